@@ -0,0 +1,633 @@
+/***************************************************************************
+                          loadgen.c  - description
+ ***************************************************************************/
+/***************************************************************************
+ *                                                                         *
+ *   Load generator mode of sircc (sircc -l).  Opens thousands of          *
+ *   non-blocking connections from one process, spread over one or more    *
+ *   servers, registers them and joins each to a channel, then sends       *
+ *   PRIVMSGs at a fixed rate and times every delivery.                    *
+ *                                                                         *
+ ***************************************************************************/
+/*
+ * Sending is open loop: message k is due at start + k/rate whatever the
+ * server is doing, and carries its due time (CLOCK_MONOTONIC ns) in the
+ * text.  Receivers take latency from that due time, not from when the
+ * write happened, so a stalled server shows up as latency instead of
+ * quietly slowing the generator down.
+ *
+ * Channels are picked uniformly, or with -z from a Zipf distribution so
+ * a few channels are large and most are small.  With -P, that share of
+ * the messages go to a random nick instead of the sender's channel.
+ *
+ * With -B, that many of the connections also ask for bulk replies while
+ * the messages flow: LIST and WHO #ch0 (the biggest channel) in turn,
+ * the next as soon as the last one ends, to see what streaming long
+ * replies does to message latency.
+ *
+ * Every interval, and once more at the end, the generator prints what
+ * it sent and received and the delivery latency percentiles.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "hist.h"
+#include "loadgen.h"
+
+#define MAX_MSG_LEN 512
+#define MAX_SERVERS 64
+#define IN_SIZE     4096
+#define OUT_MAX     (256 * 1024)    /* queued bytes before we skip a sender */
+#define MAX_EVENTS  512
+#define MAX_PAYLOAD 400             /* leaves room for the rest of the line */
+
+enum { L_CONNECTING, L_REGISTERING, L_JOINING, L_READY, L_DEAD };
+
+typedef struct lconn {
+	int fd;
+	int index;
+	int server;
+	int chan;
+	int state;
+	int want_out;		/* EPOLLOUT armed */
+	int bulk;		/* asks for LIST/WHO; the next request */
+	char in[IN_SIZE];
+	int in_len;
+	char *out;
+	int out_len;
+	int out_cap;
+} lconn;
+
+/* Options */
+static struct sockaddr_in servers[MAX_SERVERS];
+static int n_servers;
+static int n_conns = 1000;
+static int n_channels = 100;
+static double zipf_s;			/* 0: uniform */
+static int rate = 1000;
+static int seconds = 10;
+static int privmsg_pct;
+static int payload;
+static int connect_rate = 2000;
+static int warmup_ms = 1000;
+static int interval = 1;
+static int bulk_conns;
+static const char *prefix = "l";
+
+static lconn *conns;
+static int *ready;			/* indices of READY connections */
+static int n_ready, n_dead;
+static int *members;			/* READY connections per channel */
+static double *chan_cdf;
+static int epfd;
+static char filler[MAX_PAYLOAD + 1];
+
+/* Counters, total and for the current interval */
+static int measuring;
+static hist_t latency, lat_int, lag;
+static unsigned long sent, sent_int, skipped, expected;
+static unsigned long delivered, delivered_int, bytes_in;
+static uint64_t last_rx;			/* time of the last delivery */
+static unsigned long bulk_rx, bulk_done;	/* reply lines, replies */
+static int bulking;			/* send bulk requests */
+
+static uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * load_usage(): display usage info about load mode
+ */
+static void load_usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s -l [-n conns] [-c channels] [-z zipf_s] "
+		"[-r msgs_per_sec]\n"
+		"          [-T seconds] [-P privmsg_pct] [-b payload_bytes] "
+		"[-C connects_per_sec]\n"
+		"          [-w warmup_ms] [-i interval] [-p nick_prefix] "
+		"[-B bulk_conns]\n"
+		"          [ip:port ...]\n", name);
+	exit(1);
+}
+
+/*
+ * add_server(): parse an ip[:port] argument
+ */
+static void add_server(const char *arg)
+{
+	struct sockaddr_in *sa = &servers[n_servers];
+	char ip[64];
+	const char *colon = strchr(arg, ':');
+	size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+
+	if (n_servers == MAX_SERVERS || len >= sizeof(ip)) {
+		fprintf(stderr, "bad server %s\n", arg);
+		exit(1);
+	}
+	memcpy(ip, arg, len);
+	ip[len] = '\0';
+	memset(sa, 0, sizeof(*sa));
+	sa->sin_family = AF_INET;
+	sa->sin_port = htons(colon ? atoi(colon + 1) : 6667);
+	if (!inet_aton(ip, &sa->sin_addr)) {
+		fprintf(stderr, "bad server %s\n", arg);
+		exit(1);
+	}
+	n_servers++;
+}
+
+
+/* Channel choice */
+
+/*
+ * init_channels(): cumulative weights for picking a channel; with
+ *                  zipf_s > 0 channel k has weight 1/(k+1)^s
+ */
+static void init_channels(void)
+{
+	double sum = 0;
+	int i;
+
+	chan_cdf = malloc(n_channels * sizeof(double));
+	members = calloc(n_channels, sizeof(int));
+	for (i = 0; i < n_channels; i++) {
+		sum += zipf_s > 0 ? 1 / pow(i + 1, zipf_s) : 1;
+		chan_cdf[i] = sum;
+	}
+	for (i = 0; i < n_channels; i++)
+		chan_cdf[i] /= sum;
+}
+
+static int pick_channel(void)
+{
+	double u = (double)rand() / ((double)RAND_MAX + 1);
+	int lo = 0, hi = n_channels - 1;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (chan_cdf[mid] > u)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+
+/* Connections */
+
+static void set_events(lconn *c, int out)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->want_out = out;
+}
+
+/*
+ * drop(): the server closed c or it failed; stop using it
+ */
+static void drop(lconn *c)
+{
+	int i;
+
+	if (c->state == L_DEAD)
+		return;
+	if (c->state == L_READY) {
+		members[c->chan]--;
+		for (i = 0; i < n_ready; i++)
+			if (ready[i] == c->index) {
+				ready[i] = ready[--n_ready];
+				break;
+			}
+	}
+	c->state = L_DEAD;
+	n_dead++;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->out);
+	c->out = NULL;
+	c->out_len = 0;
+}
+
+static void flush_out(lconn *c)
+{
+	ssize_t n = 0;
+	int off = 0;
+
+	while (off < c->out_len) {
+		n = write(c->fd, c->out + off, c->out_len - off);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			drop(c);
+			return;
+		}
+		off += n;
+	}
+	memmove(c->out, c->out + off, c->out_len - off);
+	c->out_len -= off;
+	if ((c->out_len > 0) != c->want_out)
+		set_events(c, c->out_len > 0);
+}
+
+static void say(lconn *c, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/*
+ * say(): queue a line for c and write what the socket will take
+ */
+static void say(lconn *c, const char *fmt, ...)
+{
+	char line[MAX_MSG_LEN + 64];
+	va_list ap;
+	int len;
+
+	if (c->state == L_DEAD)
+		return;
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(line))
+		len = sizeof(line) - 1;
+	if (c->out_len + len > c->out_cap) {
+		c->out_cap = (c->out_len + len) * 2;
+		if (!(c->out = realloc(c->out, c->out_cap))) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(c->out + c->out_len, line, len);
+	c->out_len += len;
+	if (!c->want_out && c->state != L_CONNECTING)
+		flush_out(c);
+}
+
+/*
+ * start_connect(): begin a non-blocking connect for c; registration
+ *                  is queued and goes out once it completes
+ */
+static void start_connect(lconn *c)
+{
+	struct epoll_event ev;
+	int one = 1;
+
+	c->server = c->index % n_servers;
+	c->chan = pick_channel();
+	c->state = L_CONNECTING;
+	if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	c->want_out = 1;
+	if (connect(c->fd, (struct sockaddr *)&servers[c->server],
+		    sizeof(servers[0])) < 0 && errno != EINPROGRESS) {
+		drop(c);
+		return;
+	}
+	say(c, "NICK %s%d\r\nUSER %s%d h s :sircc load\r\n",
+	    prefix, c->index, prefix, c->index);
+}
+
+/*
+ * bulk_request(): ask for the next bulk reply, alternating LIST and WHO
+ */
+static void bulk_request(lconn *c)
+{
+	if (c->bulk++ % 2)
+		say(c, "WHO #ch0\r\n");
+	else
+		say(c, "LIST\r\n");
+}
+
+static void connected(lconn *c)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if (err) {
+		drop(c);
+		return;
+	}
+	c->state = L_REGISTERING;
+	flush_out(c);
+}
+
+
+/* Input */
+
+static void handle_line(lconn *c, char *line)
+{
+	unsigned long long stamp;
+	char *cmd, *p;
+	uint64_t now;
+
+	if (!strncmp(line, "PING ", 5)) {
+		say(c, "PONG %s\r\n", line + 5);
+		return;
+	}
+	if (!(cmd = strchr(line, ' ')))
+		return;
+	cmd++;
+	if (!strncmp(cmd, "PRIVMSG ", 8)) {
+		if (!measuring || !(p = strstr(cmd, " :t=")) ||
+		    sscanf(p + 4, "%llu", &stamp) != 1)
+			return;
+		now = mono_ns();
+		hist_add(&latency, now - stamp);
+		hist_add(&lat_int, now - stamp);
+		delivered++;
+		delivered_int++;
+		last_rx = now;
+	} else if (!strncmp(cmd, "322 ", 4) || !strncmp(cmd, "352 ", 4)) {
+		bulk_rx++;
+	} else if (!strncmp(cmd, "323 ", 4) || !strncmp(cmd, "315 ", 4)) {
+		bulk_done++;
+		if (bulking && c->bulk)
+			bulk_request(c);
+	} else if (!strncmp(cmd, "376 ", 4) && c->state == L_REGISTERING) {
+		c->state = L_JOINING;
+		say(c, "JOIN #ch%d\r\n", c->chan);
+	} else if (!strncmp(cmd, "366 ", 4) && c->state == L_JOINING) {
+		c->state = L_READY;
+		ready[n_ready++] = c->index;
+		members[c->chan]++;
+	} else if (!strncmp(cmd, "433 ", 4) || !strncmp(cmd, "403 ", 4)) {
+		fprintf(stderr, "%s%d: %s\n", prefix, c->index, line);
+		drop(c);
+	}
+}
+
+static void handle_input(lconn *c)
+{
+	char *start, *nl;
+	ssize_t n;
+
+	while (c->state != L_DEAD) {
+		n = read(c->fd, c->in + c->in_len, IN_SIZE - c->in_len);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (n <= 0) {
+			drop(c);
+			return;
+		}
+		bytes_in += n;
+		c->in_len += n;
+		start = c->in;
+		while (c->state != L_DEAD &&
+		       (nl = memchr(start, '\n', c->in + c->in_len - start))) {
+			*nl = '\0';
+			if (nl > start && nl[-1] == '\r')
+				nl[-1] = '\0';
+			handle_line(c, start);
+			start = nl + 1;
+		}
+		c->in_len -= start - c->in;
+		memmove(c->in, start, c->in_len);
+		if (c->in_len == IN_SIZE)
+			c->in_len = 0;		/* overlong line; drop it */
+	}
+}
+
+/*
+ * pump(): handle whatever is ready, waiting at most ms for it
+ */
+static void pump(int ms)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int i, n;
+
+	n = epoll_wait(epfd, events, MAX_EVENTS, ms);
+	for (i = 0; i < n; i++) {
+		lconn *c = events[i].data.ptr;
+		if (c->state == L_CONNECTING) {
+			connected(c);
+			continue;
+		}
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			handle_input(c);
+		if ((events[i].events & EPOLLOUT) && c->state != L_DEAD)
+			flush_out(c);
+	}
+}
+
+static void pump_until(uint64_t until)
+{
+	uint64_t now;
+
+	while ((now = mono_ns()) < until)
+		pump((until - now) / 1000000 + 1);
+}
+
+
+/* Sending */
+
+/*
+ * send_one(): send the message due at due from a random connection,
+ *             to its channel or (privmsg_pct of the time) a random nick
+ */
+static void send_one(uint64_t due)
+{
+	lconn *c = &conns[ready[rand() % n_ready]], *to;
+
+	if (c->out_len > OUT_MAX) {
+		skipped++;
+		return;
+	}
+	if (n_ready > 1 && rand() % 100 < privmsg_pct) {
+		do
+			to = &conns[ready[rand() % n_ready]];
+		while (to == c);
+		say(c, "PRIVMSG %s%d :t=%llu %s\r\n", prefix, to->index,
+		    (unsigned long long)due, filler);
+		expected++;
+	} else {
+		say(c, "PRIVMSG #ch%d :t=%llu %s\r\n", c->chan,
+		    (unsigned long long)due, filler);
+		expected += members[c->chan] - 1;
+	}
+	sent++;
+	sent_int++;
+	hist_add(&lag, mono_ns() - due);
+}
+
+static void report(const char *what, double secs, const hist_t *h,
+		   unsigned long s, unsigned long d)
+{
+	printf("%-6s %8.1f msg/s sent %9.1f msg/s delivered  "
+	       "ms p50 %.3f p99 %.3f p999 %.3f max %.3f\n", what,
+	       s / secs, d / secs, hist_percentile(h, 0.5) / 1e6,
+	       hist_percentile(h, 0.99) / 1e6,
+	       hist_percentile(h, 0.999) / 1e6, h->max / 1e6);
+	fflush(stdout);
+}
+
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return;
+	if (rl.rlim_cur < (rlim_t)n_conns + 64) {
+		rl.rlim_cur = (rlim_t)n_conns + 64;
+		if (rl.rlim_cur > rl.rlim_max)
+			rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+/*
+ * load_main(): sircc -l [options] [ip:port ...]
+ */
+int load_main(int argc, char *argv[])
+{
+	uint64_t start, now, due, end, next_report, ns_per_msg, t0;
+	unsigned long quiet;
+	int ch, i, opened;
+
+	while ((ch = getopt(argc, argv, "n:c:z:r:T:P:b:C:w:i:p:B:")) != -1) {
+		switch (ch) {
+		case 'n': n_conns = atoi(optarg); break;
+		case 'c': n_channels = atoi(optarg); break;
+		case 'z': zipf_s = atof(optarg); break;
+		case 'r': rate = atoi(optarg); break;
+		case 'T': seconds = atoi(optarg); break;
+		case 'P': privmsg_pct = atoi(optarg); break;
+		case 'b': payload = atoi(optarg); break;
+		case 'C': connect_rate = atoi(optarg); break;
+		case 'w': warmup_ms = atoi(optarg); break;
+		case 'i': interval = atoi(optarg); break;
+		case 'p': prefix = optarg; break;
+		case 'B': bulk_conns = atoi(optarg); break;
+		default: load_usage(argv[0]);
+		}
+	}
+	if (n_conns < 1 || n_channels < 1 || rate < 1 || seconds < 1 ||
+	    connect_rate < 1 || interval < 1 || payload < 0 ||
+	    payload > MAX_PAYLOAD || bulk_conns < 0)
+		load_usage(argv[0]);
+	for (i = optind; i < argc; i++)
+		add_server(argv[i]);
+	if (n_servers == 0)
+		add_server("127.0.0.1:6667");
+
+	memset(filler, 'x', payload);
+	raise_fd_limit();
+	init_channels();
+	conns = calloc(n_conns, sizeof(lconn));
+	ready = malloc(n_conns * sizeof(int));
+	if ((epfd = epoll_create1(0)) < 0 || !conns || !ready) {
+		perror("setup");
+		return 1;
+	}
+
+	/* Connect at connect_rate, so the listen backlog doesn't overflow */
+	printf("%d connections to %d server(s), %d channels%s\n", n_conns,
+	       n_servers, n_channels, zipf_s > 0 ? " (zipf)" : "");
+	t0 = mono_ns();
+	for (opened = 0; opened < n_conns || n_ready + n_dead < n_conns;) {
+		now = mono_ns();
+		while (opened < n_conns && (uint64_t)opened * 1000000000 /
+		       connect_rate <= now - t0) {
+			conns[opened].index = opened;
+			start_connect(&conns[opened++]);
+		}
+		if (now - t0 > (uint64_t)(n_conns / connect_rate + 30) *
+		    1000000000) {
+			fprintf(stderr, "timed out registering\n");
+			break;
+		}
+		pump(1);
+	}
+	printf("%d ready, %d failed in %.2f s\n", n_ready, n_dead,
+	       (mono_ns() - t0) / 1e9);
+	if (n_ready == 0)
+		return 1;
+	pump_until(mono_ns() + (uint64_t)warmup_ms * 1000000);
+
+	/* Open loop: message k is due at start + k * ns_per_msg */
+	hist_reset(&latency);
+	hist_reset(&lat_int);
+	hist_reset(&lag);
+	measuring = 1;
+	bulking = 1;
+	for (i = 0; i < bulk_conns && i < n_ready; i++)
+		bulk_request(&conns[ready[i]]);
+	ns_per_msg = 1000000000 / rate;
+	start = due = mono_ns();
+	end = start + (uint64_t)seconds * 1000000000;
+	next_report = start + (uint64_t)interval * 1000000000;
+	while ((now = mono_ns()) < end) {
+		for (; due <= now && due < end && n_ready > 0;
+		     due += ns_per_msg)
+			send_one(due);
+		if (now >= next_report) {
+			report("int", interval, &lat_int, sent_int,
+			       delivered_int);
+			hist_reset(&lat_int);
+			sent_int = delivered_int = 0;
+			next_report += (uint64_t)interval * 1000000000;
+		}
+		pump(due > now ? (due - now) / 1000000 : 0);
+	}
+
+	bulking = 0;
+
+	/* Drain until everything arrived or nothing has for a second */
+	for (quiet = 0; delivered < expected && quiet < 10; ) {
+		unsigned long before = delivered;
+		pump_until(mono_ns() + 100000000);
+		quiet = delivered == before ? quiet + 1 : 0;
+	}
+
+	if (last_rx < end)
+		last_rx = end;
+	report("total", (last_rx - start) / 1e9, &latency, sent, delivered);
+	printf("sent %lu (%lu skipped on full sendq), delivered %lu of %lu, "
+	       "%.1f MB in\n", sent, skipped, delivered, expected,
+	       bytes_in / 1e6);
+	printf("send lag ms p50 %.3f p99 %.3f max %.3f, %d connections lost\n",
+	       hist_percentile(&lag, 0.5) / 1e6,
+	       hist_percentile(&lag, 0.99) / 1e6, lag.max / 1e6, n_dead);
+	if (bulk_conns)
+		printf("bulk: %lu replies, %lu lines, %.0f lines/s\n",
+		       bulk_done, bulk_rx, bulk_rx / ((last_rx - start) / 1e9));
+
+	for (i = 0; i < n_conns; i++)
+		if (conns[i].state != L_DEAD && conns[i].fd > 0) {
+			close(conns[i].fd);
+			free(conns[i].out);
+		}
+	free(conns);
+	free(ready);
+	free(members);
+	free(chan_cdf);
+	close(epfd);
+	return 0;
+}
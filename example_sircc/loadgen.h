@@ -0,0 +1,12 @@
+/***************************************************************************
+                          loadgen.h  - description
+ ***************************************************************************/
+#ifndef _LOADGEN_H_
+#define _LOADGEN_H_
+
+/*
+ * load_main(): run sircc as a load generator (sircc -l ...)
+ */
+int load_main(int argc, char *argv[]);
+
+#endif /* _LOADGEN_H_ */
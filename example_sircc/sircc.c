@@ -18,6 +18,7 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include "csapp.h"
+#include "loadgen.h"
 
 #ifndef SHUT_WR
 #define SHUT_WR 1
@@ -37,7 +38,9 @@ int          server_port = 6667;
  */
 void usage(char *name)
 {
-	printf("Usage: name <ip address> <port>\n");
+	printf("Usage: %s <ip address> <port>\n", name);
+	printf("       %s -l [options] [<ip>:<port> ...]  (load generator)\n",
+	       name);
 	exit(0);
 }
 
@@ -81,6 +84,10 @@ int main(int argc, char *argv[])
 	char  *end;
 	fd_set read_fds;
 
+	/* load generator mode */
+	if (argc > 1 && strcmp(argv[1], "-l") == 0)
+		return load_main(argc - 1, argv + 1);
+
 	/* display usage information */
 	if (argc > 1){
 		if ((strcmp(argv[1], "--help") == 0) || 
@@ -127,7 +134,6 @@ int main(int argc, char *argv[])
 		// display server message first 
 		if (FD_ISSET(server_sock, &read_fds)){
 			do {
-				bzero(recvbuf, MAX_MSG_LEN+1);
 				byte_read = read(server_sock, recvbuf, MAX_MSG_LEN);
 				if (byte_read > 0){
 					recvbuf[byte_read] = '\0';
@@ -0,0 +1,170 @@
+/*
+ * admit.c
+ *
+ * Token buckets for new connections.  See admit.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "admit.h"
+
+#define ADMIT_NODES 32          /* config file node addresses */
+
+/*
+ * A bucket holds thousandths of a token, so a rate of r connections a
+ * second refills r of them every ms and the arithmetic stays integer.
+ */
+typedef struct bucket {
+    uint32_t addr;              /* 0: entry unused */
+    uint32_t tokens;
+    uint64_t last;              /* ms it was last brought up to date */
+} bucket_t;
+
+const char *const admit_reason[ADMIT_REASONS] = {
+    "ok", "ip_limit", "limit", "full", "error"
+};
+
+static unsigned ip_rate = ADMIT_IP_RATE, ip_burst = ADMIT_IP_BURST;
+static unsigned rate = ADMIT_RATE, burst = ADMIT_BURST;
+static bucket_t table[ADMIT_TABLE];
+static bucket_t global;
+static struct {
+    uint32_t addr;
+    unsigned n;                 /* nodes at addr */
+} nodes[ADMIT_NODES];
+static int n_nodes;
+static admit_stats_t stats;
+
+/*
+ * Parse -a: "ip_rate[:ip_burst[:rate[:burst]]]".  A burst left out is
+ * twice the rate.
+ */
+int admit_init(const char *spec) {
+    unsigned v[4] = { ADMIT_IP_RATE, 0, ADMIT_RATE, 0 };
+    const char *p = spec;
+    char *end;
+    int i;
+
+    for (i = 0; i < 4 && *p; i++) {
+        v[i] = strtoul(p, &end, 10);
+        if (end == p || (*end && *end != ':'))
+            return -1;
+        p = *end ? end + 1 : end;
+    }
+    if (*p)
+        return -1;
+    ip_rate = v[0];
+    ip_burst = v[1] ? v[1] : 2 * v[0];
+    rate = v[2];
+    burst = v[3] ? v[3] : 2 * v[2];
+    if ((ip_rate && !ip_burst) || (rate && !burst))
+        return -1;
+    memset(table, 0, sizeof(table));
+    memset(&global, 0, sizeof(global));
+    stats.tracked = 0;
+    return 0;
+}
+
+/* A node in the config file is at addr: a bigger bucket for it */
+void admit_node(uint32_t addr) {
+    int i;
+
+    for (i = 0; i < n_nodes && nodes[i].addr != addr; i++)
+        ;
+    if (i == n_nodes) {
+        if (n_nodes == ADMIT_NODES)
+            return;
+        nodes[n_nodes++].addr = addr;
+    }
+    nodes[i].n++;
+}
+
+/* The burst of addr's bucket */
+static unsigned burst_for(uint32_t addr) {
+    int i;
+
+    for (i = 0; i < n_nodes; i++)
+        if (nodes[i].addr == addr)
+            return ip_burst + nodes[i].n * ADMIT_NODE_BURST;
+    return ip_burst;
+}
+
+/* Bring b up to date at now and take a token if it has one */
+static int take(bucket_t *b, unsigned r, unsigned max, uint64_t now) {
+    uint64_t elapsed = now - b->last;
+
+    if (elapsed >= (uint64_t)max * 1000 / r)
+        b->tokens = max * 1000;
+    else if ((b->tokens += elapsed * r) > max * 1000)
+        b->tokens = max * 1000;
+    b->last = now;
+    if (b->tokens < 1000)
+        return 0;
+    b->tokens -= 1000;
+    return 1;
+}
+
+/* Has b refilled completely by now? */
+static int full(const bucket_t *b, uint64_t now) {
+    return now - b->last >= (uint64_t)burst_for(b->addr) * 1000 / ip_rate;
+}
+
+/* addr's bucket, starting a full one if it has none */
+static bucket_t *lookup(uint32_t addr, uint64_t now) {
+    unsigned h = (addr * 2654435769u) >> 20;    /* 12 bits: ADMIT_TABLE */
+    bucket_t *b, *victim = NULL;
+    int i;
+
+    for (i = 0; i < ADMIT_PROBE; i++) {
+        b = &table[(h + i) % ADMIT_TABLE];
+        if (b->addr == addr)
+            return b;
+        if (!b->addr) {
+            if (!victim || victim->addr)
+                victim = b;
+        } else if (!victim || (victim->addr && b->last < victim->last)) {
+            victim = b;
+        }
+    }
+    if (!victim->addr)
+        stats.tracked++;
+    else if (!full(victim, now))
+        stats.evicted++;
+    victim->addr = addr;
+    victim->tokens = burst_for(addr) * 1000;
+    victim->last = now;
+    return victim;
+}
+
+/*
+ * May a connection from addr (network byte order) come in at now?
+ * Returns ADMIT_OK or the reason it may not, which is counted.
+ */
+int admit_check(uint32_t addr, uint64_t now) {
+    bucket_t *b = NULL;
+
+    if (ip_rate && !take(b = lookup(addr, now), ip_rate, burst_for(addr),
+                         now)) {
+        stats.rejects[ADMIT_IP_LIMIT]++;
+        return ADMIT_IP_LIMIT;
+    }
+    if (rate && !take(&global, rate, burst, now)) {
+        if (b)
+            b->tokens += 1000;
+        stats.rejects[ADMIT_LIMIT]++;
+        return ADMIT_LIMIT;
+    }
+    return ADMIT_OK;
+}
+
+/* How a connection ended up: let in, or turned away after the check */
+void admit_count(int reason) {
+    if (reason == ADMIT_OK)
+        stats.accepted++;
+    else
+        stats.rejects[reason]++;
+}
+
+void admit_stats(admit_stats_t *st) {
+    *st = stats;
+}
@@ -0,0 +1,69 @@
+#ifndef _ADMIT_H_
+#define _ADMIT_H_
+
+#include <stdint.h>
+
+/*
+ * Admission control for new connections.
+ *
+ * Each connection accepted on the IRC port takes a token from the
+ * bucket of its source address and then one from a bucket shared by
+ * everybody, before anything is allocated for it.  A connection that
+ * finds either bucket empty is closed on the spot, so a reconnect storm
+ * or a connect flood costs an accept() and a close() per connection
+ * and nothing else.  Buckets refill continuously at their rate, up to
+ * their burst, and are only brought up to date when they are used.
+ *
+ * Per-address buckets live in a fixed, open addressed table.  An
+ * address that has not connected for long enough has a full bucket,
+ * which is the same as having none, so its entry is simply reused;
+ * when every entry nearby is busy the stalest one is.
+ *
+ * A connection turned away by the shared bucket gets its address's
+ * token back, so it doesn't count against the address twice.
+ *
+ * The addresses of the nodes in the config file are limited like any
+ * other, but their buckets hold ADMIT_NODE_BURST more tokens for every
+ * node there, so server links reconnecting after a failure get through
+ * alongside that host's clients.  Clients on such a host share the
+ * larger bucket; nothing is known to be a server link until it has
+ * said SERVER, long after it was let in.
+ *
+ * A rate of 0 turns that limit off.
+ */
+
+#define ADMIT_TABLE 4096        /* per-address buckets */
+#define ADMIT_PROBE 8           /* entries looked at per address */
+
+#define ADMIT_IP_RATE  10       /* connections per second per address */
+#define ADMIT_IP_BURST 20
+#define ADMIT_RATE     200      /* connections per second in all */
+#define ADMIT_BURST    400
+#define ADMIT_NODE_BURST 4      /* more per node at an address */
+
+/* Why a connection was turned away */
+enum {
+    ADMIT_OK,
+    ADMIT_IP_LIMIT,             /* its address is over its rate */
+    ADMIT_LIMIT,                /* everybody together is over the rate */
+    ADMIT_FULL,                 /* no client slot for it */
+    ADMIT_ERROR,                /* accept() or setting it up failed */
+    ADMIT_REASONS
+};
+
+extern const char *const admit_reason[ADMIT_REASONS];
+
+typedef struct admit_stats {
+    unsigned long accepted;
+    unsigned long rejects[ADMIT_REASONS];   /* [ADMIT_OK] is unused */
+    unsigned long tracked;      /* addresses with a bucket now */
+    unsigned long evicted;      /* buckets taken over while not full */
+} admit_stats_t;
+
+int admit_init(const char *spec);
+void admit_node(uint32_t addr);
+int admit_check(uint32_t addr, uint64_t now_ms);
+void admit_count(int reason);
+void admit_stats(admit_stats_t *st);
+
+#endif /* _ADMIT_H_ */
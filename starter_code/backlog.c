@@ -0,0 +1,201 @@
+/*
+ * backlog.c
+ *
+ * Per-channel history rings.  See backlog.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "backlog.h"
+
+static unsigned max_lines;      /* 0: no history kept */
+static backlog_t *table[BACKLOG_HASH];
+static backlog_t *newest, *oldest;
+static backlog_stats_t stats;
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Parse -H: "lines[:kbytes]", lines per channel and the cap on all */
+int backlog_init(const char *spec) {
+    unsigned long lines, kbytes = BACKLOG_KBYTES;
+    char *end;
+
+    lines = strtoul(spec, &end, 10);
+    if (end == spec)
+        return -1;
+    if (*end == ':') {
+        spec = end + 1;
+        kbytes = strtoul(spec, &end, 10);
+        if (end == spec)
+            return -1;
+    }
+    if (*end || lines > 65535 || (lines && !kbytes))
+        return -1;
+    max_lines = lines;
+    stats.cap = kbytes * 1024;
+    return 0;
+}
+
+int backlog_enabled() {
+    return max_lines > 0;
+}
+
+/* What a line costs: its buffer's whole pool object */
+static unsigned long line_bytes(const msgbuf_t *mb) {
+    return sizeof(msgbuf_t) + mb->size;
+}
+
+static backlog_t *lookup(const istr_t *name) {
+    backlog_t *b = table[name->hash % BACKLOG_HASH];
+
+    for (; b && b->name != name; b = b->hash_next)
+        ;
+    return b;
+}
+
+static void unlink_lru(backlog_t *b) {
+    if (b->newer)
+        b->newer->older = b->older;
+    else
+        newest = b->older;
+    if (b->older)
+        b->older->newer = b->newer;
+    else
+        oldest = b->newer;
+}
+
+static void push_lru(backlog_t *b) {
+    b->newer = NULL;
+    b->older = newest;
+    if (newest)
+        newest->newer = b;
+    else
+        oldest = b;
+    newest = b;
+}
+
+static backlog_t *create(istr_t *name) {
+    backlog_t *b;
+    size_t ring = max_lines * sizeof(msgbuf_t *);
+    unsigned h = name->hash % BACKLOG_HASH;
+
+    if (!(b = pool_alloc(sizeof(backlog_t))))
+        return NULL;
+    memset(b, 0, sizeof(*b));
+    if (!(b->ring = pool_alloc(ring))) {
+        pool_free(b);
+        return NULL;
+    }
+    b->name = istr_ref(name);
+    b->bytes = sizeof(backlog_t) + ring;
+    b->hash_next = table[h];
+    table[h] = b;
+    push_lru(b);
+    stats.channels++;
+    stats.bytes += b->bytes;
+    return b;
+}
+
+static void destroy(backlog_t *b) {
+    backlog_t **pp;
+
+    for (pp = &table[b->name->hash % BACKLOG_HASH]; *pp != b;
+         pp = &(*pp)->hash_next)
+        ;
+    *pp = b->hash_next;
+    unlink_lru(b);
+    stats.channels--;
+    stats.bytes -= b->bytes;
+    istr_put(b->name);
+    pool_free(b->ring);
+    pool_free(b);
+}
+
+static void drop_oldest(backlog_t *b) {
+    msgbuf_t *mb = b->ring[b->head];
+    unsigned long n = line_bytes(mb);
+
+    b->head = (b->head + 1) % max_lines;
+    b->n--;
+    b->bytes -= n;
+    stats.bytes -= n;
+    stats.lines--;
+    msgbuf_unref(mb);
+}
+
+/*
+ * Take lines from the quietest histories until all of them are under
+ * the cap again.  b, which just got a line, keeps that one at least.
+ */
+static void evict(backlog_t *b) {
+    backlog_t *victim;
+
+    while (stats.bytes > stats.cap && (victim = oldest)) {
+        if (victim == b && b->n <= 1)
+            break;
+        drop_oldest(victim);
+        stats.evicted++;
+        if (!victim->n)
+            destroy(victim);
+    }
+}
+
+/* Keep mb, a PRIVMSG just sent to the channel called name */
+void backlog_add(istr_t *name, msgbuf_t *mb) {
+    backlog_t *b;
+    unsigned long n = line_bytes(mb);
+
+    if (!max_lines)
+        return;
+    if (!(b = lookup(name)) && !(b = create(name)))
+        return;
+    if (b->n == max_lines)
+        drop_oldest(b);
+    b->ring[(b->head + b->n++) % max_lines] = msgbuf_ref(mb);
+    b->bytes += n;
+    b->active = time(NULL);
+    stats.bytes += n;
+    stats.lines++;
+    if (b != newest) {
+        unlink_lru(b);
+        push_lru(b);
+    }
+    evict(b);
+}
+
+/* Queue the history of the channel called name for c; the lines sent */
+int backlog_replay(const istr_t *name, client *c) {
+    backlog_t *b = lookup(name);
+    uint64_t start = mono_ns();
+    unsigned long room, len = 0;
+    unsigned i, first;
+
+    if (!b || c->sendq_len >= c->sendq_max)
+        return 0;
+    room = (c->sendq_max - c->sendq_len) / 2;
+    for (first = b->n; first > 0; first--) {
+        len += b->ring[(b->head + first - 1) % max_lines]->len;
+        if (len > room)
+            break;
+    }
+    for (i = first; i < b->n && !c->closing; i++)
+        client_queue(c, b->ring[(b->head + i) % max_lines]);
+    b->replays++;
+    stats.replays++;
+    stats.replayed += i - first;
+    hist_add(&stats.replay_ns, mono_ns() - start);
+    return i - first;
+}
+
+/* The history after b (NULL: the first), most recently active first */
+const backlog_t *backlog_next(const backlog_t *b) {
+    return b ? b->older : newest;
+}
+
+void backlog_stats(backlog_stats_t *st) {
+    *st = stats;
+}
@@ -0,0 +1,60 @@
+#ifndef _BACKLOG_H_
+#define _BACKLOG_H_
+
+#include <time.h>
+#include "sircd.h"
+#include "msgbuf.h"
+
+/*
+ * Channel history.
+ *
+ * With -H, each channel keeps its last few PRIVMSGs so a client that
+ * joins (or comes back after a dropped connection) is sent them right
+ * after its JOIN.  A line is kept as the very msgbuf_t it was fanned
+ * out in, one more reference to it, so keeping it costs no copy and
+ * replaying it is queueing that reference again.
+ *
+ * A history is keyed by the channel's interned name and outlives the
+ * channel, so the last member leaving and coming back still finds it.
+ * All of them together are held under a cap on pool memory: when a
+ * line takes them over it, lines go oldest first from the channel that
+ * has been quiet longest (the histories are kept in the order of their
+ * last line), and a history that is emptied goes too.
+ *
+ * A replay is at most half of the room left in the client's send queue;
+ * older lines than fit are left out.
+ */
+
+#define BACKLOG_KBYTES 4096     /* default cap on all histories */
+#define BACKLOG_HASH   256
+
+typedef struct backlog {
+    istr_t *name;               /* the channel's, referenced */
+    msgbuf_t **ring;            /* lines, oldest at head */
+    unsigned head, n;
+    unsigned long bytes;        /* pool memory, ring and lines */
+    time_t active;              /* when the last line came */
+    unsigned long replays;
+    struct backlog *hash_next;
+    struct backlog *newer, *older;  /* by activity */
+} backlog_t;
+
+typedef struct backlog_stats {
+    unsigned long channels;     /* with a history now */
+    unsigned long lines;
+    unsigned long bytes;
+    unsigned long cap;          /* bytes */
+    unsigned long evicted;      /* lines dropped to stay under the cap */
+    unsigned long replays;
+    unsigned long replayed;     /* lines queued by them */
+    hist_t replay_ns;
+} backlog_stats_t;
+
+int backlog_init(const char *spec);
+int backlog_enabled(void);
+void backlog_add(istr_t *name, msgbuf_t *mb);
+int backlog_replay(const istr_t *name, client *c);
+const backlog_t *backlog_next(const backlog_t *b);
+void backlog_stats(backlog_stats_t *st);
+
+#endif /* _BACKLOG_H_ */
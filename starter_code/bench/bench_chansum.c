@@ -0,0 +1,189 @@
+/*
+ * bench_chansum.c
+ *
+ * Inter-node channel traffic with sparse membership, under three kinds
+ * of channel interest summary:
+ *
+ *   none   no summaries: every node looks interested in every channel,
+ *          so every message is flooded over a spanning tree
+ *   exact  exact channel sets (chansum exact mode)
+ *   bloom  Bloom filters (chansum bloom mode)
+ *
+ * Every node joins a few of many channels.  Messages go to random
+ * channels from random member nodes; for each, the pruned multicast tree
+ * is costed with mcast_tree_cost().  Reports link copies per message,
+ * the Bloom false positive rate, and summary bytes on the wire.
+ *
+ * usage: bench_chansum [-n nodes] [-d extra_links] [-c channels]
+ *                      [-j joins_per_node] [-m messages] [-b bloom_bits]
+ *                      [-k hashes] [-s seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "lsdb.h"
+#include "chansum.h"
+#include "mcast.h"
+#include "topo.h"
+
+#define MODE_NONE  -1
+
+static int n_nodes = 64;
+static int extra = 1;
+static int n_channels = 500;
+static int joins = 8;
+static int n_msgs = 20000;
+static unsigned bloom_bits = CHANSUM_DEFAULT_BITS;
+static unsigned bloom_k = CHANSUM_DEFAULT_K;
+
+static topo_t topo;
+static char **names;            /* channel names */
+static unsigned char *member;   /* n_nodes * n_channels */
+
+#define MEMBER(node, chan) member[(node) * n_channels + (chan)]
+
+static void build() {
+    char buf[32];
+    int i, j;
+
+    topo_random(&topo, n_nodes, extra);
+    names = malloc(n_channels * sizeof(char *));
+    for (i = 0; i < n_channels; i++) {
+        snprintf(buf, sizeof(buf), "#chan%d", i);
+        names[i] = strdup(buf);
+    }
+    member = calloc((size_t)n_nodes * n_channels, 1);
+    for (i = 0; i < n_nodes; i++)
+        for (j = 0; j < joins; j++)
+            MEMBER(i, rand() % n_channels) = 1;
+}
+
+/*
+ * Fill db with one LSA per node carrying its summary.  Returns the
+ * total summary bytes as they would go on the wire.
+ */
+static unsigned long fill(lsdb_t *db, int mode) {
+    uint8_t pkt[LSA_MAX_PACKET];
+    char *chans[n_channels];
+    unsigned long bytes = 0;
+    int i, j, n;
+
+    lsdb_init(db);
+    for (i = 0; i < n_nodes; i++) {
+        lsa_t *lsa = topo_lsa(&topo, i, 1);
+        size_t base = LSA_FIXED_LEN + 4 * lsa->n_links;
+        chansum_t cs;
+
+        for (n = 0, j = 0; j < n_channels; j++)
+            if (MEMBER(i, j))
+                chans[n++] = names[j];
+
+        if (mode == MODE_NONE) {
+            /* As if every delta had been missed */
+            lsa->chan_fmt = LSA_CHANS_DELTA;
+            lsa->chan_stale = 1;
+        } else {
+            chansum_init(&cs, mode, bloom_bits, bloom_k);
+            for (j = 0; j < n; j++)
+                chansum_add(&cs, chans[j]);
+            chansum_fill(&cs, lsa, chans, n, 0, 1);
+            chansum_destroy(&cs);
+            bytes += lsa_encode(lsa, pkt, sizeof(pkt), 1) - base;
+        }
+        lsdb_update(db, lsa);
+    }
+    return bytes;
+}
+
+/* Bytes of an exact-mode delta advertising one join */
+static size_t delta_bytes() {
+    return 12 + 1 + strlen(names[n_channels - 1]);
+}
+
+static void run(const char *label, int mode) {
+    unsigned long links = 0, bytes, fp = 0, negatives = 0;
+    unsigned tree, unicast;
+    struct timespec t0, t1;
+    mcast_cache_t mc;
+    lsdb_t db;
+    int m, i, chan, src;
+    double ns;
+
+    bytes = fill(&db, mode);
+    mcast_init(&mc);
+
+    srand(12345);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (m = 0; m < n_msgs; m++) {
+        /* A random channel with at least one member, from a member */
+        do {
+            chan = rand() % n_channels;
+            src = rand() % n_nodes;
+        } while (!MEMBER(src, chan));
+        mcast_tree_cost(&mc, &db, src + 1, names[chan], &tree, &unicast);
+        links += tree;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    /* False positives: non-member (node, channel) pairs that match */
+    for (i = 0; i < n_nodes; i++) {
+        lsa_t *lsa = lsdb_find(&db, i + 1);
+        for (chan = 0; chan < n_channels; chan++) {
+            if (MEMBER(i, chan))
+                continue;
+            negatives++;
+            fp += lsa_may_have_chan(lsa, names[chan]);
+        }
+    }
+
+    printf("%-6s  %8.2f links/msg  fp %6.3f%%  %7lu summary bytes"
+           "  %6.0f ns/msg\n", label, (double)links / n_msgs,
+           100.0 * fp / negatives, bytes, ns / n_msgs);
+
+    mcast_destroy(&mc);
+    lsdb_destroy(&db);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned seed = time(NULL);
+    int ch;
+
+    while ((ch = getopt(argc, argv, "n:d:c:j:m:b:k:s:")) != -1) {
+        switch (ch) {
+        case 'n': n_nodes = atoi(optarg); break;
+        case 'd': extra = atoi(optarg); break;
+        case 'c': n_channels = atoi(optarg); break;
+        case 'j': joins = atoi(optarg); break;
+        case 'm': n_msgs = atoi(optarg); break;
+        case 'b': bloom_bits = strtoul(optarg, NULL, 0); break;
+        case 'k': bloom_k = strtoul(optarg, NULL, 0); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-n nodes] [-d extra] [-c channels] "
+                    "[-j joins] [-m messages] [-b bits] [-k hashes] "
+                    "[-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n_nodes < 2 || n_channels < 1 || joins < 1) {
+        fprintf(stderr, "need at least 2 nodes, 1 channel and 1 join\n");
+        return 1;
+    }
+
+    srand(seed);
+    build();
+    printf("nodes %d  channels %d  joins/node %d  bloom %u bits k=%u  "
+           "seed %u\n", n_nodes, n_channels, joins, bloom_bits, bloom_k,
+           seed);
+    run("none", MODE_NONE);
+    run("exact", CHANSUM_EXACT);
+    run("bloom", CHANSUM_BLOOM);
+    printf("exact delta for one join: %zu bytes\n", delta_bytes());
+
+    topo_free(&topo);
+    return 0;
+}
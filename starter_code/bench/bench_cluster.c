@@ -0,0 +1,464 @@
+/*
+ * bench_cluster.c
+ *
+ * Cluster throughput and delivery latency over real sockets, on
+ * loopback.
+ *
+ * Writes a config in the node1.conf format (nodeID host routing_port
+ * local_port irc_port) for n nodes on 127.0.0.1 and starts a sircd for
+ * each, with flood control off (-f 0) so the clients can send at any
+ * rate, and admission control off (-a 0:0:0) so they can all connect
+ * at once from the one address.  For a full mesh every node reads the same file; for a line,
+ * each node gets a file with just itself and its two neighbors.  Then
+ * m clients attach to every node, each joining one of c channels, and
+ * the clients send an open-loop stream of messages at a fixed total
+ * rate: a share of them PRIVMSGs to a random client on another node,
+ * the rest to the sender's channel.  Every message carries its send
+ * time, so each delivery is timed end to end.
+ *
+ * Reports deliveries against what was expected, delivery throughput,
+ * p50/p99/p999 latency, and the CPU each sircd used over the run.
+ *
+ * usage: bench_cluster [-n nodes] [-t mesh|line] [-m clients_per_node]
+ *                      [-c channels] [-r msgs_per_sec] [-T seconds]
+ *                      [-P privmsg_pct] [-p base_port] [-x sircd]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "hist.h"
+
+#define MAX_NODES 32
+#define MAX_PER_NODE 500
+
+typedef struct conn {
+    int fd;
+    int node;
+    int index;              /* within the node */
+    int chan;
+    char in[16384];
+    int in_len;
+    char *out;
+    int out_len;
+    int out_cap;
+    int want_out;           /* EPOLLOUT armed */
+} conn_t;
+
+static int n_nodes = 4;
+static int line_topo;
+static int per_node = 20;
+static int n_channels = 10;
+static int rate = 2000;
+static int seconds = 5;
+static int privmsg_pct = 50;
+static int base_port = 32000;
+static const char *sircd = "./sircd";
+
+static char dir[] = "/tmp/bench_clusterXXXXXX";
+static pid_t pids[MAX_NODES];
+static conn_t *conns;
+static int n_conns;
+static int *chan_members;
+static int epfd;
+
+static int measuring;
+static hist_t latency;
+static unsigned long delivered, expected, sent_priv, sent_chan;
+static int probe_seen[MAX_NODES];
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* The cluster */
+
+static int irc_port(int node) { return base_port + node * 10 + 2; }
+
+static void config_line(FILE *f, int node) {
+    int p = base_port + node * 10;
+    fprintf(f, "%d 127.0.0.1 %d %d %d\n", node + 1, p, p + 1, p + 2);
+}
+
+static void write_config(const char *path, int node) {
+    FILE *f = fopen(path, "w");
+    int j;
+
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    for (j = 0; j < n_nodes; j++)
+        if (node < 0 || j == node || j == node - 1 || j == node + 1)
+            config_line(f, j);
+    fclose(f);
+}
+
+static void config_path(char *path, size_t size, int node) {
+    if (line_topo)
+        snprintf(path, size, "%s/node%d.conf", dir, node + 1);
+    else
+        snprintf(path, size, "%s/cluster.conf", dir);
+}
+
+static void start_nodes() {
+    char path[256], id[16];
+    int i;
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    if (!line_topo) {
+        config_path(path, sizeof(path), 0);
+        write_config(path, -1);
+    }
+    for (i = 0; i < n_nodes; i++) {
+        config_path(path, sizeof(path), i);
+        if (line_topo)
+            write_config(path, i);
+        snprintf(id, sizeof(id), "%d", i + 1);
+        if ((pids[i] = fork()) == 0) {
+            freopen("/dev/null", "w", stdout);
+            execl(sircd, sircd, "-f", "0", "-a", "0:0:0", id, path,
+                  (char *)NULL);
+            perror(sircd);
+            _exit(1);
+        }
+    }
+}
+
+static void stop_nodes() {
+    char path[256];
+    int i;
+
+    for (i = 0; i < n_nodes; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+            waitpid(pids[i], NULL, 0);
+        }
+        config_path(path, sizeof(path), i);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+/* utime + stime of a process, in seconds */
+static double cpu_seconds(pid_t pid) {
+    char path[64], buf[1024], *p;
+    unsigned long utime, stime;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if (!(f = fopen(path, "r")))
+        return 0;
+    if (!fgets(buf, sizeof(buf), f)) {
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    /* Fields 14 and 15, counting from after the command name */
+    if (!(p = strrchr(buf, ')')) ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime) != 2)
+        return 0;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+
+/* Clients */
+
+static void die(const char *what) {
+    fprintf(stderr, "bench_cluster: %s\n", what);
+    stop_nodes();
+    exit(1);
+}
+
+static void set_events(conn_t *c, int out) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_out = out;
+}
+
+static void flush_out(conn_t *c) {
+    ssize_t n;
+
+    while (c->out_len > 0) {
+        n = write(c->fd, c->out, c->out_len);
+        if (n < 0) {
+            if (errno == EAGAIN)
+                break;
+            die("write failed");
+        }
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+    if ((c->out_len > 0) != c->want_out)
+        set_events(c, c->out_len > 0);
+}
+
+static void say(conn_t *c, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void say(conn_t *c, const char *fmt, ...) {
+    char line[600];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (c->out_len + len > c->out_cap) {
+        c->out_cap = (c->out_len + len) * 2;
+        if (!(c->out = realloc(c->out, c->out_cap)))
+            die("out of memory");
+    }
+    memcpy(c->out + c->out_len, line, len);
+    c->out_len += len;
+    if (!c->want_out)
+        flush_out(c);
+}
+
+static void connect_client(conn_t *c) {
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    int tries, one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(irc_port(c->node));
+    for (tries = 0; tries < 50; tries++) {
+        c->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            break;
+        close(c->fd);
+        c->fd = -1;
+        usleep(100000);
+    }
+    if (c->fd < 0)
+        die("can't connect to sircd");
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    say(c, "NICK c%d_%d\r\nUSER c%d h s :bench\r\nJOIN #ch%d\r\n",
+        c->node, c->index, c->node, c->chan);
+}
+
+static void handle_line(conn_t *c, char *line) {
+    unsigned long long stamp;
+    char *p;
+
+    if (!strstr(line, " PRIVMSG "))
+        return;
+    if ((p = strstr(line, " :t=")) && sscanf(p + 4, "%llu", &stamp) == 1) {
+        if (measuring) {
+            hist_add(&latency, mono_ns() - stamp);
+            delivered++;
+        }
+    } else if (strstr(line, " :probe")) {
+        probe_seen[c->node] = 1;
+    }
+}
+
+static void handle_input(conn_t *c) {
+    char *start, *nl;
+    ssize_t n;
+
+    for (;;) {
+        n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0)
+            die("sircd closed a connection");
+        c->in_len += n;
+        start = c->in;
+        while ((nl = memchr(start, '\n', c->in + c->in_len - start))) {
+            *nl = '\0';
+            handle_line(c, start);
+            start = nl + 1;
+        }
+        c->in_len -= start - c->in;
+        memmove(c->in, start, c->in_len);
+        if (c->in_len == sizeof(c->in))
+            c->in_len = 0;      /* absurd line; drop it */
+    }
+}
+
+/* Run the event loop for up to ms */
+static void pump(int ms) {
+    struct epoll_event events[256];
+    int i, n;
+
+    n = epoll_wait(epfd, events, 256, ms);
+    for (i = 0; i < n; i++) {
+        conn_t *c = events[i].data.ptr;
+        if (events[i].events & EPOLLOUT)
+            flush_out(c);
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            handle_input(c);
+    }
+}
+
+static void pump_for(int ms) {
+    uint64_t until = mono_ns() + (uint64_t)ms * 1000000;
+    uint64_t now;
+
+    while ((now = mono_ns()) < until)
+        pump((until - now) / 1000000 + 1);
+}
+
+/*
+ * Wait until client 0 on every node can reach client 0 on the next
+ * node round the ring, so routes and nicks have propagated.
+ */
+static void wait_converged() {
+    int tries, i, all;
+
+    for (tries = 0; tries < 100; tries++) {
+        memset(probe_seen, 0, sizeof(probe_seen));
+        for (i = 0; i < n_nodes; i++)
+            say(&conns[i * per_node], "PRIVMSG c%d_0 :probe\r\n",
+                (i + 1) % n_nodes);
+        pump_for(300);
+        for (all = 1, i = 0; i < n_nodes; i++)
+            all &= probe_seen[i];
+        if (all)
+            return;
+    }
+    die("cluster never converged");
+}
+
+static void send_one() {
+    conn_t *c = &conns[rand() % n_conns];
+    int node, index;
+
+    if (rand() % 100 < privmsg_pct) {
+        node = (c->node + 1 + rand() % (n_nodes - 1)) % n_nodes;
+        index = rand() % per_node;
+        say(c, "PRIVMSG c%d_%d :t=%llu\r\n", node, index,
+            (unsigned long long)mono_ns());
+        sent_priv++;
+        expected++;
+    } else {
+        say(c, "PRIVMSG #ch%d :t=%llu\r\n", c->chan,
+            (unsigned long long)mono_ns());
+        sent_chan++;
+        expected += chan_members[c->chan] - 1;
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    double cpu_before[MAX_NODES], wall;
+    unsigned long last;
+    uint64_t start, now, due, sent = 0;
+    int ch, i;
+
+    while ((ch = getopt(argc, argv, "n:t:m:c:r:T:P:p:x:")) != -1) {
+        switch (ch) {
+        case 'n': n_nodes = atoi(optarg); break;
+        case 't': line_topo = !strcmp(optarg, "line"); break;
+        case 'm': per_node = atoi(optarg); break;
+        case 'c': n_channels = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'T': seconds = atoi(optarg); break;
+        case 'P': privmsg_pct = atoi(optarg); break;
+        case 'p': base_port = atoi(optarg); break;
+        case 'x': sircd = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-n nodes] [-t mesh|line] "
+                    "[-m clients_per_node] [-c channels] [-r msgs_per_sec] "
+                    "[-T seconds] [-P privmsg_pct] [-p base_port] "
+                    "[-x sircd]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n_nodes < 2 || n_nodes > MAX_NODES || per_node < 1 ||
+        per_node > MAX_PER_NODE || n_channels < 1 || rate < 1 ||
+        seconds < 1) {
+        fprintf(stderr, "nodes must be 2..%d, clients 1..%d\n", MAX_NODES,
+                MAX_PER_NODE);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    srand(1);
+    if ((epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    start_nodes();
+
+    n_conns = n_nodes * per_node;
+    conns = calloc(n_conns, sizeof(conn_t));
+    chan_members = calloc(n_channels, sizeof(int));
+    for (i = 0; i < n_conns; i++) {
+        conns[i].node = i / per_node;
+        conns[i].index = i % per_node;
+        conns[i].chan = i % n_channels;
+        chan_members[conns[i].chan]++;
+        connect_client(&conns[i]);
+    }
+    pump_for(500);
+    wait_converged();
+    pump_for(1000);
+
+    for (i = 0; i < n_nodes; i++)
+        cpu_before[i] = cpu_seconds(pids[i]);
+    hist_reset(&latency);
+    measuring = 1;
+    start = mono_ns();
+    while ((now = mono_ns()) - start < (uint64_t)seconds * 1000000000) {
+        /* Open loop: keep up with the schedule, whatever the replies */
+        due = (now - start) * rate / 1000000000;
+        for (; sent < due; sent++)
+            send_one();
+        pump(1);
+    }
+    /* Stragglers */
+    do {
+        last = delivered;
+        pump_for(500);
+    } while (delivered != last);
+    wall = (mono_ns() - start) / 1e9;
+
+    printf("%d nodes (%s), %d clients/node, %d channels, %d msgs/s for "
+           "%d s, %d%% privmsg\n", n_nodes, line_topo ? "line" : "mesh",
+           per_node, n_channels, rate, seconds, privmsg_pct);
+    printf("sent %lu (%lu privmsg, %lu channel), delivered %lu of %lu\n",
+           sent_priv + sent_chan, sent_priv, sent_chan, delivered, expected);
+    printf("throughput %.0f deliveries/s\n", delivered / (double)seconds);
+    printf("latency p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  max %.3f ms\n",
+           hist_percentile(&latency, 0.50) / 1e6,
+           hist_percentile(&latency, 0.99) / 1e6,
+           hist_percentile(&latency, 0.999) / 1e6, latency.max / 1e6);
+    printf("node  cpu%%\n");
+    for (i = 0; i < n_nodes; i++)
+        printf("%4d  %5.1f\n", i + 1,
+               100 * (cpu_seconds(pids[i]) - cpu_before[i]) / wall);
+
+    stop_nodes();
+    return delivered != expected;
+}
@@ -0,0 +1,342 @@
+/*
+ * bench_ecmp.c
+ *
+ * Link utilization under equal-cost multipath forwarding, on loopback.
+ *
+ * Generates a diamond or a grid mesh of nodes, writes one config file
+ * per node (itself plus its neighbors, in the node1.conf format), starts
+ * a sircd for each, and puts k sender clients on the first node and k
+ * receivers on the last.  Every sender then sends m PRIVMSGs to every
+ * receiver.  The lines each node sent on each of its forwarding links
+ * ("STATS l") show how evenly the equal-cost paths were used.
+ *
+ * usage: bench_ecmp [-t diamond|mesh] [-r rows] [-c cols] [-k clients]
+ *                   [-m msgs_per_pair] [-p base_port] [-x sircd]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_NODES 32
+#define MAX_CLIENTS 256
+
+static int n_nodes;
+static int adj[MAX_NODES][MAX_NODES];
+static int base_port = 31000;
+static const char *sircd = "./sircd";
+static char dir[] = "/tmp/bench_ecmpXXXXXX";
+static pid_t pids[MAX_NODES];
+
+static int irc_port(int node) { return base_port + node * 10 + 2; }
+
+static void build_diamond() {
+    n_nodes = 4;
+    adj[0][1] = adj[1][0] = 1;
+    adj[0][2] = adj[2][0] = 1;
+    adj[1][3] = adj[3][1] = 1;
+    adj[2][3] = adj[3][2] = 1;
+}
+
+static void build_mesh(int rows, int cols) {
+    int r, c, i;
+
+    n_nodes = rows * cols;
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < cols; c++) {
+            i = r * cols + c;
+            if (c + 1 < cols)
+                adj[i][i + 1] = adj[i + 1][i] = 1;
+            if (r + 1 < rows)
+                adj[i][i + cols] = adj[i + cols][i] = 1;
+        }
+    }
+}
+
+static void config_line(FILE *f, int node) {
+    int p = base_port + node * 10;
+    fprintf(f, "%d 127.0.0.1 %d %d %d\n", node + 1, p, p + 1, p + 2);
+}
+
+static void start_nodes() {
+    char path[256], id[16];
+    int i, j;
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    for (i = 0; i < n_nodes; i++) {
+        FILE *f;
+        snprintf(path, sizeof(path), "%s/node%d.conf", dir, i + 1);
+        if (!(f = fopen(path, "w"))) {
+            perror(path);
+            exit(1);
+        }
+        for (j = 0; j < n_nodes; j++)
+            if (j == i || adj[i][j])
+                config_line(f, j);
+        fclose(f);
+
+        snprintf(id, sizeof(id), "%d", i + 1);
+        if ((pids[i] = fork()) == 0) {
+            freopen("/dev/null", "w", stdout);
+            execl(sircd, sircd, id, path, (char *)NULL);
+            perror(sircd);
+            _exit(1);
+        }
+    }
+}
+
+static void stop_nodes() {
+    char path[256];
+    int i;
+
+    for (i = 0; i < n_nodes; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+            waitpid(pids[i], NULL, 0);
+        }
+        snprintf(path, sizeof(path), "%s/node%d.conf", dir, i + 1);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+
+/* Clients */
+
+typedef struct conn {
+    int fd;
+    char buf[8192];
+    int len;
+} conn_t;
+
+static void die(const char *what) {
+    fprintf(stderr, "bench_ecmp: %s\n", what);
+    stop_nodes();
+    exit(1);
+}
+
+static void say(conn_t *c, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void say(conn_t *c, const char *fmt, ...) {
+    char line[512];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (write(c->fd, line, len) != len)
+        die("write failed");
+}
+
+static void connect_client(conn_t *c, int node, const char *nick) {
+    struct sockaddr_in addr;
+    int tries;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(irc_port(node));
+    for (tries = 0; tries < 50; tries++) {
+        c->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            break;
+        close(c->fd);
+        c->fd = -1;
+        usleep(100000);
+    }
+    if (c->fd < 0)
+        die("can't connect to sircd");
+    c->len = 0;
+    say(c, "NICK %s\r\nUSER %s h s :bench\r\n", nick, nick);
+}
+
+/*
+ * Read the next line from c into line, waiting up to ms.  Returns 0 on
+ * timeout.
+ */
+static int get_line(conn_t *c, char *line, size_t size, int ms) {
+    struct pollfd pfd = { c->fd, POLLIN, 0 };
+    char *nl;
+    ssize_t n;
+
+    for (;;) {
+        if ((nl = memchr(c->buf, '\n', c->len)) != NULL) {
+            size_t l = nl - c->buf + 1;
+            size_t copy = l < size ? l : size - 1;
+            memcpy(line, c->buf, copy);
+            line[copy] = '\0';
+            memmove(c->buf, c->buf + l, c->len - l);
+            c->len -= l;
+            return 1;
+        }
+        if (poll(&pfd, 1, ms) <= 0)
+            return 0;
+        n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+        if (n <= 0)
+            die("sircd closed a connection");
+        c->len += n;
+    }
+}
+
+static void drain(conn_t *c, int ms) {
+    char line[600];
+    while (get_line(c, line, sizeof(line), ms))
+        ;
+}
+
+/* Count PRIVMSG lines arriving on c until none come for ms */
+static int count_privmsgs(conn_t *c, int ms) {
+    char line[600];
+    int n = 0;
+
+    while (get_line(c, line, sizeof(line), ms))
+        if (strstr(line, " PRIVMSG "))
+            n++;
+    return n;
+}
+
+/* Lines sent so far on every link, from each node's STATS l */
+static void link_lines(conn_t *stats, unsigned long lines[][MAX_NODES]) {
+    char line[600];
+    unsigned long to, l, b;
+    int i;
+
+    for (i = 0; i < n_nodes; i++) {
+        say(&stats[i], "STATS l\r\n");
+        while (get_line(&stats[i], line, sizeof(line), 2000)) {
+            char *p = strstr(line, ":link ");
+            if (p && sscanf(p, ":link %lu %lu lines %lu bytes", &to, &l,
+                            &b) == 3 && to >= 1 && to <= n_nodes)
+                lines[i][to - 1] = l;
+            if (strstr(line, " 219 "))
+                break;
+        }
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    static unsigned long before[MAX_NODES][MAX_NODES];
+    static unsigned long after[MAX_NODES][MAX_NODES];
+    static conn_t senders[MAX_CLIENTS], receivers[MAX_CLIENTS];
+    static conn_t stats[MAX_NODES];
+    const char *topo = "diamond";
+    int rows = 3, cols = 3, k = 16, m = 4;
+    int ch, i, j, src, dst, got, sent, tries;
+    unsigned long total = 0, used = 0, busiest = 0;
+    char nick[32];
+
+    while ((ch = getopt(argc, argv, "t:r:c:k:m:p:x:")) != -1) {
+        switch (ch) {
+        case 't': topo = optarg; break;
+        case 'r': rows = atoi(optarg); break;
+        case 'c': cols = atoi(optarg); break;
+        case 'k': k = atoi(optarg); break;
+        case 'm': m = atoi(optarg); break;
+        case 'p': base_port = atoi(optarg); break;
+        case 'x': sircd = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-t diamond|mesh] [-r rows] "
+                    "[-c cols] [-k clients] [-m msgs_per_pair] "
+                    "[-p base_port] [-x sircd]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!strcmp(topo, "diamond"))
+        build_diamond();
+    else if (!strcmp(topo, "mesh") && rows * cols >= 2 &&
+             rows * cols <= MAX_NODES)
+        build_mesh(rows, cols);
+    else {
+        fprintf(stderr, "bad topology %s (%dx%d)\n", topo, rows, cols);
+        return 1;
+    }
+    if (k < 1 || k > MAX_CLIENTS) {
+        fprintf(stderr, "clients must be 1..%d\n", MAX_CLIENTS);
+        return 1;
+    }
+    src = 0;
+    dst = n_nodes - 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    start_nodes();
+
+    for (i = 0; i < n_nodes; i++) {
+        snprintf(nick, sizeof(nick), "stats%d", i + 1);
+        connect_client(&stats[i], i, nick);
+    }
+    for (i = 0; i < k; i++) {
+        snprintf(nick, sizeof(nick), "s%d", i);
+        connect_client(&senders[i], src, nick);
+        snprintf(nick, sizeof(nick), "r%d", i);
+        connect_client(&receivers[i], dst, nick);
+    }
+    for (i = 0; i < n_nodes; i++)
+        drain(&stats[i], 100);
+    for (i = 0; i < k; i++) {
+        drain(&senders[i], 10);
+        drain(&receivers[i], 10);
+    }
+
+    /* Wait until the last receiver is reachable, then a little longer
+       for every equal-cost link to come up */
+    for (tries = 0; tries < 100; tries++) {
+        say(&senders[0], "PRIVMSG r%d :probe\r\n", k - 1);
+        if (count_privmsgs(&receivers[k - 1], 300) > 0)
+            break;
+    }
+    if (tries == 100)
+        die("routes never converged");
+    sleep(2);
+    drain(&senders[0], 10);
+
+    link_lines(stats, before);
+    for (i = 0; i < k; i++)
+        for (j = 0; j < k; j++)
+            for (sent = 0; sent < m; sent++)
+                say(&senders[i], "PRIVMSG r%d :msg %d\r\n", j, sent);
+    for (got = 0, i = 0; i < k; i++)
+        got += count_privmsgs(&receivers[i], 500);
+    link_lines(stats, after);
+
+    printf("%s, %d nodes, %d x %d senders x receivers, %d msgs per pair\n",
+           topo, n_nodes, k, k, m);
+    printf("delivered %d of %d\n", got, k * k * m);
+    printf("link      lines\n");
+    for (i = 0; i < n_nodes; i++) {
+        for (j = 0; j < n_nodes; j++) {
+            unsigned long d = after[i][j] - before[i][j];
+            if (!adj[i][j] || !d)
+                continue;
+            printf("%2d -> %-2d %6lu\n", i + 1, j + 1, d);
+            total += d;
+            used++;
+            if (d > busiest)
+                busiest = d;
+        }
+    }
+    for (j = 0; j < n_nodes; j++)
+        if (adj[src][j])
+            printf("first hop %d: %.1f%%\n", j + 1, total ?
+                   100.0 * (after[src][j] - before[src][j]) /
+                   (k * k * m) : 0.0);
+    printf("links used %lu, busiest/mean %.2f\n", used,
+           used ? busiest / ((double)total / used) : 0.0);
+
+    stop_nodes();
+    return got != k * k * m;
+}
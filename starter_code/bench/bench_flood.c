@@ -0,0 +1,139 @@
+/*
+ * bench_flood.c
+ *
+ * Reflooding after many nodes fail at once, with per-LSA ACKs against
+ * batched ACKS datagrams.
+ *
+ * Runs every node of a random topology in the simulator (sim.h), with
+ * a fixed link latency and optional packet loss.  Once the network has
+ * settled, f nodes fail together.  Their neighbors notice after
+ * neighbor_timeout, reoriginate and flood.  From the first
+ * detection the benchmark counts routing packets and bytes until the
+ * network is quiet again (nothing in flight, nothing awaiting an ack),
+ * and the virtual time until every surviving node holds the latest LSA
+ * of every survivor it can still reach.
+ *
+ * Timers are the defaults except neighbor_timeout, which is 100 s so
+ * the failures are noticed between two advertisement cycles and the
+ * periodic refreshes stay out of the count.
+ *
+ * usage: bench_flood [-n nodes] [-d extra_links] [-f failures]
+ *                    [-L latency_ms] [-l loss_pct] [-s seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "routing.h"
+#include "topo.h"
+#include "sim.h"
+
+#define FAIL_AT 31000   /* ms, just after the first refresh has settled */
+#define LIMIT   600000  /* ms of virtual time to give up after */
+
+static int n_nodes = 300;
+static int extra = 2;
+static int n_fail = 100;
+static int latency = 1;
+static int loss_pct = 0;
+static unsigned seed = 1;
+
+static topo_t topo;
+static int *failed;
+
+static unsigned long retransmits(const sim_t *s) {
+    unsigned long n = 0;
+    int i;
+
+    for (i = 0; i < s->n; i++)
+        n += s->nodes[i].rt.stats.retransmits;
+    return n;
+}
+
+static void run(const char *label, int ack_each) {
+    uint64_t detected, converged, quiet;
+    unsigned long base_rexmit;
+    rt_timers_t timers;
+    sim_stats_t base;
+    sim_t sim;
+    int i, initial;
+
+    rt_timers_default(&timers);
+    timers.neighbor_timeout = 100 * 1000;
+    if (sim_init(&sim, &topo, &timers, seed) < 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    sim.latency = latency;
+    sim.loss_pct = loss_pct;
+    for (i = 0; i < n_nodes; i++)
+        sim.nodes[i].rt.ack_each = ack_each;
+
+    sim_run_until(&sim, FAIL_AT);
+    for (i = 0; i < n_fail; i++)
+        sim_fail(&sim, failed[i]);
+    initial = sim_stale_links(&sim);
+
+    /* Up to the first node noticing */
+    while (sim_stale_links(&sim) == initial && sim.now < LIMIT)
+        sim_step(&sim, LIMIT);
+    detected = sim.now;
+    base = sim.stats;
+    base_rexmit = retransmits(&sim);
+
+    quiet = sim_settle(&sim, LIMIT, &converged);
+    printf("%-8s  %8lu  %7lu  %7lu  %6lu  %10lu  %7.0f  %8.0f\n", label,
+           sim.stats.packets - base.packets, sim.stats.adverts - base.adverts,
+           sim.stats.acks - base.acks, retransmits(&sim) - base_rexmit,
+           sim.stats.bytes - base.bytes,
+           converged ? (double)(converged - detected) : -1.0,
+           quiet ? (double)(quiet - detected) : -1.0);
+    sim_destroy(&sim);
+}
+
+int main(int argc, char *argv[]) {
+    int ch, i, j;
+
+    while ((ch = getopt(argc, argv, "n:d:f:L:l:s:")) != -1) {
+        switch (ch) {
+        case 'n': n_nodes = atoi(optarg); break;
+        case 'd': extra = atoi(optarg); break;
+        case 'f': n_fail = atoi(optarg); break;
+        case 'L': latency = atoi(optarg); break;
+        case 'l': loss_pct = atoi(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-n nodes] [-d extra] [-f failures] "
+                    "[-L latency_ms] [-l loss_pct] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n_nodes < 2 || n_fail < 1 || n_fail >= n_nodes || latency < 1) {
+        fprintf(stderr, "need 2+ nodes, 1..nodes-1 failures, latency 1+\n");
+        return 1;
+    }
+
+    srand(seed);
+    topo_random(&topo, n_nodes, extra);
+    failed = malloc(n_fail * sizeof(int));
+    for (i = 0; i < n_fail; i++) {
+        failed[i] = rand() % n_nodes;
+        for (j = 0; j < i; j++)
+            if (failed[j] == failed[i])
+                break;
+        if (j < i)
+            i--;
+    }
+
+    printf("nodes %d  extra links %d  failures %d  latency %d ms  "
+           "loss %d%%  seed %u\n", n_nodes, extra, n_fail, latency, loss_pct,
+           seed);
+    printf("acks       packets  adverts     acks  rexmit       bytes  "
+           "conv ms  quiet ms\n");
+    run("each", 1);
+    run("batched", 0);
+
+    free(failed);
+    topo_free(&topo);
+    return 0;
+}
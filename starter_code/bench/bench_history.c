@@ -0,0 +1,195 @@
+/*
+ * bench_history.c
+ *
+ * Channel history (backlog.h): what it takes per channel, what a replay
+ * to a joining client costs, and what the memory cap throws away.
+ *
+ * First every channel gets a full history of PRIVMSG lines of random
+ * length, and the pool memory they take is set against the text in
+ * them.  Then clients join random channels and are replayed their
+ * history, which queues references to the lines; for comparison the
+ * same lines are copied into fresh buffers, the way they would be if
+ * they were kept as text and sent anew.  Last, the cap is lowered to a
+ * fraction of what is held and traffic goes on, three lines in four to
+ * a few busy channels: the quiet ones should lose their history first,
+ * and the busy ones end up with full rings.
+ *
+ * usage: bench_history [-c channels] [-l lines] [-j joins] [-f cap_pct]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include "backlog.h"
+#include "msgbuf.h"
+
+#define HOT 10                  /* busy channels in the cap test */
+
+/* What irc_proto.c and sircd.c would provide */
+unsigned irc_strhash(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)tolower((unsigned char)*s++);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* A client's send queue, written out after every replay */
+static msgbuf_t *queue[65536];
+static int n_queued;
+
+void client_queue(client *c, msgbuf_t *mb) {
+    queue[n_queued++] = msgbuf_ref(mb);
+    c->sendq_len += mb->len;
+}
+
+static void written(client *c) {
+    while (n_queued > 0)
+        msgbuf_unref(queue[--n_queued]);
+    c->sendq_len = 0;
+}
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t rng = 2463534242u;
+
+static uint32_t rand32() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static int n_chans = 200, n_lines = 50, n_joins = 100000, cap_pct = 25;
+static istr_t **chans;
+static unsigned long text_bytes;
+
+/* A PRIVMSG to channel i, fanned out (here: to nobody) and kept */
+static void say(int i) {
+    char buf[MAX_MSG_LEN];
+    int len, n = 20 + rand32() % 380;
+    msgbuf_t *mb;
+
+    len = snprintf(buf, sizeof(buf), ":nick%u!user@host%u.example "
+                   "PRIVMSG %s :", rand32() % 1000, rand32() % 1000,
+                   chans[i]->s);
+    memset(buf + len, 'x', n);
+    len += n;
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    mb = msgbuf_copy(buf, len);
+    backlog_add(chans[i], mb);
+    msgbuf_unref(mb);
+    text_bytes += len;
+}
+
+int main(int argc, char *argv[]) {
+    char name[32], spec[64];
+    backlog_stats_t st;
+    const backlog_t *b, **hists;
+    client c;
+    uint64_t start, ref_ns, copy_ns;
+    unsigned long lines = 0, full_hot = 0, kept_quiet = 0;
+    int ch, i, j, k;
+
+    while ((ch = getopt(argc, argv, "c:l:j:f:")) != -1) {
+        switch (ch) {
+        case 'c': n_chans = atoi(optarg); break;
+        case 'l': n_lines = atoi(optarg); break;
+        case 'j': n_joins = atoi(optarg); break;
+        case 'f': cap_pct = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c channels] [-l lines] [-j joins] "
+                    "[-f cap_pct]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n_chans <= HOT || n_lines < 1 || n_joins < 1 || cap_pct < 1) {
+        fprintf(stderr, "need more than %d channels and at least a line, "
+                "a join and 1%%\n", HOT);
+        return 1;
+    }
+
+    /* Memory */
+    snprintf(spec, sizeof(spec), "%d:%d", n_lines, 1 << 30);
+    backlog_init(spec);
+    chans = calloc(n_chans, sizeof(istr_t *));
+    for (i = 0; i < n_chans; i++) {
+        snprintf(name, sizeof(name), "#chan%d", i);
+        chans[i] = istr_get(name);
+    }
+    for (j = 0; j < n_lines; j++)
+        for (i = 0; i < n_chans; i++)
+            say(i);
+    backlog_stats(&st);
+    printf("%d channels, %d lines each:\n", n_chans, n_lines);
+    printf("  %lu bytes per channel, %.1f per line, %.2fx the text in "
+           "them\n", st.bytes / st.channels, (double)st.bytes / st.lines,
+           (double)st.bytes / text_bytes);
+
+    /* Replays */
+    memset(&c, 0, sizeof(c));
+    c.sendq_max = MAX_SENDQ;
+    start = mono_ns();
+    for (i = 0; i < n_joins; i++) {
+        lines += backlog_replay(chans[rand32() % n_chans], &c);
+        written(&c);
+    }
+    ref_ns = mono_ns() - start;
+    hists = calloc(n_chans, sizeof(backlog_t *));
+    for (b = backlog_next(NULL); b; b = backlog_next(b))
+        hists[atoi(b->name->s + 5)] = b;
+    start = mono_ns();
+    for (i = 0; i < n_joins; i++) {
+        b = hists[rand32() % n_chans];
+        for (k = 0; k < (int)b->n; k++) {
+            msgbuf_t *mb = b->ring[(b->head + k) % n_lines];
+            client_queue(&c, msgbuf_copy(mb->data, mb->len));
+            msgbuf_unref(queue[n_queued - 1]);
+        }
+        written(&c);
+    }
+    copy_ns = mono_ns() - start;
+    printf("%d replays, %.1f lines each:\n", n_joins,
+           (double)lines / n_joins);
+    printf("  by reference %8.1f ns per replay, %5.1f per line\n",
+           (double)ref_ns / n_joins, (double)ref_ns / lines);
+    printf("  copied       %8.1f ns per replay, %5.1f per line\n",
+           (double)copy_ns / n_joins, (double)copy_ns / lines);
+
+    /* The cap */
+    snprintf(spec, sizeof(spec), "%d:%lu", n_lines,
+             st.bytes * cap_pct / 100 / 1024);
+    backlog_init(spec);
+    for (j = 0; j < 4 * n_lines * HOT; j++)
+        say(rand32() % 4 ? rand32() % HOT :
+            HOT + rand32() % (n_chans - HOT));
+    backlog_stats(&st);
+    for (b = backlog_next(NULL); b; b = backlog_next(b)) {
+        for (i = 0; i < HOT && b->name != chans[i]; i++)
+            ;
+        if (i < HOT)
+            full_hot += b->n == (unsigned)n_lines;
+        else
+            kept_quiet++;
+    }
+    printf("cap at %d%%, %d lines mostly to %d busy channels:\n", cap_pct,
+           4 * n_lines * HOT, HOT);
+    printf("  %lu of %lu bytes, %lu channels left, %lu lines evicted; "
+           "%lu busy ones full, %lu quiet ones left\n", st.bytes, st.cap,
+           st.channels, st.evicted, full_hot, kept_quiet);
+    if (st.bytes > st.cap || full_hot < HOT) {
+        printf("FAIL: over the cap or a busy channel lost lines\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,296 @@
+/*
+ * bench_mask.c
+ *
+ * Checking nick!user@host against a channel's ban list (mask.h), three
+ * ways: the recursive glob ircds traditionally use, run over every mask
+ * as it was typed; compiled masks (mask_compile()), still every one of
+ * them; and a maskset, which only tries the masks its tries lead to.
+ *
+ * The bans are a mix like real lists have: mostly whole hosts and
+ * domains ("*!*@cpe-1-2-3-4.net7.example", "*!*@*.net7.example"),
+ * address ranges ("*!*@10.1.2.*") and nicks ("nick42!*@*" and
+ * "bot42*!*@*"), and a few by user ("*!ident42@*") or unanchored
+ * ("*spam42*!*@*"), which no index helps with.  One check in ten is by
+ * a client some ban matches, the rest by clients none does.  All three
+ * must agree on every check, and then every ban is deleted again.
+ *
+ * usage: bench_mask [-n bans] [-c checks]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include "mask.h"
+#include "msgbuf.h"
+
+#define DOMAINS 500
+
+typedef struct subject {
+    char nick[32], user[32], host[64];
+    char full[128];             /* "nick!user@host" */
+} subject_t;
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t rng = 2463534242u;
+
+static uint32_t rand32() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+
+/* The bans */
+
+static char (*bans)[MASK_MAX];
+static int n_bans = 10000;
+
+static void make_ban(char *buf, size_t size) {
+    unsigned r = rand32() % 100, d = rand32() % DOMAINS, k = rand32();
+
+    if (r < 35)
+        snprintf(buf, size, "*!*@cpe-%u-%u-%u-%u.net%u.example",
+                 k & 0xff, k >> 8 & 0xff, k >> 16 & 0xff, k >> 24, d);
+    else if (r < 55)
+        snprintf(buf, size, "*!*@*.net%u.example", d);
+    else if (r < 75)
+        snprintf(buf, size, "*!*@10.%u.%u.*", k & 0xff, k >> 8 & 0xff);
+    else if (r < 90)
+        snprintf(buf, size, "nick%u!*@*", k % 100000);
+    else if (r < 97)
+        snprintf(buf, size, "Bot%u*!*@*", k % 100000);
+    else if (r < 99)
+        snprintf(buf, size, "*!ident%u@*", k % 100000);
+    else
+        snprintf(buf, size, "*spam%u*!*@*", k % 1000);
+}
+
+
+/* Clients to check */
+
+/* A client no ban is meant for (though one may match it anyway) */
+static void make_clean(subject_t *s) {
+    unsigned k = rand32();
+
+    snprintf(s->nick, sizeof(s->nick), "user%u", k % 1000000);
+    snprintf(s->user, sizeof(s->user), "u%u", k % 9999);
+    if (k & 1)
+        snprintf(s->host, sizeof(s->host), "dsl-%u-%u.isp%u.example",
+                 k >> 1 & 0xff, k >> 9 & 0xff, rand32() % DOMAINS);
+    else
+        snprintf(s->host, sizeof(s->host), "192.168.%u.%u", k >> 1 & 0xff,
+                 k >> 9 & 0xff);
+}
+
+/* A client that the ban b is meant for: fill in its wildcards */
+static void make_banned(subject_t *s, const char *b) {
+    char buf[MASK_MAX], *part[3], *dst[3] = { s->nick, s->user, s->host };
+    size_t size[3] = { sizeof(s->nick), sizeof(s->user), sizeof(s->host) };
+    const char *p;
+    size_t n;
+    int i;
+
+    snprintf(buf, sizeof(buf), "%s", b);
+    part[0] = buf;
+    part[1] = strchr(buf, '!');
+    *part[1]++ = '\0';
+    part[2] = strchr(part[1], '@');
+    *part[2]++ = '\0';
+    for (i = 0; i < 3; i++) {
+        for (n = 0, p = part[i]; *p && n < size[i] - 8; p++) {
+            if (*p == '*')
+                n += snprintf(dst[i] + n, size[i] - n, "%s",
+                              i == 2 ? "x1" : "Zed");
+            else if (*p == '?')
+                dst[i][n++] = 'q';
+            else
+                dst[i][n++] = *p;
+        }
+        dst[i][n] = '\0';
+    }
+}
+
+
+/* The traditional way: a recursive glob, case folded as it goes */
+
+static int naive_glob(const char *m, const char *s) {
+    for (; *m; m++, s++) {
+        if (*m == '*') {
+            while (*m == '*')
+                m++;
+            if (!*m)
+                return 1;
+            for (; *s; s++)
+                if (naive_glob(m, s))
+                    return 1;
+            return 0;
+        }
+        if (!*s || (*m != '?' && tolower((unsigned char)*m) !=
+                    tolower((unsigned char)*s)))
+            return 0;
+    }
+    return !*s;
+}
+
+
+/* Compiled, but every mask still tried */
+
+typedef struct compiled {
+    mask_t *nick, *user, *host;
+} compiled_t;
+
+static compiled_t *compiled;
+
+static void compile_all() {
+    char buf[MASK_MAX], *bang, *at;
+    int i;
+
+    compiled = calloc(n_bans, sizeof(compiled_t));
+    for (i = 0; i < n_bans; i++) {
+        snprintf(buf, sizeof(buf), "%s", bans[i]);
+        bang = strchr(buf, '!');
+        at = strchr(bang, '@');
+        *bang = *at = '\0';
+        compiled[i].nick = mask_compile(buf);
+        compiled[i].user = mask_compile(bang + 1);
+        compiled[i].host = mask_compile(at + 1);
+    }
+}
+
+
+/* The runs */
+
+typedef struct result {
+    uint64_t ns;
+    unsigned long tried;
+    unsigned long matched;
+} result_t;
+
+static void report(const char *what, const result_t *r, int checks) {
+    printf("  %-9s %8.1f ns per check, %8.1f masks tried, %lu matched\n",
+           what, (double)r->ns / checks, (double)r->tried / checks,
+           r->matched);
+}
+
+int main(int argc, char *argv[]) {
+    result_t naive = { 0 }, linear = { 0 }, indexed = { 0 };
+    subject_t *subj;
+    maskset_t set;
+    char *want, *got;
+    char f[3][MASK_MAX];
+    size_t len[3];
+    int checks = 5000, ch, i, j, mismatches = 0;
+    uint64_t start;
+
+    while ((ch = getopt(argc, argv, "n:c:")) != -1) {
+        switch (ch) {
+        case 'n': n_bans = atoi(optarg); break;
+        case 'c': checks = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n bans] [-c checks]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n_bans < 1 || checks < 1) {
+        fprintf(stderr, "need at least one ban and one check\n");
+        return 1;
+    }
+
+    bans = calloc(n_bans, MASK_MAX);
+    memset(&set, 0, sizeof(set));
+    for (i = 0; i < n_bans; i++) {
+        do
+            make_ban(bans[i], MASK_MAX);
+        while (maskset_add(&set, bans[i]) != 1);
+    }
+    compile_all();
+
+    subj = calloc(checks, sizeof(subject_t));
+    want = calloc(checks, 1);
+    got = calloc(checks, 1);
+    for (i = 0; i < checks; i++) {
+        subject_t *s = &subj[i];
+        if (rand32() % 10 == 0)
+            make_banned(s, bans[rand32() % n_bans]);
+        else
+            make_clean(s);
+        snprintf(s->full, sizeof(s->full), "%s!%s@%s", s->nick, s->user,
+                 s->host);
+    }
+    printf("%d bans (%u filed), %d checks:\n", n_bans, set.count, checks);
+
+    start = mono_ns();
+    for (i = 0; i < checks; i++) {
+        for (j = 0; j < n_bans; j++) {
+            naive.tried++;
+            if (naive_glob(bans[j], subj[i].full)) {
+                want[i] = 1;
+                naive.matched++;
+                break;
+            }
+        }
+    }
+    naive.ns = mono_ns() - start;
+
+    start = mono_ns();
+    for (i = 0; i < checks; i++) {
+        len[0] = mask_fold(f[0], subj[i].nick, MASK_MAX);
+        len[1] = mask_fold(f[1], subj[i].user, MASK_MAX);
+        len[2] = mask_fold(f[2], subj[i].host, MASK_MAX);
+        for (j = 0; j < n_bans; j++) {
+            linear.tried++;
+            if (mask_match(compiled[j].host, f[2], len[2]) &&
+                mask_match(compiled[j].nick, f[0], len[0]) &&
+                mask_match(compiled[j].user, f[1], len[1])) {
+                got[i] = 1;
+                linear.matched++;
+                break;
+            }
+        }
+    }
+    linear.ns = mono_ns() - start;
+    for (i = 0; i < checks; i++)
+        mismatches += got[i] != want[i];
+    memset(got, 0, checks);
+
+    start = mono_ns();
+    for (i = 0; i < checks; i++) {
+        if (maskset_match(&set, subj[i].nick, subj[i].user, subj[i].host)) {
+            got[i] = 1;
+            indexed.matched++;
+        }
+    }
+    indexed.ns = mono_ns() - start;
+    indexed.tried = set.tried;
+    for (i = 0; i < checks; i++)
+        mismatches += got[i] != want[i];
+
+    report("naive", &naive, checks);
+    report("compiled", &linear, checks);
+    report("indexed", &indexed, checks);
+    if (mismatches) {
+        printf("MISMATCH: %d checks disagree\n", mismatches);
+        return 1;
+    }
+
+    /* Taking them all out again must leave nothing behind */
+    for (i = 0; i < n_bans; i++)
+        if (!maskset_del(&set, bans[i]))
+            mismatches++;
+    if (mismatches || set.count || set.all) {
+        printf("MISMATCH: %d bans not found to delete\n", mismatches);
+        return 1;
+    }
+    maskset_clear(&set);
+    return 0;
+}
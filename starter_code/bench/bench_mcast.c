@@ -0,0 +1,150 @@
+/*
+ * bench_mcast.c
+ *
+ * Multicast versus unicast fan-out of channel messages.
+ *
+ * Builds a random connected topology, puts channel members on a subset
+ * of the nodes, and sends one message from every member node.  Each
+ * message is walked down the tree hop by hop with mcast_next_hops(),
+ * exactly as the servers would relay it, counting link copies and
+ * checking every member node gets it exactly once.  The unicast figure
+ * is what sending one copy per member node along its shortest path
+ * would have cost.
+ *
+ * usage: bench_mcast [-n nodes] [-d extra_links_per_node] [-m member_pct]
+ *                    [-s seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "lsdb.h"
+#include "spf.h"
+#include "mcast.h"
+#include "topo.h"
+
+#define CHAN "#bench"
+
+static int n_nodes = 64;
+static int extra = 1;
+static int member_pct = 25;
+
+static topo_t topo;
+static int *member;
+
+static void build_topology() {
+    int i;
+
+    topo_random(&topo, n_nodes, extra);
+    member = calloc(n_nodes, sizeof(int));
+    for (i = 0; i < n_nodes; i++)
+        member[i] = rand() % 100 < member_pct;
+}
+
+static void fill_lsdb(lsdb_t *db) {
+    char *chans[] = { CHAN };
+    int i;
+
+    lsdb_init(db);
+    for (i = 0; i < n_nodes; i++) {
+        lsa_t *lsa = topo_lsa(&topo, i, 1);
+        lsa_set_names(lsa, NULL, 0, chans, member[i]);
+        lsdb_update(db, lsa);
+    }
+}
+
+/*
+ * Relay one message from src the way the servers do.  Returns the
+ * number of link copies; *dups counts nodes that got it twice.
+ */
+static int walk(mcast_cache_t *mc, lsdb_t *db, int src, int *dups) {
+    int queue[n_nodes], seen[n_nodes];
+    u_long hops[MCAST_MAX_HOPS];
+    int head = 0, tail = 0, copies = 0, i, n;
+
+    memset(seen, 0, sizeof(seen));
+    queue[tail++] = src;
+    seen[src] = 1;
+    while (head < tail) {
+        int at = queue[head++];
+        n = mcast_next_hops(mc, db, src + 1, at + 1, CHAN, hops,
+                            MCAST_MAX_HOPS);
+        for (i = 0; i < n; i++) {
+            int to = hops[i] - 1;
+            copies++;
+            if (seen[to]++) {
+                (*dups)++;
+                continue;
+            }
+            queue[tail++] = to;
+        }
+    }
+    for (i = 0; i < n_nodes; i++)
+        if (member[i] && i != src && !seen[i])
+            fprintf(stderr, "member node %d missed message from %d\n",
+                    i + 1, src + 1);
+    return copies;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long tree_total = 0, unicast_total = 0, walked = 0;
+    unsigned seed = time(NULL), tree, unicast;
+    int ch, i, dups = 0, sources = 0, members = 0;
+    struct timespec t0, t1;
+    mcast_cache_t mc;
+    lsdb_t db;
+    double ns;
+
+    while ((ch = getopt(argc, argv, "n:d:m:s:")) != -1) {
+        switch (ch) {
+        case 'n': n_nodes = atoi(optarg); break;
+        case 'd': extra = atoi(optarg); break;
+        case 'm': member_pct = atoi(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-n nodes] [-d extra] [-m member_pct]"
+                    " [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n_nodes < 2) {
+        fprintf(stderr, "need at least 2 nodes\n");
+        return 1;
+    }
+
+    srand(seed);
+    build_topology();
+    fill_lsdb(&db);
+    mcast_init(&mc);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < n_nodes; i++) {
+        if (!member[i])
+            continue;
+        members++;
+        sources++;
+        mcast_tree_cost(&mc, &db, i + 1, CHAN, &tree, &unicast);
+        tree_total += tree;
+        unicast_total += unicast;
+        walked += walk(&mc, &db, i, &dups);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    printf("nodes %d  member nodes %d  seed %u\n", n_nodes, members, seed);
+    printf("unicast link copies   %lu\n", unicast_total);
+    printf("multicast link copies %lu (walked %lu)\n", tree_total, walked);
+    printf("duplicates suppressed %lu (%.1f%%)\n",
+           unicast_total - tree_total, unicast_total ?
+           100.0 * (unicast_total - tree_total) / unicast_total : 0.0);
+    printf("duplicate deliveries  %d\n", dups);
+    printf("spf runs %lu, %.0f ns per source\n", spf_runs,
+           sources ? ns / sources : 0.0);
+
+    mcast_destroy(&mc);
+    lsdb_destroy(&db);
+    topo_free(&topo);
+    return dups != 0;
+}
@@ -0,0 +1,280 @@
+/*
+ * bench_pool.c
+ *
+ * The msgbuf pool (msgbuf.h) against plain malloc() and free().
+ *
+ * First, alloc/free pairs of each class size, with a working set of
+ * objects live at once so the free lists get stirred.  Then a model of
+ * sircd's send queues: every round one line of random length goes to a
+ * random group of clients (one refcounted copy, a queue entry per
+ * recipient) and one client gets a reply of its own, while every client
+ * writes out a random part of what it has queued, the way slow readers
+ * do.  Queues are capped like MAX_SENDQ, lines beyond that are dropped.
+ *
+ * Heap calls (malloc, calloc, realloc and free) are counted by wrapping
+ * them at link time, separately for the warm-up and for the measured
+ * rounds after it.  With the pool the second count should be zero.
+ *
+ * usage: bench_pool [-c clients] [-g group] [-r rounds] [-w warmup]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "msgbuf.h"
+
+#define WORKING_SET 4096
+#define PAIRS       (4 * 1000 * 1000)
+#define QUEUE_MAX   (64 * 1024)
+
+/* Heap call counting (-Wl,--wrap=malloc etc.) */
+static unsigned long heap_calls;
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void __real_free(void *p);
+
+void *__wrap_malloc(size_t size) {
+    heap_calls++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    heap_calls++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    heap_calls++;
+    return __real_realloc(p, size);
+}
+
+void __wrap_free(void *p) {
+    if (p)
+        heap_calls++;
+    __real_free(p);
+}
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t rng = 2463534242u;
+
+static uint32_t rand32() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/* Everything below runs on either allocator */
+static int use_pool;
+
+static void *obj_alloc(size_t size) {
+    return use_pool ? pool_alloc(size) : malloc(size);
+}
+
+static void obj_free(void *p) {
+    if (use_pool)
+        pool_free(p);
+    else
+        free(p);
+}
+
+static const char *name() {
+    return use_pool ? "pool" : "malloc";
+}
+
+
+/* Alloc/free pairs */
+
+static void pairs(size_t size) {
+    static void *live[WORKING_SET];
+    unsigned long before;
+    uint64_t start, ns;
+    int i, j;
+
+    for (i = 0; i < WORKING_SET; i++)
+        live[i] = obj_alloc(size);
+    before = heap_calls;
+    start = mono_ns();
+    for (i = 0; i < PAIRS; i++) {
+        j = rand32() % WORKING_SET;
+        obj_free(live[j]);
+        live[j] = obj_alloc(size);
+    }
+    ns = mono_ns() - start;
+    printf("  %-6s %3zu bytes: %6.1f ns per pair, %lu heap calls\n",
+           name(), size, (double)ns / PAIRS, heap_calls - before);
+    for (i = 0; i < WORKING_SET; i++)
+        obj_free(live[i]);
+}
+
+
+/* Send queues */
+
+typedef struct entry {
+    msgbuf_t *mb;
+    unsigned off, len;
+    struct entry *next;
+} entry_t;
+
+typedef struct queue {
+    entry_t *head, *tail;
+    unsigned bytes;
+} queue_t;
+
+static int n_clients = 500, group = 50, rounds = 200000, warmup = 100000;
+static queue_t *queues;
+static unsigned long queued_lines, dropped;
+
+static msgbuf_t *line_new(size_t len) {
+    msgbuf_t *mb = obj_alloc(sizeof(msgbuf_t) + len);
+
+    mb->refs = 1;
+    mb->len = mb->size = len;
+    memset(mb->data, 'x', len);
+    return mb;
+}
+
+static void line_unref(msgbuf_t *mb) {
+    if (--mb->refs == 0)
+        obj_free(mb);
+}
+
+static void enqueue(queue_t *q, msgbuf_t *mb) {
+    entry_t *e;
+
+    if (q->bytes + mb->len > QUEUE_MAX) {
+        dropped++;
+        return;
+    }
+    e = obj_alloc(sizeof(entry_t));
+    e->mb = mb;
+    mb->refs++;
+    e->off = 0;
+    e->len = mb->len;
+    e->next = NULL;
+    if (q->tail)
+        q->tail->next = e;
+    else
+        q->head = e;
+    q->tail = e;
+    q->bytes += mb->len;
+    queued_lines++;
+}
+
+/* Take n bytes off the front of q, as a write would */
+static void drain(queue_t *q, unsigned n) {
+    entry_t *e;
+
+    while ((e = q->head) && n >= e->len) {
+        n -= e->len;
+        q->bytes -= e->len;
+        q->head = e->next;
+        line_unref(e->mb);
+        obj_free(e);
+    }
+    if (!q->head)
+        q->tail = NULL;
+    else if (n > 0) {
+        e->off += n;
+        e->len -= n;
+        q->bytes -= n;
+    }
+}
+
+static void one_round() {
+    msgbuf_t *mb;
+    int i, first;
+
+    mb = line_new(40 + rand32() % 400);
+    first = rand32() % n_clients;
+    for (i = 0; i < group; i++)
+        enqueue(&queues[(first + i) % n_clients], mb);
+    line_unref(mb);
+
+    mb = line_new(20 + rand32() % 100);
+    enqueue(&queues[rand32() % n_clients], mb);
+    line_unref(mb);
+
+    /* Each client's socket takes about what it was given, on average */
+    for (i = 0; i < 8; i++)
+        drain(&queues[rand32() % n_clients], rand32() % 4096);
+}
+
+static void sendqs() {
+    unsigned long before, warm_calls;
+    uint64_t start, ns;
+    int i;
+
+    queues = calloc(n_clients, sizeof(queue_t));
+    queued_lines = dropped = 0;
+    rng = 2463534242u;
+    before = heap_calls;
+    for (i = 0; i < warmup; i++)
+        one_round();
+    warm_calls = heap_calls - before;
+
+    before = heap_calls;
+    queued_lines = 0;
+    start = mono_ns();
+    for (i = 0; i < rounds; i++)
+        one_round();
+    ns = mono_ns() - start;
+    printf("  %-6s %.1f ns per queued line, heap calls %lu warming up, "
+           "%lu after (%.3f per line), %lu dropped\n", name(),
+           (double)ns / queued_lines, warm_calls, heap_calls - before,
+           (double)(heap_calls - before) / queued_lines, dropped);
+
+    for (i = 0; i < n_clients; i++)
+        drain(&queues[i], ~0u);
+    free(queues);
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t sizes[] = { 24, 120, 240, 520 };
+    pool_stats_t st;
+    int ch, i;
+
+    while ((ch = getopt(argc, argv, "c:g:r:w:")) != -1) {
+        switch (ch) {
+        case 'c': n_clients = atoi(optarg); break;
+        case 'g': group = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c clients] [-g group] [-r rounds] "
+                    "[-w warmup]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n_clients < 1 || group < 1 || group > n_clients) {
+        fprintf(stderr, "need 1 <= group <= clients\n");
+        return 1;
+    }
+
+    printf("alloc/free pairs, %d live:\n", WORKING_SET);
+    for (i = 0; i < 4; i++) {
+        for (use_pool = 0; use_pool < 2; use_pool++)
+            pairs(sizes[i]);
+    }
+
+    printf("send queues, %d clients, lines to %d of them, %d rounds "
+           "after %d:\n", n_clients, group, rounds, warmup);
+    for (use_pool = 0; use_pool < 2; use_pool++)
+        sendqs();
+
+    pool_stats(&st);
+    printf("pool: %lu slabs (%lu KB)", st.slabs, st.slabs * POOL_SLAB / 1024);
+    for (i = 0; i < POOL_CLASSES; i++)
+        printf(", %u: %lu allocs", pool_class_size[i], st.allocs[i]);
+    printf(", %lu too big\n", st.allocs[POOL_CLASSES]);
+    return 0;
+}
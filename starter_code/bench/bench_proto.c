@@ -0,0 +1,428 @@
+/*
+ * bench_proto.c
+ *
+ * Microbenchmarks for the client protocol hot paths: irc_parse(),
+ * handle_line()'s dispatch through cmds[] to the handlers, and the
+ * reply formatting they do.
+ *
+ * irc_proto.o, channel.o, fwd.o and the small modules they use are
+ * linked in as they are; this file stands in for sircd.c, with a
+ * client table and a client_send() that only counts what it is given.
+ * One registered client, "alice", sends every line.  Nine others share
+ * her channel #bench, twenty more sit in channels of their own, and an
+ * inbound link from neighbor node 2 carries the server lines.
+ *
+ * Each case runs a corpus of lines over and over for a while, five
+ * times, and keeps the fastest run's ns per line.  Allocations per line
+ * are counted by wrapping malloc, calloc and realloc at link time.
+ *
+ * With -b, results are checked against a baseline file ("name ns/line
+ * allocs/line" per line) and the exit status is 1 if any case is more
+ * than the tolerance slower, or allocates more.  -w writes a baseline.
+ * ns/line depends on the machine, so a baseline is only good for the
+ * machine that wrote it.
+ *
+ * usage: bench_proto [-b baseline] [-w baseline] [-t tolerance_pct]
+ *                    [-f filter] [-r runs]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include "sircd.h"
+#include "irc_proto.h"
+#include "channel.h"
+#include "fwd.h"
+#include "msgbuf.h"
+
+#define NICK_HASH_SIZE 64
+#define CORPUS_MAX 16
+#define RUN_NS (20 * 1000 * 1000)
+
+/* What sircd.c would provide */
+u_long curr_nodeID = 1;
+rt_config_file_t curr_node_config_file;
+rt_config_entry_t *curr_node_config_entry;
+char server_name[MAX_SERVERNAME] = "node1";
+rt_node_t routing;
+uint64_t line_stamp;
+unsigned long clients_queued;
+unsigned long clients_drained;
+loop_stats_t loop_stats;
+
+static client *nick_hash[NICK_HASH_SIZE];
+static client *slots[MAX_CLIENTS];
+static int n_slots;
+static unsigned long sink_bytes, sink_lines;
+
+/* Allocation counting (-Wl,--wrap=malloc etc.) */
+static unsigned long allocs;
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    allocs++;
+    return __real_realloc(p, size);
+}
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t wall_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+client *client_get(int slot) {
+    return slot >= 0 && slot < n_slots ? slots[slot] : NULL;
+}
+
+client *client_by_nick(const char *nick) {
+    istr_t *is = istr_find(nick);
+    client *c;
+
+    if (!is)
+        return NULL;
+    for (c = nick_hash[is->hash % NICK_HASH_SIZE]; c; c = c->nick_next)
+        if (c->nick_key == is)
+            return c;
+    return NULL;
+}
+
+int client_set_nick(client *c, const char *nick) {
+    istr_t *is = istr_get(nick);
+    client **pp;
+
+    if (!is)
+        return -1;
+    if (c->nick_key) {
+        for (pp = &nick_hash[c->nick_key->hash % NICK_HASH_SIZE]; *pp;
+             pp = &(*pp)->nick_next) {
+            if (*pp == c) {
+                *pp = c->nick_next;
+                break;
+            }
+        }
+        istr_put(c->nick_key);
+    }
+    c->nick_key = is;
+    snprintf(c->nick, MAX_USERNAME, "%s", nick);
+    c->nick_next = nick_hash[is->hash % NICK_HASH_SIZE];
+    nick_hash[is->hash % NICK_HASH_SIZE] = c;
+    return 0;
+}
+
+void client_send(client *c, const char *buf, size_t len) {
+    irc_current->bytes_out += len;
+    sink_bytes += len;
+    sink_lines += buf[len - 1] == '\n';
+}
+
+void client_close(client *c, const char *reason) {
+    c->closing = 1;
+}
+
+client *client_connect(u_long nodeID, conn_kind_t kind) {
+    return NULL;
+}
+
+int client_fanout(client *const *to, int n, client *except,
+                  const char *buf, size_t len) {
+    int i, sent = 0;
+
+    for (i = 0; i < n; i++) {
+        if (to[i] != except) {
+            client_send(to[i], buf, len);
+            sent++;
+        }
+    }
+    return sent;
+}
+
+void client_queue(client *c, msgbuf_t *mb) {
+    client_send(c, mb->data, mb->len);
+}
+
+int client_fanout_buf(client *const *to, int n, client *except,
+                      msgbuf_t *mb) {
+    return client_fanout(to, n, except, mb->data, mb->len);
+}
+
+void client_trace(client *c, int on) {
+}
+
+unsigned long rss_bytes() {
+    return 0;
+}
+
+void client_resample(unsigned n) {
+}
+
+static int routing_send(void *ctx, u_long to, const uint8_t *buf,
+                        size_t len) {
+    return 0;
+}
+
+static void routing_local(void *ctx, lsa_t *lsa, int periodic) {
+}
+
+
+/* Setup */
+
+static client *alice, *link_in;
+
+static client *new_client(const char *nick, const char *chan) {
+    client *c = calloc(1, sizeof(client));
+
+    c->kind = CONN_CLIENT;
+    c->slot = n_slots;
+    slots[n_slots++] = c;
+    strcpy(c->user, nick);
+    c->hostname = istr_get("127.0.0.1");
+    c->realname = pool_alloc(sizeof("Bench User"));
+    strcpy(c->realname, "Bench User");
+    client_set_nick(c, nick);
+    c->registered = 1;
+    if (chan)
+        channel_join(c, chan);
+    return c;
+}
+
+static void setup() {
+    u_long nbr = 2;
+    rt_timers_t timers;
+    char nick[32], chan[32];
+    int i;
+
+    /* alice sends far faster than any flood limit; nothing refills */
+    irc_flood_init("0");
+    rt_timers_default(&timers);
+    rt_init(&routing, curr_nodeID, &nbr, 1, &timers, routing_send,
+            routing_local, NULL);
+    alice = new_client("alice", "#bench");
+    new_client("bob", "#bench");
+    for (i = 0; i < 8; i++) {
+        snprintf(nick, sizeof(nick), "member%d", i);
+        new_client(nick, "#bench");
+    }
+    for (i = 0; i < 20; i++) {
+        snprintf(nick, sizeof(nick), "other%d", i);
+        snprintf(chan, sizeof(chan), "#room%d", i);
+        new_client(nick, chan);
+    }
+    /* The neighbor's link comes from where the config says it is */
+    curr_node_config_file.entries[0].nodeID = nbr;
+    curr_node_config_file.entries[0].ipaddr = INADDR_LOOPBACK;
+    curr_node_config_file.size = 1;
+    link_in = calloc(1, sizeof(client));
+    link_in->kind = CONN_CLIENT;
+    link_in->cliaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fwd_accept_link(link_in, nbr) < 0) {
+        fprintf(stderr, "can't set up the server link\n");
+        exit(1);
+    }
+}
+
+
+/* Cases */
+
+enum { PARSE, DISPATCH };
+
+typedef struct bench_case {
+    const char *name;
+    int mode;
+    int server;                 /* lines come in on the server link */
+    const char *lines[CORPUS_MAX];
+} bench_case_t;
+
+#define LONG_TEXT \
+    "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do " \
+    "eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut enim " \
+    "ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut " \
+    "aliquip ex ea commodo consequat. Duis aute irure dolor in " \
+    "reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla " \
+    "pariatur. Excepteur sint occaecat cupidatat non proident, sunt in " \
+    "culpa qui officia deserunt mollit anim id est laborum."
+
+#define MALFORMED \
+    "", "   ", ":prefix.only", ":prefix  ", "PRIVMSG", "PRIVMSG bob", \
+    "privmsg bob :lower case", "NOSUCHCOMMAND a b c", "JOIN", \
+    "JOIN bad-channel", "PART #nosuch", "USER a b c", \
+    "NICK 9bad", ": :", "PRIVMSG  :", "WHO #nosuch"
+
+#define MAX_TOKENS \
+    "WHO #nosuch a b c d e f g h i j k l m n o p :trailing text here", \
+    "PRIVMSG bob a b c d e f g h i j :and the trailing"
+
+static bench_case_t cases[] = {
+    { "parse/short_privmsg", PARSE, 0, { "PRIVMSG bob :hi there" } },
+    { "parse/long_trailing", PARSE, 0,
+      { "PRIVMSG #bench :" LONG_TEXT } },
+    { "parse/prefixed", PARSE, 0,
+      { ":alice!alice@127.0.0.1 CMSG 2 1 #bench :hello from node 2" } },
+    { "parse/malformed", PARSE, 0, { MALFORMED } },
+    { "parse/max_tokens", PARSE, 0, { MAX_TOKENS } },
+
+    { "dispatch/short_privmsg", DISPATCH, 0, { "PRIVMSG bob :hi there" } },
+    { "dispatch/long_trailing", DISPATCH, 0,
+      { "PRIVMSG #bench :" LONG_TEXT } },
+    { "dispatch/server_cmsg", DISPATCH, 1,
+      { ":carol!carol@10.0.0.2 CMSG 2 1 #bench :hello from node 2" } },
+    { "dispatch/server_pmsg", DISPATCH, 1,
+      { ":carol!carol@10.0.0.2 PMSG 1 8 0 bob :hello from node 2" } },
+    { "dispatch/malformed", DISPATCH, 0, { MALFORMED } },
+    { "dispatch/max_tokens", DISPATCH, 0, { MAX_TOKENS } },
+
+    { "format/who", DISPATCH, 0, { "WHO #bench" } },
+    { "format/list", DISPATCH, 0, { "LIST" } },
+    { "format/join", DISPATCH, 0, { "JOIN #room0", "JOIN #bench" } },
+};
+
+#define N_CASES (sizeof(cases) / sizeof(cases[0]))
+
+typedef struct result {
+    double ns;
+    double allocs;
+} result_t;
+
+/* One pass over the corpus; returns the lines handled */
+static int pass(const bench_case_t *bc) {
+    char buf[MAX_MSG_LEN + 1], *prefix, *command, *params[MAX_MSG_TOKENS];
+    client *c = bc->server ? link_in : alice;
+    int i;
+
+    for (i = 0; i < CORPUS_MAX && bc->lines[i]; i++) {
+        strncpy(buf, bc->lines[i], MAX_MSG_LEN);
+        buf[MAX_MSG_LEN] = '\0';
+        if (bc->mode == PARSE) {
+            irc_parse(buf, &prefix, &command, params);
+        } else {
+            handle_line(c, buf);
+            irc_bulk_run();     /* as the event loop would */
+        }
+    }
+    return i;
+}
+
+static void run_case(const bench_case_t *bc, int runs, result_t *r) {
+    unsigned long lines, a0;
+    uint64_t t0, t;
+    double best = 1e18;
+    int run;
+
+    r->allocs = 0;
+    pass(bc);               /* warm up; first JOINs may allocate */
+    for (run = 0; run < runs; run++) {
+        lines = 0;
+        a0 = allocs;
+        t0 = mono_ns();
+        do {
+            lines += pass(bc);
+        } while ((t = mono_ns() - t0) < RUN_NS);
+        if ((double)t / lines < best) {
+            best = (double)t / lines;
+            r->allocs = (double)(allocs - a0) / lines;
+        }
+    }
+    r->ns = best;
+}
+
+
+/* Baselines */
+
+static int load_baseline(const char *path, const char *name, result_t *r) {
+    char line[256], n[128];
+    FILE *f = fopen(path, "r");
+    int found = 0;
+
+    if (!f) {
+        perror(path);
+        exit(2);
+    }
+    while (!found && fgets(line, sizeof(line), f))
+        found = line[0] != '#' &&
+                sscanf(line, "%127s %lf %lf", n, &r->ns, &r->allocs) == 3 &&
+                !strcmp(n, name);
+    fclose(f);
+    return found;
+}
+
+int main(int argc, char *argv[]) {
+    const char *baseline = NULL, *write_to = NULL, *filter = NULL;
+    result_t r, base;
+    double tolerance = 30;
+    int ch, runs = 5, failed = 0;
+    unsigned i;
+    FILE *out = NULL;
+
+    while ((ch = getopt(argc, argv, "b:w:t:f:r:")) != -1) {
+        switch (ch) {
+        case 'b': baseline = optarg; break;
+        case 'w': write_to = optarg; break;
+        case 't': tolerance = atof(optarg); break;
+        case 'f': filter = optarg; break;
+        case 'r': runs = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-b baseline] [-w baseline] "
+                    "[-t tolerance_pct] [-f filter] [-r runs]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (runs < 1) {
+        fprintf(stderr, "need 1+ runs\n");
+        return 2;
+    }
+    if (write_to && !(out = fopen(write_to, "w"))) {
+        perror(write_to);
+        return 2;
+    }
+    if (out)
+        fprintf(out, "# bench_proto baseline: name ns/line allocs/line\n");
+
+    setup();
+    printf("%-24s %10s %12s %s\n", "case", "ns/line", "allocs/line",
+           baseline ? "  baseline" : "");
+    for (i = 0; i < N_CASES; i++) {
+        if (filter && !strstr(cases[i].name, filter))
+            continue;
+        run_case(&cases[i], runs, &r);
+        printf("%-24s %10.1f %12.2f", cases[i].name, r.ns, r.allocs);
+        if (baseline && load_baseline(baseline, cases[i].name, &base)) {
+            int slow = r.ns > base.ns * (1 + tolerance / 100);
+            int fat = r.allocs > base.allocs + 0.005;
+            printf("  %8.1f %5.2f%s%s", base.ns, base.allocs,
+                   slow ? "  SLOWER" : "", fat ? "  MORE ALLOCS" : "");
+            failed += slow || fat;
+        } else if (baseline) {
+            printf("  (no baseline)");
+        }
+        printf("\n");
+        if (out)
+            fprintf(out, "%-24s %10.1f %8.2f\n", cases[i].name, r.ns,
+                    r.allocs);
+    }
+    if (out)
+        fclose(out);
+    if (failed)
+        printf("%d case(s) outside the baseline (tolerance %.0f%%)\n",
+               failed, tolerance);
+    return failed ? 1 : 0;
+}
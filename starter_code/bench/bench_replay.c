@@ -0,0 +1,372 @@
+/*
+ * bench_replay.c
+ *
+ * Play a traffic capture (sircd -c, see capture.h) back against a
+ * server.
+ *
+ * Every client connection in the log gets a connection of its own, and
+ * its lines are sent in log order, all connections multiplexed on one
+ * epoll loop.  By default the log is replayed as fast as the server
+ * takes it; with -t each record waits for its original offset from the
+ * start, divided by the -x speedup.  Connections that turned out to be
+ * server links (first line SERVER) are not replayed.  Unless its flood
+ * control is what is being measured, run the server with -f 0: a
+ * replay sent as fast as possible is a flood.
+ *
+ * Reports the lines and bytes sent, how long that took, the lines the
+ * server sent back, and with -t how far behind schedule records went
+ * out.  With -d the log is printed as text instead.
+ *
+ * usage: bench_replay [-t] [-x speedup] [-w wait_ms] [-d] log [ip:port]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "capture.h"
+#include "hist.h"
+
+#define CONN_HASH  4096
+#define OUT_HIGH   (1024 * 1024)    /* queued bytes before we wait */
+#define MAX_CONNECTING 64           /* so the listen backlog can't fill */
+
+typedef struct rconn {
+    uint32_t id;            /* in the log */
+    int fd;
+    int skip;               /* a server link; not replayed */
+    int connected;
+    int closing;            /* shut down once the queue is written */
+    unsigned long lines;    /* sent so far */
+    int want_out;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    struct rconn *next;     /* hash chain */
+} rconn_t;
+
+static int timed;
+static double speedup = 1;
+static int wait_ms = 500;
+static struct sockaddr_in server;
+
+static rconn_t *conn_hash[CONN_HASH];
+static int epfd;
+static int n_open, n_connecting;
+static size_t queued;       /* bytes waiting in all out queues */
+static unsigned long opened, lines, bytes, replies, skipped;
+static hist_t lateness;
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void set_out(rconn_t *c, int out) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_out = out;
+}
+
+static void shut(rconn_t *c) {
+    if (c->fd < 0)
+        return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    if (!c->connected)
+        n_connecting--;
+    queued -= c->out_len;
+    c->out_len = 0;
+    n_open--;
+}
+
+static void flush_out(rconn_t *c) {
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < c->out_len) {
+        n = write(c->fd, c->out + off, c->out_len - off);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                break;
+            shut(c);
+            return;
+        }
+        off += n;
+    }
+    memmove(c->out, c->out + off, c->out_len - off);
+    c->out_len -= off;
+    queued -= off;
+    if ((c->out_len > 0) != c->want_out)
+        set_out(c, c->out_len > 0);
+    if (c->closing && c->out_len == 0)
+        shutdown(c->fd, SHUT_WR);
+}
+
+static void drain_input(rconn_t *c) {
+    char buf[16384];
+    ssize_t n, i;
+
+    for (;;) {
+        n = read(c->fd, buf, sizeof(buf));
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (n <= 0) {
+            shut(c);
+            return;
+        }
+        for (i = 0; i < n; i++)
+            replies += buf[i] == '\n';
+    }
+}
+
+static void pump(int ms) {
+    struct epoll_event events[256];
+    int i, n;
+
+    n = epoll_wait(epfd, events, 256, ms);
+    for (i = 0; i < n; i++) {
+        rconn_t *c = events[i].data.ptr;
+        if (c->fd >= 0 && !c->connected && (events[i].events & EPOLLOUT)) {
+            c->connected = 1;
+            n_connecting--;
+        }
+        if (c->fd >= 0 && (events[i].events & EPOLLOUT))
+            flush_out(c);
+        if (c->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP)))
+            drain_input(c);
+    }
+}
+
+static rconn_t *find_conn(uint32_t id) {
+    rconn_t *c;
+
+    for (c = conn_hash[id % CONN_HASH]; c; c = c->next)
+        if (c->id == id)
+            return c;
+    return NULL;
+}
+
+/* A new connection for log connection id; connects in the background */
+static rconn_t *open_conn(uint32_t id) {
+    struct epoll_event ev;
+    rconn_t *c;
+    int one = 1;
+
+    while (n_connecting >= MAX_CONNECTING)
+        pump(10);
+    if (!(c = calloc(1, sizeof(rconn_t)))) {
+        perror("calloc");
+        exit(1);
+    }
+    c->id = id;
+    c->next = conn_hash[id % CONN_HASH];
+    conn_hash[id % CONN_HASH] = c;
+    if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&server, sizeof(server)) < 0 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        exit(1);
+    }
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    c->want_out = 1;
+    n_connecting++;
+    n_open++;
+    opened++;
+    return c;
+}
+
+static void queue_line(rconn_t *c, const char *line, size_t len) {
+    if (c->out_len + len + 2 > c->out_cap) {
+        c->out_cap = (c->out_len + len + 2) * 2;
+        if (!(c->out = realloc(c->out, c->out_cap))) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(c->out + c->out_len, line, len);
+    memcpy(c->out + c->out_len + len, "\r\n", 2);
+    c->out_len += len + 2;
+    queued += len + 2;
+    if (!c->want_out)
+        flush_out(c);
+}
+
+static void replay(const capture_rec_t *r) {
+    rconn_t *c = find_conn(r->conn);
+
+    if (r->kind == CAPTURE_OPEN) {
+        if (!c)
+            open_conn(r->conn);
+        return;
+    }
+    /* Hang up our side only, so the server's last replies still count */
+    if (r->kind == CAPTURE_CLOSE) {
+        if (c && c->fd >= 0) {
+            c->closing = 1;
+            if (c->out_len == 0 && c->connected)
+                shutdown(c->fd, SHUT_WR);
+        }
+        return;
+    }
+    /* A line; the log may have started after its connection opened */
+    if (!c)
+        c = open_conn(r->conn);
+    if (c->skip || c->fd < 0 || c->closing) {
+        skipped++;
+        return;
+    }
+    if (!c->lines && r->len >= 7 && !strncmp(r->line, "SERVER ", 7)) {
+        c->skip = 1;
+        shut(c);
+        skipped++;
+        return;
+    }
+    queue_line(c, r->line, r->len);
+    c->lines++;
+    lines++;
+    bytes += r->len + 2;
+}
+
+static void dump(const uint8_t *buf, size_t len) {
+    capture_rec_t r;
+    uint64_t t = 0;
+    size_t off;
+
+    for (off = CAPTURE_HEADER; (off = capture_next(buf, len, off, &r)); ) {
+        t += r.delta;
+        printf("%12.6f %6u ", t / 1e9, r.conn);
+        if (r.kind == CAPTURE_LINE)
+            printf("%.*s\n", (int)r.len, r.line);
+        else
+            printf("%s\n", r.kind == CAPTURE_OPEN ? "[open]" : "[close]");
+    }
+}
+
+static void set_server(const char *arg) {
+    char ip[64];
+    const char *colon = strchr(arg, ':');
+    size_t n = colon ? (size_t)(colon - arg) : strlen(arg);
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(colon ? atoi(colon + 1) : 6667);
+    if (n >= sizeof(ip)) {
+        fprintf(stderr, "bad server %s\n", arg);
+        exit(1);
+    }
+    memcpy(ip, arg, n);
+    ip[n] = '\0';
+    if (!inet_aton(ip, &server.sin_addr)) {
+        fprintf(stderr, "bad server %s\n", arg);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t started, start, due, now, t = 0, sent_at;
+    unsigned long before;
+    capture_rec_t r;
+    struct stat st;
+    uint8_t *buf;
+    size_t off;
+    int ch, fd, print = 0;
+    time_t secs;
+
+    while ((ch = getopt(argc, argv, "tx:w:d")) != -1) {
+        switch (ch) {
+        case 't': timed = 1; break;
+        case 'x': speedup = atof(optarg); break;
+        case 'w': wait_ms = atoi(optarg); break;
+        case 'd': print = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-x speedup] [-w wait_ms] [-d] "
+                    "log [ip:port]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || speedup <= 0) {
+        fprintf(stderr, "usage: %s [-t] [-x speedup] [-w wait_ms] [-d] "
+                "log [ip:port]\n", argv[0]);
+        return 1;
+    }
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED ||
+        capture_check(buf, st.st_size, &started) < 0) {
+        fprintf(stderr, "%s: not a capture log\n", argv[optind]);
+        return 1;
+    }
+    if (print) {
+        dump(buf, st.st_size);
+        return 0;
+    }
+    set_server(optind + 1 < argc ? argv[optind + 1] : "127.0.0.1:6667");
+    if ((epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    secs = started / 1000000000;
+    printf("log started %s", ctime(&secs));
+    hist_reset(&lateness);
+    start = mono_ns();
+    for (off = CAPTURE_HEADER; (off = capture_next(buf, st.st_size, off,
+                                                   &r)); ) {
+        t += r.delta;
+        if (timed) {
+            due = start + t / speedup;
+            while ((now = mono_ns()) < due)
+                pump((due - now) / 1000000);
+            hist_add(&lateness, now - due);
+        }
+        while (queued > OUT_HIGH)
+            pump(10);
+        replay(&r);
+    }
+    while (queued > 0)
+        pump(10);
+    sent_at = mono_ns();
+
+    /* Let the replies come in */
+    do {
+        before = replies;
+        pump(wait_ms);
+    } while (replies != before && n_open > 0);
+
+    printf("%lu connections, %lu lines (%lu skipped), %lu bytes in "
+           "%.3f s: %.0f lines/s\n", opened, lines, skipped, bytes,
+           (sent_at - start) / 1e9,
+           lines / ((sent_at - start) / 1e9 + 1e-9));
+    printf("%lu lines back from the server\n", replies);
+    if (timed)
+        printf("behind schedule ms p50 %.3f p99 %.3f max %.3f "
+               "(log spans %.3f s)\n", hist_percentile(&lateness, 0.5) / 1e6,
+               hist_percentile(&lateness, 0.99) / 1e6, lateness.max / 1e6,
+               t / 1e9);
+    return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * bench_resync.c
+ *
+ * Database resync after a netsplit heals: Merkle diff against a full
+ * dump.
+ *
+ * Two routing nodes, 1 and 2, are neighbors across the split.  Both
+ * start with the same database of n synthetic LSAs (nodes 3..n+2, with
+ * links and a few users each).  During the split d of those nodes
+ * changed, half of them on each side, so each side holds newer copies
+ * the other is missing.  The link then comes back up and packets are
+ * passed between the two until neither has anything more to say.
+ * Reports the routing bytes and packets exchanged, the round trips
+ * (delivery rounds) it took, CPU time, and whether the two databases
+ * ended up identical.
+ *
+ * usage: bench_resync [-n nodes] [-u users_per_node] [-s seed]
+ *                     [-d divergence[,divergence...]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "lsdb.h"
+#include "routing.h"
+#include "topo.h"
+
+#define MAX_DIVERGENCE 64
+
+/* A datagram in flight */
+typedef struct pkt {
+    u_long from, to;
+    size_t len;
+    struct pkt *next;
+    uint8_t data[];
+} pkt_t;
+
+static int n_nodes = 5000;
+static int n_users = 4;
+static topo_t topo;
+
+static pkt_t *queue, **queue_tail = &queue;
+static unsigned long bytes, packets;
+
+typedef struct node_ctx {
+    u_long self;
+} node_ctx_t;
+
+static int send_pkt(void *ctx, u_long to, const uint8_t *buf, size_t len) {
+    pkt_t *p = malloc(sizeof(pkt_t) + len);
+
+    if (!p)
+        return -1;
+    p->from = ((node_ctx_t *)ctx)->self;
+    p->to = to;
+    p->len = len;
+    p->next = NULL;
+    memcpy(p->data, buf, len);
+    *queue_tail = p;
+    queue_tail = &p->next;
+    bytes += len;
+    packets++;
+    return 0;
+}
+
+/* LSA for synthetic node i (nodeID i + 3) */
+static lsa_t *make_lsa(int i, uint32_t seq) {
+    char names[n_users][16];
+    char *users[n_users];
+    lsa_t *lsa = topo_lsa(&topo, i, seq);
+    int j;
+
+    for (j = 0; j < n_users; j++) {
+        snprintf(names[j], sizeof(names[j]), "u%d_%d_%u", i, j, seq);
+        users[j] = names[j];
+    }
+    lsa->sender = i + 3;
+    for (j = 0; j < lsa->n_links; j++)
+        lsa->links[j] += 2;
+    lsa_set_names(lsa, users, n_users, NULL, 0);
+    return lsa;
+}
+
+static void fill(rt_node_t *rt, const int *changed, int n_changed) {
+    int i;
+
+    for (i = 0; i < n_nodes; i++)
+        lsdb_update(&rt->db, make_lsa(i, 1));
+    for (i = 0; i < n_changed; i++)
+        lsdb_update(&rt->db, make_lsa(changed[i], 2));
+}
+
+static int same_db(const lsdb_t *a, const lsdb_t *b) {
+    int i;
+
+    if (a->size != b->size)
+        return 0;
+    for (i = 0; i < a->size; i++) {
+        lsa_t *other = lsdb_find(b, a->entries[i]->sender);
+        if (!other || other->seq != a->entries[i]->seq)
+            return 0;
+    }
+    return 1;
+}
+
+static void run(int divergence, int full_sync) {
+    static node_ctx_t ctx[2] = { { 1 }, { 2 } };
+    int changed[2][divergence / 2 + 1], n_changed[2] = { 0, 0 };
+    u_long nbr[2] = { 2, 1 };
+    rt_node_t rt[2];
+    rt_timers_t timers;
+    struct timespec t0, t1;
+    uint64_t now = 1000;
+    int i, rounds = 0;
+    double ms;
+
+    /* Distinct nodes, alternating sides */
+    srand(divergence);
+    while (n_changed[0] + n_changed[1] < divergence) {
+        int side = (n_changed[0] + n_changed[1]) & 1;
+        int node = rand() % n_nodes, j, dup = 0;
+        for (i = 0; i < 2; i++)
+            for (j = 0; j < n_changed[i]; j++)
+                dup |= changed[i][j] == node;
+        if (!dup)
+            changed[side][n_changed[side]++] = node;
+    }
+
+    rt_timers_default(&timers);
+    for (i = 0; i < 2; i++) {
+        rt_init(&rt[i], i + 1, &nbr[i], 1, &timers, send_pkt, NULL, &ctx[i]);
+        rt[i].full_sync = full_sync;
+        fill(&rt[i], changed[i], n_changed[i]);
+    }
+    bytes = packets = 0;
+
+    /* The split heals: each side hears the other's fresh LSA */
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t0);
+    rt_tick(&rt[0], now);
+    rt_tick(&rt[1], now);
+    while (queue) {
+        pkt_t *batch = queue, *p;
+
+        queue = NULL;
+        queue_tail = &queue;
+        rounds++;
+        now++;
+        while ((p = batch) != NULL) {
+            batch = p->next;
+            rt_recv(&rt[p->to - 1], p->from, p->data, p->len, now);
+            free(p);
+        }
+        rt_tick(&rt[0], now);
+        rt_tick(&rt[1], now);
+    }
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
+    ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+    printf("%8d  %-6s  %9lu  %7lu  %6d  %8.2f  %s\n", divergence,
+           full_sync ? "full" : "merkle", bytes, packets, rounds, ms,
+           same_db(&rt[0].db, &rt[1].db) ? "yes" : "NO");
+
+    for (i = 0; i < 2; i++)
+        rt_destroy(&rt[i]);
+}
+
+int main(int argc, char *argv[]) {
+    int divergence[MAX_DIVERGENCE] = { 0, 1, 10, 100, 1000 };
+    int n_div = 5, ch, i;
+    unsigned seed = 1;
+    char *s;
+
+    while ((ch = getopt(argc, argv, "n:u:s:d:")) != -1) {
+        switch (ch) {
+        case 'n': n_nodes = atoi(optarg); break;
+        case 'u': n_users = atoi(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        case 'd':
+            for (n_div = 0, s = strtok(optarg, ","); s && n_div <
+                 MAX_DIVERGENCE; s = strtok(NULL, ","))
+                divergence[n_div++] = atoi(s);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n nodes] [-u users] [-s seed] "
+                    "[-d divergence,...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n_nodes < 2 || n_users < 0) {
+        fprintf(stderr, "need at least 2 nodes\n");
+        return 1;
+    }
+    for (i = 0; i < n_div; i++) {
+        if (divergence[i] < 0 || divergence[i] > n_nodes) {
+            fprintf(stderr, "divergence must be 0..%d\n", n_nodes);
+            return 1;
+        }
+    }
+
+    srand(seed);
+    topo_random(&topo, n_nodes, 1);
+    printf("nodes %d  users/node %d  seed %u\n", n_nodes, n_users, seed);
+    printf("diverged  sync      bytes  packets  rounds   cpu ms  same\n");
+    for (i = 0; i < n_div; i++) {
+        run(divergence[i], 1);
+        run(divergence[i], 0);
+    }
+
+    topo_free(&topo);
+    return 0;
+}
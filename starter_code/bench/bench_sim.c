@@ -0,0 +1,348 @@
+/*
+ * bench_sim.c
+ *
+ * Whole-network simulation: hundreds of routing nodes in one process,
+ * on the simulator's virtual clock (sim.h), instead of a sircd per node
+ * waiting out real timers.
+ *
+ * Builds a random topology, joins every node to a few random channels
+ * and cold starts the network with the default timers.  Then reports:
+ *
+ *   convergence  virtual time until every node has every other node's
+ *                latest LSA, and until the network goes quiet, with
+ *                the routing packets and bytes it took
+ *   spf          the cost of one SPF run on every node
+ *   multicast    channel messages relayed hop by hop, every node
+ *                deciding from its own database: link copies per
+ *                message against a unicast copy per member node, any
+ *                duplicate or missed deliveries, and how many of the
+ *                pruned trees came from the nodes' caches (mcast.h)
+ *   unicast      random node pairs routed hop by hop with rt_nexthop():
+ *                mean hops against the shortest path, and failures
+ *
+ * With -f, that many random nodes then fail, and the same is reported
+ * again once the survivors have noticed and reconverged; reconvergence
+ * is timed from the first node noticing (after neighbor_timeout).
+ *
+ * Everything but the CPU times depends only on the options and the
+ * seed; the fingerprint at the end (over every node's database hash and
+ * the packet counts) makes it easy to check two runs behaved the same.
+ *
+ * usage: bench_sim [-n nodes] [-d extra_links] [-c channels]
+ *                  [-j joins_per_node] [-m messages] [-f failures]
+ *                  [-L latency_ms] [-J jitter_ms] [-l loss_pct] [-s seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "lsdb.h"
+#include "spf.h"
+#include "mcast.h"
+#include "routing.h"
+#include "topo.h"
+#include "sim.h"
+
+#define LIMIT (30 * 60 * 1000)  /* ms of virtual time per phase */
+
+static int n_nodes = 200;
+static int extra = 2;
+static int n_channels = 50;
+static int joins = 3;
+static int n_msgs = 2000;
+static int n_fail = 0;
+static int latency = 5;
+static int jitter = 0;
+static int loss_pct = 0;
+static unsigned seed = 1;
+
+static topo_t topo;
+static sim_t sim;
+static mcast_cache_t *caches;   /* one per node */
+static char **names;            /* channel names */
+
+static double cpu_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int is_member(int node, int chan) {
+    int i;
+    for (i = 0; i < sim.nodes[node].n_chans; i++)
+        if (!strcmp(sim.nodes[node].chans[i], names[chan]))
+            return 1;
+    return 0;
+}
+
+/* A random live node, or a random live member of chan if chan >= 0 */
+static int pick(int chan) {
+    int tries;
+
+    for (tries = 0; tries < 100 * n_nodes; tries++) {
+        int i = rand() % n_nodes;
+        if (sim.nodes[i].up && (chan < 0 || is_member(i, chan)))
+            return i;
+    }
+    return -1;
+}
+
+/* Hops from every live node to dest over the live topology */
+static void distances(int dest, int *dist) {
+    int queue[n_nodes], head = 0, tail = 0, i;
+
+    for (i = 0; i < n_nodes; i++)
+        dist[i] = -1;
+    dist[dest] = 0;
+    queue[tail++] = dest;
+    while (head < tail) {
+        int u = queue[head++];
+        for (i = 0; i < n_nodes; i++) {
+            if (TOPO_ADJ(&topo, u, i) && sim.nodes[i].up && dist[i] < 0) {
+                dist[i] = dist[u] + 1;
+                queue[tail++] = i;
+            }
+        }
+    }
+}
+
+static void converge(const char *what, uint64_t since) {
+    sim_stats_t before = sim.stats;
+    uint64_t consistent, quiet;
+    double t0 = cpu_ms();
+
+    quiet = sim_settle(&sim, sim.now + LIMIT, &consistent);
+    if (!quiet) {
+        printf("%-12s did not settle within %d s\n", what, LIMIT / 1000);
+        return;
+    }
+    printf("%-12s consistent +%lu ms, quiet +%lu ms, %lu packets "
+           "(%lu adverts, %lu acks, %lu sync, %lu lost), %lu bytes, "
+           "%.0f ms cpu\n", what, (unsigned long)(consistent - since),
+           (unsigned long)(quiet - since), sim.stats.packets - before.packets,
+           sim.stats.adverts - before.adverts, sim.stats.acks - before.acks,
+           sim.stats.sync - before.sync, sim.stats.lost - before.lost,
+           sim.stats.bytes - before.bytes, cpu_ms() - t0);
+}
+
+static void spf_cost() {
+    unsigned long runs = spf_runs;
+    double t0 = cpu_ms(), ms;
+    int i, up = 0;
+
+    for (i = 0; i < n_nodes; i++) {
+        if (!sim.nodes[i].up)
+            continue;
+        sim.nodes[i].rt.spf_valid = 0;
+        rt_routes(&sim.nodes[i].rt);
+        up++;
+    }
+    ms = cpu_ms() - t0;
+    printf("%-12s %lu runs, %.1f us/run, %.1f ms for the network\n", "spf",
+           spf_runs - runs, up ? 1000 * ms / up : 0.0, ms);
+}
+
+/*
+ * Relay messages down the multicast trees, each node using its own
+ * database, as the servers would.
+ */
+static void multicast() {
+    unsigned long copies = 0, unicast = 0, dups = 0, missed = 0, sent = 0;
+    unsigned long runs = spf_runs, hits = 0, misses = 0;
+    u_long hops[MCAST_MAX_HOPS];
+    int queue[n_nodes], seen[n_nodes], dist[n_nodes];
+    int m, i, n, chan, src, head, tail;
+    double t0 = cpu_ms();
+
+    for (m = 0; m < n_msgs; m++) {
+        chan = rand() % n_channels;
+        if ((src = pick(chan)) < 0)
+            continue;
+        sent++;
+        memset(seen, 0, sizeof(seen));
+        head = tail = 0;
+        queue[tail++] = src;
+        seen[src] = 1;
+        while (head < tail) {
+            int at = queue[head++];
+            n = mcast_next_hops(&caches[at], &sim.nodes[at].rt.db, src + 1,
+                                at + 1, names[chan], hops, MCAST_MAX_HOPS);
+            for (i = 0; i < n; i++) {
+                int to = hops[i] - 1;
+                copies++;
+                if (!sim.nodes[to].up)
+                    continue;
+                if (seen[to]++) {
+                    dups++;
+                    continue;
+                }
+                queue[tail++] = to;
+            }
+        }
+        distances(src, dist);
+        for (i = 0; i < n_nodes; i++) {
+            if (i == src || dist[i] < 0 || !is_member(i, chan))
+                continue;
+            unicast += dist[i];
+            missed += !seen[i];
+        }
+    }
+    for (i = 0; i < n_nodes; i++) {
+        hits += caches[i].hits;
+        misses += caches[i].misses;
+        caches[i].hits = caches[i].misses = 0;
+    }
+    printf("%-12s %lu msgs, %.2f links/msg (unicast %.2f), %lu duplicates, "
+           "%lu missed, %.0f ms cpu\n", "multicast", sent,
+           sent ? (double)copies / sent : 0,
+           sent ? (double)unicast / sent : 0, dups, missed, cpu_ms() - t0);
+    printf("%-12s pruned trees %lu cached, %lu worked out; %lu spf runs\n",
+           "", hits, misses, spf_runs - runs);
+}
+
+/* Route random pairs hop by hop, each node using its own next hops */
+static void unicast() {
+    unsigned long hops = 0, shortest = 0, sent = 0, failed = 0;
+    int dist[n_nodes];
+    int m, src, dst, at, n;
+    u_long hop;
+
+    for (m = 0; m < n_msgs; m++) {
+        if ((src = pick(-1)) < 0 || (dst = pick(-1)) < 0 || src == dst)
+            continue;
+        distances(dst, dist);
+        if (dist[src] < 0)
+            continue;
+        sent++;
+        shortest += dist[src];
+        for (at = src, n = 0; at != dst && n <= n_nodes; n++) {
+            if (rt_nexthop(&sim.nodes[at].rt, dst + 1, m, &hop) < 0 ||
+                !sim.nodes[hop - 1].up)
+                break;
+            at = hop - 1;
+        }
+        if (at != dst)
+            failed++;
+        else
+            hops += n;
+    }
+    printf("%-12s %lu msgs, %.2f hops (shortest %.2f), %lu undeliverable\n",
+           "unicast", sent, sent - failed ? (double)hops / (sent - failed) : 0,
+           sent ? (double)shortest / sent : 0, failed);
+}
+
+static uint64_t fingerprint() {
+    uint64_t h = sim.stats.packets * 0x9e3779b97f4a7c15ULL ^ sim.stats.bytes;
+    int i;
+
+    for (i = 0; i < n_nodes; i++)
+        h = (h ^ lsdb_merkle(&sim.nodes[i].rt.db, 0, 0)) *
+            0x100000001b3ULL;
+    return h;
+}
+
+int main(int argc, char *argv[]) {
+    rt_timers_t timers;
+    char buf[32];
+    double t0 = cpu_ms();
+    uint64_t failed_at;
+    int ch, i, j, stale, links = 0;
+
+    while ((ch = getopt(argc, argv, "n:d:c:j:m:f:L:J:l:s:")) != -1) {
+        switch (ch) {
+        case 'n': n_nodes = atoi(optarg); break;
+        case 'd': extra = atoi(optarg); break;
+        case 'c': n_channels = atoi(optarg); break;
+        case 'j': joins = atoi(optarg); break;
+        case 'm': n_msgs = atoi(optarg); break;
+        case 'f': n_fail = atoi(optarg); break;
+        case 'L': latency = atoi(optarg); break;
+        case 'J': jitter = atoi(optarg); break;
+        case 'l': loss_pct = atoi(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-n nodes] [-d extra] [-c channels] "
+                    "[-j joins] [-m messages] [-f failures] [-L latency_ms] "
+                    "[-J jitter_ms] [-l loss_pct] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n_nodes < 2 || n_channels < 1 || joins < 0 || n_fail < 0 ||
+        n_fail >= n_nodes || latency < 0 || jitter < 0 || loss_pct < 0 ||
+        loss_pct > 100) {
+        fprintf(stderr, "bad options\n");
+        return 1;
+    }
+
+    srand(seed);
+    topo_random(&topo, n_nodes, extra);
+    for (i = 0; i < n_nodes; i++)
+        for (j = i + 1; j < n_nodes; j++)
+            links += TOPO_ADJ(&topo, i, j);
+
+    rt_timers_default(&timers);
+    if (sim_init(&sim, &topo, &timers, seed) < 0) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    sim.latency = latency;
+    sim.jitter = jitter;
+    sim.loss_pct = loss_pct;
+
+    names = malloc(n_channels * sizeof(char *));
+    for (i = 0; i < n_channels; i++) {
+        snprintf(buf, sizeof(buf), "#chan%d", i);
+        names[i] = strdup(buf);
+    }
+    for (i = 0; i < n_nodes; i++)
+        for (j = 0; j < joins; j++)
+            sim_join(&sim, i, names[rand() % n_channels]);
+    caches = malloc(n_nodes * sizeof(mcast_cache_t));
+    for (i = 0; i < n_nodes; i++)
+        mcast_init(&caches[i]);
+
+    printf("nodes %d  links %d  channels %d  joins/node %d  latency %d+%d ms"
+           "  loss %d%%  seed %u\n", n_nodes, links, n_channels, joins,
+           latency, jitter, loss_pct, seed);
+    converge("cold start", 0);
+    spf_cost();
+    multicast();
+    unicast();
+
+    if (n_fail > 0) {
+        for (i = 0; i < n_fail; i++) {
+            j = rand() % n_nodes;
+            if (!sim.nodes[j].up)
+                i--;
+            sim_fail(&sim, j);
+        }
+        failed_at = sim.now;
+        stale = sim_stale_links(&sim);
+        while (sim_stale_links(&sim) == stale &&
+               sim_step(&sim, failed_at + LIMIT))
+            ;
+        printf("-- %d nodes fail at %lu ms, first noticed +%lu ms\n",
+               n_fail, (unsigned long)failed_at,
+               (unsigned long)(sim.now - failed_at));
+        converge("reconverge", sim.now);
+        spf_cost();
+        multicast();
+        unicast();
+    }
+
+    printf("virtual time %.1f s, cpu %.2f s, fingerprint %016llx\n",
+           sim.now / 1000.0, (cpu_ms() - t0) / 1000,
+           (unsigned long long)fingerprint());
+
+    for (i = 0; i < n_nodes; i++)
+        mcast_destroy(&caches[i]);
+    free(caches);
+    sim_destroy(&sim);
+    for (i = 0; i < n_channels; i++)
+        free(names[i]);
+    free(names);
+    topo_free(&topo);
+    return 0;
+}
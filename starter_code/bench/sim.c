@@ -0,0 +1,337 @@
+/*
+ * sim.c
+ *
+ * In-process routing simulation shared by the benchmarks.  See sim.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+
+
+/* Randomness */
+
+/* xorshift64*, so runs don't depend on what else calls rand() */
+uint32_t sim_rand(sim_t *s) {
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return (s->rng * 2685821657736338717ULL) >> 32;
+}
+
+
+/* The network */
+
+static int earlier(const sim_pkt_t *a, const sim_pkt_t *b) {
+    return a->at < b->at || (a->at == b->at && a->id < b->id);
+}
+
+static int heap_push(sim_t *s, sim_pkt_t *p) {
+    int i;
+
+    if (s->heap_len == s->heap_cap) {
+        int cap = s->heap_cap ? s->heap_cap * 2 : 1024;
+        sim_pkt_t **heap = realloc(s->heap, cap * sizeof(sim_pkt_t *));
+        if (!heap)
+            return -1;
+        s->heap = heap;
+        s->heap_cap = cap;
+    }
+    for (i = s->heap_len++; i > 0 && earlier(p, s->heap[(i - 1) / 2]);
+         i = (i - 1) / 2)
+        s->heap[i] = s->heap[(i - 1) / 2];
+    s->heap[i] = p;
+    return 0;
+}
+
+static sim_pkt_t *heap_pop(sim_t *s) {
+    sim_pkt_t *top = s->heap[0], *last = s->heap[--s->heap_len];
+    int i = 0, c;
+
+    while ((c = 2 * i + 1) < s->heap_len) {
+        if (c + 1 < s->heap_len && earlier(s->heap[c + 1], s->heap[c]))
+            c++;
+        if (!earlier(s->heap[c], last))
+            break;
+        s->heap[i] = s->heap[c];
+        i = c;
+    }
+    s->heap[i] = last;
+    return top;
+}
+
+static int send_pkt(void *ctx, u_long to, const uint8_t *buf, size_t len) {
+    sim_node_t *from = ctx;
+    sim_t *s = from->sim;
+    sim_pkt_t *p;
+    u_long sender;
+    uint32_t seq;
+    int type;
+
+    s->stats.packets++;
+    s->stats.bytes += len;
+    if (lsa_peek(buf, len, &type, &sender, &seq) == 0) {
+        if (type == LSA_TYPE_ADVERT)
+            s->stats.adverts++;
+        else if (type == LSA_TYPE_ACK || type == LSA_TYPE_ACKS)
+            s->stats.acks++;
+        else
+            s->stats.sync++;
+    }
+    if (to < 1 || to > (u_long)s->n)
+        return -1;
+    if (s->loss_pct && (int)(sim_rand(s) % 100) < s->loss_pct) {
+        s->stats.lost++;
+        return 0;
+    }
+    if (!(p = malloc(sizeof(sim_pkt_t) + len)))
+        return -1;
+    p->at = s->now + s->latency +
+            (s->jitter ? sim_rand(s) % (s->jitter + 1) : 0);
+    p->id = s->next_id++;
+    p->from = from->index;
+    p->to = to - 1;
+    p->len = len;
+    memcpy(p->data, buf, len);
+    if (heap_push(s, p) < 0) {
+        free(p);
+        return -1;
+    }
+    return 0;
+}
+
+/* Our LSA lists the channels joined on this node */
+static void local_lsa(void *ctx, lsa_t *lsa, int periodic) {
+    sim_node_t *node = ctx;
+
+    (void)periodic;
+    lsa_set_names(lsa, NULL, 0, node->chans, node->n_chans);
+}
+
+
+/* Setup */
+
+int sim_init(sim_t *s, const topo_t *topo, const rt_timers_t *timers,
+             unsigned seed) {
+    u_long links[topo->n];
+    int i, n;
+
+    memset(s, 0, sizeof(*s));
+    s->topo = topo;
+    s->n = topo->n;
+    s->latency = 1;
+    s->rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+    if (!(s->nodes = calloc(s->n, sizeof(sim_node_t))))
+        return -1;
+    for (i = 0; i < s->n; i++) {
+        sim_node_t *node = &s->nodes[i];
+        n = topo_links(topo, i, links);
+        node->sim = s;
+        node->index = i;
+        node->up = 1;
+        if (rt_init(&node->rt, i + 1, links, n, timers, send_pkt, local_lsa,
+                    node) < 0) {
+            sim_destroy(s);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void sim_destroy(sim_t *s) {
+    int i, j;
+
+    while (s->heap_len > 0)
+        free(heap_pop(s));
+    free(s->heap);
+    for (i = 0; s->nodes && i < s->n; i++) {
+        for (j = 0; j < s->nodes[i].n_chans; j++)
+            free(s->nodes[i].chans[j]);
+        free(s->nodes[i].chans);
+        rt_destroy(&s->nodes[i].rt);
+    }
+    free(s->nodes);
+    memset(s, 0, sizeof(*s));
+}
+
+int sim_join(sim_t *s, int node, const char *chan) {
+    sim_node_t *nd = &s->nodes[node];
+    char **chans;
+    int i;
+
+    for (i = 0; i < nd->n_chans; i++)
+        if (!strcmp(nd->chans[i], chan))
+            return 0;
+    chans = realloc(nd->chans, (nd->n_chans + 1) * sizeof(char *));
+    if (!chans)
+        return -1;
+    nd->chans = chans;
+    if (!(nd->chans[nd->n_chans] = strdup(chan)))
+        return -1;
+    nd->n_chans++;
+    rt_local_changed(&nd->rt);
+    return 0;
+}
+
+/* node stops dead: its packets in flight are lost with it */
+void sim_fail(sim_t *s, int node) {
+    s->nodes[node].up = 0;
+}
+
+
+/* Running */
+
+/*
+ * Advance to the next event, but not past until: deliver everything
+ * due, then run the timers of every node that got packets or is due.
+ * Returns 0 once there is nothing left to do before until.
+ */
+int sim_step(sim_t *s, uint64_t until) {
+    uint64_t next = UINT64_MAX, d;
+    sim_pkt_t *p;
+    int i;
+
+    if (s->heap_len > 0)
+        next = s->heap[0]->at;
+    for (i = 0; i < s->n; i++)
+        if (s->nodes[i].up &&
+            (d = rt_next_deadline(&s->nodes[i].rt, s->now)) < next)
+            next = d;
+    if (next > until) {
+        s->now = until;
+        return 0;
+    }
+    if (next > s->now)
+        s->now = next;
+
+    while (s->heap_len > 0 && s->heap[0]->at <= s->now) {
+        p = heap_pop(s);
+        if (s->nodes[p->to].up && s->nodes[p->from].up) {
+            rt_recv(&s->nodes[p->to].rt, p->from + 1, p->data, p->len,
+                    s->now);
+            s->nodes[p->to].touched = 1;
+        }
+        free(p);
+    }
+    for (i = 0; i < s->n; i++) {
+        sim_node_t *node = &s->nodes[i];
+        if (!node->up)
+            continue;
+        if (node->touched || rt_next_deadline(&node->rt, s->now) <= s->now)
+            rt_tick(&node->rt, s->now);
+        node->touched = 0;
+    }
+    return 1;
+}
+
+void sim_run_until(sim_t *s, uint64_t until) {
+    while (sim_step(s, until))
+        ;
+}
+
+
+/* Checks */
+
+/* Which component of the live topology each node is in, -1 if down */
+void sim_components(const sim_t *s, int *comp) {
+    int stack[s->n];
+    int i, j, top, c = 0;
+
+    for (i = 0; i < s->n; i++)
+        comp[i] = -1;
+    for (i = 0; i < s->n; i++) {
+        if (!s->nodes[i].up || comp[i] >= 0)
+            continue;
+        comp[i] = c;
+        stack[0] = i;
+        top = 1;
+        while (top > 0) {
+            int u = stack[--top];
+            for (j = 0; j < s->n; j++) {
+                if (TOPO_ADJ(s->topo, u, j) && s->nodes[j].up &&
+                    comp[j] < 0) {
+                    comp[j] = c;
+                    stack[top++] = j;
+                }
+            }
+        }
+        c++;
+    }
+}
+
+/* Does every live node have the latest LSA of every node it reaches? */
+int sim_consistent(const sim_t *s, const int *comp) {
+    int i, j;
+
+    for (i = 0; i < s->n; i++) {
+        if (comp[i] < 0)
+            continue;
+        for (j = 0; j < s->n; j++) {
+            lsa_t *lsa;
+            if (j == i || comp[j] != comp[i])
+                continue;
+            lsa = lsdb_find(&s->nodes[i].rt.db, j + 1);
+            if (!lsa || lsa->seq != s->nodes[j].rt.last_originated)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* Links from live nodes to dead neighbors they haven't noticed yet */
+int sim_stale_links(const sim_t *s) {
+    int i, j, n = 0;
+
+    for (i = 0; i < s->n; i++) {
+        const rt_node_t *rt = &s->nodes[i].rt;
+        if (!s->nodes[i].up)
+            continue;
+        for (j = 0; j < rt->n_nbrs; j++)
+            n += rt->nbrs[j].alive && !s->nodes[rt->nbrs[j].nodeID - 1].up;
+    }
+    return n;
+}
+
+/*
+ * Nothing in flight, nothing due, nothing waiting for an ack or held
+ * back by lsa_hold, and no live node still thinks a dead neighbor is up.
+ */
+int sim_quiet(const sim_t *s) {
+    int i, j;
+
+    if (s->heap_len > 0 || sim_stale_links(s) > 0)
+        return 0;
+    for (i = 0; i < s->n; i++) {
+        const rt_node_t *rt = &s->nodes[i].rt;
+        if (!s->nodes[i].up)
+            continue;
+        if (rt->local_dirty || rt_next_deadline(rt, s->now) <= s->now)
+            return 0;
+        for (j = 0; j < rt->n_nbrs; j++)
+            if (rt->nbrs[j].rexmit)
+                return 0;
+    }
+    return 1;
+}
+
+/*
+ * Run until the network is consistent and quiet, or until limit.
+ * Returns the time it went quiet, 0 if it never did; *consistent_at
+ * gets the time the databases last became consistent.
+ */
+uint64_t sim_settle(sim_t *s, uint64_t limit, uint64_t *consistent_at) {
+    int comp[s->n];
+
+    sim_components(s, comp);
+    *consistent_at = 0;
+    for (;;) {
+        if (!sim_consistent(s, comp))
+            *consistent_at = 0;
+        else if (!*consistent_at)
+            *consistent_at = s->now;
+        if (*consistent_at && sim_quiet(s))
+            return s->now;
+        if (!sim_step(s, limit))
+            return 0;
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include "routing.h"
+#include "topo.h"
+
+/*
+ * In-process simulation of many routing nodes.
+ *
+ * One rt_node_t per node of a topology, wired together by an in-memory
+ * network.  Every datagram takes latency plus up to jitter ms to arrive
+ * and is lost with probability loss_pct.  Time is virtual: each step
+ * jumps straight to the next delivery or routing timer, so minutes of
+ * protocol time with the real timer values take as long as the work
+ * done in them.  All randomness (jitter, loss) comes from the sim's own
+ * generator, so a run is repeatable from its seed.
+ *
+ * A node that is down neither sends nor receives, and its timers stop.
+ */
+
+typedef struct sim_pkt {
+    uint64_t at;            /* delivery time */
+    unsigned long id;       /* keeps equal times in send order */
+    int from, to;           /* node indices */
+    size_t len;
+    uint8_t data[];
+} sim_pkt_t;
+
+typedef struct sim_node {
+    struct sim *sim;
+    int index;              /* nodeID - 1 */
+    int up;
+    int touched;            /* received something this step */
+    char **chans;           /* channels with members here */
+    int n_chans;
+    rt_node_t rt;
+} sim_node_t;
+
+typedef struct sim_stats {
+    unsigned long packets;  /* sent, including lost ones */
+    unsigned long bytes;
+    unsigned long adverts;
+    unsigned long acks;
+    unsigned long sync;     /* DIGEST and LEAVES */
+    unsigned long lost;
+} sim_stats_t;
+
+typedef struct sim {
+    const topo_t *topo;
+    int n;
+    sim_node_t *nodes;
+    uint64_t now;           /* ms */
+    int latency;            /* ms */
+    int jitter;             /* ms */
+    int loss_pct;
+    uint64_t rng;
+    sim_pkt_t **heap;       /* datagrams in flight, by delivery time */
+    int heap_len;
+    int heap_cap;
+    unsigned long next_id;
+    sim_stats_t stats;
+} sim_t;
+
+int sim_init(sim_t *s, const topo_t *topo, const rt_timers_t *timers,
+             unsigned seed);
+void sim_destroy(sim_t *s);
+uint32_t sim_rand(sim_t *s);
+int sim_join(sim_t *s, int node, const char *chan);
+void sim_fail(sim_t *s, int node);
+int sim_step(sim_t *s, uint64_t until);
+void sim_run_until(sim_t *s, uint64_t until);
+void sim_components(const sim_t *s, int *comp);
+int sim_consistent(const sim_t *s, const int *comp);
+int sim_stale_links(const sim_t *s);
+int sim_quiet(const sim_t *s);
+uint64_t sim_settle(sim_t *s, uint64_t limit, uint64_t *consistent_at);
+
+#endif /* _SIM_H_ */
@@ -0,0 +1,60 @@
+/*
+ * topo.c
+ *
+ * Topology generators shared by the benchmarks.
+ */
+
+#include <stdlib.h>
+#include "topo.h"
+
+/*
+ * A random spanning tree, to keep it connected, plus extra random links
+ * per node to give it alternative paths.  Uses rand(); seed it first.
+ */
+int topo_random(topo_t *t, int n, int extra) {
+    int i, j, k;
+
+    t->n = n;
+    t->adj = calloc((size_t)n * n, 1);
+    if (!t->adj)
+        return -1;
+    for (i = 1; i < n; i++) {
+        j = rand() % i;
+        TOPO_ADJ(t, i, j) = TOPO_ADJ(t, j, i) = 1;
+    }
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < extra; k++) {
+            j = rand() % n;
+            if (j != i)
+                TOPO_ADJ(t, i, j) = TOPO_ADJ(t, j, i) = 1;
+        }
+    }
+    return 0;
+}
+
+void topo_free(topo_t *t) {
+    free(t->adj);
+    t->adj = NULL;
+    t->n = 0;
+}
+
+/* The nodeIDs of node i's neighbors; links[] needs room for t->n */
+int topo_links(const topo_t *t, int i, u_long *links) {
+    int j, n = 0;
+    for (j = 0; j < t->n; j++)
+        if (TOPO_ADJ(t, i, j))
+            links[n++] = j + 1;
+    return n;
+}
+
+/* An LSA for node i listing its links and nothing else */
+lsa_t *topo_lsa(const topo_t *t, int i, uint32_t seq) {
+    u_long links[t->n];
+    lsa_t *lsa = lsa_new(i + 1, seq);
+
+    if (lsa && lsa_set_links(lsa, links, topo_links(t, i, links)) < 0) {
+        lsa_free(lsa);
+        return NULL;
+    }
+    return lsa;
+}
@@ -0,0 +1,23 @@
+#ifndef _TOPO_H_
+#define _TOPO_H_
+
+#include "lsdb.h"
+
+/*
+ * Generated topologies for the benchmarks.  Node i of the topology is
+ * nodeID i + 1.
+ */
+
+typedef struct topo {
+    int n;
+    unsigned char *adj;     /* n * n adjacency matrix */
+} topo_t;
+
+#define TOPO_ADJ(t, a, b) ((t)->adj[(a) * (t)->n + (b)])
+
+int topo_random(topo_t *t, int n, int extra);
+void topo_free(topo_t *t);
+int topo_links(const topo_t *t, int i, u_long *links);
+lsa_t *topo_lsa(const topo_t *t, int i, uint32_t seq);
+
+#endif /* _TOPO_H_ */
@@ -0,0 +1,221 @@
+/*
+ * capture.c
+ *
+ * Append-only, memory mapped log of client traffic.  See capture.h.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "debug.h"
+#include "capture.h"
+
+#define MAX_VARINT 10
+
+int capture_enabled;
+
+static int fd = -1;
+static uint8_t *map;            /* the window being written */
+static off_t map_off;           /* its offset in the file */
+static off_t file_len;
+static off_t pos;               /* where the next record goes */
+static uint64_t last_ns;
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+/* Returns the bytes used, 0 if the varint runs off the end */
+static size_t get_varint(const uint8_t *p, size_t len, uint64_t *v) {
+    size_t n;
+
+    *v = 0;
+    for (n = 0; n < len && n < MAX_VARINT; n++) {
+        *v |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80))
+            return n + 1;
+    }
+    return 0;
+}
+
+/*
+ * Map a CAPTURE_CHUNK window of the file starting at the page holding
+ * pos, growing the file to cover it.
+ */
+static int map_window() {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t off = pos & ~(off_t)(page - 1);
+
+    if (map)
+        munmap(map, CAPTURE_CHUNK);
+    map = NULL;
+    if (off + CAPTURE_CHUNK > file_len) {
+        if (ftruncate(fd, off + CAPTURE_CHUNK) < 0)
+            return -1;
+        file_len = off + CAPTURE_CHUNK;
+    }
+    map = mmap(NULL, CAPTURE_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+               off);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        return -1;
+    }
+    map_off = off;
+    return 0;
+}
+
+/* Find the end of the records in an existing log */
+static int find_end() {
+    capture_rec_t rec;
+    uint8_t *buf;
+    size_t off, next;
+    uint64_t started;
+
+    buf = mmap(NULL, file_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (buf == MAP_FAILED)
+        return -1;
+    if (capture_check(buf, file_len, &started) < 0) {
+        munmap(buf, file_len);
+        return -1;
+    }
+    for (off = CAPTURE_HEADER;
+         (next = capture_next(buf, file_len, off, &rec)) > 0; off = next)
+        ;
+    munmap(buf, file_len);
+    pos = off;
+    return 0;
+}
+
+int capture_open(const char *path) {
+    struct timespec ts;
+    struct stat st;
+    uint64_t now;
+    int i;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 ||
+        fstat(fd, &st) < 0)
+        goto fail;
+    file_len = st.st_size;
+    if (file_len > 0) {
+        if (find_end() < 0) {
+            eprintf("sircd: %s is not a capture log\n", path);
+            goto fail;
+        }
+        if (map_window() < 0)
+            goto fail;
+    } else {
+        pos = 0;
+        if (map_window() < 0)
+            goto fail;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        memcpy(map, CAPTURE_MAGIC, 8);
+        for (i = 0; i < 8; i++)
+            map[8 + i] = now >> (8 * i);
+        pos = CAPTURE_HEADER;
+    }
+    last_ns = mono_ns();
+    capture_enabled = 1;
+    return 0;
+
+fail:
+    DEBUG_PERROR("capture");
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    return -1;
+}
+
+/* Trim the unused end of the last chunk and stop recording */
+void capture_close() {
+    if (fd < 0)
+        return;
+    if (map)
+        munmap(map, CAPTURE_CHUNK);
+    map = NULL;
+    if (ftruncate(fd, pos) < 0)
+        DEBUG_PERROR("capture");
+    close(fd);
+    fd = -1;
+    capture_enabled = 0;
+}
+
+void capture_record(int kind, uint32_t conn, const char *line, size_t len) {
+    uint64_t now = mono_ns();
+    uint8_t *p;
+
+    if (!capture_enabled)
+        return;
+    if (pos + (off_t)(len + 3 * MAX_VARINT) > map_off + CAPTURE_CHUNK &&
+        map_window() < 0) {
+        eprintf("sircd: capture stopped, can't grow the log\n");
+        capture_close();
+        return;
+    }
+    p = map + (pos - map_off);
+    p += put_varint(p, (uint64_t)len << 2 | kind);
+    p += put_varint(p, now - last_ns);
+    p += put_varint(p, conn);
+    memcpy(p, line, len);
+    pos = (p + len - map) + map_off;
+    last_ns = now;
+}
+
+
+/* Reading */
+
+/* 0 if buf starts with a capture header; *started gets its time */
+int capture_check(const uint8_t *buf, size_t len, uint64_t *started) {
+    int i;
+
+    if (len < CAPTURE_HEADER || memcmp(buf, CAPTURE_MAGIC, 8))
+        return -1;
+    for (*started = 0, i = 0; i < 8; i++)
+        *started |= (uint64_t)buf[8 + i] << (8 * i);
+    return 0;
+}
+
+/*
+ * Decode the record at off into rec.  Returns the offset of the next
+ * one, or 0 at the end of the log (or a damaged record).
+ */
+size_t capture_next(const uint8_t *buf, size_t len, size_t off,
+                    capture_rec_t *rec) {
+    uint64_t head, conn;
+    size_t n;
+
+    if (off >= len || buf[off] == 0)
+        return 0;
+    if (!(n = get_varint(buf + off, len - off, &head)))
+        return 0;
+    off += n;
+    if (!(n = get_varint(buf + off, len - off, &rec->delta)))
+        return 0;
+    off += n;
+    if (!(n = get_varint(buf + off, len - off, &conn)))
+        return 0;
+    off += n;
+    rec->kind = head & 3;
+    rec->conn = conn;
+    rec->len = head >> 2;
+    rec->line = (const char *)buf + off;
+    if (rec->len > len - off)
+        return 0;
+    return off + rec->len;
+}
@@ -0,0 +1,66 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Traffic capture.
+ *
+ * With -c <file>, sircd appends every line it reads from a client
+ * connection, and every client connection opening and closing, to a
+ * binary log.  bench/bench_replay plays a log back against a server.
+ *
+ * The file is written through a shared memory mapping that grows in
+ * CAPTURE_CHUNK steps, so recording a line is a memcpy and a few
+ * varints, with no system call.  The kernel writes the pages back; a
+ * crash of sircd loses nothing already recorded.
+ *
+ * Layout: a 16 byte header, "SIRCCAP1" and the wall clock time (ns,
+ * little endian) the log was started, then records:
+ *
+ *   varint  (len << 2) | kind    kind: 1 line, 2 open, 3 close
+ *   varint  ns since the previous record (CLOCK_MONOTONIC)
+ *   varint  connection id
+ *   len     bytes of line, without the CR LF (lines only)
+ *
+ * Varints are LEB128: 7 bits a byte, low bits first, high bit set on
+ * all bytes but the last.  kind is never 0, so the zero bytes after
+ * the last record (the rest of the chunk) mark the end of the log.
+ * Reopening an existing log appends to it, the first record's time
+ * delta running from the moment it was reopened.
+ *
+ * Connection ids count up from 1 for the life of the server; unlike
+ * client table slots, they are never reused.
+ */
+
+#define CAPTURE_MAGIC   "SIRCCAP1"
+#define CAPTURE_HEADER  16
+#define CAPTURE_CHUNK   (4 * 1024 * 1024)
+
+enum {
+    CAPTURE_LINE = 1,
+    CAPTURE_OPEN = 2,
+    CAPTURE_CLOSE = 3
+};
+
+typedef struct capture_rec {
+    int kind;
+    uint64_t delta;         /* ns since the previous record */
+    uint32_t conn;
+    const char *line;       /* points into the log; not terminated */
+    size_t len;
+} capture_rec_t;
+
+extern int capture_enabled;
+
+int capture_open(const char *path);
+void capture_close(void);
+void capture_record(int kind, uint32_t conn, const char *line, size_t len);
+
+/* Reading a log, given the whole file in memory */
+int capture_check(const uint8_t *buf, size_t len, uint64_t *started);
+size_t capture_next(const uint8_t *buf, size_t len, size_t off,
+                    capture_rec_t *rec);
+
+#endif /* _CAPTURE_H_ */
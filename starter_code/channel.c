@@ -0,0 +1,185 @@
+/*
+ * channel.c
+ *
+ * The table of local channels and their members.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "channel.h"
+#include "irc_proto.h"
+#include "backlog.h"
+#include "msgbuf.h"
+#include "debug.h"
+#include "probes.h"
+
+#define CHAN_HASH_SIZE 256
+
+channel *channel_list = NULL;
+int channel_count = 0;
+chansum_t channel_summary;
+
+static channel *chan_hash[CHAN_HASH_SIZE];
+
+/* Only names our LSAs can carry, or other nodes would never match them */
+int channel_valid_name(const char *name) {
+    size_t len = strlen(name);
+
+    if ((name[0] != '#' && name[0] != '&') || len < 2 || len > LSA_MAX_NAME)
+        return 0;
+    return strpbrk(name, " ,\a") == NULL;
+}
+
+/* The channel with the interned name name, if it exists */
+channel *channel_get(const istr_t *name) {
+    channel *ch = chan_hash[name->hash % CHAN_HASH_SIZE];
+
+    for (; ch; ch = ch->hash_next)
+        if (ch->name == name)
+            return ch;
+    return NULL;
+}
+
+channel *channel_find(const char *name) {
+    istr_t *is = istr_find(name);
+
+    return is ? channel_get(is) : NULL;
+}
+
+static channel *channel_create(const char *name) {
+    channel *ch = calloc(1, sizeof(channel));
+    unsigned h;
+
+    if (!ch)
+        return NULL;
+    if (!(ch->name = istr_get(name))) {
+        free(ch);
+        return NULL;
+    }
+    h = ch->name->hash % CHAN_HASH_SIZE;
+    ch->hash_next = chan_hash[h];
+    chan_hash[h] = ch;
+    ch->next = channel_list;
+    channel_list = ch;
+    channel_count++;
+    chansum_add(&channel_summary, ch->name->s);
+    rt_local_changed(&routing);
+
+    DPRINTF(DEBUG_CHANNELS, "channel %s created\n", name);
+    return ch;
+}
+
+static void channel_destroy(channel *ch) {
+    channel **pp;
+
+    for (pp = &chan_hash[ch->name->hash % CHAN_HASH_SIZE]; *pp;
+         pp = &(*pp)->hash_next) {
+        if (*pp == ch) {
+            *pp = ch->hash_next;
+            break;
+        }
+    }
+    for (pp = &channel_list; *pp; pp = &(*pp)->next) {
+        if (*pp == ch) {
+            *pp = ch->next;
+            break;
+        }
+    }
+    channel_count--;
+    irc_channel_gone(ch);
+    chansum_del(&channel_summary, ch->name->s);
+    rt_local_changed(&routing);
+
+    DPRINTF(DEBUG_CHANNELS, "channel %s destroyed\n", ch->name->s);
+    istr_put(ch->name);
+    maskset_clear(&ch->bans);
+    free(ch->members);
+    free(ch);
+}
+
+/*
+ * Add c to the channel called name, creating it if needed.  The caller
+ * must already have taken c out of its previous channel.
+ */
+channel *channel_join(client *c, const char *name) {
+    channel *ch = channel_find(name);
+
+    if (!ch && !(ch = channel_create(name)))
+        return NULL;
+
+    if (ch->n_members == ch->cap) {
+        int cap = ch->cap ? ch->cap * 2 : 8;
+        client **m = realloc(ch->members, cap * sizeof(client *));
+        if (!m) {
+            if (!ch->n_members)
+                channel_destroy(ch);
+            return NULL;
+        }
+        ch->members = m;
+        ch->cap = cap;
+    }
+    ch->members[ch->n_members++] = c;
+    c->channel = istr_ref(ch->name);
+    return ch;
+}
+
+void channel_leave(client *c) {
+    channel *ch;
+    int i;
+
+    if (!c->channel)
+        return;
+    ch = channel_get(c->channel);
+    istr_put(c->channel);
+    c->channel = NULL;
+    if (!ch)
+        return;
+
+    for (i = 0; i < ch->n_members; i++) {
+        if (ch->members[i] == c) {
+            ch->members[i] = ch->members[--ch->n_members];
+            break;
+        }
+    }
+    if (ch->n_members == 0)
+        channel_destroy(ch);
+}
+
+/* Is nick!user@host banned from ch? */
+int channel_banned(channel *ch, const char *nick, const char *user,
+                   const char *host) {
+    return ch->bans.count && maskset_match(&ch->bans, nick, user, host);
+}
+
+void channel_send(channel *ch, client *except, const char *buf, size_t len) {
+    /* Sending can close members; ch may not outlive it */
+    istr_t *name = istr_ref(ch->name);
+    int n = client_fanout(ch->members, ch->n_members, except, buf, len);
+
+    PROBE3(fanout, name->s, n, len);
+    istr_put(name);
+}
+
+/* A PRIVMSG to ch: sent like channel_send(), and kept in its history */
+void channel_msg(channel *ch, client *except, const char *buf, size_t len) {
+    istr_t *name;
+    msgbuf_t *mb;
+    int n;
+
+    if (!backlog_enabled() || !(mb = msgbuf_copy(buf, len))) {
+        channel_send(ch, except, buf, len);
+        return;
+    }
+    /* Sending can close members; ch may not outlive it */
+    name = istr_ref(ch->name);
+    n = client_fanout_buf(ch->members, ch->n_members, except, mb);
+    PROBE3(fanout, name->s, n, len);
+    backlog_add(name, mb);
+    istr_put(name);
+    msgbuf_unref(mb);
+}
+
+/* Send c, which just joined ch, what was said there lately */
+int channel_replay(channel *ch, client *c) {
+    return backlog_replay(ch->name, c);
+}
@@ -0,0 +1,45 @@
+#ifndef _CHANNEL_H_
+#define _CHANNEL_H_
+
+#include "sircd.h"
+#include "chansum.h"
+#include "mask.h"
+
+/*
+ * Local channels.  A client is in at most one channel at a time (its
+ * name is kept in client->channel); a channel exists while it has at
+ * least one local member.
+ *
+ * Each channel has a ban list of "nick!user@host" masks that JOINs and
+ * PRIVMSGs to it are checked against.  Like the channel it is local to
+ * this node, and goes when the channel does.
+ */
+
+#define BAN_MAX 16384           /* bans per channel */
+
+typedef struct channel {
+    istr_t *name;               /* interned */
+    client **members;
+    int n_members;
+    int cap;
+    maskset_t bans;
+    struct channel *hash_next;
+    struct channel *next;       /* list of all channels */
+} channel;
+
+extern channel *channel_list;
+extern int channel_count;
+extern chansum_t channel_summary;   /* what our LSAs advertise */
+
+int channel_valid_name(const char *name);
+channel *channel_find(const char *name);
+channel *channel_get(const istr_t *name);
+channel *channel_join(client *c, const char *name);
+void channel_leave(client *c);
+int channel_banned(channel *ch, const char *nick, const char *user,
+                   const char *host);
+void channel_send(channel *ch, client *except, const char *buf, size_t len);
+void channel_msg(channel *ch, client *except, const char *buf, size_t len);
+int channel_replay(channel *ch, client *c);
+
+#endif /* _CHANNEL_H_ */
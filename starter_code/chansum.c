@@ -0,0 +1,202 @@
+/*
+ * chansum.c
+ *
+ * Channel interest summaries for LSAs.  See chansum.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "chansum.h"
+#include "lsdb.h"
+#include "debug.h"
+
+chansum_stats_t chansum_stats;
+
+int chansum_init(chansum_t *cs, int mode, unsigned bits, unsigned k) {
+    memset(cs, 0, sizeof(*cs));
+    cs->mode = mode;
+    if (mode == CHANSUM_BLOOM) {
+        bits = (bits + 7) & ~7u;
+        if (bits == 0 || bits > CHANSUM_MAX_BITS || k == 0 || k > 16)
+            return -1;
+        cs->bits = bits;
+        cs->k = k;
+        cs->counters = calloc(bits, 1);
+        if (!cs->counters)
+            return -1;
+    }
+    return 0;
+}
+
+static void free_list(char **list, int n) {
+    int i;
+    for (i = 0; i < n; i++)
+        free(list[i]);
+    free(list);
+}
+
+void chansum_destroy(chansum_t *cs) {
+    free(cs->counters);
+    free_list(cs->added, cs->n_added);
+    free_list(cs->removed, cs->n_removed);
+    memset(cs, 0, sizeof(*cs));
+}
+
+int chansum_parse_mode(const char *name) {
+    if (!strcasecmp(name, "exact"))
+        return CHANSUM_EXACT;
+    if (!strcasecmp(name, "bloom"))
+        return CHANSUM_BLOOM;
+    return -1;
+}
+
+/*
+ * Two independent 32 bit hashes of the casefolded name; the k filter
+ * positions are h1 + i*h2 (Kirsch and Mitzenmacher).
+ */
+void chansum_hash(const char *chan, uint32_t *h1, uint32_t *h2) {
+    uint32_t a = 2166136261u, b = 5381;
+
+    for (; *chan; chan++) {
+        unsigned char ch = tolower((unsigned char)*chan);
+        a = (a ^ ch) * 16777619u;
+        b = b * 33 + ch;
+    }
+    *h1 = a;
+    *h2 = (b ^ (b >> 15)) | 1;
+}
+
+int bloom_test(const uint8_t *bloom, unsigned bits, unsigned k,
+               const char *chan) {
+    uint32_t h1, h2, bit;
+    unsigned i;
+
+    chansum_hash(chan, &h1, &h2);
+    for (i = 0; i < k; i++) {
+        bit = (h1 + i * h2) % bits;
+        if (!(bloom[bit / 8] & (1 << (bit % 8))))
+            return 0;
+    }
+    return 1;
+}
+
+static void bloom_count(chansum_t *cs, const char *chan, int delta) {
+    uint32_t h1, h2, bit;
+    unsigned i;
+
+    chansum_hash(chan, &h1, &h2);
+    for (i = 0; i < cs->k; i++) {
+        bit = (h1 + i * h2) % cs->bits;
+        /* A saturated counter sticks: we can no longer tell when it
+         * should drop back to zero */
+        if (cs->counters[bit] == 255)
+            continue;
+        if (delta > 0)
+            cs->counters[bit]++;
+        else if (cs->counters[bit] > 0)
+            cs->counters[bit]--;
+    }
+}
+
+/* Remove chan from list if present; returns 1 if it was */
+static int list_remove(char **list, int *n, const char *chan) {
+    int i;
+    for (i = 0; i < *n; i++) {
+        if (!strcasecmp(list[i], chan)) {
+            free(list[i]);
+            list[i] = list[--*n];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void list_add(char ***list, int *n, int *cap, const char *chan) {
+    if (*n == *cap) {
+        int ncap = *cap ? *cap * 2 : 8;
+        char **l = realloc(*list, ncap * sizeof(char *));
+        if (!l)
+            return;
+        *list = l;
+        *cap = ncap;
+    }
+    if (((*list)[*n] = strdup(chan)) != NULL)
+        (*n)++;
+}
+
+/* A channel got its first local member */
+void chansum_add(chansum_t *cs, const char *chan) {
+    if (cs->mode == CHANSUM_BLOOM)
+        bloom_count(cs, chan, 1);
+    else if (!list_remove(cs->removed, &cs->n_removed, chan))
+        list_add(&cs->added, &cs->n_added, &cs->cap_added, chan);
+}
+
+/* A channel lost its last local member */
+void chansum_del(chansum_t *cs, const char *chan) {
+    if (cs->mode == CHANSUM_BLOOM)
+        bloom_count(cs, chan, -1);
+    else if (!list_remove(cs->added, &cs->n_added, chan))
+        list_add(&cs->removed, &cs->n_removed, &cs->cap_removed, chan);
+}
+
+static size_t names_size(char **names, int n) {
+    size_t size = 0;
+    int i;
+    for (i = 0; i < n; i++)
+        size += 1 + strlen(names[i]);
+    return size;
+}
+
+/*
+ * Put our channel summary into lsa, which is about to be originated.
+ * chans[] is the complete current set of local channels.  Periodic
+ * advertisements carry the full set so anyone who missed a delta
+ * catches up within one advertisement cycle.  Returns the size of the
+ * summary on the wire.
+ */
+int chansum_fill(chansum_t *cs, lsa_t *lsa, char **chans, int n_chans,
+                 uint32_t prev_seq, int periodic) {
+    size_t full, delta;
+    int i, ret;
+
+    if (cs->mode == CHANSUM_BLOOM) {
+        uint8_t bloom[CHANSUM_MAX_BITS / 8];
+
+        memset(bloom, 0, cs->bits / 8);
+        for (i = 0; i < cs->bits; i++)
+            if (cs->counters[i])
+                bloom[i / 8] |= 1 << (i % 8);
+        lsa_set_names(lsa, lsa->users, lsa->n_users, NULL, 0);
+        if (lsa_set_bloom(lsa, bloom, cs->bits, cs->k) < 0)
+            return -1;
+        chansum_stats.bloom_sent++;
+        ret = 3 + cs->bits / 8;
+        chansum_stats.bytes += ret;
+        return ret;
+    }
+
+    full = 4 + names_size(chans, n_chans);
+    delta = 12 + names_size(cs->added, cs->n_added) +
+            names_size(cs->removed, cs->n_removed);
+
+    lsa_set_names(lsa, lsa->users, lsa->n_users, chans, n_chans);
+    if (!periodic && prev_seq && delta < full) {
+        lsa_set_delta(lsa, prev_seq, cs->added, cs->n_added,
+                      cs->removed, cs->n_removed);
+        chansum_stats.delta_sent++;
+        ret = delta;
+    } else {
+        chansum_stats.full_sent++;
+        ret = full;
+    }
+
+    free_list(cs->added, cs->n_added);
+    free_list(cs->removed, cs->n_removed);
+    cs->added = cs->removed = NULL;
+    cs->n_added = cs->n_removed = cs->cap_added = cs->cap_removed = 0;
+
+    chansum_stats.bytes += ret;
+    return ret;
+}
@@ -0,0 +1,74 @@
+#ifndef _CHANSUM_H_
+#define _CHANSUM_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct lsa;
+
+/*
+ * Channel interest summaries.
+ *
+ * Every LSA says which channels have members on its node, so that
+ * channel traffic is only forwarded towards nodes that might want it.
+ * The summary comes in one of two flavours, picked with sircd -s:
+ *
+ *   exact  The full channel set in periodic advertisements, and only
+ *          the channels added and removed since the previous LSA in
+ *          advertisements triggered by a local change.  A receiver that
+ *          missed the base of a delta treats the node as interested in
+ *          everything until the next full set arrives.
+ *
+ *   bloom  A fixed size Bloom filter.  Locally it is kept as a counting
+ *          filter so channels can be removed again; only the bit vector
+ *          (counter != 0) goes on the wire.  False positives cost a
+ *          wasted forward, never a lost message.
+ */
+
+#define CHANSUM_EXACT 0
+#define CHANSUM_BLOOM 1
+
+#define CHANSUM_DEFAULT_BITS 1024
+#define CHANSUM_DEFAULT_K    4
+#define CHANSUM_MAX_BITS     65528
+
+typedef struct chansum {
+    int mode;
+
+    /* bloom: 8 bit counters, one per filter bit */
+    uint8_t *counters;
+    unsigned bits;
+    unsigned k;
+
+    /* exact: channels added/removed since the last advertisement */
+    char **added;
+    int n_added;
+    char **removed;
+    int n_removed;
+    int cap_added;
+    int cap_removed;
+} chansum_t;
+
+typedef struct chansum_stats {
+    unsigned long full_sent;      /* LSAs with a full channel set */
+    unsigned long delta_sent;     /* LSAs with a channel delta */
+    unsigned long bloom_sent;     /* LSAs with a Bloom filter */
+    unsigned long bytes;          /* bytes of channel summary originated */
+    unsigned long stale;          /* deltas we couldn't apply */
+} chansum_stats_t;
+
+int chansum_init(chansum_t *cs, int mode, unsigned bits, unsigned k);
+void chansum_destroy(chansum_t *cs);
+int chansum_parse_mode(const char *name);
+void chansum_add(chansum_t *cs, const char *chan);
+void chansum_del(chansum_t *cs, const char *chan);
+int chansum_fill(chansum_t *cs, struct lsa *lsa, char **chans, int n_chans,
+                 uint32_t prev_seq, int periodic);
+
+void chansum_hash(const char *chan, uint32_t *h1, uint32_t *h2);
+int bloom_test(const uint8_t *bloom, unsigned bits, unsigned k,
+               const char *chan);
+
+extern chansum_stats_t chansum_stats;
+
+#endif /* _CHANSUM_H_ */
@@ -5,10 +5,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include "debug.h"
 
 unsigned int debug = 0;
+unsigned int debug_any = 0;
+unsigned int debug_sample = 1;
+int debug_traced = 0;
 
 /* We could autogenerate this if we felt like it */
 
@@ -43,13 +53,400 @@ int set_debug(char *arg) {
     }
 
     if (!strcmp(arg, "all")) {
-        debug = 0xffffffff;
+        debug_set_mask(DEBUG_ALL);
         return 0;
     }
 
     if (isdigit(arg[0])) {
-        debug |= atoi(arg);
+        debug_set_mask(debug | atoi(arg));
     }
 
     return 0;
 }
+
+void debug_set_mask(unsigned int mask) {
+    debug = mask;
+    debug_update();
+}
+
+int debug_sampled(unsigned long id) {
+    return debug_sample && id % debug_sample == 0 ? TRACE_SAMPLED
+                                                  : TRACE_NONE;
+}
+
+void debug_update() {
+    debug_any = debug | (debug_traced > 0 ? DEBUG_CLIENT : 0);
+}
+
+
+/*
+ * The logger.
+ *
+ * Each thread that logs gets a single producer, single consumer ring of
+ * records: the format pointer (it identifies the message; the text is
+ * never copied) and the arguments, 8 bytes each, %s strings inline.  The
+ * logging thread walks the format to find the argument types, packs the
+ * record and publishes it by moving head; the logger thread walks the
+ * same format to unpack it, formats each conversion with snprintf and
+ * writes in batches.  Messages from one thread come out in order;
+ * different threads' messages may interleave by batch.
+ */
+
+#define DLOG_RING     (256 * 1024)  /* bytes per thread, a power of 2 */
+#define DLOG_MAX_REC  2048          /* longer records are cut short */
+#define DLOG_MAX_STR  512           /* %s arguments are cut to this */
+#define DLOG_PAD      0x80000000u   /* rest of the ring is unused */
+#define DLOG_IDLE_NS  1000000       /* logger naps this long when idle */
+
+typedef struct dlog_ring {
+    _Atomic uint64_t head;          /* bytes written, by the producer */
+    _Atomic uint64_t tail;          /* bytes consumed, by the logger */
+    _Atomic unsigned long logged;
+    _Atomic unsigned long dropped;
+    unsigned long reported;         /* drops the logger has mentioned */
+    struct dlog_ring *next;
+    uint64_t buf[DLOG_RING / 8];
+} dlog_ring_t;
+
+/* Record header; the arguments follow */
+typedef struct dlog_rec {
+    uint32_t len;                   /* bytes, header included, 8 aligned */
+    uint32_t truncated;
+    const char *fmt;
+} dlog_rec_t;
+
+enum { ARG_NONE, ARG_INT, ARG_LONG, ARG_DOUBLE, ARG_LDOUBLE, ARG_STR,
+       ARG_PTR };
+
+/* One conversion in a format */
+typedef struct conv {
+    const char *start, *end;        /* the spec, '%' to conversion char */
+    int stars;                      /* '*' width / precision ints */
+    int type;
+} conv_t;
+
+static _Atomic(dlog_ring_t *) rings;
+static __thread dlog_ring_t *my_ring;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static pthread_t logger;
+static atomic_int stopping;
+
+/*
+ * Find the next conversion at or after p.  Returns the text before it
+ * in [p, cv->start), or NULL at the end of the format.  "%%" comes
+ * back as a conversion of type ARG_NONE.
+ */
+static const char *next_conv(const char *p, conv_t *cv) {
+    const char *q;
+    int longs = 0, ldouble = 0;
+
+    if (!*p)
+        return NULL;
+    cv->start = strchr(p, '%');
+    if (!cv->start) {
+        cv->start = cv->end = p + strlen(p);
+        cv->type = ARG_NONE;
+        cv->stars = 0;
+        return p;
+    }
+    q = cv->start + 1;
+    cv->stars = 0;
+    while (*q && strchr("-+ #0'", *q))
+        q++;
+    for (; *q && (isdigit(*q) || *q == '.' || *q == '*'); q++)
+        cv->stars += *q == '*';
+    for (; *q && strchr("hlLqjzt", *q); q++) {
+        longs += *q == 'l' || *q == 'q' || *q == 'j' || *q == 'z' ||
+                 *q == 't';
+        ldouble |= *q == 'L';
+    }
+    switch (*q) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        cv->type = longs ? ARG_LONG : ARG_INT;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a':
+    case 'A':
+        cv->type = ldouble ? ARG_LDOUBLE : ARG_DOUBLE;
+        break;
+    case 's':
+        cv->type = ARG_STR;
+        break;
+    case 'p':
+        cv->type = ARG_PTR;
+        break;
+    default:                        /* "%%", or something we don't do */
+        cv->type = ARG_NONE;
+        break;
+    }
+    if (cv->type == ARG_NONE || cv->stars > 2) {
+        cv->type = ARG_NONE;
+        cv->stars = 0;
+    }
+    cv->end = *q ? q + 1 : q;
+    return p;
+}
+
+static void *logger_main(void *arg);
+
+static void stop_logger() {
+    atomic_store(&stopping, 1);
+    pthread_join(logger, NULL);
+}
+
+static void start_logger() {
+    if (pthread_create(&logger, NULL, logger_main, NULL) == 0)
+        atexit(stop_logger);
+}
+
+static dlog_ring_t *ring_register() {
+    dlog_ring_t *r = calloc(1, sizeof(dlog_ring_t));
+
+    if (!r)
+        return NULL;
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+        ;
+    my_ring = r;
+    pthread_once(&start_once, start_logger);
+    return r;
+}
+
+void dlog(const char *fmt, ...) {
+    uint64_t rec[DLOG_MAX_REC / 8];
+    dlog_ring_t *r = my_ring;
+    dlog_rec_t *h = (dlog_rec_t *)rec;
+    char *out = (char *)(h + 1), *lim = (char *)rec + DLOG_MAX_REC;
+    uint64_t head, idx, room;
+    const char *p = fmt;
+    size_t len, size;
+    va_list ap;
+    conv_t cv;
+    int i;
+
+    if (!r && !(r = ring_register()))
+        return;
+
+    h->fmt = fmt;
+    h->truncated = 0;
+    va_start(ap, fmt);
+    while ((p = next_conv(p, &cv))) {
+        p = cv.end;
+        if (cv.type == ARG_NONE)
+            continue;
+        if (out + 8 * (cv.stars + 1) > lim) {
+            h->truncated = 1;
+            break;
+        }
+        for (i = 0; i < cv.stars; i++, out += 8)
+            *(int64_t *)out = va_arg(ap, int);
+        switch (cv.type) {
+        case ARG_INT:
+            *(int64_t *)out = va_arg(ap, int);
+            break;
+        case ARG_LONG:
+            *(int64_t *)out = va_arg(ap, long long);
+            break;
+        case ARG_DOUBLE:
+            *(double *)out = va_arg(ap, double);
+            break;
+        case ARG_LDOUBLE:
+            *(double *)out = va_arg(ap, long double);
+            break;
+        case ARG_PTR:
+            *(void **)out = va_arg(ap, void *);
+            break;
+        case ARG_STR: {
+            const char *s = va_arg(ap, const char *);
+
+            if (!s)
+                s = "(null)";
+            len = strnlen(s, DLOG_MAX_STR);
+            if (out + 8 + len > lim)
+                len = lim - out - 8;
+            *(uint64_t *)out = len;
+            memcpy(out + 8, s, len);
+            out += (len + 7) & ~(size_t)7;
+            break;
+        }
+        }
+        out += 8;
+    }
+    va_end(ap);
+    size = out - (char *)rec;
+    h->len = size;
+
+    /* Copy it in, padding out the end of the ring if it would wrap */
+    head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    room = DLOG_RING - (head -
+           atomic_load_explicit(&r->tail, memory_order_acquire));
+    idx = head & (DLOG_RING - 1);
+    len = DLOG_RING - idx;
+    if (size > len && room >= size + len) {
+        *(uint32_t *)((char *)r->buf + idx) = DLOG_PAD;
+        head += len;
+        room -= len;
+        idx = 0;
+    }
+    if (size > room || size > DLOG_RING - idx) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    memcpy((char *)r->buf + idx, rec, size);
+    atomic_store_explicit(&r->head, head + size, memory_order_release);
+    atomic_fetch_add_explicit(&r->logged, 1, memory_order_relaxed);
+}
+
+/* Format the record at rec onto the end of out */
+static size_t format_rec(const dlog_rec_t *h, char *out, size_t cap) {
+    const char *in = (const char *)(h + 1), *end = (const char *)h + h->len;
+    const char *p = h->fmt;
+    char spec[32];
+    int64_t stars[2] = { 0, 0 };
+    size_t n = 0, len;
+    conv_t cv;
+    int i, w;
+
+#define PUT(call) do { \
+        w = (call); \
+        if (w > 0) \
+            n += (size_t)w < cap - n ? (size_t)w : cap - n - 1; \
+    } while (0)
+#define CONV(v) (cv.stars == 0 ? snprintf(out + n, cap - n, spec, v) : \
+                 cv.stars == 1 ? snprintf(out + n, cap - n, spec, \
+                                          (int)stars[0], v) : \
+                 snprintf(out + n, cap - n, spec, (int)stars[0], \
+                          (int)stars[1], v))
+
+    while ((p = next_conv(p, &cv)) && n + 1 < cap) {
+        len = cv.start - p;
+        PUT(snprintf(out + n, cap - n, "%.*s", (int)len, p));
+        p = cv.end;
+        if (cv.start == cv.end)
+            break;
+        len = cv.end - cv.start;
+        if (cv.type == ARG_NONE) {
+            if (len == 2 && cv.start[1] == '%')
+                PUT(snprintf(out + n, cap - n, "%%"));
+            continue;
+        }
+        if (in + 8 * (cv.stars + 1) > end || len >= sizeof(spec))
+            break;
+        memcpy(spec, cv.start, len);
+        spec[len] = '\0';
+        for (i = 0; i < cv.stars; i++, in += 8)
+            stars[i] = *(const int64_t *)in;
+        switch (cv.type) {
+        case ARG_INT:
+            /* the length modifier says how much of it printf looks at */
+            PUT(CONV((int)*(const int64_t *)in));
+            break;
+        case ARG_LONG:
+            PUT(CONV(*(const long long *)in));
+            break;
+        case ARG_DOUBLE:
+            PUT(CONV(*(const double *)in));
+            break;
+        case ARG_LDOUBLE:
+            PUT(CONV((long double)*(const double *)in));
+            break;
+        case ARG_PTR:
+            PUT(CONV(*(void *const *)in));
+            break;
+        case ARG_STR: {
+            char s[DLOG_MAX_STR + 1];
+
+            len = *(const uint64_t *)in;
+            memcpy(s, in + 8, len);
+            s[len] = '\0';
+            in += (len + 7) & ~(size_t)7;
+            PUT(CONV(s));
+            break;
+        }
+        }
+        in += 8;
+    }
+    if (h->truncated && n + 1 < cap)
+        PUT(snprintf(out + n, cap - n, "...[truncated]\n"));
+    return n;
+#undef CONV
+#undef PUT
+}
+
+static void write_all(const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(STDERR_FILENO, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Drain every ring once; returns the records written */
+static int drain() {
+    static char out[65536];
+    size_t n = 0;
+    dlog_ring_t *r;
+    uint64_t head, tail;
+    unsigned long dropped;
+    const dlog_rec_t *h;
+    int done = 0;
+
+    for (r = atomic_load(&rings); r; r = r->next) {
+        head = atomic_load_explicit(&r->head, memory_order_acquire);
+        tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        while (tail != head) {
+            h = (const dlog_rec_t *)((char *)r->buf +
+                                     (tail & (DLOG_RING - 1)));
+            if (h->len & DLOG_PAD) {
+                tail += DLOG_RING - (tail & (DLOG_RING - 1));
+                continue;
+            }
+            if (n + DLOG_MAX_REC + DLOG_MAX_STR > sizeof(out)) {
+                write_all(out, n);
+                n = 0;
+            }
+            n += format_rec(h, out + n, sizeof(out) - n);
+            tail += h->len;
+            done++;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+        dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        if (dropped != r->reported) {
+            if (n + 64 > sizeof(out)) {
+                write_all(out, n);
+                n = 0;
+            }
+            n += snprintf(out + n, sizeof(out) - n,
+                          "dlog: %lu messages dropped\n",
+                          dropped - r->reported);
+            r->reported = dropped;
+        }
+    }
+    write_all(out, n);
+    return done;
+}
+
+static void *logger_main(void *arg) {
+    struct timespec nap = { 0, DLOG_IDLE_NS };
+
+    while (!atomic_load(&stopping))
+        if (!drain())
+            nanosleep(&nap, NULL);
+    drain();
+    return NULL;
+}
+
+void dlog_stats(unsigned long *logged, unsigned long *dropped) {
+    dlog_ring_t *r;
+
+    *logged = *dropped = 0;
+    for (r = atomic_load(&rings); r; r = r->next) {
+        *logged += atomic_load(&r->logged);
+        *dropped += atomic_load(&r->dropped);
+    }
+}
@@ -2,18 +2,44 @@
 
     #define _DEBUG_H_
 
-    #include <stdio.h>  /* for perror */
+    #include <stdio.h>  /* for eprintf */
 
     #define eprintf(fmt, args...) fprintf(stderr, fmt, ##args)
 
+    /*
+     * DPRINTF doesn't write anything itself: dlog() copies the format
+     * pointer and the arguments into a ring owned by the calling thread,
+     * and a logger thread formats them onto stderr.  fmt must be a
+     * string literal (the pointer is kept, not the text); %s arguments
+     * are copied.  If the logger falls behind and the ring fills, the
+     * message is dropped and counted rather than waited for.
+     */
+    /*
+     * CDPRINTF is for messages about one client c.  Those are logged
+     * for a client that is traced (TRACE_ALL, whatever the mask says)
+     * and, if the mask has the level, for clients picked by sampling
+     * (TRACE_SAMPLED: one in debug_sample of them).  debug_any is the
+     * mask or'd with DEBUG_CLIENT while any client is traced, so with
+     * nothing to log either macro is one test of a global.
+     */
     #ifdef DEBUG
+        #include <string.h>  /* for strerror */
+        #include <errno.h>
         extern unsigned int debug;
+        extern unsigned int debug_any;
         #define DPRINTF(level, fmt, args...) \
-                do { if (debug & (level)) fprintf(stderr, fmt , ##args ); } while(0)
+                do { if (__builtin_expect(debug & (level), 0)) \
+                    dlog(fmt , ##args ); } while(0)
+        #define CDPRINTF(c, level, fmt, args...) \
+                do { if (__builtin_expect(debug_any & (level), 0) && \
+                         debug_wanted((c)->trace, level)) \
+                    dlog(fmt , ##args ); } while(0)
         #define DEBUG_PERROR(errmsg) \
-                do { if (debug & DEBUG_ERRS) perror(errmsg); } while(0)
+                do { if (debug & DEBUG_ERRS) \
+                    dlog("%s: %s\n", errmsg, strerror(errno)); } while(0)
     #else
         #define DPRINTF(args...)
+        #define CDPRINTF(args...)
         #define DEBUG_PERROR(args...)
     #endif
 
@@ -30,9 +56,31 @@
     #define DEBUG_CLIENTS   0x10    // DBTEXT:  Debug client arrival/depart
     #define DEBUG_COMMANDS  0x20    // DBTEXT:  Debug client commands
     #define DEBUG_CHANNELS  0x40    // DBTEXT:  Debug channel operations
+    #define DEBUG_ROUTING   0x80    // DBTEXT:  Debug routing protocol and SPF
+    #define DEBUG_FORWARD   0x100   // DBTEXT:  Debug server to server forwarding
 
     #define DEBUG_ALL  0xffffffff
 
+    /* The levels CDPRINTF is used with; what tracing a client turns on */
+    #define DEBUG_CLIENT  (DEBUG_INPUT | DEBUG_CLIENTS | DEBUG_COMMANDS)
+
+    enum { TRACE_NONE, TRACE_SAMPLED, TRACE_ALL };
+
+    extern unsigned int debug;
+    extern unsigned int debug_sample;  /* 1 in this many clients sampled */
+    extern int debug_traced;           /* clients with TRACE_ALL */
+
+    static inline int debug_wanted(int trace, unsigned int level) {
+        return trace == TRACE_ALL || (trace == TRACE_SAMPLED &&
+                                      (debug & level));
+    }
+
     int set_debug(char *arg);  /* Returns 0 on success, -1 on failure */
+    void debug_set_mask(unsigned int mask);
+    int debug_sampled(unsigned long id);  /* TRACE_SAMPLED or TRACE_NONE */
+    void debug_update(void);   /* after debug or debug_traced change */
+
+    void dlog(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+    void dlog_stats(unsigned long *logged, unsigned long *dropped);
 
 #endif /* _DEBUG_H_ */
@@ -0,0 +1,650 @@
+/*
+ * fwd.c
+ *
+ * Forwarding links between neighboring servers.  See fwd.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "fwd.h"
+#include "channel.h"
+#include "irc_proto.h"
+#include "debug.h"
+#include "msgbuf.h"
+
+#define NELMS(array) (sizeof(array) / sizeof(array[0]))
+
+#define FWD_ARGS client *c, char *prefix, char **params, int n_params
+
+mcast_cache_t fwd_mcast;
+hist_t fwd_local_latency;
+hist_t fwd_remote_latency;
+
+/* A line waiting for credit; both come from the msgbuf pool */
+typedef struct fwd_msg {
+    struct fwd_msg *next;
+    msgbuf_t *mb;
+} fwd_msg_t;
+
+/* The lines queued for one channel or nick on one link (pooled too) */
+typedef struct fwd_flow {
+    istr_t *key;
+    fwd_msg_t *head, *tail;
+    struct fwd_flow *next;
+} fwd_flow_t;
+
+/*
+ * Everything we know about the links to and from one neighbor: our
+ * outbound link with its credit and flow queues, and the neighbor's
+ * inbound link with the credit we owe it.
+ */
+static struct {
+    u_long nodeID;
+    client *link;               /* ours, to the neighbor */
+    client *in;                 /* the neighbor's, to us */
+    long credits;               /* bytes we may still send on link */
+    fwd_flow_t *flows;          /* flows with lines queued, served round */
+    fwd_flow_t *flows_tail;     /* robin from the head */
+    unsigned long owed;         /* bytes read from in, not yet granted */
+    uint64_t owed_since;        /* when we started holding them back */
+    fwd_link_stats_t stats;
+} links[MAX_CONFIG_FILE_LINES];
+static int n_links = 0;
+
+static unsigned long queued_total = 0;  /* bytes in every flow queue */
+static unsigned long queued_drained = 0;  /* ...and ever taken out */
+static uint64_t last_tick = 0;          /* ms, from fwd_tick() */
+
+/* Drained from the queues while congested, not yet granted */
+static unsigned long drain_credit = 0;
+static unsigned long drain_seen = 0;    /* queued + clients_drained then */
+static int grant_first = 0;             /* link grant_held() starts at */
+
+
+/* Links */
+
+static int is_neighbor(u_long nodeID) {
+    return nodeID != curr_nodeID && rt_neighbor(&routing, nodeID) != NULL;
+}
+
+/* The links[] slot for nodeID, made if needed; -1 if the table is full */
+static int slot_for(u_long nodeID) {
+    int i;
+
+    for (i = 0; i < n_links; i++)
+        if (links[i].nodeID == nodeID)
+            return i;
+    if (n_links == MAX_CONFIG_FILE_LINES)
+        return -1;
+    memset(&links[n_links], 0, sizeof(links[0]));
+    links[n_links].nodeID = nodeID;
+    return n_links++;
+}
+
+/*
+ * The outbound link to nodeID, connecting it if needed.  A new link
+ * starts with a full window of credit.
+ */
+static int link_to(u_long nodeID) {
+    char hello[64];
+    client *c;
+    int i, len;
+
+    if ((i = slot_for(nodeID)) < 0)
+        return -1;
+    if (links[i].link)
+        return i;
+
+    c = client_connect(nodeID, CONN_SERVER_OUT);
+    if (!c)
+        return -1;
+    len = snprintf(hello, sizeof(hello), "SERVER %lu\r\n", curr_nodeID);
+    client_send(c, hello, len);
+    links[i].link = c;
+    links[i].credits = FWD_WINDOW;
+    DPRINTF(DEBUG_FORWARD, "fwd: opened link to %lu\n", nodeID);
+    return i;
+}
+
+/* Is c connected from the address the config file gives nodeID? */
+static int from_node(const client *c, u_long nodeID) {
+    int i;
+
+    for (i = 0; i < curr_node_config_file.size; i++)
+        if (curr_node_config_file.entries[i].nodeID == nodeID)
+            return curr_node_config_file.entries[i].ipaddr ==
+                ntohl(c->cliaddr.sin_addr.s_addr);
+    return 0;
+}
+
+/*
+ * Take c as nodeID's link to us.  Anyone can connect and say SERVER, so
+ * it must come from that node's configured address, and a node only has
+ * one link in: a second is refused while the first is open.
+ */
+int fwd_accept_link(client *c, u_long nodeID) {
+    int i;
+
+    if (!is_neighbor(nodeID) || !from_node(c, nodeID) ||
+        (i = slot_for(nodeID)) < 0)
+        return -1;
+    if (links[i].in) {
+        DPRINTF(DEBUG_FORWARD, "fwd: second link from %lu refused\n",
+                nodeID);
+        return -1;
+    }
+    c->kind = CONN_SERVER_IN;
+    c->nodeID = nodeID;
+    c->sendq_max = MAX_SERVER_SENDQ;
+    links[i].in = c;
+    links[i].owed = 0;
+    DPRINTF(DEBUG_FORWARD, "fwd: link from %lu accepted\n", nodeID);
+    return 0;
+}
+
+static void drop_queued(int i) {
+    fwd_flow_t *f, *fnext;
+    fwd_msg_t *m, *mnext;
+
+    for (f = links[i].flows; f; f = fnext) {
+        fnext = f->next;
+        for (m = f->head; m; m = mnext) {
+            mnext = m->next;
+            links[i].stats.drops++;
+            queued_total -= m->mb->len;
+            queued_drained += m->mb->len;
+            msgbuf_unref(m->mb);
+            pool_free(m);
+        }
+        istr_put(f->key);
+        pool_free(f);
+    }
+    links[i].flows = links[i].flows_tail = NULL;
+    links[i].stats.queued_lines = links[i].stats.queued_bytes = 0;
+}
+
+void fwd_link_closed(client *c) {
+    int i;
+
+    for (i = 0; i < n_links; i++) {
+        if (links[i].link == c) {
+            /* Queued lines were routed over a link that's gone */
+            links[i].link = NULL;
+            drop_queued(i);
+        }
+        if (links[i].in == c)
+            links[i].in = NULL;
+    }
+}
+
+static void put_line(int i, const char *buf, size_t len) {
+    client_send(links[i].link, buf, len);
+    links[i].credits -= len;
+    links[i].stats.lines++;
+    links[i].stats.bytes += len;
+}
+
+static void grant_held();
+
+/*
+ * Send queued lines on link i while there is credit for them, taking
+ * one line from each flow in turn so a busy channel can't starve the
+ * others.
+ */
+static void pump(int i) {
+    fwd_flow_t *f;
+    fwd_msg_t *m;
+
+    while ((f = links[i].flows) && links[i].link &&
+           links[i].credits >= (long)f->head->mb->len) {
+        m = f->head;
+        put_line(i, m->mb->data, m->mb->len);
+        links[i].stats.queued_lines--;
+        links[i].stats.queued_bytes -= m->mb->len;
+        queued_total -= m->mb->len;
+        queued_drained += m->mb->len;
+        f->head = m->next;
+        msgbuf_unref(m->mb);
+        pool_free(m);
+
+        links[i].flows = f->next;
+        if (!links[i].flows)
+            links[i].flows_tail = NULL;
+        if (f->head) {
+            f->next = NULL;
+            if (links[i].flows_tail)
+                links[i].flows_tail->next = f;
+            else
+                links[i].flows = f;
+            links[i].flows_tail = f;
+        } else {
+            istr_put(f->key);
+            pool_free(f);
+        }
+    }
+    grant_held();
+}
+
+/*
+ * Queue a line for flow key on link i.  Returns -1 (and counts a drop)
+ * if the link already has MAX_SERVER_SENDQ bytes waiting.
+ */
+static int enqueue(int i, const char *key, const char *buf, size_t len) {
+    istr_t *k = istr_find(key);
+    fwd_flow_t *f = NULL;
+    fwd_msg_t *m;
+
+    if (links[i].stats.queued_bytes + len > MAX_SERVER_SENDQ) {
+        links[i].stats.drops++;
+        return -1;
+    }
+    if (!(m = pool_alloc(sizeof(fwd_msg_t))))
+        return -1;
+    if (!(m->mb = msgbuf_copy(buf, len))) {
+        pool_free(m);
+        return -1;
+    }
+    m->next = NULL;
+
+    /* A flow holds its key, so a key nobody has interned has no flow */
+    if (k)
+        for (f = links[i].flows; f && f->key != k; f = f->next)
+            ;
+    if (!f) {
+        if (!(f = pool_alloc(sizeof(fwd_flow_t)))) {
+            msgbuf_unref(m->mb);
+            pool_free(m);
+            return -1;
+        }
+        memset(f, 0, sizeof(fwd_flow_t));
+        if (!(f->key = k ? istr_ref(k) : istr_get(key))) {
+            pool_free(f);
+            msgbuf_unref(m->mb);
+            pool_free(m);
+            return -1;
+        }
+        if (links[i].flows_tail)
+            links[i].flows_tail->next = f;
+        else
+            links[i].flows = f;
+        links[i].flows_tail = f;
+    }
+    if (f->tail)
+        f->tail->next = m;
+    else
+        f->head = m;
+    f->tail = m;
+
+    links[i].stats.queued_lines++;
+    links[i].stats.queued_bytes += len;
+    if (links[i].stats.queued_bytes > links[i].stats.peak_bytes)
+        links[i].stats.peak_bytes = links[i].stats.queued_bytes;
+    queued_total += len;
+    return 0;
+}
+
+/*
+ * Send a line for flow key (a channel or nick) to neighbor nodeID.  It
+ * goes straight out if the link has credit and nothing is queued ahead
+ * of it, otherwise it waits in the flow's queue.
+ */
+static int send_line(u_long nodeID, const char *key, const char *buf,
+                     size_t len) {
+    int i = link_to(nodeID);
+
+    if (i < 0)
+        return -1;
+    if (!links[i].flows && links[i].credits >= (long)len) {
+        put_line(i, buf, len);
+        return 0;
+    }
+    if (links[i].credits < (long)len)
+        links[i].stats.stalls++;
+    return enqueue(i, key, buf, len);
+}
+
+
+/* Credit */
+
+static int congested() {
+    return queued_total > FWD_QUEUE_HIGH || clients_queued > FWD_QUEUE_HIGH;
+}
+
+/*
+ * Add what has left the queues since we last looked to drain_credit.
+ * Only what drains while they are over FWD_QUEUE_HIGH counts.
+ */
+static void count_drain() {
+    unsigned long total = queued_drained + clients_drained;
+
+    if (congested())
+        drain_credit += total - drain_seen;
+    else
+        drain_credit = 0;
+    drain_seen = total;
+}
+
+/*
+ * Give neighbor i back the credit for what we have read from it.  With
+ * the queues below FWD_QUEUE_HIGH it gets all it is owed, a quarter
+ * window at a time.  Above, only what has drained from them since: that
+ * is how congestion further on pushes back to the sender.  If nothing
+ * has drained for FWD_GRANT_HOLD ms it gets one line's worth, so links
+ * waiting on each other in a cycle can't deadlock.
+ */
+static void grant(int i, uint64_t now) {
+    char buf[64];
+    unsigned long n = links[i].owed;
+    int len;
+
+    if (!links[i].in || !n)
+        return;
+    count_drain();
+    if (!congested()) {
+        if (n < FWD_WINDOW / 4)
+            return;
+    } else {
+        if (n > drain_credit)
+            n = drain_credit;
+        if (n < FWD_GRANT_MIN) {
+            if (!links[i].owed_since)
+                links[i].owed_since = now;
+            if (now - links[i].owed_since < FWD_GRANT_HOLD)
+                return;
+            if (!n) {
+                n = links[i].owed < MAX_MSG_LEN ? links[i].owed
+                                                : MAX_MSG_LEN;
+                links[i].stats.forced_grants++;
+            }
+        }
+        drain_credit -= n < drain_credit ? n : drain_credit;
+    }
+    len = snprintf(buf, sizeof(buf), "CREDIT %lu\r\n", n);
+    client_send(links[i].in, buf, len);
+    links[i].stats.granted += n;
+    links[i].owed -= n;
+    links[i].owed_since = 0;
+}
+
+/* Round the links, starting one further each time, so drain_credit
+   doesn't always go to the first */
+static void grant_held() {
+    int i;
+
+    for (i = 0; i < n_links; i++)
+        grant((grant_first + i) % n_links, last_tick);
+    if (n_links)
+        grant_first = (grant_first + 1) % n_links;
+}
+
+/* Called every time round the event loop, to release held credit */
+void fwd_tick(uint64_t now) {
+    last_tick = now;
+    grant_held();
+}
+
+/*
+ * Traffic sent to each neighbor we have had a link to.  Returns the
+ * number of entries filled in.
+ */
+int fwd_link_stats(u_long *nodes, fwd_link_stats_t *stats, int max) {
+    int i;
+
+    for (i = 0; i < n_links && i < max; i++) {
+        nodes[i] = links[i].nodeID;
+        stats[i] = links[i].stats;
+        stats[i].credits = links[i].link ? links[i].credits : 0;
+        stats[i].owed = links[i].owed;
+    }
+    return i;
+}
+
+
+/* Channel multicast */
+
+/*
+ * Send a channel message from src to the children of this node in src's
+ * tree (never back to the node it came from).  The line is cut to fit
+ * MAX_MSG_LEN, which also keeps the PRIVMSG built from it at the far
+ * end within the limit.
+ */
+static int relay_channel_msg(u_long src, u_long from, int ttl,
+                             const char *prefix, const char *chan,
+                             const char *text) {
+    u_long hops[MCAST_MAX_HOPS];
+    char buf[MAX_MSG_LEN + 1];
+    int i, n, len, sent = 0;
+
+    n = mcast_next_hops(&fwd_mcast, &routing.db, src, curr_nodeID, chan,
+                        hops, MCAST_MAX_HOPS);
+    if (n <= 0)
+        return 0;
+
+    len = snprintf(buf, sizeof(buf) - 2, ":%s CMSG %lu %d %s :%s", prefix,
+                   src, ttl, chan, text);
+    if (len > (int)sizeof(buf) - 3)
+        len = sizeof(buf) - 3;
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+
+    for (i = 0; i < n; i++) {
+        if (hops[i] == from)
+            continue;
+        if (send_line(hops[i], chan, buf, len) == 0)
+            sent++;
+    }
+    return sent;
+}
+
+/*
+ * Send a message from one of our clients to the other nodes with
+ * members in chan.  Returns the number of links it went out on.
+ */
+int fwd_channel_msg(const char *prefix, const char *chan, const char *text) {
+    unsigned tree, unicast;
+    int sent;
+
+    sent = relay_channel_msg(curr_nodeID, curr_nodeID, MCAST_TTL,
+                             prefix, chan, text);
+    if (sent > 0 && mcast_tree_cost(&fwd_mcast, &routing.db, curr_nodeID,
+                                    chan, &tree, &unicast) == 0) {
+        mcast_stats.originated++;
+        mcast_stats.tree_links += tree;
+        mcast_stats.unicast_links += unicast;
+    }
+    return sent;
+}
+
+
+/* Private messages */
+
+/*
+ * The flow a private message belongs to, for picking among equal-cost
+ * paths: the sender's nick (from the nick!user@host prefix) and the
+ * target nick, both case folded.
+ */
+static uint32_t flow_hash(const char *prefix, const char *nick) {
+    uint32_t h = 2166136261u;
+
+    for (; *prefix && *prefix != '!'; prefix++)
+        h = (h ^ (unsigned char)tolower((unsigned char)*prefix)) * 16777619u;
+    h = (h ^ ' ') * 16777619u;
+    for (; *nick; nick++)
+        h = (h ^ (unsigned char)tolower((unsigned char)*nick)) * 16777619u;
+    return h;
+}
+
+/*
+ * Pass a PMSG line on towards dst.  The line is cut to fit MAX_MSG_LEN
+ * like CMSG.
+ */
+static int route_user_msg(u_long dst, int ttl, uint64_t stamp,
+                          const char *prefix, const char *nick,
+                          const char *text) {
+    char buf[MAX_MSG_LEN + 1];
+    u_long hop;
+    int len;
+
+    if (rt_nexthop(&routing, dst, flow_hash(prefix, nick), &hop) < 0)
+        return -1;
+    len = snprintf(buf, sizeof(buf) - 2, ":%s PMSG %lu %d %llu %s :%s",
+                   prefix, dst, ttl, (unsigned long long)stamp, nick, text);
+    if (len > (int)sizeof(buf) - 3)
+        len = sizeof(buf) - 3;
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    return send_line(hop, nick, buf, len);
+}
+
+/*
+ * Send a message from one of our clients to nick on another node.
+ * Returns -1 if no reachable node has that nick.
+ */
+int fwd_user_msg(const char *prefix, const char *nick, const char *text,
+                 uint64_t stamp) {
+    const nickdir_entry_t *e = rt_locate_nick(&routing, nick);
+
+    if (!e || e->node == curr_nodeID || !e->hop)
+        return -1;
+    return route_user_msg(e->node, MCAST_TTL, stamp, prefix, nick, text);
+}
+
+
+/* Server commands */
+
+/*
+ * Is the sender prefix "nick!user@host" banned from ch?  Bans are this
+ * node's own, so the message still goes on to the other nodes.
+ */
+static int prefix_banned(channel *ch, const char *prefix) {
+    char buf[MAX_MSG_LEN], *bang, *at;
+
+    if (!ch->bans.count)
+        return 0;
+    snprintf(buf, sizeof(buf), "%s", prefix);
+    if (!(bang = strchr(buf, '!')) || !(at = strchr(bang, '@')))
+        return 0;
+    *bang = *at = '\0';
+    return channel_banned(ch, buf, bang + 1, at + 1);
+}
+
+static void srv_cmsg(FWD_ARGS) {
+    char buf[MAX_MSG_LEN + 3];
+    u_long src = strtoul(params[0], NULL, 10);
+    int ttl = atoi(params[1]);
+    channel *ch = channel_find(params[2]);
+    int len, relayed = 0;
+
+    if (!prefix)
+        return;
+    mcast_stats.received++;
+    if (ch && prefix_banned(ch, prefix))
+        ch = NULL;
+    if (ch) {
+        len = snprintf(buf, MAX_MSG_LEN - 1, ":%s PRIVMSG %s :%s", prefix,
+                       ch->name->s, params[3]);
+        if (len > MAX_MSG_LEN - 2)
+            len = MAX_MSG_LEN - 2;
+        buf[len++] = '\r';
+        buf[len++] = '\n';
+        channel_msg(ch, NULL, buf, len);
+    }
+    if (ttl > 1)
+        relayed = relay_channel_msg(src, c->nodeID, ttl - 1, prefix,
+                                    params[2], params[3]);
+    mcast_stats.forwarded += relayed;
+    if (!ch && !relayed)
+        mcast_stats.wasted++;
+}
+
+static void srv_pmsg(FWD_ARGS) {
+    char buf[MAX_MSG_LEN + 3];
+    u_long dst = strtoul(params[0], NULL, 10);
+    int ttl = atoi(params[1]);
+    uint64_t stamp = strtoull(params[2], NULL, 10), now;
+    client *to;
+    int len;
+
+    if (!prefix)
+        return;
+    if (dst != curr_nodeID) {
+        if (ttl > 1)
+            route_user_msg(dst, ttl - 1, stamp, prefix, params[3],
+                           params[4]);
+        return;
+    }
+
+    to = client_by_nick(params[3]);
+    if (!to || !to->registered) {
+        DPRINTF(DEBUG_FORWARD, "fwd: PMSG for %s, who isn't here\n",
+                params[3]);
+        return;
+    }
+    len = snprintf(buf, MAX_MSG_LEN - 1, ":%s PRIVMSG %s :%s", prefix,
+                   to->nick, params[4]);
+    if (len > MAX_MSG_LEN - 2)
+        len = MAX_MSG_LEN - 2;
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    client_send(to, buf, len);
+    now = wall_ns();
+    if (stamp && now >= stamp)
+        hist_add(&fwd_remote_latency, now - stamp);
+}
+
+/* Credit for our link, sent back along it by the neighbor */
+static void srv_credit(FWD_ARGS) {
+    int i;
+
+    for (i = 0; i < n_links; i++) {
+        if (links[i].link == c) {
+            links[i].credits += strtoul(params[0], NULL, 10);
+            pump(i);
+            return;
+        }
+    }
+}
+
+struct srv_dispatch {
+    char cmd[16];
+    int minparams;
+    void (*handler)(FWD_ARGS);
+};
+
+static struct srv_dispatch srv_cmds[] = {
+    { "CMSG", 4, srv_cmsg },
+    { "PMSG", 5, srv_pmsg },
+    { "CREDIT", 1, srv_credit },
+};
+
+/*
+ * Handle a line from a server link.  len is its length on the wire:
+ * once a line from a neighbor's link has been dealt with (delivered or
+ * passed on, if only into a queue) its bytes are owed back as credit.
+ */
+void fwd_handle_line(client *c, size_t len, char *prefix, char *command,
+                     char **params, int n_params) {
+    int i;
+
+    for (i = 0; i < NELMS(srv_cmds); i++) {
+        if (!strcmp(srv_cmds[i].cmd, command)) {
+            if (n_params >= srv_cmds[i].minparams)
+                srv_cmds[i].handler(c, prefix, params, n_params);
+            break;
+        }
+    }
+    if (i == NELMS(srv_cmds))
+        DPRINTF(DEBUG_FORWARD, "fwd: unknown command %s from %lu\n",
+                command, c->nodeID);
+
+    if (c->kind != CONN_SERVER_IN)
+        return;
+    for (i = 0; i < n_links; i++) {
+        if (links[i].in == c) {
+            links[i].owed += len;
+            grant(i, last_tick);
+        }
+    }
+}
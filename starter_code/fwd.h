@@ -0,0 +1,87 @@
+#ifndef _FWD_H_
+#define _FWD_H_
+
+#include "sircd.h"
+#include "mcast.h"
+#include "hist.h"
+
+/*
+ * Server to server forwarding.
+ *
+ * Each node opens one TCP connection to the irc_port of every neighbor
+ * it needs to send to and announces itself with "SERVER <nodeID>".
+ * That is only believed from the address the config file gives the
+ * node, and only while it has no other link to us open.  Connections
+ * are kept open once made.  A node only ever sends on its
+ * own outbound links; lines arriving on inbound links are handed to
+ * fwd_handle_line().
+ *
+ * Server to server lines:
+ *
+ *   :<nick!user@host> CMSG <srcnode> <ttl> <channel> :<text>
+ *       A channel message originated at srcnode, travelling down
+ *       srcnode's multicast tree (see mcast.h).
+ *
+ *   :<nick!user@host> PMSG <dstnode> <ttl> <stamp> <nick> :<text>
+ *       A private message for a nick on dstnode, passed along the
+ *       unicast next hops towards it.  stamp is the wall clock time (ns)
+ *       at which the originating server read the PRIVMSG, so the far
+ *       end can time the delivery; it is only meaningful between nodes
+ *       with synchronized clocks (e.g. all on one host).
+ *
+ *   CREDIT <bytes>
+ *       Sent back on a neighbor's link to us: it may send that many more
+ *       bytes (see below).
+ */
+
+/*
+ * Flow control: a node may only have FWD_WINDOW bytes in flight on its
+ * link to a neighbor.  The neighbor hands the credit back ("CREDIT
+ * <bytes>", on the same connection) as it deals with the lines.  While
+ * its own forwarding queues or its clients' sendqs are over
+ * FWD_QUEUE_HIGH it only hands back as much as has drained from them
+ * since, so a sender can't go faster than the slowest queue it fills.
+ * If nothing has drained for FWD_GRANT_HOLD, one line's worth is let
+ * through anyway, in case links are waiting on each other in a cycle.
+ * Lines that find no credit wait in per-channel and per-nick queues on
+ * the link, which are served round robin.
+ */
+#define FWD_WINDOW      (64 * 1024)
+#define FWD_QUEUE_HIGH  (256 * 1024)
+#define FWD_GRANT_MIN   (4 * 1024)  /* smallest grant while congested */
+#define FWD_GRANT_HOLD  1000        /* ms without any drain before a
+                                       line is let through anyway */
+
+typedef struct fwd_link_stats {
+    unsigned long lines;          /* sent on our link */
+    unsigned long bytes;
+    long credits;                 /* bytes we may still send */
+    unsigned long stalls;         /* lines that had to wait for credit */
+    unsigned long queued_lines;   /* waiting now */
+    unsigned long queued_bytes;
+    unsigned long peak_bytes;     /* most ever waiting */
+    unsigned long drops;          /* lines dropped, queue full or link
+                                     lost */
+    unsigned long owed;           /* credit we owe the neighbor's link */
+    unsigned long granted;        /* credit given back so far */
+    unsigned long forced_grants;  /* lines let through with nothing
+                                     drained */
+} fwd_link_stats_t;
+
+int fwd_accept_link(client *c, u_long nodeID);
+void fwd_link_closed(client *c);
+void fwd_handle_line(client *c, size_t len, char *prefix, char *command,
+                     char **params, int n_params);
+void fwd_tick(uint64_t now);
+int fwd_channel_msg(const char *prefix, const char *chan, const char *text);
+int fwd_user_msg(const char *prefix, const char *nick, const char *text,
+                 uint64_t stamp);
+int fwd_link_stats(u_long *nodes, fwd_link_stats_t *stats, int max);
+
+extern mcast_cache_t fwd_mcast;
+
+/* PRIVMSG to a nick: read to queued on the recipient, in ns */
+extern hist_t fwd_local_latency;
+extern hist_t fwd_remote_latency;
+
+#endif /* _FWD_H_ */
@@ -0,0 +1,76 @@
+/*
+ * hist.c
+ *
+ * Log-linear latency histograms.  See hist.h.
+ */
+
+#include <string.h>
+#include "hist.h"
+
+void hist_reset(hist_t *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+static int bucket_of(uint64_t v) {
+    int msb;
+
+    if (v < HIST_SUB)
+        return v;
+    msb = 63 - __builtin_clzll(v);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* The largest value that lands in bucket b */
+static uint64_t bucket_top(int b) {
+    int shift;
+
+    if (b < HIST_SUB)
+        return b;
+    shift = b / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + b % HIST_SUB + 1) << shift) - 1;
+}
+
+void hist_add(hist_t *h, uint64_t v) {
+    h->buckets[bucket_of(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+void hist_merge(hist_t *dst, const hist_t *src) {
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/*
+ * The value below which a fraction p (0..1) of the samples fall,
+ * rounded up to the top of its bucket.  0 if there are no samples.
+ */
+uint64_t hist_percentile(const hist_t *h, double p) {
+    uint64_t want, seen = 0;
+    int i;
+
+    if (!h->count)
+        return 0;
+    want = p * h->count;
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want)
+            return bucket_top(i) < h->max ? bucket_top(i) : h->max;
+    }
+    return h->max;
+}
+
+uint64_t hist_mean(const hist_t *h) {
+    return h->count ? h->sum / h->count : 0;
+}
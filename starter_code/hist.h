@@ -0,0 +1,32 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stdint.h>
+
+/*
+ * Latency histograms.
+ *
+ * Values (nanoseconds, usually) go into log-linear buckets: every power
+ * of two is split into HIST_SUB linear sub-buckets, so a percentile read
+ * back is within 1/HIST_SUB of the true value whatever its magnitude,
+ * and adding a sample is a couple of shifts.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t buckets[HIST_BUCKETS];
+} hist_t;
+
+void hist_reset(hist_t *h);
+void hist_add(hist_t *h, uint64_t v);
+void hist_merge(hist_t *dst, const hist_t *src);
+uint64_t hist_percentile(const hist_t *h, double p);
+uint64_t hist_mean(const hist_t *h);
+
+#endif /* _HIST_H_ */
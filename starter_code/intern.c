@@ -0,0 +1,102 @@
+/*
+ * intern.c
+ *
+ * The interned string table.  See intern.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "intern.h"
+#include "irc_proto.h"
+#include "msgbuf.h"
+
+#define INTERN_MIN 256        /* buckets to start with */
+
+static istr_t **table;
+static unsigned size;         /* buckets, a power of two */
+static intern_stats_t stats;
+
+/* Double the buckets once there are more strings than buckets */
+static void grow() {
+    unsigned n = size ? size * 2 : INTERN_MIN, i;
+    istr_t **t, *is, *next;
+
+    if (!(t = calloc(n, sizeof(istr_t *))))
+        return;
+    for (i = 0; i < size; i++) {
+        for (is = table[i]; is; is = next) {
+            next = is->next;
+            is->next = t[is->hash & (n - 1)];
+            t[is->hash & (n - 1)] = is;
+        }
+    }
+    free(table);
+    table = t;
+    size = n;
+}
+
+static istr_t *lookup(const char *s, unsigned h) {
+    istr_t *is;
+
+    stats.lookups++;
+    if (!size)
+        return NULL;
+    for (is = table[h & (size - 1)]; is; is = is->next) {
+        if (is->hash == h && !strcasecmp(is->s, s)) {
+            stats.hits++;
+            return is;
+        }
+    }
+    return NULL;
+}
+
+/* The interned s, without taking a reference; NULL if there is none */
+istr_t *istr_find(const char *s) {
+    return lookup(s, irc_strhash(s));
+}
+
+/* A reference to the interned s, adding it if needed */
+istr_t *istr_get(const char *s) {
+    unsigned h = irc_strhash(s);
+    size_t len;
+    istr_t *is;
+
+    if ((is = lookup(s, h)))
+        return istr_ref(is);
+    if (stats.strings >= size)
+        grow();
+    if (!size)
+        return NULL;
+    len = strlen(s);
+    if (!(is = pool_alloc(sizeof(istr_t) + len + 1)))
+        return NULL;
+    is->refs = 1;
+    is->hash = h;
+    memcpy(is->s, s, len + 1);
+    is->next = table[h & (size - 1)];
+    table[h & (size - 1)] = is;
+    stats.strings++;
+    stats.bytes += sizeof(istr_t) + len + 1;
+    return is;
+}
+
+void istr_put(istr_t *is) {
+    istr_t **pp;
+
+    if (!is || --is->refs > 0)
+        return;
+    for (pp = &table[is->hash & (size - 1)]; *pp; pp = &(*pp)->next) {
+        if (*pp == is) {
+            *pp = is->next;
+            break;
+        }
+    }
+    stats.strings--;
+    stats.bytes -= sizeof(istr_t) + strlen(is->s) + 1;
+    pool_free(is);
+}
+
+void intern_stats(intern_stats_t *st) {
+    *st = stats;
+}
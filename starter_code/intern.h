@@ -0,0 +1,40 @@
+#ifndef _INTERN_H_
+#define _INTERN_H_
+
+/*
+ * Interned strings.
+ *
+ * Channel names, hostnames and the other names clients give are kept
+ * once each in a table and shared by reference.  Lookups ignore case
+ * the way IRC does, so "#Foo" and "#foo" are the same string (spelled
+ * as it was first seen), and two interned names are equal exactly when
+ * the pointers are.  Each string carries its irc_strhash(), so tables
+ * keyed on one don't hash it again.  Strings live in the msgbuf pool
+ * and go away with their last reference.
+ */
+
+typedef struct istr {
+    unsigned refs;
+    unsigned hash;            /* irc_strhash(s) */
+    struct istr *next;        /* table chain */
+    char s[];
+} istr_t;
+
+typedef struct intern_stats {
+    unsigned long strings;    /* in the table now */
+    unsigned long bytes;      /* pool memory they take */
+    unsigned long lookups;
+    unsigned long hits;       /* lookups that found the string there */
+} intern_stats_t;
+
+istr_t *istr_get(const char *s);
+istr_t *istr_find(const char *s);
+void istr_put(istr_t *is);
+void intern_stats(intern_stats_t *st);
+
+static inline istr_t *istr_ref(istr_t *is) {
+    is->refs++;
+    return is;
+}
+
+#endif /* _INTERN_H_ */
@@ -3,10 +3,20 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdarg.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include "sircd.h"
+#include "channel.h"
+#include "fwd.h"
+#include "msgbuf.h"
+#include "admit.h"
+#include "mask.h"
+#include "backlog.h"
+#include "probes.h"
 
 #define MAX_COMMAND 16
 
@@ -16,15 +26,12 @@
 #define NELMS(array) (sizeof(array) / sizeof(array[0]))
 
 
-/* You'll want to define the CMD_ARGS to match up with how you
- * keep track of clients.  Probably add a few args...
- * The command handler functions will look like
+/* The command handler functions look like
  * void cmd_nick(CMD_ARGS)
- * e.g., void cmd_nick(your_client_thingy *c, char *prefix, ...)
- * or however you set it up.
+ * and get the client that sent the line along with the parsed line.
  */
 
-#define CMD_ARGS char *prefix, char **params, int n_params
+#define CMD_ARGS client *c, char *prefix, char **params, int n_params
 
 typedef void (*cmd_handler_t)(CMD_ARGS);
 
@@ -32,23 +39,569 @@ struct dispatch {
     char cmd[MAX_COMMAND];
     int needreg; /* Must the user be registered to issue this cmd? */
     int minparams; /* send NEEDMOREPARAMS if < this many params */
+    int cost; /* tokens from the client's flood bucket */
     cmd_handler_t handler;
+    cmd_stats_t stats;
 };
 
 
+/* Metrics */
+
+const err_t irc_err_codes[IRC_N_ERRS] = {
+    ERR_INVALID, ERR_NOSUCHNICK, ERR_NOSUCHCHANNEL, ERR_NORECIPIENT,
+    ERR_NOTEXTTOSEND, ERR_UNKNOWNCOMMAND, ERR_ERRONEOUSNICKNAME,
+    ERR_NICKNAMEINUSE, ERR_NONICKNAMEGIVEN, ERR_NOTONCHANNEL, ERR_NOLOGIN,
+    ERR_NOTREGISTERED, ERR_NEEDMOREPARAMS, ERR_ALREADYREGISTRED,
+    ERR_NOPRIVILEGES, ERR_CANNOTSENDTOCHAN, ERR_UNKNOWNMODE,
+    ERR_BANNEDFROMCHAN, ERR_BANLISTFULL, ERR_PASSWDMISMATCH, ERR_NOOPERHOST
+};
+
+static cmd_stats_t unknown_stats;   /* commands not in cmds[] */
+static cmd_stats_t other_stats;     /* output outside any command */
+cmd_stats_t *irc_current = &other_stats;
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void count_error(int code) {
+    int i;
+
+    for (i = 0; i < IRC_N_ERRS; i++) {
+        if (irc_err_codes[i] == (err_t)code) {
+            irc_current->errors[i]++;
+            return;
+        }
+    }
+}
+
+
+/* Replies */
+
+static const char *nick_or_star(client *c) {
+    return c->nick[0] ? c->nick : "*";
+}
+
+/*
+ * Send a numeric reply to c:  ":<server> <code> <nick> <text>\r\n".
+ * The text is truncated so the whole line fits in MAX_MSG_LEN.
+ */
+static void reply(client *c, int code, const char *fmt, ...) {
+    char buf[MAX_MSG_LEN + 1];
+    va_list ap;
+    int len;
+
+    if (code < 200 || code >= 400)
+        count_error(code);
+    len = snprintf(buf, sizeof(buf) - 2, ":%s %03d %s ", server_name, code,
+                   nick_or_star(c));
+    va_start(ap, fmt);
+    len += vsnprintf(buf + len, sizeof(buf) - 2 - len, fmt, ap);
+    va_end(ap);
+    if (len > (int)sizeof(buf) - 3)
+        len = sizeof(buf) - 3;
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    client_send(c, buf, len);
+}
+
+/*
+ * Format a message from c as other clients see it:
+ * ":<nick>!<user>@<host> <text>\r\n".  Returns the length.
+ */
+static int format_from(client *c, char *buf, size_t size,
+                       const char *fmt, ...) {
+    va_list ap;
+    int len;
+
+    len = snprintf(buf, size - 2, ":%s!%s@%s ", c->nick, c->user,
+                   c->hostname->s);
+    va_start(ap, fmt);
+    len += vsnprintf(buf + len, size - 2 - len, fmt, ap);
+    va_end(ap);
+    if (len > (int)size - 3)
+        len = size - 3;
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    buf[len] = '\0';
+    return len;
+}
+
+static void send_motd(client *c) {
+    reply(c, RPL_MOTDSTART, ":- %s Message of the day - ", server_name);
+    reply(c, RPL_MOTD, ":- sircd node %lu", curr_nodeID);
+    reply(c, RPL_ENDOFMOTD, ":End of /MOTD command");
+}
+
+static void try_register(client *c) {
+    if (c->registered || !c->nick[0] || !c->user[0])
+        return;
+    c->registered = 1;
+    rt_local_changed(&routing);
+    CDPRINTF(c, DEBUG_CLIENTS, "client %d registered as %s\n", c->slot,
+             c->nick);
+    send_motd(c);
+}
+
+/* Hash a name the way IRC compares them:  case insensitively */
+unsigned irc_strhash(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)tolower((unsigned char)*s++);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int valid_nick(const char *nick) {
+    const char *special = "-[]\\`^{}_|";
+
+    if (!*nick || strlen(nick) >= MAX_USERNAME)
+        return 0;
+    if (!isalpha((unsigned char)*nick) && !strchr(special, *nick))
+        return 0;
+    for (nick++; *nick; nick++)
+        if (!isalnum((unsigned char)*nick) && !strchr(special, *nick))
+            return 0;
+    return 1;
+}
+
+/* Take c out of its channel, telling everyone left behind */
+static void leave_channel(client *c, const char *verb, const char *why) {
+    char buf[MAX_MSG_LEN + 3];
+    channel *ch;
+    int len;
+
+    if (!c->channel)
+        return;
+    ch = channel_get(c->channel);
+    if (ch) {
+        if (why)
+            len = format_from(c, buf, sizeof(buf), "%s %s :%s", verb,
+                              ch->name->s, why);
+        else
+            len = format_from(c, buf, sizeof(buf), "%s %s", verb,
+                              ch->name->s);
+        channel_send(ch, NULL, buf, len);
+    }
+    channel_leave(c);
+}
+
+
+/*
+ * Bulk replies.
+ *
+ * LIST, WHO, ban lists and the NAMES list a JOIN sends can run to
+ * hundreds of lines.  Instead of being formatted all at once, ahead of
+ * everything else this client and the others are waiting for, each is
+ * a job that makes a few lines at a time: at most BULK_QUANTUM for a client per
+ * turn and BULK_BUDGET in all per loop iteration (irc_bulk_run()), and
+ * only while the client has less than BULK_HIGH bytes waiting to go
+ * out.  Everything else (PRIVMSGs, other replies) is sent as it
+ * happens, so it overtakes bulk output instead of queueing behind it.
+ * A job that fits in what is left of the iteration's budget finishes
+ * on the spot and is never allocated.  A client's jobs run in order.
+ */
+#define BULK_BUDGET  256        /* lines per loop iteration */
+#define BULK_QUANTUM 32         /* lines per client per turn */
+#define BULK_HIGH    8192       /* queued bytes that make a client wait */
+
+enum {
+    BULK_LIST,
+    BULK_WHO,                   /* the members of one channel */
+    BULK_WHO_CHANS,             /* of each channel matching a mask */
+    BULK_WHO_USERS,             /* the clients here matching a mask */
+    BULK_NAMES,
+    BULK_BANS
+};
+
+typedef struct bulk {
+    int kind;
+    channel *next;              /* LIST, WHO_CHANS: the next channel */
+    int index;                  /* WHO, NAMES: the next member; */
+                                /* WHO_USERS: the next client slot */
+    istr_t *name;               /* the channel (WHO: the mask as asked) */
+    mask_t *mask;               /* WHO_CHANS, WHO_USERS */
+    const maskent_t *ban;       /* BANS: the next ban to list */
+    struct bulk *queue;         /* the client's next job */
+} bulk_t;
+
+static client *bulk_clients[MAX_CLIENTS];   /* with c->bulk jobs */
+static int n_bulk, bulk_rr;
+static int bulk_left = BULK_BUDGET;
+static client *bulk_busy;       /* running a job; see bulk_cancel() */
+static unsigned long bulk_lines, bulk_deferred;
+
+static unsigned queued(client *c) {
+    return c->sendq_len;
+}
+
+static void who_reply(client *c, const char *chan, client *m) {
+    reply(c, RPL_WHOREPLY, "%s %s %s %s %s H :0 %s", chan, m->user,
+          m->hostname->s, server_name, m->nick,
+          m->realname ? m->realname : "");
+}
+
+/* Does mask match s, which isn't folded yet? */
+static int who_match(const mask_t *mask, const char *s) {
+    char buf[MASK_MAX];
+
+    return mask_match(mask, buf, mask_fold(buf, s, sizeof(buf)));
+}
+
+/* WHO matches a client by nick, host, server or real name */
+static int who_match_client(const mask_t *mask, client *m) {
+    return who_match(mask, m->nick) || who_match(mask, m->hostname->s) ||
+           who_match(mask, server_name) ||
+           (m->realname && who_match(mask, m->realname));
+}
+
+/* Up to max lines of b.  Returns the number sent; *done at the end */
+static int bulk_step(client *c, bulk_t *b, int max, int *done) {
+    char buf[MAX_MSG_LEN];
+    channel *ch;
+    int n = 0, len, room;
+
+    *done = 0;
+    switch (b->kind) {
+    case BULK_LIST:
+        while ((ch = b->next) && n < max) {
+            reply(c, RPL_LIST, "%s %d :", ch->name->s, ch->n_members);
+            n++;
+            if (c->closing)
+                return n;
+            b->next = ch->next;
+        }
+        if (!b->next) {
+            reply(c, RPL_LISTEND, ":End of /LIST");
+            *done = 1;
+        }
+        break;
+
+    case BULK_WHO:
+        ch = channel_get(b->name);
+        while (ch && b->index < ch->n_members && n < max) {
+            who_reply(c, ch->name->s, ch->members[b->index++]);
+            n++;
+            if (c->closing)
+                return n;
+        }
+        if (!ch || b->index >= ch->n_members) {
+            reply(c, RPL_ENDOFWHO, "%s :End of /WHO list", b->name->s);
+            *done = 1;
+        }
+        break;
+
+    case BULK_WHO_CHANS:
+        while ((ch = b->next) && n < max) {
+            if (b->index < ch->n_members &&
+                (b->index || who_match(b->mask, ch->name->s))) {
+                who_reply(c, ch->name->s, ch->members[b->index++]);
+                n++;
+                if (c->closing)
+                    return n;
+                if (b->index < ch->n_members)
+                    continue;
+            }
+            b->next = ch->next;
+            b->index = 0;
+        }
+        if (!b->next) {
+            reply(c, RPL_ENDOFWHO, "%s :End of /WHO list", b->name->s);
+            *done = 1;
+        }
+        break;
+
+    case BULK_WHO_USERS:
+        while (b->index < MAX_CLIENTS && n < max) {
+            client *m = client_get(b->index++);
+            if (!m || !m->registered || !who_match_client(b->mask, m))
+                continue;
+            who_reply(c, m->channel ? m->channel->s : "*", m);
+            n++;
+            if (c->closing)
+                return n;
+        }
+        if (b->index >= MAX_CLIENTS) {
+            reply(c, RPL_ENDOFWHO, "%s :End of /WHO list", b->name->s);
+            *done = 1;
+        }
+        break;
+
+    case BULK_BANS:
+        ch = channel_get(b->name);
+        while (ch && b->ban && n < max) {
+            reply(c, RPL_BANLIST, "%s %s", ch->name->s, b->ban->text);
+            n++;
+            if (c->closing)
+                return n;
+            b->ban = b->ban->all_next;
+        }
+        if (!ch || !b->ban) {
+            reply(c, RPL_ENDOFBANLIST, "%s :End of channel ban list",
+                  b->name->s);
+            *done = 1;
+        }
+        break;
+
+    case BULK_NAMES:
+        /* Split so each line stays under MAX_MSG_LEN */
+        ch = channel_get(b->name);
+        room = MAX_MSG_LEN - 32 - strlen(server_name) - strlen(c->nick) -
+               strlen(b->name->s);
+        if (room < MAX_USERNAME + 1)
+            room = MAX_USERNAME + 1;
+        while (ch && b->index < ch->n_members && n < max) {
+            for (len = 0; b->index < ch->n_members; b->index++) {
+                const char *nick = ch->members[b->index]->nick;
+                size_t l = strlen(nick);
+                if (len && len + l + 1 > room)
+                    break;
+                len += sprintf(buf + len, "%s%s", len ? " " : "", nick);
+            }
+            reply(c, RPL_NAMREPLY, "= %s :%s", ch->name->s, buf);
+            n++;
+            if (c->closing)
+                return n;
+        }
+        if (!ch || b->index >= ch->n_members) {
+            reply(c, RPL_ENDOFNAMES, "%s :End of /NAMES list",
+                  b->name->s);
+            *done = 1;
+        }
+        break;
+    }
+    bulk_lines += n;
+    return n;
+}
+
+static bulk_t *bulk_alloc() {
+    return pool_alloc(sizeof(bulk_t));
+}
+
+/* Let go of what a job holds */
+static void bulk_release(const bulk_t *b) {
+    istr_put(b->name);
+    mask_free(b->mask);
+}
+
+static void bulk_free(bulk_t *b) {
+    bulk_release(b);
+    pool_free(b);
+}
+
+static void bulk_unlist(client *c) {
+    int i;
+
+    for (i = 0; i < n_bulk; i++) {
+        if (bulk_clients[i] == c) {
+            bulk_clients[i] = bulk_clients[--n_bulk];
+            break;
+        }
+    }
+}
+
+/* Drop c's jobs, if it has any */
+static void bulk_cancel(client *c) {
+    bulk_t *b;
+
+    if (!c->bulk)
+        return;
+    while ((b = c->bulk)) {
+        c->bulk = b->queue;
+        bulk_free(b);
+    }
+    bulk_unlist(c);
+}
+
+/*
+ * Start the job *job for c, running it now if there is budget left.
+ * The job's reference to its name and its mask pass to bulk_start().
+ */
+static void bulk_start(client *c, const bulk_t *job) {
+    bulk_t *b, **pp;
+    int done = 0;
+
+    if ((job->kind != BULK_LIST && !job->name) ||
+        ((job->kind == BULK_WHO_CHANS || job->kind == BULK_WHO_USERS) &&
+         !job->mask)) {
+        bulk_release(job);
+        client_close(c, "Out of memory");
+        return;
+    }
+    if (!c->bulk && bulk_left > 0 && queued(c) < BULK_HIGH) {
+        bulk_t now = *job;
+        bulk_busy = c;
+        bulk_left -= bulk_step(c, &now, bulk_left, &done);
+        bulk_busy = NULL;
+        if (done || c->closing) {
+            bulk_release(&now);
+            return;
+        }
+        if (!(b = bulk_alloc())) {
+            while (!done && !c->closing)
+                bulk_step(c, &now, BULK_BUDGET, &done);
+            bulk_release(&now);
+            return;
+        }
+        *b = now;
+    } else if (!(b = bulk_alloc())) {
+        bulk_release(job);
+        client_close(c, "Out of memory");
+        return;
+    } else {
+        *b = *job;
+    }
+    b->queue = NULL;
+    bulk_deferred++;
+    if (!c->bulk)
+        bulk_clients[n_bulk++] = c;
+    for (pp = &c->bulk; *pp; pp = &(*pp)->queue)
+        ;
+    *pp = b;
+}
+
+void irc_bulk_run() {
+    int i, n, max, done, progress = 1;
+    client *c;
+
+    while (bulk_left > 0 && progress) {
+        progress = 0;
+        for (i = 0; i < n_bulk && bulk_left > 0; i++) {
+            c = bulk_clients[(bulk_rr + i) % n_bulk];
+            if (c->closing || queued(c) >= BULK_HIGH)
+                continue;
+            max = bulk_left < BULK_QUANTUM ? bulk_left : BULK_QUANTUM;
+            bulk_busy = c;
+            n = bulk_step(c, c->bulk, max, &done);
+            bulk_busy = NULL;
+            bulk_left -= n;
+            progress = 1;
+            if (c->closing) {
+                bulk_cancel(c);
+            } else if (done) {
+                bulk_t *b = c->bulk;
+                c->bulk = b->queue;
+                bulk_free(b);
+                if (!c->bulk)
+                    bulk_unlist(c);
+            }
+        }
+        bulk_rr++;
+    }
+    bulk_left = BULK_BUDGET;
+}
+
+int irc_bulk_pending() {
+    int i;
+
+    for (i = 0; i < n_bulk; i++)
+        if (!bulk_clients[i]->closing && queued(bulk_clients[i]) < BULK_HIGH)
+            return 1;
+    return 0;
+}
+
+/*
+ * A LIST or WHO cursor on ch moves on to the channel after it, and a
+ * listing of its bans ends.
+ */
+void irc_channel_gone(channel *ch) {
+    bulk_t *b;
+    int i;
+
+    for (i = 0; i < n_bulk; i++) {
+        for (b = bulk_clients[i]->bulk; b; b = b->queue) {
+            if ((b->kind == BULK_LIST || b->kind == BULK_WHO_CHANS) &&
+                b->next == ch) {
+                b->next = ch->next;
+                b->index = 0;
+            } else if (b->kind == BULK_BANS && b->name == ch->name) {
+                b->ban = NULL;
+            }
+        }
+    }
+}
+
+/* A listing of bans about to show e moves on to the one after it */
+static void bulk_ban_gone(const maskent_t *e) {
+    bulk_t *b;
+    int i;
+
+    for (i = 0; i < n_bulk; i++)
+        for (b = bulk_clients[i]->bulk; b; b = b->queue)
+            if (b->kind == BULK_BANS && b->ban == e)
+                b->ban = e->all_next;
+}
+
+
 /* Command handlers */
 
 /* NICK – Give the user a nickname or change the previous one. Your server should report
 an error message if a user attempts to use an already-taken nickname. */
 
 void cmd_nick(CMD_ARGS) {
-    /* Do something */
+    char buf[MAX_MSG_LEN + 3];
+    const nickdir_entry_t *remote;
+    client *other;
+    channel *ch;
+    int len;
+
+    if (n_params < 1) {
+        reply(c, ERR_NONICKNAMEGIVEN, ":No nickname given");
+        return;
+    }
+    if (!valid_nick(params[0])) {
+        reply(c, ERR_ERRONEOUSNICKNAME, "%s :Erroneus nickname", params[0]);
+        return;
+    }
+    other = client_by_nick(params[0]);
+    remote = rt_locate_nick(&routing, params[0]);
+    if ((other && other != c) || (remote && remote->node != curr_nodeID)) {
+        reply(c, ERR_NICKNAMEINUSE, "%s :Nickname is already in use",
+              params[0]);
+        return;
+    }
+
+    if (!c->registered) {
+        if (client_set_nick(c, params[0]) == 0)
+            try_register(c);
+        return;
+    }
+    /* Announced from the old nick, so formatted before it changes */
+    len = format_from(c, buf, sizeof(buf), "NICK %s", params[0]);
+    if (client_set_nick(c, params[0]) < 0)
+        return;
+    ch = c->channel ? channel_get(c->channel) : NULL;
+    if (ch)
+        channel_send(ch, c, buf, len);
+    client_send(c, buf, len);
+    rt_local_changed(&routing);
 }
 
 
-/* USER – Specify the username, hostname, and real name of a user. */
+/* USER – Specify the username, hostname, and real name of a user.
+ * The hostname a client claims is ignored; c->hostname is the address
+ * it connected from. */
 
 void cmd_user(CMD_ARGS) {
+    size_t len;
+
+    if (c->registered) {
+        reply(c, ERR_ALREADYREGISTRED, ":You may not reregister");
+        return;
+    }
+    strncpy(c->user, params[0], MAX_USERNAME - 1);
+    istr_put(c->servername);
+    c->servername = istr_get(params[2]);
+    pool_free(c->realname);
+    len = strnlen(params[3], MAX_REALNAME - 1);
+    if ((c->realname = pool_alloc(len + 1))) {
+        memcpy(c->realname, params[3], len);
+        c->realname[len] = '\0';
+    }
+    try_register(c);
 }
 
 
@@ -56,6 +609,7 @@ void cmd_user(CMD_ARGS) {
 other users sharing the channel with the departing client. */
 
 void cmd_quit(CMD_ARGS) {
+    client_close(c, n_params > 0 ? params[0] : "Client Quit");
 }
 
 
@@ -66,6 +620,50 @@ member of at most one channel. Joining a new channel should implicitly cause the
 to leave the current channel. */
 
 void cmd_join(CMD_ARGS) {
+    char buf[MAX_MSG_LEN + 3], *name, *comma;
+    bulk_t job;
+    channel *ch;
+    int len;
+
+    /* Only one channel at a time, so only the first of a list counts */
+    name = params[0];
+    if ((comma = strchr(name, ',')) != NULL)
+        *comma = '\0';
+
+    if (!channel_valid_name(name)) {
+        reply(c, ERR_NOSUCHCHANNEL, "%s :No such channel", name);
+        return;
+    }
+    if (c->channel && istr_find(name) == c->channel)
+        return;
+    if ((ch = channel_find(name)) &&
+        channel_banned(ch, c->nick, c->user, c->hostname->s)) {
+        reply(c, ERR_BANNEDFROMCHAN, "%s :Cannot join channel (+b)",
+              ch->name->s);
+        return;
+    }
+
+    /* The PART and JOIN echoes can overflow c's SendQ and close it */
+    leave_channel(c, "PART", NULL);
+    if (c->closing)
+        return;
+    ch = channel_join(c, name);
+    if (!ch)
+        return;
+
+    len = format_from(c, buf, sizeof(buf), "JOIN %s", ch->name->s);
+    channel_send(ch, NULL, buf, len);
+    if (c->closing)
+        return;
+    channel_replay(ch, c);
+    if (c->closing)
+        return;
+
+    job.kind = BULK_NAMES;
+    job.index = 0;
+    job.name = istr_ref(ch->name);
+    job.mask = NULL;
+    bulk_start(c, &job);
 }
 
 
@@ -74,6 +672,19 @@ PART should still handle multiple arguments. If no such channel exists or it exi
 user is not currently in that channel, send the appropriate error message. */
 
 void cmd_part(CMD_ARGS) {
+    char *name, *save = NULL;
+
+    for (name = strtok_r(params[0], ",", &save); name;
+         name = strtok_r(NULL, ",", &save)) {
+        if (!channel_find(name)) {
+            reply(c, ERR_NOSUCHCHANNEL, "%s :No such channel", name);
+        } else if (istr_find(name) != c->channel) {
+            reply(c, ERR_NOTONCHANNEL, "%s :You're not on that channel",
+                  name);
+        } else {
+            leave_channel(c, "PART", n_params > 1 ? params[1] : NULL);
+        }
+    }
 }
 
 
@@ -82,6 +693,14 @@ parameters and list all channels and the number of users on the local server in
 Advanced Commands */
 
 void cmd_list(CMD_ARGS) {
+    bulk_t job;
+
+    reply(c, RPL_LISTSTART, "Channel :Users Name");
+    job.kind = BULK_LIST;
+    job.next = channel_list;
+    job.name = NULL;
+    job.mask = NULL;
+    bulk_start(c, &job);
 }
 
 
@@ -91,54 +710,598 @@ except the message originator. If the target is a nickname, the message will be
 that user. */
 
 void cmd_privmsg(CMD_ARGS) {
+    char buf[MAX_MSG_LEN + 3], prefix_buf[2 * MAX_USERNAME + MAX_HOSTNAME];
+    char *target, *save = NULL;
+    client *to;
+    channel *ch;
+    int len;
+
+    if (n_params < 1) {
+        reply(c, ERR_NORECIPIENT, ":No recipient given (PRIVMSG)");
+        return;
+    }
+    if (n_params < 2 || !params[1][0]) {
+        reply(c, ERR_NOTEXTTOSEND, ":No text to send");
+        return;
+    }
+
+    snprintf(prefix_buf, sizeof(prefix_buf), "%s!%s@%s", c->nick, c->user,
+             c->hostname->s);
+
+    for (target = strtok_r(params[0], ",", &save); target;
+         target = strtok_r(NULL, ",", &save)) {
+        len = format_from(c, buf, sizeof(buf), "PRIVMSG %s :%s", target,
+                          params[1]);
+        if (target[0] == '#' || target[0] == '&') {
+            ch = channel_find(target);
+            if (ch && channel_banned(ch, c->nick, c->user, c->hostname->s)) {
+                reply(c, ERR_CANNOTSENDTOCHAN, "%s :Cannot send to channel",
+                      ch->name->s);
+                continue;
+            }
+            if (ch)
+                channel_msg(ch, c, buf, len);
+            if (fwd_channel_msg(prefix_buf, target, params[1]) == 0 && !ch)
+                reply(c, ERR_NOSUCHNICK, "%s :No such nick/channel", target);
+        } else if ((to = client_by_nick(target)) != NULL && to->registered) {
+            client_send(to, buf, len);
+            hist_add(&fwd_local_latency, wall_ns() - line_stamp);
+        } else if (fwd_user_msg(prefix_buf, target, params[1],
+                                line_stamp) < 0) {
+            reply(c, ERR_NOSUCHNICK, "%s :No such nick/channel", target);
+        }
+    }
 }
 
 
 /* WHO – Query information about clients or channels. In this project, your server only needs
 to support querying channels on the local server. It should do an exact match on the channel
-name and return the users on that channel. */
+name and return the users on that channel.
+ * A mask with '*' or '?' in it lists the members of every channel
+ * here it matches, if it starts like a channel name, or else every
+ * client here whose nick, host, server or real name it matches; so does
+ * a nick.  No mask, or "0", is "*". */
 
 void cmd_who(CMD_ARGS) {
+    const char *mask = n_params > 0 && strcmp(params[0], "0") ?
+                       params[0] : "*";
+    char name[MASK_MAX];
+    bulk_t job;
+
+    /* No such channel: the job just ends the list */
+    snprintf(name, sizeof(name), "%s", mask);
+    job.index = 0;
+    job.next = channel_list;
+    job.name = istr_get(name);
+    job.mask = NULL;
+    if (!mask_wild(name) && (name[0] == '#' || name[0] == '&')) {
+        job.kind = BULK_WHO;
+    } else {
+        job.kind = name[0] == '#' || name[0] == '&' ? BULK_WHO_CHANS :
+                   BULK_WHO_USERS;
+        job.mask = mask_compile(name);
+    }
+    bulk_start(c, &job);
+}
+
+
+/* MODE – Channel modes.  The only one is b, the ban list: "MODE #chan
+ * +b <mask>" bans nick!user@host masks from joining the channel and
+ * sending to it, "-b <mask>" lifts a ban, and "+b" alone lists them.
+ * There are no channel operators, so changing the bans takes a member
+ * who has given OPER (else a banned member could lift their own ban,
+ * or anyone mute the rest); anybody may list them.  A mask is filled out the usual way ("nick"
+ * is nick!*@*, "user@host" is *!user@host) and announced to the
+ * channel in full. */
+
+static void change_ban(client *c, channel *ch, int add, const char *mask) {
+    char buf[MAX_MSG_LEN + 3];
+    maskent_t *e;
+    int len;
+
+    if (c->channel != ch->name) {
+        reply(c, ERR_NOTONCHANNEL, "%s :You're not on that channel",
+              ch->name->s);
+        return;
+    }
+    if (!c->oper) {
+        reply(c, ERR_NOPRIVILEGES, ":Permission Denied- You're not an IRC "
+              "operator");
+        return;
+    }
+    if (add) {
+        if (ch->bans.count >= BAN_MAX) {
+            reply(c, ERR_BANLISTFULL, "%s %s :Channel ban list is full",
+                  ch->name->s, mask);
+            return;
+        }
+        if (maskset_add(&ch->bans, mask) <= 0)
+            return;
+        e = ch->bans.all_tail;
+    } else if (!(e = maskset_find(&ch->bans, mask))) {
+        return;
+    }
+    len = format_from(c, buf, sizeof(buf), "MODE %s %cb %s", ch->name->s,
+                      add ? '+' : '-', e->text);
+    if (!add) {
+        bulk_ban_gone(e);
+        maskset_remove(&ch->bans, e);
+    }
+    /* c last: if that closes it, ch may go */
+    channel_send(ch, c, buf, len);
+    client_send(c, buf, len);
+}
+
+void cmd_mode(CMD_ARGS) {
+    const char *p;
+    int add = 1, arg = 2;
+    channel *ch;
+    bulk_t job;
+
+    if (!(ch = channel_find(params[0]))) {
+        reply(c, ERR_NOSUCHCHANNEL, "%s :No such channel", params[0]);
+        return;
+    }
+    if (n_params < 2) {
+        reply(c, RPL_CHANNELMODEIS, "%s +", ch->name->s);
+        return;
+    }
+    for (p = params[1]; *p && !c->closing; p++) {
+        if (*p == '+' || *p == '-') {
+            add = *p == '+';
+        } else if (*p != 'b') {
+            reply(c, ERR_UNKNOWNMODE, "%c :is unknown mode char to me for "
+                  "%s", *p, ch->name->s);
+        } else if (arg < n_params) {
+            change_ban(c, ch, add, params[arg++]);
+        } else {
+            job.kind = BULK_BANS;
+            job.name = istr_ref(ch->name);
+            job.mask = NULL;
+            job.ban = ch->bans.all;
+            bulk_start(c, &job);
+        }
+    }
+}
+
+
+/* STATS – Server statistics.  "STATS d" reports how long PRIVMSGs to
+ * nicks take from being read to being queued on the recipient, for
+ * recipients here and on other nodes, and the state of the nick
+ * directory behind the remote ones.  "STATS l" lists the traffic, credit
+ * and queue depths of each forwarding link.  "STATS c" gives calls,
+ * errors, bytes and handler latency per command, "STATS e" the event
+ * loop's wakeups, batch sizes, busy time and queued output, "STATS h"
+ * the memory each channel's history (-H) takes and what replaying it
+ * costs, and "STATS m" all of those as "name value" pairs for scripts
+ * (the same format SIGUSR1 writes to stderr). */
+
+static void stats_latency(client *c, const char *what, const hist_t *h) {
+    reply(c, RPL_STATSDEBUG, "d :%s %llu msgs, us p50 %.1f p99 %.1f "
+          "p99.9 %.1f max %.1f", what, (unsigned long long)h->count,
+          hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.99) / 1e3,
+          hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+static void stats_commands(client *c);
+static void stats_loop(client *c);
+static void stats_history(client *c);
+static void stats_machine(client *c);
+
+void cmd_stats(CMD_ARGS) {
+    char query = n_params > 0 ? params[0][0] : 'd';
+    fwd_link_stats_t links[MAX_CONFIG_FILE_LINES];
+    u_long nodes[MAX_CONFIG_FILE_LINES];
+    int i, n;
+
+    switch (query) {
+    case 'd':
+        stats_latency(c, "local", &fwd_local_latency);
+        stats_latency(c, "remote", &fwd_remote_latency);
+        reply(c, RPL_STATSDEBUG, "d :directory %d nicks, %lu rebuilds, "
+              "%d routes, route gen %u", routing.dir.n_entries,
+              routing.dir.rebuilds, routing.n_hops, routing.route_gen);
+        break;
+    case 'l':
+        n = fwd_link_stats(nodes, links, MAX_CONFIG_FILE_LINES);
+        for (i = 0; i < n; i++) {
+            fwd_link_stats_t *l = &links[i];
+            reply(c, RPL_STATSDEBUG, "l :link %lu %lu lines %lu bytes "
+                  "credit %ld stalls %lu queued %lu/%lu peak %lu drops %lu "
+                  "owed %lu granted %lu forced %lu", nodes[i], l->lines,
+                  l->bytes, l->credits, l->stalls, l->queued_lines,
+                  l->queued_bytes, l->peak_bytes, l->drops, l->owed,
+                  l->granted, l->forced_grants);
+        }
+        break;
+    case 'c':
+        stats_commands(c);
+        break;
+    case 'e':
+        stats_loop(c);
+        break;
+    case 'h':
+        stats_history(c);
+        break;
+    case 'm':
+        stats_machine(c);
+        break;
+    }
+    reply(c, RPL_ENDOFSTATS, "%c :End of /STATS report", query);
+}
+
+
+/* SERVER – Sent by a neighboring node as the first line on its
+ * forwarding link.  From then on the connection carries server to
+ * server traffic (see fwd.c) instead of client commands. */
+
+void cmd_server(CMD_ARGS) {
+    u_long nodeID = strtoul(params[0], NULL, 10);
+
+    if (c->registered || c->nick[0] || fwd_accept_link(c, nodeID) < 0)
+        client_close(c, "Not a neighbor");
+}
+
+
+/* OPER – "OPER <name> <password>" makes the client an operator, if
+ * they match what sircd -o was given.  With no -o there are none. */
+
+static char oper_name[MAX_USERNAME];
+static char oper_pass[MAX_USERNAME];
+
+/* Parse -o: "name:password".  The password is wiped from spec, so it
+ * doesn't stay readable in ps. */
+int irc_oper_init(char *spec) {
+    char *pass = strchr(spec, ':');
+
+    if (!pass || pass == spec || !pass[1] ||
+        pass - spec >= (int)sizeof(oper_name) ||
+        strlen(pass + 1) >= sizeof(oper_pass))
+        return -1;
+    snprintf(oper_name, sizeof(oper_name), "%.*s", (int)(pass - spec),
+             spec);
+    snprintf(oper_pass, sizeof(oper_pass), "%s", pass + 1);
+    memset(pass + 1, 'x', strlen(pass + 1));
+    return 0;
+}
+
+/* Compare a and b in time that doesn't depend on where they differ */
+static int same_secret(const char *a, const char *b) {
+    size_t i, la = strlen(a), lb = strlen(b);
+    unsigned char diff = la != lb;
+
+    for (i = 0; i < la; i++)
+        diff |= a[i] ^ b[i < lb ? i : 0];
+    return !diff;
+}
+
+void cmd_oper(CMD_ARGS) {
+    if (!oper_name[0]) {
+        reply(c, ERR_NOOPERHOST, ":No O-lines for your host");
+        return;
+    }
+    if (strcmp(params[0], oper_name) ||
+        !same_secret(params[1], oper_pass)) {
+        DPRINTF(DEBUG_COMMANDS, "OPER: failed attempt by %s\n", c->nick);
+        reply(c, ERR_PASSWDMISMATCH, ":Password incorrect");
+        return;
+    }
+    c->oper = 1;
+    reply(c, RPL_YOUREOPER, ":You are now an IRC operator");
+}
+
+
+/* DEBUG – Change what the server logs while it runs; operators only.
+ * "DEBUG" shows the settings; "DEBUG MASK <n>|all|none" sets the debug
+ * mask (the values are in sircd -D list); "DEBUG SAMPLE <n>" has the
+ * client levels logged for one client in n (0 for none); "DEBUG TRACE
+ * <nick>" logs everything about one client, whatever the mask and
+ * sampling say, until "DEBUG UNTRACE <nick>". */
+
+void cmd_debug(CMD_ARGS) {
+    const char *op = n_params > 0 ? params[0] : NULL;
+    const char *arg = n_params > 1 ? params[1] : NULL;
+    client *who;
+
+    if (!c->oper) {
+        reply(c, ERR_NOPRIVILEGES, ":Permission Denied- You're not an IRC "
+              "operator");
+        return;
+    }
+    if (!op) {
+        /* just the report */
+    } else if (!strcasecmp(op, "MASK") && arg) {
+        if (!strcasecmp(arg, "all"))
+            debug_set_mask(DEBUG_ALL);
+        else if (!strcasecmp(arg, "none"))
+            debug_set_mask(DEBUG_NONE);
+        else
+            debug_set_mask(strtoul(arg, NULL, 0));
+    } else if (!strcasecmp(op, "SAMPLE") && arg) {
+        client_resample(strtoul(arg, NULL, 10));
+    } else if ((!strcasecmp(op, "TRACE") || !strcasecmp(op, "UNTRACE")) &&
+               arg) {
+        if (!(who = client_by_nick(arg))) {
+            reply(c, ERR_NOSUCHNICK, "%s :No such nick/channel", arg);
+            return;
+        }
+        client_trace(who, toupper((unsigned char)op[0]) == 'T');
+    } else {
+        reply(c, ERR_NEEDMOREPARAMS, "DEBUG :Not enough parameters");
+        return;
+    }
+    reply(c, RPL_STATSDEBUG, ":debug mask 0x%x sample 1/%u traced %d",
+          debug, debug_sample, debug_traced);
 }
 
 
 /* Dispatch table.  "reg" means "user must be registered in order
  * to call this function".  "#param" is the # of parameters that
  * the command requires.  It may take more optional parameters.
+ * "cost" is what it takes from the client's flood bucket; PRIVMSG
+ * costs that per nick it goes to and FLOOD_CHANNEL per channel, MODE
+ * that per mask.
  */
 struct dispatch cmds[] = {
-    /* cmd,    reg  #parm  function */
-    { "NICK",    0, 0, cmd_nick    },
-    { "USER",    0, 4, cmd_user    },
-    { "QUIT",    0, 0, cmd_quit    },
-    { "JOIN",    1, 1, cmd_join    },
-    { "PART",    1, 1, cmd_part    },
-    { "LIST",    1, 0, cmd_list    },
-    { "PRIVMSG", 1, 2, cmd_privmsg },
-    { "WHO",     1, 0, cmd_who     },
+    /* cmd,    reg  #parm cost  function */
+    { "NICK",    0, 0,    4,    cmd_nick    },
+    { "USER",    0, 4,    1,    cmd_user    },
+    { "QUIT",    0, 0,    0,    cmd_quit    },
+    { "JOIN",    1, 1,    4,    cmd_join    },
+    { "PART",    1, 1,    2,    cmd_part    },
+    { "LIST",    1, 0,    8,    cmd_list    },
+    { "PRIVMSG", 1, 0,    1,    cmd_privmsg },
+    { "WHO",     1, 0,    6,    cmd_who     },
+    { "MODE",    1, 1,    2,    cmd_mode    },
+    { "STATS",   1, 0,    8,    cmd_stats   },
+    { "SERVER",  0, 1,    0,    cmd_server  },
+    { "OPER",    1, 2,    8,    cmd_oper    },
+    { "DEBUG",   1, 0,    2,    cmd_debug   },
 };
 
 
-/* Handle a command line.  NOTE:  You will probably want to
- * modify the way this function is called to pass in a client
- * pointer or a table pointer or something of that nature
- * so you know who to dispatch on...
- * Mostly, this is here to do the parsing and dispatching
- * for you
- *
- * This function takes a single line (i.e., don't just pass
- * it the result of calling readline of text.  You MUST have
- * ensured that it's a complete ()).
- * Strip the trailing newline off before calling this function.
+/* Metrics reports (STATS c, e and m, and irc_stats_dump()) */
+
+static unsigned long total_errors(const cmd_stats_t *st) {
+    unsigned long n = 0;
+    int i;
+
+    for (i = 0; i < IRC_N_ERRS; i++)
+        n += st->errors[i];
+    return n;
+}
+
+static void stats_command(client *c, const char *name,
+                          const cmd_stats_t *st) {
+    const hist_t *h = &st->latency;
+
+    if (!st->calls && !st->bytes_out)
+        return;
+    reply(c, RPL_STATSDEBUG, "c :%s %lu calls %lu errors, bytes %lu in "
+          "%lu out, us p50 %.1f p99 %.1f max %.1f", name, st->calls,
+          total_errors(st), st->bytes_in, st->bytes_out,
+          hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.99) / 1e3,
+          h->max / 1e3);
+}
+
+static void stats_commands(client *c) {
+    int i;
+
+    for (i = 0; i < NELMS(cmds); i++)
+        stats_command(c, cmds[i].cmd, &cmds[i].stats);
+    stats_command(c, "unknown", &unknown_stats);
+    stats_command(c, "none", &other_stats);
+}
+
+static void stats_loop(client *c) {
+    const loop_stats_t *l = &loop_stats;
+
+    reply(c, RPL_STATSDEBUG, "e :%lu wakeups %lu idle %lu events, "
+          "events/wakeup p50 %llu p99 %llu max %llu", l->wakeups, l->idle,
+          l->events, (unsigned long long)hist_percentile(&l->batch, 0.5),
+          (unsigned long long)hist_percentile(&l->batch, 0.99),
+          (unsigned long long)l->batch.max);
+    reply(c, RPL_STATSDEBUG, "e :busy us p50 %.1f p99 %.1f p99.9 %.1f "
+          "max %.1f", hist_percentile(&l->busy, 0.5) / 1e3,
+          hist_percentile(&l->busy, 0.99) / 1e3,
+          hist_percentile(&l->busy, 0.999) / 1e3, l->busy.max / 1e3);
+    reply(c, RPL_STATSDEBUG, "e :queued bytes now %lu p50 %llu p99 %llu "
+          "peak %lu", clients_queued,
+          (unsigned long long)hist_percentile(&l->queued, 0.5),
+          (unsigned long long)hist_percentile(&l->queued, 0.99),
+          l->queued_peak);
+    reply(c, RPL_STATSDEBUG, "e :%lu sends in %lu writes, %.2f per write",
+          l->sends, l->writes, l->writes ? (double)l->sends / l->writes : 0);
+}
+
+/* The most recently active histories first, at most STATS_HISTORY */
+#define STATS_HISTORY 32
+
+static void stats_history(client *c) {
+    const backlog_t *b;
+    backlog_stats_t st;
+    time_t now = time(NULL);
+    int i;
+
+    backlog_stats(&st);
+    for (b = backlog_next(NULL), i = 0; b && i < STATS_HISTORY;
+         b = backlog_next(b), i++)
+        reply(c, RPL_STATSDEBUG, "h :%s %u lines %lu bytes, active %lds "
+              "ago, %lu replays", b->name->s, b->n, b->bytes,
+              (long)(now - b->active), b->replays);
+    reply(c, RPL_STATSDEBUG, "h :%lu channels %lu lines %lu/%lu bytes, "
+          "%lu lines evicted", st.channels, st.lines, st.bytes, st.cap,
+          st.evicted);
+    reply(c, RPL_STATSDEBUG, "h :%lu replays %lu lines, us p50 %.1f "
+          "p99 %.1f max %.1f", st.replays, st.replayed,
+          hist_percentile(&st.replay_ns, 0.5) / 1e3,
+          hist_percentile(&st.replay_ns, 0.99) / 1e3,
+          st.replay_ns.max / 1e3);
+}
+
+/*
+ * Every metric as "name value", one at a time through emit: counters
+ * as they are, histograms as count, mean, p50, p99, p999 and max.
+ */
+typedef void (*emit_t)(void *ctx, const char *name, unsigned long long v);
+
+static void emit_hist(emit_t emit, void *ctx, const char *name,
+                      const hist_t *h) {
+    static const struct { const char *suffix; double p; } pcts[] = {
+        { "p50", 0.5 }, { "p99", 0.99 }, { "p999", 0.999 }
+    };
+    char buf[128];
+    int i;
+
+    snprintf(buf, sizeof(buf), "%s.count", name);
+    emit(ctx, buf, h->count);
+    snprintf(buf, sizeof(buf), "%s.mean", name);
+    emit(ctx, buf, hist_mean(h));
+    for (i = 0; i < NELMS(pcts); i++) {
+        snprintf(buf, sizeof(buf), "%s.%s", name, pcts[i].suffix);
+        emit(ctx, buf, hist_percentile(h, pcts[i].p));
+    }
+    snprintf(buf, sizeof(buf), "%s.max", name);
+    emit(ctx, buf, h->max);
+}
+
+static void emit_command(emit_t emit, void *ctx, const char *name,
+                         const cmd_stats_t *st) {
+    char buf[128];
+    int i;
+
+    snprintf(buf, sizeof(buf), "cmd.%s.calls", name);
+    emit(ctx, buf, st->calls);
+    snprintf(buf, sizeof(buf), "cmd.%s.bytes_in", name);
+    emit(ctx, buf, st->bytes_in);
+    snprintf(buf, sizeof(buf), "cmd.%s.bytes_out", name);
+    emit(ctx, buf, st->bytes_out);
+    for (i = 0; i < IRC_N_ERRS; i++) {
+        if (!st->errors[i])
+            continue;
+        snprintf(buf, sizeof(buf), "cmd.%s.errors.%03d", name,
+                 irc_err_codes[i]);
+        emit(ctx, buf, st->errors[i]);
+    }
+    snprintf(buf, sizeof(buf), "cmd.%s.latency_ns", name);
+    emit_hist(emit, ctx, buf, &st->latency);
+}
+
+static void emit_all(emit_t emit, void *ctx) {
+    const loop_stats_t *l = &loop_stats;
+    unsigned long logged, dropped;
+    unsigned long rss = rss_bytes();
+    pool_stats_t pool;
+    intern_stats_t in;
+    admit_stats_t ad;
+    backlog_stats_t bl;
+    unsigned long bans = 0, lookups = 0, tried = 0;
+    char buf[64], cls[16];
+    channel *ch;
+    int i;
+
+    for (i = 0; i < NELMS(cmds); i++)
+        emit_command(emit, ctx, cmds[i].cmd, &cmds[i].stats);
+    emit_command(emit, ctx, "unknown", &unknown_stats);
+    emit_command(emit, ctx, "none", &other_stats);
+    emit(ctx, "loop.wakeups", l->wakeups);
+    emit(ctx, "loop.idle", l->idle);
+    emit(ctx, "loop.events", l->events);
+    emit_hist(emit, ctx, "loop.batch", &l->batch);
+    emit_hist(emit, ctx, "loop.busy_ns", &l->busy);
+    emit_hist(emit, ctx, "loop.queued_bytes", &l->queued);
+    emit(ctx, "loop.queued_bytes.now", clients_queued);
+    emit(ctx, "loop.queued_bytes.peak", l->queued_peak);
+    emit(ctx, "loop.sends", l->sends);
+    emit(ctx, "loop.writes", l->writes);
+    emit(ctx, "flood.throttled", l->throttled);
+    emit(ctx, "flood.paused", l->paused);
+    emit(ctx, "mem.connections", l->connections);
+    emit(ctx, "mem.inbufs", l->inbufs);
+    emit(ctx, "mem.client_bytes", sizeof(client));
+    emit(ctx, "mem.rss_bytes", rss);
+    emit(ctx, "mem.rss_per_connection", l->connections && rss > l->rss_start ?
+         (rss - l->rss_start) / l->connections : 0);
+    emit(ctx, "bulk.lines", bulk_lines);
+    emit(ctx, "bulk.deferred", bulk_deferred);
+    dlog_stats(&logged, &dropped);
+    emit(ctx, "log.messages", logged);
+    emit(ctx, "log.dropped", dropped);
+    pool_stats(&pool);
+    for (i = 0; i <= POOL_CLASSES; i++) {
+        if (i < POOL_CLASSES)
+            snprintf(cls, sizeof(cls), "%u", pool_class_size[i]);
+        else
+            strcpy(cls, "large");
+        snprintf(buf, sizeof(buf), "pool.%s.allocs", cls);
+        emit(ctx, buf, pool.allocs[i]);
+        snprintf(buf, sizeof(buf), "pool.%s.in_use", cls);
+        emit(ctx, buf, pool.in_use[i]);
+    }
+    emit(ctx, "pool.slabs", pool.slabs);
+    emit(ctx, "pool.heap_calls", pool.heap);
+    intern_stats(&in);
+    emit(ctx, "intern.strings", in.strings);
+    emit(ctx, "intern.bytes", in.bytes);
+    emit(ctx, "intern.lookups", in.lookups);
+    emit(ctx, "intern.hits", in.hits);
+    admit_stats(&ad);
+    emit(ctx, "admit.accepted", ad.accepted);
+    for (i = ADMIT_OK + 1; i < ADMIT_REASONS; i++) {
+        snprintf(buf, sizeof(buf), "admit.reject.%s", admit_reason[i]);
+        emit(ctx, buf, ad.rejects[i]);
+    }
+    emit(ctx, "admit.tracked", ad.tracked);
+    emit(ctx, "admit.evicted", ad.evicted);
+    for (ch = channel_list; ch; ch = ch->next) {
+        bans += ch->bans.count;
+        lookups += ch->bans.lookups;
+        tried += ch->bans.tried;
+    }
+    emit(ctx, "bans.masks", bans);
+    emit(ctx, "bans.lookups", lookups);
+    emit(ctx, "bans.tried", tried);
+    backlog_stats(&bl);
+    emit(ctx, "history.channels", bl.channels);
+    emit(ctx, "history.lines", bl.lines);
+    emit(ctx, "history.bytes", bl.bytes);
+    emit(ctx, "history.cap_bytes", bl.cap);
+    emit(ctx, "history.evicted", bl.evicted);
+    emit(ctx, "history.replays", bl.replays);
+    emit(ctx, "history.replayed_lines", bl.replayed);
+    emit_hist(emit, ctx, "history.replay_ns", &bl.replay_ns);
+}
+
+static void emit_reply(void *ctx, const char *name, unsigned long long v) {
+    reply(ctx, RPL_STATSDEBUG, "m :%s %llu", name, v);
+}
+
+static void emit_file(void *ctx, const char *name, unsigned long long v) {
+    fprintf(ctx, "%s %llu\n", name, v);
+}
+
+static void stats_machine(client *c) {
+    emit_all(emit_reply, c);
+}
+
+void irc_stats_dump(FILE *f) {
+    emit_all(emit_file, f);
+    fflush(f);
+}
+
+
+/*
+ * Split a line into prefix, command and parameters, in place.  params
+ * must have room for MAX_MSG_TOKENS entries.  Returns the number of
+ * parameters, or -1 if there is no command.
  */
 
-void handle_line(char *line) {
+int irc_parse(char *line, char **prefix_out, char **command_out,
+              char **params) {
     char *prefix = NULL, *trailing = NULL;
-    char *command, *pstart, *params[MAX_MSG_TOKENS];
+    char *command, *pstart;
     int n_params = 0;
 
-    DPRINTF(DEBUG_INPUT, "Handling line: %s\n", line);
-
     command = line;
     if (*line == ':') {
         prefix = ++line;
@@ -146,8 +1309,7 @@ void handle_line(char *line) {
     }
 
     if (!command || *command == '\0') {
-        /* Send ERR_UNKNOWNCOMMAND */
-        return;
+        return -1;
     }
 
     while (*command == ' ') {
@@ -155,8 +1317,7 @@ void handle_line(char *line) {
     }
 
     if (*command == '\0') {
-        /* Send ERR_UNKNOWNCOMMAND */
-        return;
+        return -1;
     }
 
     pstart = strchr(command, ' ');
@@ -196,38 +1357,182 @@ void handle_line(char *line) {
         params[n_params++] = trailing;
     }
 
+    *prefix_out = prefix;
+    *command_out = command;
+    return n_params;
+}
+
+
+/*
+ * Flood control.
+ *
+ * Every client has a bucket of tokens that refills at flood_rate a
+ * second up to flood_burst, and each line it sends takes the cost of
+ * its command (cmds[]).  A line is handled as long as the bucket isn't
+ * empty, even if that takes it below zero; after that sircd stops
+ * reading from the client until irc_flood_wait() says the debt has been
+ * paid off and a quarter of the burst is back, so it gets a few lines
+ * in each time it is let go on.  The bucket holds thousandths of a
+ * token and is only brought up to date when asked, so none of this
+ * needs a timer.
+ * Server links have flow control of their own (fwd.c) and no bucket.
+ */
+#define FLOOD_RATE    20        /* tokens per second */
+#define FLOOD_CHANNEL 2         /* a PRIVMSG to a channel, per channel */
+#define FLOOD_OTHER   1         /* empty lines, unknown commands */
+#define FLOOD_MAX     1000000   /* most -f takes for a rate or burst */
+
+static unsigned flood_rate = FLOOD_RATE, flood_burst = 2 * FLOOD_RATE;
+
+/*
+ * Parse -f: "rate[:burst]", burst twice the rate if left out; 0 is off.
+ * Neither may pass FLOOD_MAX, so a bucket's thousandths, refilled over
+ * any stretch of ms, stay well inside int64_t.
+ */
+int irc_flood_init(const char *spec) {
+    unsigned long rate, burst;
+    char *end;
+
+    rate = strtoul(spec, &end, 10);
+    if (end == spec)
+        return -1;
+    burst = 2 * rate;
+    if (*end == ':') {
+        spec = end + 1;
+        burst = strtoul(spec, &end, 10);
+        if (end == spec)
+            return -1;
+    }
+    if (*end || (rate && !burst) || rate > FLOOD_MAX || burst > FLOOD_MAX)
+        return -1;
+    flood_rate = rate;
+    flood_burst = burst;
+    return 0;
+}
+
+/* Bring c's bucket up to now (ms); how long before it may send again */
+unsigned irc_flood_wait(client *c, uint64_t now) {
+    int64_t tokens;
+
+    if (!flood_rate)
+        return 0;
+    tokens = c->flood_tokens + (int64_t)(now - c->flood_last) * flood_rate;
+    if (tokens > (int64_t)flood_burst * 1000)
+        tokens = (int64_t)flood_burst * 1000;
+    c->flood_tokens = tokens;
+    c->flood_last = now;
+    if (tokens > 0)
+        return 0;
+    return (-tokens + flood_burst * 250) / flood_rate + 1;
+}
+
+/* The cost of command d (NULL: not one we know) with these params */
+static int flood_cost(const struct dispatch *d, char **params,
+                      int n_params) {
+    const char *t;
+    int cost;
+
+    if (!d)
+        return FLOOD_OTHER;
+    if (d->handler == cmd_mode && n_params > 3)
+        return d->cost * (n_params - 2);
+    if (d->handler != cmd_privmsg || n_params < 1)
+        return d->cost;
+    for (cost = 0, t = params[0]; t; t = strchr(t, ',')) {
+        if (*t == ',')
+            t++;
+        cost += (*t == '#' || *t == '&') ? FLOOD_CHANNEL : d->cost;
+    }
+    return cost;
+}
+
+static void flood_charge(client *c, int cost) {
+    if (flood_rate)
+        c->flood_tokens -= cost * 1000;
+}
+
+
+/* Handle a command line from client c.
+ *
+ * This function takes a single line (i.e., don't just pass
+ * it the result of calling readline of text.  You MUST have
+ * ensured that it's a complete ()).
+ * Strip the trailing newline off before calling this function.
+ */
+
+void handle_line(client *c, char *line) {
+    char *prefix, *command, *params[MAX_MSG_TOKENS];
+    size_t len = strlen(line) + 2;
+    int n_params;
+
+    /* Traced input is logged, but not an operator's password */
+    CDPRINTF(c, DEBUG_INPUT, "Handling line from client %d: %s\n", c->slot,
+             strncasecmp(line, "OPER ", 5) ? line : "OPER ...");
 
-    DPRINTF(DEBUG_INPUT, "Prefix:  %s\nCommand: %s\nParams (%d):\n",
+    n_params = irc_parse(line, &prefix, &command, params);
+    if (n_params < 0) {
+        /* Empty lines are silently ignored */
+        if (c->kind == CONN_CLIENT)
+            flood_charge(c, FLOOD_OTHER);
+        return;
+    }
+
+    CDPRINTF(c, DEBUG_INPUT, "Prefix:  %s\nCommand: %s\nParams (%d):\n",
         prefix ? prefix : "<none>", command, n_params);
     int i;
     for (i = 0; i < n_params; i++) {
-	   DPRINTF(DEBUG_INPUT, "   %s\n", params[i]);
+	   CDPRINTF(c, DEBUG_INPUT, "   %s\n", i > 0 &&
+                    !strcasecmp(command, "OPER") ? "..." : params[i]);
+    }
+    CDPRINTF(c, DEBUG_INPUT, "\n");
+
+    if (c->kind != CONN_CLIENT) {
+        fwd_handle_line(c, len, prefix, command, params, n_params);
+        return;
     }
-    DPRINTF(DEBUG_INPUT, "\n");
 
     for (i = 0; i < NELMS(cmds); i++) {
     	if (!strcasecmp(cmds[i].cmd, command)) {
-    	    if (cmds[i].needreg /* && YOUR TEST HERE TO
-                                          SEE IF CLIENT IS REGISTERED */) {
-                // raise ERR_NOTREGISTERED
-        		/* ERROR - the client is not registered and they need
-        		 * to be in order to use this command! */
+            flood_charge(c, flood_cost(&cmds[i], params, n_params));
+            irc_current = &cmds[i].stats;
+            irc_current->calls++;
+            irc_current->bytes_in += len;
+    	    if (cmds[i].needreg && !c->registered) {
+                reply(c, ERR_NOTREGISTERED, ":You have not registered");
             } else if (n_params < cmds[i].minparams) {
-    		/* ERROR - the client didn't specify enough parameters
-    		 * for this command! */
-                // raise ERR_NEEDMOREPARAMS
+                reply(c, ERR_NEEDMOREPARAMS, "%s :Not enough parameters",
+                      cmds[i].cmd);
             } else {
-        		/* Here's the call to the cmd_foo handler... modify
-        		 * to send it the right params per your program
-        		 * structure. */
-                (*cmds[i].handler)(prefix, params, n_params);
+                uint64_t start = mono_ns(), ns;
+                CDPRINTF(c, DEBUG_COMMANDS, "client %d: %s\n", c->slot,
+                         cmds[i].cmd);
+                (*cmds[i].handler)(c, prefix, params, n_params);
+                ns = mono_ns() - start;
+                hist_add(&irc_current->latency, ns);
+                PROBE4(command, c->id, i, cmds[i].cmd, ns);
             }
             break;
         }
     }
 
     if (i == NELMS(cmds)) {
-    	/* ERROR - unknown command! */
-        // raise ERR_UNKNOWNCOMMAND
+        flood_charge(c, flood_cost(NULL, params, n_params));
+        irc_current = &unknown_stats;
+        irc_current->calls++;
+        irc_current->bytes_in += len;
+        reply(c, ERR_UNKNOWNCOMMAND, "%s :Unknown command", command);
     }
+    irc_current = &other_stats;
+}
+
+
+/* Called by sircd when a client goes away for any reason */
+
+void irc_client_gone(client *c, const char *reason) {
+    if (c != bulk_busy)
+        bulk_cancel(c);         /* else irc_bulk_run() does, after */
+    if (c->kind == CONN_CLIENT)
+        leave_channel(c, "QUIT", reason);
+    if (c->registered)
+        rt_local_changed(&routing);
 }
@@ -1,10 +1,14 @@
 #ifndef _IRC_PROTO_H_
 #define _IRC_PROTO_H_
 
+#include <stdio.h>
+#include "sircd.h"
+
 typedef enum {
     ERR_INVALID = 1,
     ERR_NOSUCHNICK = 401,
     ERR_NOSUCHCHANNEL = 403,
+    ERR_CANNOTSENDTOCHAN = 404,
     ERR_NORECIPIENT = 411,
     ERR_NOTEXTTOSEND = 412,
     ERR_UNKNOWNCOMMAND = 421,
@@ -13,24 +17,70 @@ typedef enum {
     ERR_NONICKNAMEGIVEN = 431,
     ERR_NOTONCHANNEL = 442,
     ERR_NOLOGIN = 444,
+    ERR_PASSWDMISMATCH = 464,
+    ERR_NOPRIVILEGES = 481,
+    ERR_NOOPERHOST = 491,
     ERR_NOTREGISTERED = 451,
     ERR_NEEDMOREPARAMS = 461,
-    ERR_ALREADYREGISTRED = 462
+    ERR_ALREADYREGISTRED = 462,
+    ERR_UNKNOWNMODE = 472,
+    ERR_BANNEDFROMCHAN = 474,
+    ERR_BANLISTFULL = 478
 } err_t;
 
 typedef enum {
     RPL_NONE = 300,
+    RPL_ENDOFSTATS = 219,
+    RPL_STATSDEBUG = 249,
     RPL_USERHOST = 302,
+    RPL_YOUREOPER = 381,
     RPL_LISTSTART = 321,
     RPL_LIST = 322,
     RPL_LISTEND = 323,
+    RPL_CHANNELMODEIS = 324,
     RPL_WHOREPLY = 352,
     RPL_ENDOFWHO = 315,
     RPL_NAMREPLY = 353,
+    RPL_BANLIST = 367,
+    RPL_ENDOFBANLIST = 368,
     RPL_ENDOFNAMES = 366,
     RPL_MOTDSTART = 375,
     RPL_MOTD = 372,
     RPL_ENDOFMOTD = 376
 } rpl_t;
 
+/*
+ * Per-command metrics: one set for each command in the dispatch table,
+ * one for unknown commands and one for output that isn't a response to
+ * a client command (relayed server traffic, CREDIT grants).  Error
+ * numerics sent are counted by code, in the order of irc_err_codes[].
+ */
+#define IRC_N_ERRS 21
+
+typedef struct cmd_stats {
+    unsigned long calls;
+    unsigned long errors[IRC_N_ERRS];
+    unsigned long bytes_in;
+    unsigned long bytes_out;      /* everything sent while handling it */
+    hist_t latency;               /* ns in the handler */
+} cmd_stats_t;
+
+extern const err_t irc_err_codes[IRC_N_ERRS];
+extern cmd_stats_t *irc_current;  /* output is charged to this */
+
+int irc_parse(char *line, char **prefix, char **command, char **params);
+unsigned irc_strhash(const char *s);
+void handle_line(client *c, char *line);
+int irc_flood_init(const char *spec);
+int irc_oper_init(char *spec);
+unsigned irc_flood_wait(client *c, uint64_t now_ms);
+void irc_client_gone(client *c, const char *reason);
+void irc_stats_dump(FILE *f);
+
+/* Bulk replies (LIST, WHO, NAMES); sircd runs them once per iteration */
+struct channel;
+void irc_bulk_run(void);
+int irc_bulk_pending(void);
+void irc_channel_gone(struct channel *ch);
+
 #endif /* _IRC_PROTO_H_ */
@@ -0,0 +1,953 @@
+/*
+ * lsdb.c
+ *
+ * Link state advertisements: building them, putting them on the wire,
+ * and keeping the newest one from every node in a database.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "lsdb.h"
+#include "chansum.h"
+#include "debug.h"
+
+#define LSDB_MIN_INDEX 64
+
+
+/* LSA construction */
+
+lsa_t *lsa_new(u_long sender, uint32_t seq) {
+    lsa_t *lsa = calloc(1, sizeof(lsa_t));
+    if (!lsa)
+        return NULL;
+    lsa->sender = sender;
+    lsa->seq = seq;
+    lsa->ttl = LSA_DEFAULT_TTL;
+    return lsa;
+}
+
+void lsa_free(lsa_t *lsa) {
+    if (!lsa)
+        return;
+    free(lsa->links);
+    free(lsa->users);
+    free(lsa->chans);
+    free(lsa->strings);
+    free(lsa->added);
+    free(lsa->removed);
+    free(lsa->delta_strings);
+    free(lsa->bloom);
+    free(lsa);
+}
+
+int lsa_set_links(lsa_t *lsa, const u_long *links, int n) {
+    u_long *copy = NULL;
+
+    if (n > 0) {
+        copy = malloc(n * sizeof(u_long));
+        if (!copy)
+            return -1;
+        memcpy(copy, links, n * sizeof(u_long));
+    }
+    free(lsa->links);
+    lsa->links = copy;
+    lsa->n_links = n;
+    return 0;
+}
+
+static int cmp_name(const void *a, const void *b) {
+    return strcasecmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Copy two lists of names into one freshly allocated block.  A name
+ * longer than LSA_MAX_NAME can't be encoded, and fails the lot.
+ */
+static int pack_names(char **a, int na, char **b, int nb,
+                      char ***out_a, char ***out_b, char **out_block) {
+    size_t total = 0, len;
+    char *p, *block;
+    char **pa = NULL, **pb = NULL;
+    int i;
+
+    for (i = 0; i < na + nb; i++) {
+        len = strlen(i < na ? a[i] : b[i - na]);
+        if (len > LSA_MAX_NAME)
+            return -1;
+        total += len + 1;
+    }
+
+    block = malloc(total ? total : 1);
+    if (na)
+        pa = malloc(na * sizeof(char *));
+    if (nb)
+        pb = malloc(nb * sizeof(char *));
+    if (!block || (na && !pa) || (nb && !pb)) {
+        free(block);
+        free(pa);
+        free(pb);
+        return -1;
+    }
+
+    p = block;
+    for (i = 0; i < na + nb; i++) {
+        char *name = i < na ? a[i] : b[i - na];
+        len = strlen(name);
+        memcpy(p, name, len);
+        p[len] = '\0';
+        if (i < na)
+            pa[i] = p;
+        else
+            pb[i - na] = p;
+        p += len + 1;
+    }
+    *out_a = pa;
+    *out_b = pb;
+    *out_block = block;
+    return 0;
+}
+
+/*
+ * Set the users and the full channel set.  The names are copied, so
+ * they may point into lsa's current strings.
+ */
+int lsa_set_names(lsa_t *lsa, char **users, int n_users,
+                  char **chans, int n_chans) {
+    char **u, **c, *strings;
+
+    if (pack_names(users, n_users, chans, n_chans, &u, &c, &strings) < 0)
+        return -1;
+    if (n_chans > 1)
+        qsort(c, n_chans, sizeof(char *), cmp_name);
+
+    free(lsa->users);
+    free(lsa->chans);
+    free(lsa->strings);
+    lsa->users = u;
+    lsa->n_users = n_users;
+    lsa->chans = c;
+    lsa->n_chans = n_chans;
+    lsa->strings = strings;
+    return 0;
+}
+
+/*
+ * Advertise the channels as a delta against the LSA numbered base.
+ * The full set must also be set (lsa_set_names) so the LSA can be sent
+ * whole to a neighbor that needs it.
+ */
+int lsa_set_delta(lsa_t *lsa, uint32_t base, char **added, int n_added,
+                  char **removed, int n_removed) {
+    char **a, **r, *strings;
+
+    if (pack_names(added, n_added, removed, n_removed, &a, &r,
+                   &strings) < 0)
+        return -1;
+    free(lsa->added);
+    free(lsa->removed);
+    free(lsa->delta_strings);
+    lsa->added = a;
+    lsa->n_added = n_added;
+    lsa->removed = r;
+    lsa->n_removed = n_removed;
+    lsa->delta_strings = strings;
+    lsa->delta_base = base;
+    lsa->chan_fmt = LSA_CHANS_DELTA;
+    return 0;
+}
+
+int lsa_set_bloom(lsa_t *lsa, const uint8_t *bloom, unsigned bits,
+                  unsigned k) {
+    uint8_t *copy = malloc(bits / 8 ? bits / 8 : 1);
+
+    if (!copy)
+        return -1;
+    memcpy(copy, bloom, bits / 8);
+    free(lsa->bloom);
+    lsa->bloom = copy;
+    lsa->bloom_bits = bits;
+    lsa->bloom_k = k;
+    lsa->chan_fmt = LSA_CHANS_BLOOM;
+    return 0;
+}
+
+static int in_list(char **list, int n, const char *name) {
+    int i;
+    for (i = 0; i < n; i++)
+        if (!strcasecmp(list[i], name))
+            return 1;
+    return 0;
+}
+
+/*
+ * Rebuild the full channel set of a just received delta LSA from the
+ * one it was based on.  If prev isn't that LSA the node is marked
+ * stale, which makes it look interested in every channel until a full
+ * set arrives.  Returns -1 in that case.
+ */
+int lsa_apply_delta(lsa_t *lsa, const lsa_t *prev) {
+    char **merged;
+    int i, n = 0, ret;
+
+    if (lsa->chan_fmt != LSA_CHANS_DELTA)
+        return 0;
+    if (!prev || prev->chan_stale || prev->chan_fmt == LSA_CHANS_BLOOM ||
+        prev->seq != lsa->delta_base) {
+        lsa->chan_stale = 1;
+        chansum_stats.stale++;
+        return -1;
+    }
+
+    merged = malloc((prev->n_chans + lsa->n_added + 1) * sizeof(char *));
+    if (!merged)
+        return -1;
+    for (i = 0; i < prev->n_chans; i++)
+        if (!in_list(lsa->removed, lsa->n_removed, prev->chans[i]))
+            merged[n++] = prev->chans[i];
+    for (i = 0; i < lsa->n_added; i++)
+        if (!in_list(merged, n, lsa->added[i]))
+            merged[n++] = lsa->added[i];
+
+    ret = lsa_set_names(lsa, lsa->users, lsa->n_users, merged, n);
+    free(merged);
+    return ret;
+}
+
+int lsa_has_link(const lsa_t *lsa, u_long nodeID) {
+    int i;
+    for (i = 0; i < lsa->n_links; i++)
+        if (lsa->links[i] == nodeID)
+            return 1;
+    return 0;
+}
+
+/*
+ * Might the node behind lsa have members in chan?  Exact summaries give
+ * an exact answer, Bloom filters may say yes wrongly.
+ */
+int lsa_may_have_chan(const lsa_t *lsa, const char *chan) {
+    if (lsa->chan_fmt == LSA_CHANS_BLOOM)
+        return bloom_test(lsa->bloom, lsa->bloom_bits, lsa->bloom_k, chan);
+    if (lsa->chan_stale)
+        return 1;
+    return bsearch(&chan, lsa->chans, lsa->n_chans, sizeof(char *),
+                   cmp_name) != NULL;
+}
+
+
+/* Wire format */
+
+static void put16(uint8_t *p, uint16_t v) {
+    v = htons(v);
+    memcpy(p, &v, 2);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static uint16_t get16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return ntohs(v);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+static void put_header(uint8_t *buf, int type, uint8_t ttl,
+                       u_long sender, uint32_t seq) {
+    buf[0] = LSA_VERSION;
+    buf[1] = ttl;
+    put16(buf + 2, type);
+    put32(buf + 4, sender);
+    put32(buf + 8, seq);
+}
+
+static size_t names_len(char **names, int n) {
+    size_t len = 0;
+    int i;
+    for (i = 0; i < n; i++)
+        len += 1 + strlen(names[i]);
+    return len;
+}
+
+static size_t put_names(uint8_t *buf, char **names, int n) {
+    size_t off = 0, len;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        len = strlen(names[i]);
+        buf[off++] = len;
+        memcpy(buf + off, names[i], len);
+        off += len;
+    }
+    return off;
+}
+
+/*
+ * Encode lsa into buf.  A delta LSA is sent as a delta unless full is
+ * set, in which case its complete channel set is sent instead.
+ */
+ssize_t lsa_encode(const lsa_t *lsa, uint8_t *buf, size_t len, int full) {
+    int i, fmt = lsa->chan_fmt;
+    size_t need, off;
+
+    /* A delta we couldn't apply has no full set to send */
+    if (fmt == LSA_CHANS_DELTA && full && !lsa->chan_stale)
+        fmt = LSA_CHANS_FULL;
+
+    need = LSA_FIXED_LEN + 4 * lsa->n_links +
+           names_len(lsa->users, lsa->n_users);
+    if (fmt == LSA_CHANS_FULL)
+        need += 4 + names_len(lsa->chans, lsa->n_chans);
+    else if (fmt == LSA_CHANS_DELTA)
+        need += 12 + names_len(lsa->added, lsa->n_added) +
+                names_len(lsa->removed, lsa->n_removed);
+    else
+        need += 3 + lsa->bloom_bits / 8;
+    if (need > len)
+        return -1;
+
+    put_header(buf, LSA_TYPE_ADVERT, lsa->ttl, lsa->sender, lsa->seq);
+    put32(buf + 12, lsa->n_links);
+    put32(buf + 16, lsa->n_users);
+    buf[20] = fmt;
+    buf[21] = buf[22] = buf[23] = 0;
+    off = LSA_FIXED_LEN;
+
+    for (i = 0; i < lsa->n_links; i++, off += 4)
+        put32(buf + off, lsa->links[i]);
+    off += put_names(buf + off, lsa->users, lsa->n_users);
+
+    switch (fmt) {
+    case LSA_CHANS_FULL:
+        put32(buf + off, lsa->n_chans);
+        off += 4;
+        off += put_names(buf + off, lsa->chans, lsa->n_chans);
+        break;
+    case LSA_CHANS_DELTA:
+        put32(buf + off, lsa->delta_base);
+        put32(buf + off + 4, lsa->n_added);
+        put32(buf + off + 8, lsa->n_removed);
+        off += 12;
+        off += put_names(buf + off, lsa->added, lsa->n_added);
+        off += put_names(buf + off, lsa->removed, lsa->n_removed);
+        break;
+    case LSA_CHANS_BLOOM:
+        put16(buf + off, lsa->bloom_bits);
+        buf[off + 2] = lsa->bloom_k;
+        off += 3;
+        memcpy(buf + off, lsa->bloom, lsa->bloom_bits / 8);
+        off += lsa->bloom_bits / 8;
+        break;
+    }
+    return off;
+}
+
+ssize_t lsa_encode_ack(u_long sender, uint32_t seq, uint8_t *buf, size_t len) {
+    if (len < LSA_HDR_LEN)
+        return -1;
+    put_header(buf, LSA_TYPE_ACK, 1, sender, seq);
+    return LSA_HDR_LEN;
+}
+
+/*
+ * Acknowledge n LSAs, given by originator in ascending order.  Runs of
+ * consecutive originators share one range header.  Returns -1 if they
+ * don't fit in len.
+ */
+ssize_t lsa_encode_acks(u_long sender, const u_long *senders,
+                        const uint32_t *seqs, int n, uint8_t *buf,
+                        size_t len) {
+    size_t off = LSA_HDR_LEN + 4;
+    int i, j, ranges = 0;
+
+    if (len < off)
+        return -1;
+    put_header(buf, LSA_TYPE_ACKS, 1, sender, 0);
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && j - i < 0xffff &&
+             senders[j] == senders[j - 1] + 1; j++)
+            ;
+        if (off + 8 + 4 * (size_t)(j - i) > len)
+            return -1;
+        put32(buf + off, senders[i]);
+        put16(buf + off + 4, j - i);
+        put16(buf + off + 6, 0);
+        off += 8;
+        for (; i < j; i++, off += 4)
+            put32(buf + off, seqs[i]);
+        ranges++;
+    }
+    put16(buf + LSA_HDR_LEN, ranges);
+    put16(buf + LSA_HDR_LEN + 2, 0);
+    return off;
+}
+
+/* Returns the number of LSAs acknowledged, or -1 if malformed */
+int lsa_decode_acks(const uint8_t *buf, size_t len, u_long *senders,
+                    uint32_t *seqs, int max) {
+    size_t off = LSA_HDR_LEN + 4;
+    int r, i, ranges, count, n = 0;
+    u_long first;
+
+    if (len < off)
+        return -1;
+    ranges = get16(buf + LSA_HDR_LEN);
+    for (r = 0; r < ranges; r++) {
+        if (len < off + 8)
+            return -1;
+        first = get32(buf + off);
+        count = get16(buf + off + 4);
+        off += 8;
+        if (n + count > max || len < off + 4 * (size_t)count)
+            return -1;
+        for (i = 0; i < count; i++, off += 4) {
+            senders[n] = first + i;
+            seqs[n++] = get32(buf + off);
+        }
+    }
+    return n;
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+    put32(p, v >> 32);
+    put32(p + 4, v);
+}
+
+static uint64_t get64(const uint8_t *p) {
+    return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+ssize_t lsa_encode_digest(u_long sender, int level, const uint16_t *pos,
+                          const uint64_t *hash, int n, uint8_t *buf,
+                          size_t len) {
+    size_t off = LSA_HDR_LEN + 4;
+    int i;
+
+    if (len < off + 10 * (size_t)n)
+        return -1;
+    put_header(buf, LSA_TYPE_DIGEST, 1, sender, 0);
+    buf[LSA_HDR_LEN] = level;
+    buf[LSA_HDR_LEN + 1] = 0;
+    put16(buf + LSA_HDR_LEN + 2, n);
+    for (i = 0; i < n; i++, off += 10) {
+        put16(buf + off, pos[i]);
+        put64(buf + off + 2, hash[i]);
+    }
+    return off;
+}
+
+/* Returns the number of (pos, hash) pairs, or -1 if malformed */
+int lsa_decode_digest(const uint8_t *buf, size_t len, int *level,
+                      uint16_t *pos, uint64_t *hash, int max) {
+    size_t off = LSA_HDR_LEN + 4;
+    int i, n;
+
+    if (len < off)
+        return -1;
+    *level = buf[LSA_HDR_LEN];
+    n = get16(buf + LSA_HDR_LEN + 2);
+    if (n > max || len < off + 10 * (size_t)n)
+        return -1;
+    for (i = 0; i < n; i++, off += 10) {
+        pos[i] = get16(buf + off);
+        hash[i] = get64(buf + off + 2);
+    }
+    return n;
+}
+
+/*
+ * Our (sender, seq) pairs in each of the given buckets.  Returns -1 if
+ * they don't fit in len.
+ */
+ssize_t lsa_encode_leaves(u_long sender, int reply, const lsdb_t *db,
+                          const uint16_t *buckets, int n_buckets,
+                          uint8_t *buf, size_t len) {
+    size_t off = LSA_HDR_LEN + 4, count_at;
+    int i, j, n;
+
+    if (len < off)
+        return -1;
+    put_header(buf, LSA_TYPE_LEAVES, 1, sender, 0);
+    buf[LSA_HDR_LEN] = reply;
+    buf[LSA_HDR_LEN + 1] = 0;
+    put16(buf + LSA_HDR_LEN + 2, n_buckets);
+    for (i = 0; i < n_buckets; i++) {
+        if (off + 4 > len)
+            return -1;
+        put16(buf + off, buckets[i]);
+        count_at = off + 2;
+        off += 4;
+        for (j = n = 0; j < db->size; j++) {
+            const lsa_t *lsa = db->entries[j];
+            if (lsdb_bucket(lsa->sender) != buckets[i])
+                continue;
+            if (off + 8 > len)
+                return -1;
+            put32(buf + off, lsa->sender);
+            put32(buf + off + 4, lsa->seq);
+            off += 8;
+            n++;
+        }
+        put16(buf + count_at, n);
+    }
+    return off;
+}
+
+/*
+ * Returns the number of (sender, seq) entries over all the buckets, or
+ * -1 if malformed.  buckets[] needs room for LSDB_MERKLE_LEAVES.
+ */
+int lsa_decode_leaves(const uint8_t *buf, size_t len, int *reply,
+                      uint16_t *buckets, int *n_buckets, u_long *senders,
+                      uint32_t *seqs, int max) {
+    size_t off = LSA_HDR_LEN + 4;
+    int i, j, n, total = 0;
+
+    if (len < off)
+        return -1;
+    *reply = buf[LSA_HDR_LEN];
+    *n_buckets = get16(buf + LSA_HDR_LEN + 2);
+    if (*n_buckets > LSDB_MERKLE_LEAVES)
+        return -1;
+    for (i = 0; i < *n_buckets; i++) {
+        if (off + 4 > len)
+            return -1;
+        buckets[i] = get16(buf + off);
+        n = get16(buf + off + 2);
+        off += 4;
+        if (total + n > max || off + 8 * (size_t)n > len)
+            return -1;
+        for (j = 0; j < n; j++, off += 8) {
+            senders[total] = get32(buf + off);
+            seqs[total++] = get32(buf + off + 4);
+        }
+    }
+    return total;
+}
+
+int lsa_peek(const uint8_t *buf, size_t len, int *type,
+             u_long *sender, uint32_t *seq) {
+    if (len < LSA_HDR_LEN || buf[0] != LSA_VERSION)
+        return -1;
+    *type = get16(buf + 2);
+    *sender = get32(buf + 4);
+    *seq = get32(buf + 8);
+    return 0;
+}
+
+/*
+ * Check that n length-prefixed names starting at buf[off] fit in len.
+ * Sets *end past the last one and adds the space they need (with NULs)
+ * to *bytes.
+ */
+static int check_names(const uint8_t *buf, size_t len, size_t off,
+                       uint32_t n, size_t *end, size_t *bytes) {
+    uint32_t i;
+
+    if (n > len)
+        return -1;
+    for (i = 0; i < n; i++) {
+        if (off >= len || off + 1 + buf[off] > len)
+            return -1;
+        *bytes += buf[off] + 1;
+        off += 1 + buf[off];
+    }
+    *end = off;
+    return 0;
+}
+
+/* Unpack n names validated by check_names(), copying them to *p */
+static char **get_names(const uint8_t *buf, size_t *off, uint32_t n,
+                        char **p) {
+    char **names = malloc((n ? n : 1) * sizeof(char *));
+    uint32_t i;
+
+    if (!names)
+        return NULL;
+    for (i = 0; i < n; i++) {
+        size_t len = buf[(*off)++];
+        memcpy(*p, buf + *off, len);
+        (*p)[len] = '\0';
+        names[i] = *p;
+        *p += len + 1;
+        *off += len;
+    }
+    return names;
+}
+
+/*
+ * Decode a complete advertisement.  Returns NULL if the packet is
+ * truncated or otherwise malformed.  A delta LSA comes back with only
+ * added[] and removed[] set; see lsa_apply_delta().
+ */
+lsa_t *lsa_decode(const uint8_t *buf, size_t len) {
+    uint32_t n_links, n_users, n_a = 0, n_b = 0, base = 0, i;
+    size_t off, chan_off, end, bytes = 0, bloom_bytes = 0;
+    int fmt;
+    lsa_t *lsa;
+    char *p;
+
+    if (len < LSA_FIXED_LEN || buf[0] != LSA_VERSION ||
+        get16(buf + 2) != LSA_TYPE_ADVERT)
+        return NULL;
+
+    n_links = get32(buf + 12);
+    n_users = get32(buf + 16);
+    fmt = buf[20];
+    if (n_links > len / 4)
+        return NULL;
+    off = LSA_FIXED_LEN + 4 * (size_t)n_links;
+    if (off > len || check_names(buf, len, off, n_users, &chan_off,
+                                 &bytes) < 0)
+        return NULL;
+
+    /* Validate the channel summary before allocating anything */
+    off = chan_off;
+    switch (fmt) {
+    case LSA_CHANS_FULL:
+        if (off + 4 > len)
+            return NULL;
+        n_a = get32(buf + off);
+        off += 4;
+        if (check_names(buf, len, off, n_a, &end, &bytes) < 0)
+            return NULL;
+        break;
+    case LSA_CHANS_DELTA:
+        if (off + 12 > len)
+            return NULL;
+        base = get32(buf + off);
+        n_a = get32(buf + off + 4);
+        n_b = get32(buf + off + 8);
+        off += 12;
+        if (check_names(buf, len, off, n_a, &end, &bytes) < 0 ||
+            check_names(buf, len, end, n_b, &end, &bytes) < 0)
+            return NULL;
+        break;
+    case LSA_CHANS_BLOOM:
+        if (off + 3 > len)
+            return NULL;
+        bloom_bytes = get16(buf + off) / 8;
+        if (bloom_bytes == 0 || buf[off + 2] == 0 ||
+            off + 3 + bloom_bytes > len)
+            return NULL;
+        break;
+    default:
+        return NULL;
+    }
+
+    lsa = lsa_new(get32(buf + 4), get32(buf + 8));
+    if (!lsa)
+        return NULL;
+    lsa->ttl = buf[1];
+    lsa->chan_fmt = fmt;
+    lsa->n_links = n_links;
+    lsa->links = n_links ? malloc(n_links * sizeof(u_long)) : NULL;
+    lsa->strings = malloc(bytes ? bytes : 1);
+    if ((n_links && !lsa->links) || !lsa->strings) {
+        lsa_free(lsa);
+        return NULL;
+    }
+
+    off = LSA_FIXED_LEN;
+    for (i = 0; i < n_links; i++, off += 4)
+        lsa->links[i] = get32(buf + off);
+
+    p = lsa->strings;
+    lsa->n_users = n_users;
+    if (!(lsa->users = get_names(buf, &off, n_users, &p)))
+        goto fail;
+
+    switch (fmt) {
+    case LSA_CHANS_FULL:
+        off += 4;
+        lsa->n_chans = n_a;
+        if (!(lsa->chans = get_names(buf, &off, n_a, &p)))
+            goto fail;
+        if (n_a > 1)
+            qsort(lsa->chans, n_a, sizeof(char *), cmp_name);
+        break;
+    case LSA_CHANS_DELTA:
+        off += 12;
+        lsa->delta_base = base;
+        lsa->n_added = n_a;
+        lsa->n_removed = n_b;
+        if (!(lsa->added = get_names(buf, &off, n_a, &p)) ||
+            !(lsa->removed = get_names(buf, &off, n_b, &p)))
+            goto fail;
+        break;
+    case LSA_CHANS_BLOOM:
+        lsa->bloom_bits = bloom_bytes * 8;
+        lsa->bloom_k = buf[off + 2];
+        lsa->bloom = malloc(bloom_bytes);
+        if (!lsa->bloom)
+            goto fail;
+        memcpy(lsa->bloom, buf + off + 3, bloom_bytes);
+        break;
+    }
+    return lsa;
+
+fail:
+    lsa_free(lsa);
+    return NULL;
+}
+
+
+/* The database */
+
+static unsigned hash_id(u_long id) {
+    uint32_t h = (uint32_t)id * 2654435761u;
+    return h ^ (h >> 16);
+}
+
+/* File entries[i] in the index */
+static void index_put(lsdb_t *db, int i) {
+    unsigned h = hash_id(db->entries[i]->sender) & (db->index_cap - 1);
+
+    while (db->index[h] >= 0)
+        h = (h + 1) & (db->index_cap - 1);
+    db->index[h] = i;
+}
+
+/* Index every entry afresh in cap slots; -1 (and no change) if out of
+   memory */
+static int index_rebuild(lsdb_t *db, int cap) {
+    int *index = malloc(cap * sizeof(int));
+    int i;
+
+    if (!index)
+        return -1;
+    free(db->index);
+    db->index = index;
+    db->index_cap = cap;
+    for (i = 0; i < cap; i++)
+        db->index[i] = -1;
+    for (i = 0; i < db->size; i++)
+        index_put(db, i);
+    return 0;
+}
+
+/*
+ * Empty slot h, moving later entries of its probe run back into the
+ * gap where their own hash allows, so lookups still find them.
+ */
+static void index_del(lsdb_t *db, unsigned h) {
+    unsigned mask = db->index_cap - 1, j = h, k;
+
+    db->index[h] = -1;
+    for (j = (j + 1) & mask; db->index[j] >= 0; j = (j + 1) & mask) {
+        k = hash_id(db->entries[db->index[j]]->sender) & mask;
+        /* Leave it if its home k is cyclically within (h, j] */
+        if (h <= j ? (h < k && k <= j) : (h < k || k <= j))
+            continue;
+        db->index[h] = db->index[j];
+        db->index[j] = -1;
+        h = j;
+    }
+}
+
+static int index_slot(const lsdb_t *db, u_long sender) {
+    unsigned h;
+
+    if (!db->index_cap)
+        return -1;
+    h = hash_id(sender) & (db->index_cap - 1);
+    while (db->index[h] >= 0) {
+        if (db->entries[db->index[h]]->sender == sender)
+            return h;
+        h = (h + 1) & (db->index_cap - 1);
+    }
+    return -1;
+}
+
+void lsdb_init(lsdb_t *db) {
+    memset(db, 0, sizeof(*db));
+    index_rebuild(db, LSDB_MIN_INDEX);
+}
+
+void lsdb_destroy(lsdb_t *db) {
+    int i;
+    for (i = 0; i < db->size; i++)
+        lsa_free(db->entries[i]);
+    free(db->entries);
+    free(db->index);
+    memset(db, 0, sizeof(*db));
+}
+
+lsa_t *lsdb_find(const lsdb_t *db, u_long sender) {
+    int h = index_slot(db, sender);
+    return h < 0 ? NULL : db->entries[db->index[h]];
+}
+
+/* Hash tree */
+
+int lsdb_bucket(u_long sender) {
+    return hash_id(sender * 0x9e3779b1u) % LSDB_MERKLE_LEAVES;
+}
+
+static uint64_t entry_hash(u_long sender, uint32_t seq) {
+    uint64_t h = ((uint64_t)sender << 32 | seq) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ull;
+    return h ^ (h >> 32);
+}
+
+/* Add (sign 1) or take out (sign -1) lsa along its path to the root */
+static void merkle_update(lsdb_t *db, const lsa_t *lsa, int sign) {
+    uint64_t h = entry_hash(lsa->sender, lsa->seq) * (uint64_t)(int64_t)sign;
+    int bucket = lsdb_bucket(lsa->sender);
+
+    db->merkle[1 + LSDB_MERKLE_FANOUT + bucket] += h;
+    db->merkle[1 + bucket / LSDB_MERKLE_FANOUT] += h;
+    db->merkle[0] += h;
+}
+
+/* The hash of the tree node at (level, pos), 0 if there is none */
+uint64_t lsdb_merkle(const lsdb_t *db, int level, int pos) {
+    switch (level) {
+    case 0:
+        return pos == 0 ? db->merkle[0] : 0;
+    case 1:
+        return pos < LSDB_MERKLE_FANOUT ? db->merkle[1 + pos] : 0;
+    case 2:
+        return pos < LSDB_MERKLE_LEAVES ?
+               db->merkle[1 + LSDB_MERKLE_FANOUT + pos] : 0;
+    }
+    return 0;
+}
+
+static int same_links(const lsa_t *a, const lsa_t *b) {
+    int i;
+    if (a->n_links != b->n_links)
+        return 0;
+    for (i = 0; i < a->n_links; i++)
+        if (!lsa_has_link(b, a->links[i]))
+            return 0;
+    return 1;
+}
+
+static int same_users(const lsa_t *a, const lsa_t *b) {
+    int i;
+    if (a->n_users != b->n_users)
+        return 0;
+    for (i = 0; i < a->n_users; i++)
+        if (strcmp(a->users[i], b->users[i]))
+            return 0;
+    return 1;
+}
+
+/* Would a and b answer lsa_may_have_chan() the same for every name? */
+static int same_chans(const lsa_t *a, const lsa_t *b) {
+    int i;
+
+    if (a->chan_fmt == LSA_CHANS_BLOOM || b->chan_fmt == LSA_CHANS_BLOOM)
+        return a->chan_fmt == b->chan_fmt && a->bloom_bits == b->bloom_bits &&
+               a->bloom_k == b->bloom_k &&
+               !memcmp(a->bloom, b->bloom, a->bloom_bits / 8);
+    if (a->chan_stale != b->chan_stale || a->n_chans != b->n_chans)
+        return 0;
+    for (i = 0; i < a->n_chans; i++)
+        if (strcmp(a->chans[i], b->chans[i]))
+            return 0;
+    return 1;
+}
+
+/*
+ * Store lsa if it is newer than what we have for its sender.  Returns 1
+ * if the database took ownership of lsa, 0 if it was stale (the caller
+ * still owns it), -1 on allocation failure.
+ */
+int lsdb_update(lsdb_t *db, lsa_t *lsa) {
+    int h = index_slot(db, lsa->sender);
+    lsa_t *old;
+
+    if (h >= 0) {
+        old = db->entries[db->index[h]];
+        if ((int32_t)(lsa->seq - old->seq) <= 0)
+            return 0;
+        if (!same_links(old, lsa))
+            db->topo_gen++;
+        if (!same_users(old, lsa))
+            db->user_gen++;
+        if (!same_chans(old, lsa))
+            db->chan_gen++;
+        merkle_update(db, old, -1);
+        merkle_update(db, lsa, 1);
+        db->entries[db->index[h]] = lsa;
+        lsa_free(old);
+        db->gen++;
+        return 1;
+    }
+
+    if (db->size == db->cap) {
+        int cap = db->cap ? db->cap * 2 : 16;
+        lsa_t **e = realloc(db->entries, cap * sizeof(lsa_t *));
+        if (!e)
+            return -1;
+        db->entries = e;
+        db->cap = cap;
+    }
+    if ((db->size + 1) * 2 > db->index_cap &&
+        index_rebuild(db, db->index_cap ? db->index_cap * 2
+                                        : LSDB_MIN_INDEX) < 0)
+        return -1;
+    db->entries[db->size++] = lsa;
+    index_put(db, db->size - 1);
+    merkle_update(db, lsa, 1);
+    db->gen++;
+    db->topo_gen++;
+    db->user_gen++;
+    db->chan_gen++;
+    return 1;
+}
+
+void lsdb_remove(lsdb_t *db, u_long sender) {
+    int h = index_slot(db, sender);
+    int i, last;
+
+    if (h < 0)
+        return;
+    i = db->index[h];
+    merkle_update(db, db->entries[i], -1);
+    lsa_free(db->entries[i]);
+    index_del(db, h);
+
+    /* The last entry fills the hole */
+    last = --db->size;
+    if (i != last) {
+        db->index[index_slot(db, db->entries[last]->sender)] = i;
+        db->entries[i] = db->entries[last];
+    }
+    db->gen++;
+    db->topo_gen++;
+    db->user_gen++;
+    db->chan_gen++;
+}
+
+/*
+ * Drop every LSA (other than our own) that hasn't been refreshed in
+ * max_age ms.  Returns the number of entries removed.
+ */
+int lsdb_expire(lsdb_t *db, u_long self, uint64_t now, uint64_t max_age) {
+    int i, removed = 0;
+
+    for (i = 0; i < db->size; ) {
+        lsa_t *lsa = db->entries[i];
+        if (lsa->sender != self && now - lsa->rcvd_at > max_age) {
+            DPRINTF(DEBUG_ROUTING, "lsdb: expiring LSA from %lu\n",
+                    lsa->sender);
+            lsdb_remove(db, lsa->sender);
+            removed++;
+        } else {
+            i++;
+        }
+    }
+    return removed;
+}
@@ -0,0 +1,168 @@
+#ifndef _LSDB_H_
+#define _LSDB_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Link state advertisements and the link state database.
+ *
+ * An LSA describes one node: the neighbors it can currently hear, the
+ * nicks registered on it and the channels that have members on it.
+ * On the wire every field is in network byte order:
+ *
+ *   uint8  version        LSA_VERSION
+ *   uint8  ttl            decremented on every flooding hop
+ *   uint16 type           LSA_TYPE_ADVERT, LSA_TYPE_ACK, ...
+ *   uint32 sender         nodeID of the originator
+ *   uint32 seq            originator's sequence number
+ *   uint32 num_links
+ *   uint32 num_users
+ *   uint8  chan_format    LSA_CHANS_FULL, _DELTA or _BLOOM
+ *   uint8  reserved[3]
+ *   uint32 links[num_links]
+ *   users as (uint8 len, char name[len]) pairs
+ *   the channel summary (see chansum.h), by chan_format:
+ *     FULL   uint32 n, then n names
+ *     DELTA  uint32 base_seq, uint32 n_added, uint32 n_removed, names
+ *     BLOOM  uint16 bits, uint8 k, uint8 filter[bits / 8]
+ *
+ * An ACK is just the first 12 bytes of the header.  ACKS acknowledges
+ * many LSAs at once; after the header (sender is the acking node, seq
+ * 0) come runs of consecutive originators:
+ *
+ *   ACKS    uint16 n_ranges, uint16 reserved, then per range
+ *           uint32 first, uint16 count, uint16 reserved,
+ *           count * uint32 seq
+ *           "I have seq[i] (or newer) from node first + i"
+ *
+ * DIGEST and LEAVES packets compare two databases (see below) when a
+ * neighbor comes up.  Both start with the 12 byte header, with sender
+ * set to the node sending the packet and seq 0:
+ *
+ *   DIGEST  uint8 level, uint8 reserved, uint16 n,
+ *           n * (uint16 pos, uint64 hash)
+ *           "these are my hashes for these tree nodes at level"
+ *   LEAVES  uint8 reply, uint8 reserved, uint16 n_buckets, then per
+ *           bucket uint16 bucket, uint16 n, n * (uint32 sender,
+ *           uint32 seq)
+ *           "this is everything I have in these buckets"
+ */
+
+#define LSA_VERSION      1
+#define LSA_DEFAULT_TTL  32
+#define LSA_TYPE_ADVERT  0
+#define LSA_TYPE_ACK     1
+#define LSA_TYPE_DIGEST  2
+#define LSA_TYPE_LEAVES  3
+#define LSA_TYPE_ACKS    4
+
+#define LSA_HDR_LEN      12
+#define LSA_FIXED_LEN    24
+#define LSA_MAX_PACKET   65000
+#define LSA_MAX_NAME     255    /* a user or channel name, length byte */
+
+#define LSA_CHANS_FULL   0
+#define LSA_CHANS_DELTA  1
+#define LSA_CHANS_BLOOM  2
+
+typedef struct lsa {
+    u_long sender;
+    uint32_t seq;
+    uint8_t ttl;
+    int n_links;
+    int n_users;
+    int n_chans;
+    u_long *links;
+    char **users;
+    char **chans;       /* the full set, sorted, for FULL and DELTA */
+    char *strings;      /* backing store for users[] and chans[] */
+    uint64_t rcvd_at;   /* ms timestamp of the last refresh, for expiry */
+
+    int chan_fmt;       /* how the channels go on the wire */
+    int chan_stale;     /* missed a delta: might have any channel */
+    uint32_t delta_base;
+    int n_added;
+    int n_removed;
+    char **added;
+    char **removed;
+    char *delta_strings;
+    uint8_t *bloom;
+    unsigned bloom_bits;
+    unsigned bloom_k;
+} lsa_t;
+
+/*
+ * Every database keeps a hash tree over its (sender, seq) pairs, so two
+ * nodes can find where their databases differ by descending only into
+ * the subtrees whose hashes disagree.  Entries are spread over
+ * LSDB_MERKLE_LEAVES buckets by sender.  A bucket's hash is the sum of
+ * its entries' hashes and an inner node's the sum of its children's, so
+ * a change only touches one root-to-leaf path.  Nodes are numbered by
+ * level (0 is the root) and position within the level.
+ */
+#define LSDB_MERKLE_FANOUT 16
+#define LSDB_MERKLE_DEPTH  2    /* levels below the root */
+#define LSDB_MERKLE_LEAVES (LSDB_MERKLE_FANOUT * LSDB_MERKLE_FANOUT)
+#define LSDB_MERKLE_NODES  (1 + LSDB_MERKLE_FANOUT + LSDB_MERKLE_LEAVES)
+
+typedef struct lsdb {
+    lsa_t **entries;
+    int size;
+    int cap;
+    int *index;         /* open addressed sender -> entries[] slot */
+    int index_cap;
+    unsigned gen;       /* bumped on every accepted change */
+    unsigned topo_gen;  /* bumped only when some link list changes */
+    unsigned user_gen;  /* bumped only when some user list changes */
+    unsigned chan_gen;  /* bumped only when some channel summary changes */
+    uint64_t merkle[LSDB_MERKLE_NODES];
+} lsdb_t;
+
+/* LSA construction and wire format */
+lsa_t *lsa_new(u_long sender, uint32_t seq);
+void lsa_free(lsa_t *lsa);
+int lsa_set_links(lsa_t *lsa, const u_long *links, int n);
+int lsa_set_names(lsa_t *lsa, char **users, int n_users,
+                  char **chans, int n_chans);
+int lsa_set_delta(lsa_t *lsa, uint32_t base, char **added, int n_added,
+                  char **removed, int n_removed);
+int lsa_set_bloom(lsa_t *lsa, const uint8_t *bloom, unsigned bits,
+                  unsigned k);
+int lsa_apply_delta(lsa_t *lsa, const lsa_t *prev);
+int lsa_has_link(const lsa_t *lsa, u_long nodeID);
+int lsa_may_have_chan(const lsa_t *lsa, const char *chan);
+ssize_t lsa_encode(const lsa_t *lsa, uint8_t *buf, size_t len, int full);
+lsa_t *lsa_decode(const uint8_t *buf, size_t len);
+int lsa_peek(const uint8_t *buf, size_t len, int *type,
+             u_long *sender, uint32_t *seq);
+ssize_t lsa_encode_ack(u_long sender, uint32_t seq, uint8_t *buf, size_t len);
+ssize_t lsa_encode_acks(u_long sender, const u_long *senders,
+                        const uint32_t *seqs, int n, uint8_t *buf,
+                        size_t len);
+int lsa_decode_acks(const uint8_t *buf, size_t len, u_long *senders,
+                    uint32_t *seqs, int max);
+ssize_t lsa_encode_digest(u_long sender, int level, const uint16_t *pos,
+                          const uint64_t *hash, int n, uint8_t *buf,
+                          size_t len);
+int lsa_decode_digest(const uint8_t *buf, size_t len, int *level,
+                      uint16_t *pos, uint64_t *hash, int max);
+ssize_t lsa_encode_leaves(u_long sender, int reply, const lsdb_t *db,
+                          const uint16_t *buckets, int n_buckets,
+                          uint8_t *buf, size_t len);
+int lsa_decode_leaves(const uint8_t *buf, size_t len, int *reply,
+                      uint16_t *buckets, int *n_buckets, u_long *senders,
+                      uint32_t *seqs, int max);
+
+/* The database owns every LSA stored in it */
+void lsdb_init(lsdb_t *db);
+void lsdb_destroy(lsdb_t *db);
+lsa_t *lsdb_find(const lsdb_t *db, u_long sender);
+int lsdb_update(lsdb_t *db, lsa_t *lsa);
+void lsdb_remove(lsdb_t *db, u_long sender);
+int lsdb_expire(lsdb_t *db, u_long self, uint64_t now, uint64_t max_age);
+int lsdb_bucket(u_long sender);
+uint64_t lsdb_merkle(const lsdb_t *db, int level, int pos);
+
+#endif /* _LSDB_H_ */
@@ -0,0 +1,465 @@
+/*
+ * mask.c
+ *
+ * Compiled wildcard masks and indexed mask sets.  See mask.h.
+ */
+
+#define _GNU_SOURCE             /* memmem() */
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "mask.h"
+#include "msgbuf.h"
+
+/* A trie node: the masks whose key is the path to it */
+typedef struct mnode {
+    unsigned char ch;
+    struct mnode *child;        /* first of its children */
+    struct mnode *sibling;
+    struct mnode *parent;
+    maskent_t *ents;
+} mnode_t;
+
+
+/* Masks */
+
+/* Fold src into dst (size bytes, terminated); returns the length */
+size_t mask_fold(char *dst, const char *src, size_t size) {
+    size_t n;
+
+    for (n = 0; src[n] && n < size - 1; n++)
+        dst[n] = tolower((unsigned char)src[n]);
+    dst[n] = '\0';
+    return n;
+}
+
+/* Does mask have wildcards in it? */
+int mask_wild(const char *mask) {
+    return strpbrk(mask, "*?") != NULL;
+}
+
+mask_t *mask_compile(const char *mask) {
+    size_t len = strnlen(mask, MASK_MAX), i;
+    mask_t *m;
+
+    if (!(m = pool_alloc(sizeof(mask_t) + len + 1)))
+        return NULL;
+    m->len = mask_fold(m->text, mask, len + 1);
+    m->star = 0;
+    m->min = 0;
+    for (i = 0; i < len; i++) {
+        if (m->text[i] == '*')
+            m->star = 1;
+        else
+            m->min++;
+    }
+    for (m->pre = 0; m->pre < len && !strchr("*?", m->text[m->pre]);
+         m->pre++)
+        ;
+    if (m->pre == len) {
+        m->suf = 0;
+        return m;
+    }
+    for (m->suf = 0; !strchr("*?", m->text[len - 1 - m->suf]); m->suf++)
+        ;
+    return m;
+}
+
+void mask_free(mask_t *m) {
+    pool_free(m);
+}
+
+/* Does the pattern p match the same number of characters at s? */
+static int run_eq(const char *p, const char *s, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        if (p[i] != s[i] && p[i] != '?')
+            return 0;
+    return 1;
+}
+
+/* The leftmost place in [s, end) that run p (n chars) matches */
+static const char *run_find(const char *p, size_t n, const char *s,
+                            const char *end) {
+    if (!memchr(p, '?', n))
+        return memmem(s, end - s, p, n);
+    for (; end - s >= (ptrdiff_t)n; s++)
+        if (run_eq(p, s, n))
+            return s;
+    return NULL;
+}
+
+/*
+ * The part of a mask between its prefix and suffix, p to pe, against
+ * the part of the subject between them, s to se.
+ */
+static int glob(const char *p, const char *pe, const char *s,
+                const char *se) {
+    const char *last, *run;
+    size_t n;
+
+    /* Up to the first star, anchored at the start */
+    for (; p < pe && *p != '*'; p++, s++)
+        if (s == se || (*p != '?' && *p != *s))
+            return 0;
+    if (p == pe)
+        return s == se;
+
+    /* After the last star, anchored at the end */
+    for (last = pe; last[-1] != '*'; last--)
+        ;
+    n = pe - last;
+    if ((size_t)(se - s) < n || !run_eq(last, se - n, n))
+        return 0;
+    se -= n;
+    pe = last - 1;
+
+    /* The runs between stars, each where it first fits */
+    while (p < pe) {
+        if (*p == '*') {
+            p++;
+            continue;
+        }
+        for (run = p; p < pe && *p != '*'; p++)
+            ;
+        if (!(s = run_find(run, p - run, s, se)))
+            return 0;
+        s += p - run;
+    }
+    return 1;
+}
+
+/* Does m match s (len chars, folded)? */
+int mask_match(const mask_t *m, const char *s, size_t len) {
+    if (len < m->min || (!m->star && len != m->min))
+        return 0;
+    if (memcmp(s, m->text, m->pre) ||
+        memcmp(s + len - m->suf, m->text + m->len - m->suf, m->suf))
+        return 0;
+    return glob(m->text + m->pre, m->text + m->len - m->suf, s + m->pre,
+                s + len - m->suf);
+}
+
+
+/* Mask sets */
+
+/*
+ * Write mask as a full "nick!user@host" into dst: "nick" alone means
+ * nick!*@*, "user@host" means *!user@host, a missing or empty part is
+ * '*'.  Returns -1 if it doesn't fit.
+ */
+int mask_normalize(char *dst, size_t size, const char *mask) {
+    const char *bang = strchr(mask, '!'), *at = strchr(mask, '@');
+    const char *nick = "*", *user = "*", *host = "*";
+    int nn = 1, un = 1, hn = 1, len;
+
+    if (at && bang > at)
+        bang = NULL;
+    if (bang) {
+        nick = mask;
+        nn = bang - mask;
+        user = bang + 1;
+        un = at ? at - user : (int)strlen(user);
+    } else if (at) {
+        user = mask;
+        un = at - mask;
+    } else {
+        nick = mask;
+        nn = strlen(mask);
+    }
+    if (at) {
+        host = at + 1;
+        hn = strlen(host);
+    }
+    if (!nn)
+        nick = "*", nn = 1;
+    if (!un)
+        user = "*", un = 1;
+    if (!hn)
+        host = "*", hn = 1;
+    len = snprintf(dst, size, "%.*s!%.*s@%.*s", nn, nick, un, user, hn,
+                   host);
+    return len < 0 || (size_t)len >= size ? -1 : 0;
+}
+
+static void ent_free(maskent_t *e) {
+    mask_free(e->nick);
+    mask_free(e->user);
+    mask_free(e->host);
+    pool_free(e);
+}
+
+/* Is key k a suffix, read backwards? */
+static int key_rev(int k) {
+    return k == MASK_HOST_SUF || k == MASK_NICK_SUF || k == MASK_USER_SUF;
+}
+
+/* The part key k is about: 0 nick, 1 user, 2 host */
+static int key_part(int k) {
+    return k == MASK_NICK_PRE || k == MASK_NICK_SUF ? 0 :
+           k == MASK_USER_PRE || k == MASK_USER_SUF ? 1 : 2;
+}
+
+/* The key e goes under: which trie, and the text and its direction */
+static int ent_key(const maskent_t *e, const char **key, int *n) {
+    const mask_t *part[3] = { e->nick, e->user, e->host }, *m;
+    int k, best = -1, len;
+
+    *n = 0;
+    for (k = 0; k < MASK_KEYS; k++) {
+        m = part[key_part(k)];
+        len = key_rev(k) ? m->suf : m->pre;
+        if (len > *n) {
+            *n = len;
+            best = k;
+        }
+    }
+    if (best < 0)
+        return best;
+    m = part[key_part(best)];
+    *key = key_rev(best) ? m->text + m->len - 1 : m->text;
+    return best;
+}
+
+static mnode_t *node_child(mnode_t *n, unsigned char ch) {
+    for (n = n->child; n && n->ch != ch; n = n->sibling)
+        ;
+    return n;
+}
+
+/* The node for key (n chars, read backwards if rev) under *root */
+static mnode_t *node_get(mnode_t **root, const char *key, int n, int rev) {
+    mnode_t *node, *next;
+    int i;
+
+    if (!*root) {
+        if (!(*root = pool_alloc(sizeof(mnode_t))))
+            return NULL;
+        memset(*root, 0, sizeof(mnode_t));
+    }
+    node = *root;
+    for (i = 0; i < n; i++) {
+        unsigned char ch = rev ? key[-i] : key[i];
+        if (!(next = node_child(node, ch))) {
+            if (!(next = pool_alloc(sizeof(mnode_t))))
+                return NULL;
+            memset(next, 0, sizeof(mnode_t));
+            next->ch = ch;
+            next->parent = node;
+            next->sibling = node->child;
+            node->child = next;
+        }
+        node = next;
+    }
+    return node;
+}
+
+/* Free node and the empty ancestors it leaves, up to the root */
+static void node_prune(mnode_t *node) {
+    mnode_t *parent, **pp;
+
+    while ((parent = node->parent) && !node->ents && !node->child) {
+        for (pp = &parent->child; *pp != node; pp = &(*pp)->sibling)
+            ;
+        *pp = node->sibling;
+        pool_free(node);
+        node = parent;
+    }
+}
+
+/* A new entry for a normalized mask, not yet filed anywhere */
+static maskent_t *ent_new(const char *norm) {
+    size_t len = strlen(norm);
+    char buf[MASK_MAX], *bang, *at;
+    maskent_t *e;
+
+    if (!(e = pool_alloc(sizeof(maskent_t) + len + 1)))
+        return NULL;
+    memcpy(e->text, norm, len + 1);
+    memcpy(buf, norm, len + 1);
+    bang = strchr(buf, '!');
+    at = strchr(bang, '@');
+    *bang = *at = '\0';
+    e->nick = mask_compile(buf);
+    e->user = mask_compile(bang + 1);
+    e->host = mask_compile(at + 1);
+    if (!e->nick || !e->user || !e->host) {
+        ent_free(e);
+        return NULL;
+    }
+    return e;
+}
+
+/*
+ * The list e belongs on, with its trie node in *node (NULL for the
+ * rest list).  Without create, NULL if the node isn't there.
+ */
+static maskent_t **ent_list(maskset_t *set, const maskent_t *e, int create,
+                            mnode_t **node) {
+    const char *key;
+    int k, n, i, rev;
+
+    *node = NULL;
+    if ((k = ent_key(e, &key, &n)) < 0)
+        return &set->rest;
+    rev = key_rev(k);
+    if (create) {
+        *node = node_get(&set->trie[k], key, n, rev);
+    } else if ((*node = set->trie[k])) {
+        for (i = 0; i < n && *node; i++)
+            *node = node_child(*node, rev ? key[-i] : key[i]);
+    }
+    return *node ? &(*node)->ents : NULL;
+}
+
+/* Add mask; 1 if it was added, 0 if it was there, -1 if it can't be */
+int maskset_add(maskset_t *set, const char *mask) {
+    char norm[MASK_MAX];
+    maskent_t *e, *o, **list;
+    mnode_t *node;
+
+    if (mask_normalize(norm, sizeof(norm), mask) < 0 ||
+        !(e = ent_new(norm)))
+        return -1;
+    if (!(list = ent_list(set, e, 1, &node))) {
+        ent_free(e);
+        return -1;
+    }
+    for (o = *list; o; o = o->next) {
+        if (!strcasecmp(o->text, e->text)) {
+            ent_free(e);
+            return 0;
+        }
+    }
+    e->node = node;
+    e->next = *list;
+    *list = e;
+    e->all_next = NULL;
+    e->all_prev = set->all_tail;
+    if (set->all_tail)
+        set->all_tail->all_next = e;
+    else
+        set->all = e;
+    set->all_tail = e;
+    set->count++;
+    return 1;
+}
+
+/* The entry for mask in set, as maskset_add() would file it, or NULL */
+maskent_t *maskset_find(maskset_t *set, const char *mask) {
+    char norm[MASK_MAX];
+    maskent_t *key, *e = NULL, **list;
+    mnode_t *node;
+
+    if (mask_normalize(norm, sizeof(norm), mask) < 0 ||
+        !(key = ent_new(norm)))
+        return NULL;
+    if ((list = ent_list(set, key, 0, &node)))
+        for (e = *list; e && strcasecmp(e->text, key->text); e = e->next)
+            ;
+    ent_free(key);
+    return e;
+}
+
+/* Take e out of set and free it */
+void maskset_remove(maskset_t *set, maskent_t *e) {
+    maskent_t **pp = e->node ? &e->node->ents : &set->rest;
+
+    for (; *pp != e; pp = &(*pp)->next)
+        ;
+    *pp = e->next;
+    if (e->node)
+        node_prune(e->node);
+    if (e->all_prev)
+        e->all_prev->all_next = e->all_next;
+    else
+        set->all = e->all_next;
+    if (e->all_next)
+        e->all_next->all_prev = e->all_prev;
+    else
+        set->all_tail = e->all_prev;
+    set->count--;
+    ent_free(e);
+}
+
+/* Remove mask; 1 if it was there */
+int maskset_del(maskset_t *set, const char *mask) {
+    maskent_t *e = maskset_find(set, mask);
+
+    if (!e)
+        return 0;
+    maskset_remove(set, e);
+    return 1;
+}
+
+static int ent_match(maskset_t *set, const maskent_t *e, const char *nick,
+                     size_t nl, const char *user, size_t ul,
+                     const char *host, size_t hl) {
+    set->tried++;
+    return mask_match(e->host, host, hl) && mask_match(e->nick, nick, nl) &&
+           mask_match(e->user, user, ul);
+}
+
+/* A mask in set that nick!user@host matches, or NULL */
+const maskent_t *maskset_match(maskset_t *set, const char *nick,
+                               const char *user, const char *host) {
+    char f[3][MASK_MAX];
+    size_t len[3];
+    const maskent_t *e;
+    const char *s;
+    mnode_t *node;
+    int k, i, n, rev;
+
+    if (!set->count)
+        return NULL;
+    set->lookups++;
+    len[0] = mask_fold(f[0], nick, MASK_MAX);
+    len[1] = mask_fold(f[1], user, MASK_MAX);
+    len[2] = mask_fold(f[2], host, MASK_MAX);
+
+    for (k = 0; k < MASK_KEYS; k++) {
+        if (!(node = set->trie[k]))
+            continue;
+        i = key_part(k);
+        rev = key_rev(k);
+        s = rev ? f[i] + len[i] - 1 : f[i];
+        for (n = 0; n < (int)len[i]; n++) {
+            if (!(node = node_child(node, rev ? s[-n] : s[n])))
+                break;
+            for (e = node->ents; e; e = e->next)
+                if (ent_match(set, e, f[0], len[0], f[1], len[1], f[2],
+                              len[2]))
+                    return e;
+        }
+    }
+    for (e = set->rest; e; e = e->next)
+        if (ent_match(set, e, f[0], len[0], f[1], len[1], f[2], len[2]))
+            return e;
+    return NULL;
+}
+
+static void trie_free(mnode_t *node) {
+    mnode_t *next;
+
+    for (; node; node = next) {
+        next = node->sibling;
+        trie_free(node->child);
+        pool_free(node);
+    }
+}
+
+/* Empty set, freeing everything in it */
+void maskset_clear(maskset_t *set) {
+    maskent_t *e, *next;
+    int k;
+
+    for (e = set->all; e; e = next) {
+        next = e->all_next;
+        ent_free(e);
+    }
+    for (k = 0; k < MASK_KEYS; k++)
+        trie_free(set->trie[k]);
+    memset(set, 0, sizeof(*set));
+}
@@ -0,0 +1,79 @@
+#ifndef _MASK_H_
+#define _MASK_H_
+
+#include <stddef.h>
+
+/*
+ * Wildcard masks.
+ *
+ * In an IRC mask '*' stands for any run of characters and '?' for any
+ * one, and case doesn't matter.  mask_compile() does the work a match
+ * would otherwise repeat every time: the mask is folded to lower case,
+ * and the fixed text before its first wildcard (the prefix) and after
+ * its last (the suffix) are noted, so a match starts with two memcmp()s
+ * and a length check.  Whatever lies between is matched left to right:
+ * the part up to the first '*' and the part after the last one are
+ * anchored, and each run between two stars is searched for once, the
+ * leftmost occurrence winning, so there is no backtracking.  Runs
+ * without '?' are found with memmem(), in linear time.
+ *
+ * Subjects are matched folded, with mask_fold().
+ *
+ * A maskset holds "nick!user@host" masks, such as a channel's bans,
+ * and finds one matching a given nick, user and host without trying
+ * every mask.  Each mask is filed in a trie under the longest fixed
+ * text it starts or ends with, in its host, nick or user; a lookup
+ * walks each trie along the subject's host, nick or user and only tries
+ * the masks it passes.  Masks without any, like "*!*@*.*", are tried
+ * every time.
+ * Everything comes from the msgbuf pool.
+ */
+
+#define MASK_MAX 512            /* longest mask, or part of a subject */
+
+typedef struct mask {
+    unsigned short len;         /* of text */
+    unsigned short pre, suf;    /* fixed text at the start and end */
+    unsigned short min;         /* shortest subject it can match */
+    int star;                   /* has a '*': subjects may be longer */
+    char text[];                /* folded, terminated */
+} mask_t;
+
+mask_t *mask_compile(const char *mask);
+void mask_free(mask_t *m);
+int mask_match(const mask_t *m, const char *s, size_t len);
+size_t mask_fold(char *dst, const char *src, size_t size);
+int mask_wild(const char *mask);
+
+/* Where a maskset files a mask: the longest of these it has */
+enum { MASK_HOST_PRE, MASK_HOST_SUF, MASK_NICK_PRE, MASK_NICK_SUF,
+       MASK_USER_PRE, MASK_USER_SUF, MASK_KEYS };
+
+typedef struct maskent {
+    mask_t *nick, *user, *host;
+    struct maskent *next;       /* in its trie node, or the rest */
+    struct maskent *all_next;   /* in the order added */
+    struct maskent *all_prev;
+    struct mnode *node;         /* NULL: on the rest list */
+    char text[];                /* "nick!user@host", as given */
+} maskent_t;
+
+typedef struct maskset {
+    struct mnode *trie[MASK_KEYS];
+    maskent_t *rest;            /* not filed in a trie */
+    maskent_t *all, *all_tail;
+    unsigned count;
+    unsigned long lookups;
+    unsigned long tried;        /* masks matched against for them */
+} maskset_t;
+
+int mask_normalize(char *dst, size_t size, const char *mask);
+int maskset_add(maskset_t *set, const char *mask);
+int maskset_del(maskset_t *set, const char *mask);
+maskent_t *maskset_find(maskset_t *set, const char *mask);
+void maskset_remove(maskset_t *set, maskent_t *e);
+const maskent_t *maskset_match(maskset_t *set, const char *nick,
+                               const char *user, const char *host);
+void maskset_clear(maskset_t *set);
+
+#endif /* _MASK_H_ */
@@ -0,0 +1,254 @@
+/*
+ * mcast.c
+ *
+ * Per-source multicast trees for channel traffic.  See mcast.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "mcast.h"
+#include "chansum.h"
+#include "debug.h"
+
+mcast_stats_t mcast_stats;
+
+void mcast_init(mcast_cache_t *mc) {
+    memset(mc, 0, sizeof(*mc));
+}
+
+static void flush_trees(mcast_cache_t *mc) {
+    int i;
+    for (i = 0; i < mc->n_trees; i++)
+        spf_free(&mc->trees[i]);
+    mc->n_trees = 0;
+    for (i = 0; i < mc->n_slots; i++)
+        mc->slots[i] = -1;
+}
+
+void mcast_destroy(mcast_cache_t *mc) {
+    int i;
+
+    flush_trees(mc);
+    for (i = 0; mc->pruned && i < MCAST_PRUNED; i++) {
+        free(mc->pruned[i].chan);
+        free(mc->pruned[i].hops);
+    }
+    free(mc->pruned);
+    free(mc->trees);
+    free(mc->slots);
+    free(mc->mark);
+    mcast_init(mc);
+}
+
+/* Which of src's trees chan travels down */
+static unsigned variant_of(const char *chan) {
+    uint32_t h1, h2;
+
+    chansum_hash(chan, &h1, &h2);
+    return h1 % MCAST_VARIANTS;
+}
+
+static unsigned tree_hash(u_long src, unsigned variant) {
+    return (unsigned)(src * MCAST_VARIANTS + variant) * 2654435761u;
+}
+
+/* File trees[i] in the slots, growing them to twice the trees */
+static int slot_add(mcast_cache_t *mc, int i) {
+    const spf_tree_t *t;
+    unsigned h;
+    int j;
+
+    if (2 * (mc->n_trees + 1) > mc->n_slots) {
+        int n = mc->n_slots ? 2 * mc->n_slots : 64;
+        int *s = malloc(n * sizeof(int));
+        if (!s)
+            return -1;
+        free(mc->slots);
+        mc->slots = s;
+        mc->n_slots = n;
+        for (j = 0; j < n; j++)
+            s[j] = -1;
+        for (j = 0; j < mc->n_trees; j++)
+            if (j != i)
+                slot_add(mc, j);
+    }
+    t = &mc->trees[i];
+    h = tree_hash(t->root, t->variant) & (mc->n_slots - 1);
+    while (mc->slots[h] >= 0)
+        h = (h + 1) & (mc->n_slots - 1);
+    mc->slots[h] = i;
+    return 0;
+}
+
+/*
+ * The shortest path tree rooted at src that chan uses, computed on
+ * first use and kept until the topology changes.
+ */
+static spf_tree_t *tree_for(mcast_cache_t *mc, const lsdb_t *db, u_long src,
+                            const char *chan) {
+    unsigned variant = variant_of(chan), h;
+    spf_tree_t *t;
+    int i;
+
+    if (mc->topo_gen != db->topo_gen) {
+        flush_trees(mc);
+        mc->topo_gen = db->topo_gen;
+    }
+    if (mc->n_slots) {
+        h = tree_hash(src, variant) & (mc->n_slots - 1);
+        for (; (i = mc->slots[h]) >= 0; h = (h + 1) & (mc->n_slots - 1))
+            if (mc->trees[i].root == src && mc->trees[i].variant == variant)
+                return &mc->trees[i];
+    }
+
+    if (mc->n_trees == mc->cap) {
+        int cap = mc->cap ? mc->cap * 2 : 8;
+        spf_tree_t *nt = realloc(mc->trees, cap * sizeof(spf_tree_t));
+        if (!nt)
+            return NULL;
+        mc->trees = nt;
+        mc->cap = cap;
+    }
+    t = &mc->trees[mc->n_trees];
+    spf_init(t);
+    if (spf_run_variant(db, src, variant, t) < 0 ||
+        slot_add(mc, mc->n_trees) < 0) {
+        spf_free(t);
+        return NULL;
+    }
+    mc->n_trees++;
+    return t;
+}
+
+/*
+ * Mark every node of t that lies on a path from the root to a node that
+ * might have members in chan, going by its channel summary.  Returns
+ * the number of marked nodes other than the root (i.e. the number of
+ * tree links), and the sum of the members' distances from the root in
+ * *unicast.
+ */
+static int mark_members(mcast_cache_t *mc, const lsdb_t *db,
+                        const spf_tree_t *t, const char *chan,
+                        unsigned *unicast) {
+    int i, v, links = 0;
+
+    if (mc->mark_cap < t->n) {
+        unsigned char *m = realloc(mc->mark, t->n);
+        if (!m)
+            return -1;
+        mc->mark = m;
+        mc->mark_cap = t->n;
+    }
+    memset(mc->mark, 0, t->n);
+    *unicast = 0;
+
+    for (i = 0; i < t->n; i++) {
+        if (t->dist[i] <= 0 ||
+            !lsa_may_have_chan(lsdb_find(db, t->ids[i]), chan))
+            continue;
+        *unicast += t->dist[i];
+        for (v = i; v >= 0 && !mc->mark[v] && t->parent[v] >= 0;
+             v = t->parent[v]) {
+            mc->mark[v] = 1;
+            links++;
+        }
+    }
+    return links;
+}
+
+/*
+ * The pruned tree for chan from src, as seen from self: from its slot
+ * if that still holds it, else worked out again into the slot.  A
+ * cached one is good for any self when only the link counts are
+ * wanted (self 0).
+ */
+static mcast_pruned_t *pruned_for(mcast_cache_t *mc, const lsdb_t *db,
+                                  u_long src, u_long self,
+                                  const char *chan) {
+    mcast_pruned_t *p;
+    spf_tree_t *t;
+    uint32_t h1, h2;
+    unsigned unicast;
+    int i, me, links, n = 0;
+
+    if (!mc->pruned &&
+        !(mc->pruned = calloc(MCAST_PRUNED, sizeof(mcast_pruned_t))))
+        return NULL;
+    chansum_hash(chan, &h1, &h2);
+    p = &mc->pruned[(h2 ^ tree_hash(src, 0)) & (MCAST_PRUNED - 1)];
+    if (p->chan && p->src == src && (!self || p->self == self) &&
+        p->topo_gen == db->topo_gen && p->chan_gen == db->chan_gen &&
+        !strcmp(p->chan, chan)) {
+        mc->hits++;
+        return p;
+    }
+
+    mc->misses++;
+    if (!self)
+        self = src;
+    if (!(t = tree_for(mc, db, src, chan)))
+        return NULL;
+    if ((links = mark_members(mc, db, t, chan, &unicast)) < 0)
+        return NULL;
+    free(p->chan);
+    free(p->hops);
+    memset(p, 0, sizeof(*p));
+    if (!(p->chan = strdup(chan)))
+        return NULL;
+    p->tree_links = links;
+    p->unicast_links = unicast;
+    me = spf_index(t, self);
+    if (me >= 0 && t->dist[me] >= 0) {
+        for (i = 0; i < t->n; i++)
+            n += t->parent[i] == me && mc->mark[i];
+        if (n > 0 && !(p->hops = malloc(n * sizeof(u_long)))) {
+            free(p->chan);
+            p->chan = NULL;
+            return NULL;
+        }
+        for (i = 0; i < t->n && p->n_hops < n; i++)
+            if (t->parent[i] == me && mc->mark[i])
+                p->hops[p->n_hops++] = t->ids[i];
+    }
+    p->src = src;
+    p->self = self;
+    p->topo_gen = db->topo_gen;
+    p->chan_gen = db->chan_gen;
+    return p;
+}
+
+/*
+ * Fill hops[] with the neighbors self must relay a message for chan
+ * from src to.  Returns the number of hops, or -1 on error.
+ */
+int mcast_next_hops(mcast_cache_t *mc, const lsdb_t *db, u_long src,
+                    u_long self, const char *chan, u_long *hops, int max) {
+    mcast_pruned_t *p = pruned_for(mc, db, src, self, chan);
+    int n;
+
+    if (!p)
+        return -1;
+    n = p->n_hops < max ? p->n_hops : max;
+    memcpy(hops, p->hops, n * sizeof(u_long));
+
+    DPRINTF(DEBUG_FORWARD, "mcast: %s from %lu at %lu -> %d hops\n",
+            chan, src, self, n);
+    return n;
+}
+
+/*
+ * How many link copies does one message for chan from src cost over
+ * the pruned tree, versus unicasting a copy to every member node?  Right
+ * after mcast_next_hops() for the same message this is a cache hit.
+ */
+int mcast_tree_cost(mcast_cache_t *mc, const lsdb_t *db, u_long src,
+                    const char *chan, unsigned *tree_links,
+                    unsigned *unicast_links) {
+    mcast_pruned_t *p = pruned_for(mc, db, src, 0, chan);
+
+    if (!p)
+        return -1;
+    *tree_links = p->tree_links;
+    *unicast_links = p->unicast_links;
+    return 0;
+}
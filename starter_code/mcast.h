@@ -0,0 +1,78 @@
+#ifndef _MCAST_H_
+#define _MCAST_H_
+
+#include "spf.h"
+
+/*
+ * Channel multicast between servers.
+ *
+ * A channel message originated at node S travels down S's shortest path
+ * tree, pruned to the branches that lead to a node with members in the
+ * channel.  Every node on the way computes the same tree from its own
+ * copy of the database, so it only needs to know S to pick its
+ * children, and each inter-node link carries the message at most once.
+ *
+ * Where there are equal-cost paths, channels are spread over
+ * MCAST_VARIANTS different trees per source (see spf_run_variant()),
+ * chosen by a hash of the channel name that every node agrees on.
+ *
+ * Trees are kept until the topology changes, found by (source, variant)
+ * in a hash table.  The pruned tree for a (source, channel), which is
+ * what a message costs to work out (a channel summary lookup for every
+ * node), is kept too: its next hops and link counts go in a slot of a
+ * fixed table picked by a hash of both, good until the topology or some
+ * node's channel summary changes (lsdb topo_gen and chan_gen) or the
+ * slot is needed for another pair.
+ */
+
+#define MCAST_MAX_HOPS 32    /* next hops from one node (its neighbors) */
+#define MCAST_TTL      32    /* relay limit, in case trees disagree */
+#define MCAST_VARIANTS 4     /* trees per source to spread channels over */
+#define MCAST_PRUNED   1024  /* pruned trees kept, a power of two */
+
+typedef struct mcast_stats {
+    unsigned long originated;     /* channel messages sent from here */
+    unsigned long tree_links;     /* link copies the pruned trees needed */
+    unsigned long unicast_links;  /* link copies per-node unicast needs */
+    unsigned long forwarded;      /* copies relayed for other sources */
+    unsigned long received;       /* copies that reached this node */
+    unsigned long wasted;         /* ... that had nowhere to go here (a
+                                     false positive in our summary) */
+} mcast_stats_t;
+
+/* One pruned tree: where self relays chan's messages from src */
+typedef struct mcast_pruned {
+    char *chan;         /* NULL: slot unused */
+    u_long src, self;
+    unsigned topo_gen, chan_gen;
+    u_long *hops;
+    int n_hops;
+    unsigned tree_links;
+    unsigned unicast_links;
+} mcast_pruned_t;
+
+typedef struct mcast_cache {
+    spf_tree_t *trees;  /* one per (source, variant) seen since the last
+                           change */
+    int n_trees;
+    int cap;
+    int *slots;         /* open addressed (source, variant) -> trees[] */
+    int n_slots;
+    unsigned topo_gen;
+    unsigned char *mark;
+    int mark_cap;
+    mcast_pruned_t *pruned;     /* MCAST_PRUNED of them, once used */
+    unsigned long hits, misses; /* pruned trees found and worked out */
+} mcast_cache_t;
+
+void mcast_init(mcast_cache_t *mc);
+void mcast_destroy(mcast_cache_t *mc);
+int mcast_next_hops(mcast_cache_t *mc, const lsdb_t *db, u_long src,
+                    u_long self, const char *chan, u_long *hops, int max);
+int mcast_tree_cost(mcast_cache_t *mc, const lsdb_t *db, u_long src,
+                    const char *chan, unsigned *tree_links,
+                    unsigned *unicast_links);
+
+extern mcast_stats_t mcast_stats;
+
+#endif /* _MCAST_H_ */
@@ -0,0 +1,123 @@
+/*
+ * msgbuf.c
+ *
+ * Size-classed object pool and refcounted line buffers.  See msgbuf.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "msgbuf.h"
+
+#define HDR 8                 /* in front of every object, for alignment */
+
+const unsigned pool_class_size[POOL_CLASSES] = { 64, 128, 256, 520 };
+
+/* Header of an object: its class while in use, the free list when not */
+typedef union obj {
+    union obj *next;
+    unsigned cls;             /* POOL_CLASSES: came from malloc() */
+} obj_t;
+
+typedef struct pool {
+    obj_t *free[POOL_CLASSES];
+    char *carve[POOL_CLASSES];      /* the unused end of the last slab */
+    size_t carve_left[POOL_CLASSES];
+    pool_stats_t stats;
+} pool_t;
+
+static __thread pool_t pool;
+
+static int class_of(size_t size) {
+    int i;
+
+    for (i = 0; i < POOL_CLASSES; i++)
+        if (size <= pool_class_size[i])
+            return i;
+    return POOL_CLASSES;
+}
+
+/* A new object of class cls from the end of the current slab */
+static obj_t *carve(int cls) {
+    size_t stride = HDR + pool_class_size[cls];
+    obj_t *o;
+
+    if (pool.carve_left[cls] < stride) {
+        if (!(pool.carve[cls] = malloc(POOL_SLAB)))
+            return NULL;
+        pool.carve_left[cls] = POOL_SLAB;
+        pool.stats.slabs++;
+        pool.stats.heap++;
+    }
+    o = (obj_t *)pool.carve[cls];
+    pool.carve[cls] += stride;
+    pool.carve_left[cls] -= stride;
+    return o;
+}
+
+void *pool_alloc(size_t size) {
+    int cls = class_of(size);
+    obj_t *o;
+
+    if (cls == POOL_CLASSES) {
+        if (!(o = malloc(HDR + size)))
+            return NULL;
+        pool.stats.heap++;
+    } else if ((o = pool.free[cls])) {
+        pool.free[cls] = o->next;
+    } else if (!(o = carve(cls))) {
+        return NULL;
+    }
+    o->cls = cls;
+    pool.stats.allocs[cls]++;
+    pool.stats.in_use[cls]++;
+    return (char *)o + HDR;
+}
+
+void pool_free(void *p) {
+    obj_t *o;
+    int cls;
+
+    if (!p)
+        return;
+    o = (obj_t *)((char *)p - HDR);
+    cls = o->cls;
+    pool.stats.in_use[cls]--;
+    if (cls == POOL_CLASSES) {
+        free(o);
+        return;
+    }
+    o->next = pool.free[cls];
+    pool.free[cls] = o;
+}
+
+/* The calling thread's counters */
+void pool_stats(pool_stats_t *s) {
+    *s = pool.stats;
+}
+
+
+/* Line buffers */
+
+/* An empty buffer with room for at least size bytes, one reference */
+msgbuf_t *msgbuf_new(size_t size) {
+    int cls = class_of(sizeof(msgbuf_t) + size);
+    msgbuf_t *mb;
+
+    if (!(mb = pool_alloc(sizeof(msgbuf_t) + size)))
+        return NULL;
+    mb->refs = 1;
+    mb->len = 0;
+    mb->size = cls < POOL_CLASSES ?
+        pool_class_size[cls] - sizeof(msgbuf_t) : size;
+    return mb;
+}
+
+msgbuf_t *msgbuf_copy(const char *buf, size_t len) {
+    msgbuf_t *mb = msgbuf_new(len);
+
+    if (!mb)
+        return NULL;
+    memcpy(mb->data, buf, len);
+    mb->len = len;
+    return mb;
+}
@@ -0,0 +1,65 @@
+#ifndef _MSGBUF_H_
+#define _MSGBUF_H_
+
+#include <stddef.h>
+
+/*
+ * Message buffers.
+ *
+ * Almost everything sircd holds on to between events is at most one
+ * IRC line long: queued output, lines waiting for forwarding credit,
+ * and the list entries pointing at them.  pool_alloc() serves these
+ * from four size classes, carved out of POOL_SLAB byte slabs and
+ * recycled through a free list per class.  Slabs are never given back,
+ * so once the pool has grown to what the traffic needs, queueing and
+ * sending lines makes no heap calls at all.  Anything bigger than the
+ * largest class comes from malloc() and is counted as such.
+ *
+ * The free lists and counters are per thread, so there is no locking.
+ * An object freed by a different thread than the one that allocated it
+ * simply joins the freeing thread's lists.
+ *
+ * A msgbuf_t is a refcounted line built on the pool, so one copy of a
+ * channel message can sit in many send queues at once.  The largest
+ * class holds its header plus a full MAX_MSG_LEN line.
+ */
+
+#define POOL_CLASSES 4
+#define POOL_SLAB    (64 * 1024)
+
+extern const unsigned pool_class_size[POOL_CLASSES];   /* 64 .. 520 */
+
+typedef struct pool_stats {
+    unsigned long allocs[POOL_CLASSES + 1];   /* last: too big, malloc() */
+    unsigned long in_use[POOL_CLASSES + 1];
+    unsigned long slabs;                      /* malloc()s for slabs */
+    unsigned long heap;                       /* all malloc()s made */
+} pool_stats_t;
+
+void *pool_alloc(size_t size);
+void pool_free(void *p);
+void pool_stats(pool_stats_t *s);
+
+typedef struct msgbuf {
+    unsigned refs;
+    unsigned short len;       /* bytes of data used */
+    unsigned short size;      /* bytes of data there is room for */
+    char data[];
+} msgbuf_t;
+
+#define MSGBUF_LINE 512       /* room for a whole line */
+
+msgbuf_t *msgbuf_new(size_t size);
+msgbuf_t *msgbuf_copy(const char *buf, size_t len);
+
+static inline msgbuf_t *msgbuf_ref(msgbuf_t *mb) {
+    mb->refs++;
+    return mb;
+}
+
+static inline void msgbuf_unref(msgbuf_t *mb) {
+    if (--mb->refs == 0)
+        pool_free(mb);
+}
+
+#endif /* _MSGBUF_H_ */
@@ -0,0 +1,126 @@
+/*
+ * nickdir.c
+ *
+ * Nick to node directory built from the link state database.  See
+ * nickdir.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "nickdir.h"
+#include "debug.h"
+
+void nickdir_init(nickdir_t *nd) {
+    memset(nd, 0, sizeof(*nd));
+}
+
+void nickdir_free(nickdir_t *nd) {
+    free(nd->buckets);
+    free(nd->entries);
+    free(nd->strings);
+    nickdir_init(nd);
+}
+
+/* Nicks compare case insensitively, so they hash that way too */
+static unsigned hash_nick(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)tolower((unsigned char)*s++);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int rebuild(nickdir_t *nd, const lsdb_t *db, nickdir_hop_fn hop,
+                   void *ctx) {
+    nickdir_entry_t *entries = NULL, **buckets;
+    char *strings = NULL, *p;
+    size_t bytes = 0;
+    int i, j, n = 0, n_buckets = 64;
+
+    for (i = 0; i < db->size; i++) {
+        const lsa_t *lsa = db->entries[i];
+        n += lsa->n_users;
+        for (j = 0; j < lsa->n_users; j++)
+            bytes += strlen(lsa->users[j]) + 1;
+    }
+    while (n_buckets < 2 * n)
+        n_buckets *= 2;
+
+    buckets = calloc(n_buckets, sizeof(nickdir_entry_t *));
+    if (n > 0) {
+        entries = malloc(n * sizeof(nickdir_entry_t));
+        strings = malloc(bytes);
+    }
+    if (!buckets || (n > 0 && (!entries || !strings))) {
+        free(buckets);
+        free(entries);
+        free(strings);
+        return -1;
+    }
+
+    p = strings;
+    n = 0;
+    for (i = 0; i < db->size; i++) {
+        const lsa_t *lsa = db->entries[i];
+        u_long via = 0;
+
+        if (hop(ctx, lsa->sender, &via) < 0)
+            via = 0;
+        for (j = 0; j < lsa->n_users; j++) {
+            nickdir_entry_t *e = &entries[n++];
+            unsigned h = hash_nick(lsa->users[j]) & (n_buckets - 1);
+
+            e->nick = strcpy(p, lsa->users[j]);
+            p += strlen(p) + 1;
+            e->node = lsa->sender;
+            e->hop = via;
+            e->next = buckets[h];
+            buckets[h] = e;
+        }
+    }
+
+    nickdir_free(nd);
+    nd->buckets = buckets;
+    nd->n_buckets = n_buckets;
+    nd->entries = entries;
+    nd->n_entries = n;
+    nd->strings = strings;
+    return 0;
+}
+
+/*
+ * Bring the directory up to date with db and the routing table
+ * generation route_gen.  Returns -1 if it couldn't be rebuilt (the old
+ * contents are kept).
+ */
+int nickdir_sync(nickdir_t *nd, const lsdb_t *db, unsigned route_gen,
+                 nickdir_hop_fn hop, void *ctx) {
+    unsigned long rebuilds = nd->rebuilds;
+
+    if (nd->valid && nd->user_gen == db->user_gen &&
+        nd->route_gen == route_gen)
+        return 0;
+    if (rebuild(nd, db, hop, ctx) < 0)
+        return -1;
+    nd->user_gen = db->user_gen;
+    nd->route_gen = route_gen;
+    nd->valid = 1;
+    nd->rebuilds = rebuilds + 1;
+    DPRINTF(DEBUG_ROUTING, "nickdir: rebuilt, %d nicks\n", nd->n_entries);
+    return 0;
+}
+
+const nickdir_entry_t *nickdir_find(const nickdir_t *nd, const char *nick) {
+    const nickdir_entry_t *e;
+
+    if (!nd->n_buckets)
+        return NULL;
+    for (e = nd->buckets[hash_nick(nick) & (nd->n_buckets - 1)]; e;
+         e = e->next)
+        if (!strcasecmp(e->nick, nick))
+            return e;
+    return NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef _NICKDIR_H_
+#define _NICKDIR_H_
+
+#include "lsdb.h"
+
+/*
+ * The cluster-wide nick directory: which node every registered nick is
+ * on, going by the user lists in the link state database, together with
+ * the next hop towards that node.
+ *
+ * The directory is a cache.  nickdir_sync() rebuilds it only when some
+ * user list has changed (db->user_gen) or the next hop table has
+ * (route_gen, see rt_nexthop()), so in the steady state finding where a
+ * message for a remote nick goes is a single hash lookup.
+ */
+
+typedef struct nickdir_entry {
+    char *nick;
+    u_long node;
+    u_long hop;         /* 0 if node is unreachable */
+    struct nickdir_entry *next;
+} nickdir_entry_t;
+
+typedef struct nickdir {
+    nickdir_entry_t **buckets;
+    int n_buckets;
+    nickdir_entry_t *entries;
+    int n_entries;
+    char *strings;
+    unsigned user_gen;
+    unsigned route_gen;
+    int valid;
+    unsigned long rebuilds;
+} nickdir_t;
+
+/* Next hop towards node from the caller's routing table, 0 on success */
+typedef int (*nickdir_hop_fn)(void *ctx, u_long node, u_long *hop);
+
+void nickdir_init(nickdir_t *nd);
+void nickdir_free(nickdir_t *nd);
+int nickdir_sync(nickdir_t *nd, const lsdb_t *db, unsigned route_gen,
+                 nickdir_hop_fn hop, void *ctx);
+const nickdir_entry_t *nickdir_find(const nickdir_t *nd, const char *nick);
+
+#endif /* _NICKDIR_H_ */
@@ -0,0 +1,81 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#include <stdint.h>
+
+/*
+ * USDT (user level statically defined tracing) probes.
+ *
+ * PROBEn(name, args...) marks a point that perf and bpftrace can attach
+ * to as usdt:<binary>:sircd:<name>, with up to four integer or pointer
+ * arguments.  Each expands to a single nop plus an ELF note in
+ * .note.stapsdt recording its address and where the arguments live; a
+ * tracer attaching swaps the nop for a breakpoint.  Until then the cost
+ * is the nop and keeping the arguments in registers or memory, so the
+ * arguments should be values the code has at hand anyway.
+ *
+ * The notes are the SystemTap <sys/sdt.h> format, written here directly
+ * so the build needs nothing extra.  Every argument is passed as a
+ * signed 64 bit value.  Building with -DNO_PROBES, or for anything but
+ * x86-64 and aarch64, leaves them out.
+ *
+ *   bpftrace -l 'usdt:./sircd:*'     lists them; see trace/ for scripts
+ */
+
+#if !defined(NO_PROBES) && (defined(__x86_64__) || defined(__aarch64__))
+
+#define _PROBE_NOTE(name, args)                                          \
+    "990:  nop\n"                                                        \
+    "      .pushsection .note.stapsdt,\"\",\"note\"\n"                   \
+    "      .balign 4\n"                                                  \
+    "      .4byte 992f-991f, 994f-993f, 3\n"                             \
+    "991:  .asciz \"stapsdt\"\n"                                         \
+    "992:  .balign 4\n"                                                  \
+    "993:  .8byte 990b\n"                                                \
+    "      .8byte _.stapsdt.base\n"                                      \
+    "      .8byte 0\n"                                                   \
+    "      .asciz \"sircd\"\n"                                           \
+    "      .asciz \"" #name "\"\n"                                       \
+    "      .asciz \"" args "\"\n"                                        \
+    "994:  .balign 4\n"                                                  \
+    "      .popsection\n"                                                \
+    "      .ifndef _.stapsdt.base\n"                                     \
+    "      .pushsection .stapsdt.base,\"aG\",\"progbits\","              \
+    ".stapsdt.base,comdat\n"                                             \
+    "      .weak _.stapsdt.base\n"                                       \
+    "      .hidden _.stapsdt.base\n"                                     \
+    "_.stapsdt.base: .space 1\n"                                         \
+    "      .size _.stapsdt.base, 1\n"                                    \
+    "      .popsection\n"                                                \
+    "      .endif\n"
+
+#define _PROBE_ARG(x) "nor" ((int64_t)(x))
+
+#define PROBE0(name) \
+    __asm__ __volatile__(_PROBE_NOTE(name, "") : : )
+#define PROBE1(name, a) \
+    __asm__ __volatile__(_PROBE_NOTE(name, "-8@%0") : : _PROBE_ARG(a))
+#define PROBE2(name, a, b) \
+    __asm__ __volatile__(_PROBE_NOTE(name, "-8@%0 -8@%1") \
+                         : : _PROBE_ARG(a), _PROBE_ARG(b))
+#define PROBE3(name, a, b, c) \
+    __asm__ __volatile__(_PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2") \
+                         : : _PROBE_ARG(a), _PROBE_ARG(b), _PROBE_ARG(c))
+#define PROBE4(name, a, b, c, d) \
+    __asm__ __volatile__(_PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2 -8@%3") \
+                         : : _PROBE_ARG(a), _PROBE_ARG(b), _PROBE_ARG(c), \
+                             _PROBE_ARG(d))
+
+#else
+
+#define PROBE0(name)                do { } while (0)
+#define PROBE1(name, a)             do { (void)(a); } while (0)
+#define PROBE2(name, a, b)          do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c) \
+    do { (void)(a); (void)(b); (void)(c); } while (0)
+#define PROBE4(name, a, b, c, d) \
+    do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+
+#endif
+
+#endif /* _PROBES_H_ */
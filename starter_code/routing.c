@@ -0,0 +1,785 @@
+/*
+ * routing.c
+ *
+ * Link state flooding, acknowledgements and neighbor liveness.  See
+ * routing.h for how it is driven.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "routing.h"
+#include "debug.h"
+#include "probes.h"
+
+static uint8_t pktbuf[LSA_MAX_PACKET];
+
+void rt_timers_default(rt_timers_t *timers) {
+    timers->adv_cycle = RT_DEFAULT_ADV_CYCLE * 1000;
+    timers->neighbor_timeout = RT_DEFAULT_NEIGHBOR_TIMEOUT * 1000;
+    timers->retransmit = RT_DEFAULT_RETRANSMIT * 1000;
+    timers->lsa_timeout = RT_DEFAULT_LSA_TIMEOUT * 1000;
+    timers->lsa_hold = RT_DEFAULT_LSA_HOLD_MS;
+}
+
+int rt_init(rt_node_t *rt, u_long self, const u_long *nbrs, int n_nbrs,
+            const rt_timers_t *timers, rt_send_fn send, rt_local_fn local,
+            void *ctx) {
+    int i;
+
+    memset(rt, 0, sizeof(*rt));
+    rt->self = self;
+    rt->timers = *timers;
+    rt->send = send;
+    rt->local = local;
+    rt->ctx = ctx;
+    rt->local_dirty = 1;
+    lsdb_init(&rt->db);
+    spf_init(&rt->spf);
+    nickdir_init(&rt->dir);
+
+    if (n_nbrs > 0) {
+        rt->nbrs = calloc(n_nbrs, sizeof(rt_neighbor_t));
+        if (!rt->nbrs)
+            return -1;
+    }
+    for (i = 0; i < n_nbrs; i++)
+        rt->nbrs[i].nodeID = nbrs[i];
+    rt->n_nbrs = n_nbrs;
+    return 0;
+}
+
+static void clear_pending(rt_neighbor_t *nb);
+
+void rt_destroy(rt_node_t *rt) {
+    int i;
+
+    for (i = 0; i < rt->n_nbrs; i++)
+        clear_pending(&rt->nbrs[i]);
+    lsdb_destroy(&rt->db);
+    spf_free(&rt->spf);
+    nickdir_free(&rt->dir);
+    free(rt->hops);
+    free(rt->nbrs);
+    memset(rt, 0, sizeof(*rt));
+}
+
+rt_neighbor_t *rt_neighbor(rt_node_t *rt, u_long nodeID) {
+    int i;
+    for (i = 0; i < rt->n_nbrs; i++)
+        if (rt->nbrs[i].nodeID == nodeID)
+            return &rt->nbrs[i];
+    return NULL;
+}
+
+void rt_local_changed(rt_node_t *rt) {
+    rt->local_dirty = 1;
+}
+
+/* When a triggered LSA may go out: lsa_hold after our previous one */
+static uint64_t hold_until(const rt_node_t *rt) {
+    if (!rt->last_originated)
+        return 0;
+    return rt->last_adv + rt->timers.lsa_hold;
+}
+
+
+/* Unicast routes */
+
+static unsigned hash_dest(u_long id, int cap) {
+    return (id * 2654435761u) & (cap - 1);
+}
+
+static rt_hop_t *hop_slot(rt_hop_t *hops, int cap, u_long dest) {
+    unsigned h = hash_dest(dest, cap);
+
+    while (hops[h].dest && hops[h].dest != dest)
+        h = (h + 1) & (cap - 1);
+    return &hops[h];
+}
+
+/*
+ * Rebuild the next hop table from a fresh SPF tree.  route_gen only
+ * moves if the new table differs from the old one.
+ */
+static void rebuild_hops(rt_node_t *rt) {
+    const spf_tree_t *t = &rt->spf;
+    rt_hop_t *hops, *old;
+    int i, cap = 16, n = 0, changed;
+
+    while (cap < 2 * t->n)
+        cap *= 2;
+    hops = calloc(cap, sizeof(rt_hop_t));
+    if (!hops)
+        return;
+    for (i = 0; i < t->n; i++) {
+        rt_hop_t *e;
+        if (t->nexthop[i] < 0)
+            continue;
+        e = hop_slot(hops, cap, t->ids[i]);
+        e->dest = t->ids[i];
+        e->n_via = spf_first_hops(t, t->ids[i], e->via, RT_MAX_PATHS);
+        n++;
+    }
+
+    changed = !rt->hops || n != rt->n_hops;
+    for (i = 0; !changed && i < cap; i++) {
+        if (!hops[i].dest)
+            continue;
+        old = hop_slot(rt->hops, rt->hops_cap, hops[i].dest);
+        changed = old->dest != hops[i].dest ||
+                  old->n_via != hops[i].n_via ||
+                  memcmp(old->via, hops[i].via,
+                         hops[i].n_via * sizeof(u_long));
+    }
+
+    free(rt->hops);
+    rt->hops = hops;
+    rt->hops_cap = cap;
+    rt->n_hops = n;
+    if (changed) {
+        rt->route_gen++;
+        DPRINTF(DEBUG_ROUTING, "routing: next hops changed, %d routes\n",
+                n);
+    }
+}
+
+const spf_tree_t *rt_routes(rt_node_t *rt) {
+    if (!rt->spf_valid || rt->spf.topo_gen != rt->db.topo_gen) {
+        PROBE1(spf_start, rt->db.size);
+        spf_run(&rt->db, rt->self, &rt->spf);
+        PROBE1(spf_done, rt->spf.n);
+        rt->spf_valid = 1;
+        rebuild_hops(rt);
+    }
+    return &rt->spf;
+}
+
+/*
+ * The neighbor to send traffic for dest through.  With several equal
+ * cost paths, flow picks one: the same flow always gets the same hop.
+ * Our own nodeID goes into the choice so that successive hops don't all
+ * make the same one (and send every flow with a given hash down the
+ * same side of the network).  Returns -1 if dest is unreachable (or is
+ * us).
+ */
+int rt_nexthop(rt_node_t *rt, u_long dest, uint32_t flow, u_long *hop) {
+    rt_hop_t *e;
+    uint32_t h;
+
+    rt_routes(rt);
+    if (!rt->hops || !dest)
+        return -1;
+    e = hop_slot(rt->hops, rt->hops_cap, dest);
+    if (!e->dest)
+        return -1;
+    if (e->n_via == 1) {
+        *hop = e->via[0];
+        return 0;
+    }
+    h = (flow ^ (uint32_t)rt->self * 0x9e3779b9u) * 0x85ebca6bu;
+    h ^= h >> 16;
+    *hop = e->via[h % e->n_via];
+    return 0;
+}
+
+static int dir_hop(void *ctx, u_long node, u_long *hop) {
+    rt_node_t *rt = ctx;
+    rt_hop_t *e;
+
+    if (node == rt->self) {
+        *hop = rt->self;
+        return 0;
+    }
+    if (!rt->hops)
+        return -1;
+    e = hop_slot(rt->hops, rt->hops_cap, node);
+    if (!e->dest)
+        return -1;
+    *hop = e->via[0];
+    return 0;
+}
+
+/*
+ * Where nick is registered, and the next hop towards it (our own nodeID
+ * for local nicks, 0 if its node is unreachable).  NULL if no node
+ * advertises it.
+ */
+const nickdir_entry_t *rt_locate_nick(rt_node_t *rt, const char *nick) {
+    rt_routes(rt);
+    nickdir_sync(&rt->dir, &rt->db, rt->route_gen, dir_hop, rt);
+    return nickdir_find(&rt->dir, nick);
+}
+
+
+/* Sending */
+
+static int cmp_ack(const void *a, const void *b) {
+    u_long x = ((const rt_ack_t *)a)->sender;
+    u_long y = ((const rt_ack_t *)b)->sender;
+    return x < y ? -1 : x > y;
+}
+
+/* Send everything held for nb in one datagram */
+static void flush_acks(rt_node_t *rt, rt_neighbor_t *nb) {
+    u_long senders[RT_MAX_ACKS];
+    uint32_t seqs[RT_MAX_ACKS];
+    ssize_t len;
+    int i, n;
+
+    if (nb->n_acks == 0)
+        return;
+    if (nb->n_acks == 1) {
+        /* A plain ACK is shorter */
+        len = lsa_encode_ack(nb->acks[0].sender, nb->acks[0].seq, pktbuf,
+                             sizeof(pktbuf));
+    } else {
+        /* In order of originator, keeping the newest of duplicates */
+        qsort(nb->acks, nb->n_acks, sizeof(rt_ack_t), cmp_ack);
+        for (i = n = 0; i < nb->n_acks; i++) {
+            if (n > 0 && senders[n - 1] == nb->acks[i].sender) {
+                if ((int32_t)(nb->acks[i].seq - seqs[n - 1]) > 0)
+                    seqs[n - 1] = nb->acks[i].seq;
+                continue;
+            }
+            senders[n] = nb->acks[i].sender;
+            seqs[n++] = nb->acks[i].seq;
+        }
+        len = lsa_encode_acks(rt->self, senders, seqs, n, pktbuf,
+                              sizeof(pktbuf));
+    }
+    if (len > 0) {
+        rt->send(rt->ctx, nb->nodeID, pktbuf, len);
+        rt->stats.acks_sent += nb->n_acks;
+        rt->stats.ack_pkts++;
+        rt->stats.bytes_sent += len;
+    }
+    nb->n_acks = 0;
+}
+
+/* Acknowledge (sender, seq) to nb, now or at the end of the burst */
+static void send_ack(rt_node_t *rt, rt_neighbor_t *nb, u_long sender,
+                     uint32_t seq) {
+    uint8_t ack[LSA_HDR_LEN];
+
+    if (rt->ack_each) {
+        lsa_encode_ack(sender, seq, ack, sizeof(ack));
+        rt->send(rt->ctx, nb->nodeID, ack, LSA_HDR_LEN);
+        rt->stats.acks_sent++;
+        rt->stats.ack_pkts++;
+        rt->stats.bytes_sent += LSA_HDR_LEN;
+        return;
+    }
+    if (nb->n_acks == RT_MAX_ACKS)
+        flush_acks(rt, nb);
+    nb->acks[nb->n_acks].sender = sender;
+    nb->acks[nb->n_acks++].seq = seq;
+}
+
+void rt_flush(rt_node_t *rt) {
+    int i;
+    for (i = 0; i < rt->n_nbrs; i++)
+        flush_acks(rt, &rt->nbrs[i]);
+}
+
+static unsigned hash_sender(u_long sender, int cap) {
+    return (uint32_t)(sender * 2654435761u) & (cap - 1);
+}
+
+static rt_pending_t *find_pending(rt_neighbor_t *nb, u_long sender) {
+    rt_pending_t *p;
+
+    if (!nb->rexmit_hash)
+        return NULL;
+    for (p = nb->rexmit_hash[hash_sender(sender, nb->rexmit_cap)]; p;
+         p = p->hash_next)
+        if (p->sender == sender)
+            return p;
+    return NULL;
+}
+
+/* Keep the sender index at no more than one entry per bucket */
+static int grow_pending(rt_neighbor_t *nb) {
+    int cap = nb->rexmit_cap ? nb->rexmit_cap * 2 : 16;
+    rt_pending_t **hash = calloc(cap, sizeof(rt_pending_t *)), *p;
+
+    if (!hash)
+        return -1;
+    for (p = nb->rexmit; p; p = p->next) {
+        unsigned h = hash_sender(p->sender, cap);
+        p->hash_next = hash[h];
+        hash[h] = p;
+    }
+    free(nb->rexmit_hash);
+    nb->rexmit_hash = hash;
+    nb->rexmit_cap = cap;
+    return 0;
+}
+
+/* Put p at the back of nb's list, as the most recently sent */
+static void append_pending(rt_neighbor_t *nb, rt_pending_t *p) {
+    p->next = NULL;
+    p->prev = nb->rexmit_last;
+    if (nb->rexmit_last)
+        nb->rexmit_last->next = p;
+    else
+        nb->rexmit = p;
+    nb->rexmit_last = p;
+}
+
+static void unlink_pending(rt_neighbor_t *nb, rt_pending_t *p) {
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        nb->rexmit = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    else
+        nb->rexmit_last = p->prev;
+}
+
+static void free_pending(rt_neighbor_t *nb, rt_pending_t *p) {
+    rt_pending_t **pp = &nb->rexmit_hash[hash_sender(p->sender,
+                                                     nb->rexmit_cap)];
+
+    while (*pp != p)
+        pp = &(*pp)->hash_next;
+    *pp = p->hash_next;
+    unlink_pending(nb, p);
+    nb->n_rexmit--;
+    free(p);
+}
+
+/* nb has (sender, seq) or newer, so stop sending it older copies */
+static void drop_pending(rt_neighbor_t *nb, u_long sender, uint32_t seq) {
+    rt_pending_t *p = find_pending(nb, sender);
+
+    if (p && (int32_t)(seq - p->seq) >= 0)
+        free_pending(nb, p);
+}
+
+static void clear_pending(rt_neighbor_t *nb) {
+    rt_pending_t *p, *next;
+
+    for (p = nb->rexmit; p; p = next) {
+        next = p->next;
+        free(p);
+    }
+    free(nb->rexmit_hash);
+    nb->rexmit = nb->rexmit_last = NULL;
+    nb->rexmit_hash = NULL;
+    nb->rexmit_cap = nb->n_rexmit = 0;
+}
+
+/* Put lsa at the back of nb's retransmission list */
+static void add_pending(rt_neighbor_t *nb, const lsa_t *lsa, uint64_t now) {
+    rt_pending_t *p = find_pending(nb, lsa->sender);
+    unsigned h;
+
+    if (p) {
+        unlink_pending(nb, p);
+    } else {
+        if (nb->n_rexmit >= nb->rexmit_cap && grow_pending(nb) < 0)
+            return;
+        if (!(p = malloc(sizeof(rt_pending_t))))
+            return;
+        p->sender = lsa->sender;
+        h = hash_sender(p->sender, nb->rexmit_cap);
+        p->hash_next = nb->rexmit_hash[h];
+        nb->rexmit_hash[h] = p;
+        nb->n_rexmit++;
+    }
+    p->seq = lsa->seq;
+    p->last_tx = now;
+    append_pending(nb, p);
+}
+
+/*
+ * Send lsa to one neighbor.  Only live neighbors are expected to ack,
+ * so only they get a retransmission entry.
+ */
+static void send_lsa(rt_node_t *rt, rt_neighbor_t *nb, const lsa_t *lsa,
+                     int full, uint64_t now) {
+    ssize_t len = lsa_encode(lsa, pktbuf, sizeof(pktbuf), full);
+
+    if (len < 0) {
+        DPRINTF(DEBUG_ROUTING, "routing: LSA from %lu too big to send\n",
+                lsa->sender);
+        return;
+    }
+    rt->send(rt->ctx, nb->nodeID, pktbuf, len);
+    rt->stats.lsa_sent++;
+    rt->stats.bytes_sent += len;
+    if (nb->alive)
+        add_pending(nb, lsa, now);
+}
+
+/* Flood lsa to every neighbor except the one it came from */
+static void flood(rt_node_t *rt, const lsa_t *lsa, u_long except,
+                  uint64_t now) {
+    int i;
+    for (i = 0; i < rt->n_nbrs; i++) {
+        rt_neighbor_t *nb = &rt->nbrs[i];
+        if (nb->nodeID == except)
+            continue;
+        if (nb->alive || lsa->sender == rt->self)
+            send_lsa(rt, nb, lsa, 0, now);
+    }
+}
+
+static void originate(rt_node_t *rt, int periodic, uint64_t now) {
+    u_long links[rt->n_nbrs > 0 ? rt->n_nbrs : 1];
+    lsa_t *lsa;
+    int i, n = 0;
+
+    for (i = 0; i < rt->n_nbrs; i++)
+        if (rt->nbrs[i].alive)
+            links[n++] = rt->nbrs[i].nodeID;
+
+    lsa = lsa_new(rt->self, ++rt->seq);
+    if (!lsa || lsa_set_links(lsa, links, n) < 0) {
+        lsa_free(lsa);
+        return;
+    }
+    if (rt->local)
+        rt->local(rt->ctx, lsa, periodic);
+    lsa->rcvd_at = now;
+
+    if (lsdb_update(&rt->db, lsa) != 1) {
+        lsa_free(lsa);
+        return;
+    }
+    rt->last_originated = lsa->seq;
+    DPRINTF(DEBUG_ROUTING, "routing: originating LSA seq %u (%d links, "
+            "%d users, %d channels)\n", lsa->seq, lsa->n_links,
+            lsa->n_users, lsa->n_chans);
+
+    rt->local_dirty = 0;
+    rt->last_adv = now;
+    flood(rt, lsa, rt->self, now);
+}
+
+
+/* Database sync */
+
+static void send_sync(rt_node_t *rt, u_long to, size_t len) {
+    rt->send(rt->ctx, to, pktbuf, len);
+    rt->stats.sync_pkts++;
+    rt->stats.sync_bytes += len;
+    rt->stats.bytes_sent += len;
+}
+
+/* Send our hashes for the given tree nodes at level */
+static void send_digest(rt_node_t *rt, u_long to, int level,
+                        const uint16_t *pos, int n) {
+    uint64_t hash[LSDB_MERKLE_LEAVES];
+    ssize_t len;
+    int i;
+
+    for (i = 0; i < n; i++)
+        hash[i] = lsdb_merkle(&rt->db, level, pos[i]);
+    len = lsa_encode_digest(rt->self, level, pos, hash, n, pktbuf,
+                            sizeof(pktbuf));
+    if (len > 0)
+        send_sync(rt, to, len);
+}
+
+static void send_leaves(rt_node_t *rt, u_long to, int reply,
+                        const uint16_t *buckets, int n) {
+    ssize_t len = lsa_encode_leaves(rt->self, reply, &rt->db, buckets, n,
+                                    pktbuf, sizeof(pktbuf));
+    if (len > 0)
+        send_sync(rt, to, len);
+    else
+        DPRINTF(DEBUG_ROUTING, "routing: %d buckets too big to send\n", n);
+}
+
+/*
+ * A neighbor just came up.  Start comparing databases from the root, so
+ * it doesn't have to wait a full advertisement cycle for what it's
+ * missing.
+ */
+static void sync_neighbor(rt_node_t *rt, rt_neighbor_t *nb, uint64_t now) {
+    uint16_t root = 0;
+    int i;
+
+    if (!rt->full_sync) {
+        send_digest(rt, nb->nodeID, 0, &root, 1);
+        nb->syncing = 1;
+        return;
+    }
+    for (i = 0; i < rt->db.size; i++) {
+        if (rt->db.entries[i]->sender != rt->self) {
+            send_lsa(rt, nb, rt->db.entries[i], 1, now);
+            rt->stats.sync_lsas++;
+        }
+    }
+}
+
+/*
+ * The neighbor's hashes for some tree nodes.  Where ours differ, go one
+ * level down; at the bottom, swap bucket contents.
+ */
+static void handle_digest(rt_node_t *rt, rt_neighbor_t *nb,
+                          const uint8_t *buf, size_t len) {
+    uint16_t pos[LSDB_MERKLE_LEAVES], next[LSDB_MERKLE_LEAVES];
+    uint64_t hash[LSDB_MERKLE_LEAVES];
+    int i, j, n, level, n_next = 0;
+
+    n = lsa_decode_digest(buf, len, &level, pos, hash, LSDB_MERKLE_LEAVES);
+    if (n < 0 || level > LSDB_MERKLE_DEPTH)
+        return;
+    if (level == 0) {
+        /* If both ends came up at once only the higher ID walks down */
+        int both = nb->syncing && rt->self < nb->nodeID;
+        nb->syncing = 0;
+        if (both)
+            return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (lsdb_merkle(&rt->db, level, pos[i]) == hash[i])
+            continue;
+        if (level == LSDB_MERKLE_DEPTH) {
+            next[n_next++] = pos[i];
+            continue;
+        }
+        for (j = 0; j < LSDB_MERKLE_FANOUT &&
+             n_next < LSDB_MERKLE_LEAVES; j++)
+            next[n_next++] = pos[i] * LSDB_MERKLE_FANOUT + j;
+    }
+    if (n_next == 0)
+        return;
+    if (level == LSDB_MERKLE_DEPTH)
+        send_leaves(rt, nb->nodeID, 0, next, n_next);
+    else
+        send_digest(rt, nb->nodeID, level + 1, next, n_next);
+}
+
+/*
+ * The neighbor's (sender, seq) lists for some buckets.  Send it every
+ * LSA of ours in them that it lacks or has an older copy of (it does
+ * the same for us when we answer with our own lists).
+ */
+static void handle_leaves(rt_node_t *rt, rt_neighbor_t *nb,
+                          const uint8_t *buf, size_t len, uint64_t now) {
+    static u_long senders[LSA_MAX_PACKET / 8];
+    static uint32_t seqs[LSA_MAX_PACKET / 8];
+    uint16_t buckets[LSDB_MERKLE_LEAVES];
+    char want[LSDB_MERKLE_LEAVES];
+    int i, j, n, n_buckets, reply;
+
+    n = lsa_decode_leaves(buf, len, &reply, buckets, &n_buckets, senders,
+                          seqs, LSA_MAX_PACKET / 8);
+    if (n < 0)
+        return;
+
+    memset(want, 0, sizeof(want));
+    for (i = 0; i < n_buckets; i++)
+        if (buckets[i] < LSDB_MERKLE_LEAVES)
+            want[buckets[i]] = 1;
+
+    for (i = 0; i < rt->db.size; i++) {
+        lsa_t *lsa = rt->db.entries[i];
+        if (!want[lsdb_bucket(lsa->sender)])
+            continue;
+        for (j = 0; j < n && senders[j] != lsa->sender; j++)
+            ;
+        if (j < n && (int32_t)(seqs[j] - lsa->seq) >= 0)
+            continue;
+        send_lsa(rt, nb, lsa, 1, now);
+        rt->stats.sync_lsas++;
+    }
+    if (!reply)
+        send_leaves(rt, nb->nodeID, 1, buckets, n_buckets);
+}
+
+
+/* Receiving */
+
+static void handle_acks(rt_node_t *rt, rt_neighbor_t *nb,
+                        const uint8_t *buf, size_t len) {
+    static u_long senders[LSA_MAX_PACKET / 4];
+    static uint32_t seqs[LSA_MAX_PACKET / 4];
+    int i, n;
+
+    n = lsa_decode_acks(buf, len, senders, seqs, LSA_MAX_PACKET / 4);
+    if (n < 0) {
+        DPRINTF(DEBUG_ROUTING, "routing: bad ACKS from %lu\n", nb->nodeID);
+        return;
+    }
+    rt->stats.acks_rcvd += n;
+    for (i = 0; i < n; i++)
+        drop_pending(nb, senders[i], seqs[i]);
+}
+
+static void handle_advert(rt_node_t *rt, rt_neighbor_t *nb,
+                          const uint8_t *buf, size_t len, uint64_t now) {
+    lsa_t *lsa = lsa_decode(buf, len), *have;
+    u_long from = nb->nodeID;
+
+    if (!lsa) {
+        DPRINTF(DEBUG_ROUTING, "routing: bad LSA from %lu\n", from);
+        return;
+    }
+    rt->stats.lsa_rcvd++;
+    PROBE3(lsa_recv, from, lsa->sender, lsa->seq);
+    send_ack(rt, nb, lsa->sender, lsa->seq);
+    /* It has this copy, so it doesn't need ours */
+    drop_pending(nb, lsa->sender, lsa->seq);
+
+    if (lsa->sender == rt->self) {
+        /* Our own LSA from before a restart: jump past it */
+        if ((int32_t)(lsa->seq - rt->seq) >= 0) {
+            rt->seq = lsa->seq;
+            rt->local_dirty = 1;
+        }
+        lsa_free(lsa);
+        return;
+    }
+
+    have = lsdb_find(&rt->db, lsa->sender);
+    if (have && (int32_t)(lsa->seq - have->seq) < 0) {
+        /* The neighbor is behind; bring it up to date */
+        send_lsa(rt, nb, have, 1, now);
+        lsa_free(lsa);
+        return;
+    }
+
+    if (have && (int32_t)(lsa->seq - have->seq) == 0) {
+        lsa_free(lsa);
+        return;
+    }
+    lsa_apply_delta(lsa, have);
+    lsa->rcvd_at = now;
+    if (lsdb_update(&rt->db, lsa) != 1) {
+        lsa_free(lsa);
+        return;
+    }
+    DPRINTF(DEBUG_ROUTING, "routing: new LSA from %lu seq %u via %lu\n",
+            lsa->sender, lsa->seq, from);
+
+    if (lsa->ttl > 1) {
+        lsa->ttl--;
+        flood(rt, lsa, from, now);
+    }
+}
+
+void rt_recv(rt_node_t *rt, u_long from, const uint8_t *buf, size_t len,
+             uint64_t now) {
+    rt_neighbor_t *nb = rt_neighbor(rt, from);
+    u_long sender;
+    uint32_t seq;
+    int type;
+
+    if (!nb) {
+        DPRINTF(DEBUG_ROUTING, "routing: packet from non-neighbor %lu\n",
+                from);
+        return;
+    }
+    nb->last_heard = now;
+    if (!nb->alive) {
+        DPRINTF(DEBUG_ROUTING, "routing: neighbor %lu is up\n", from);
+        nb->alive = 1;
+        rt->local_dirty = 1;
+        sync_neighbor(rt, nb, now);
+    }
+
+    if (lsa_peek(buf, len, &type, &sender, &seq) < 0)
+        return;
+    switch (type) {
+    case LSA_TYPE_ACK:
+        rt->stats.acks_rcvd++;
+        drop_pending(nb, sender, seq);
+        break;
+    case LSA_TYPE_ACKS:
+        handle_acks(rt, nb, buf, len);
+        break;
+    case LSA_TYPE_ADVERT:
+        handle_advert(rt, nb, buf, len, now);
+        break;
+    case LSA_TYPE_DIGEST:
+        handle_digest(rt, nb, buf, len);
+        break;
+    case LSA_TYPE_LEAVES:
+        handle_leaves(rt, nb, buf, len, now);
+        break;
+    }
+}
+
+
+/* Timers */
+
+/*
+ * nb's retransmission timer: resend every entry at the head of its list
+ * that has gone unacknowledged for the retransmit interval, and move
+ * them to the back.
+ */
+static void retransmit(rt_node_t *rt, rt_neighbor_t *nb, uint64_t now) {
+    rt_pending_t *p;
+    int n = nb->n_rexmit;
+
+    while (n-- > 0 && (p = nb->rexmit) != NULL &&
+           now - p->last_tx >= rt->timers.retransmit) {
+        lsa_t *lsa = lsdb_find(&rt->db, p->sender);
+        ssize_t len;
+
+        if (!lsa || lsa->seq != p->seq) {
+            free_pending(nb, p);
+            continue;
+        }
+        len = lsa_encode(lsa, pktbuf, sizeof(pktbuf), 0);
+        if (len > 0) {
+            rt->send(rt->ctx, nb->nodeID, pktbuf, len);
+            rt->stats.retransmits++;
+            rt->stats.bytes_sent += len;
+        }
+        p->last_tx = now;
+        unlink_pending(nb, p);
+        append_pending(nb, p);
+    }
+}
+
+void rt_tick(rt_node_t *rt, uint64_t now) {
+    int i;
+
+    for (i = 0; i < rt->n_nbrs; i++) {
+        rt_neighbor_t *nb = &rt->nbrs[i];
+        if (nb->alive && now - nb->last_heard > rt->timers.neighbor_timeout) {
+            DPRINTF(DEBUG_ROUTING, "routing: neighbor %lu timed out\n",
+                    nb->nodeID);
+            nb->alive = 0;
+            nb->n_acks = 0;
+            clear_pending(nb);
+            rt->local_dirty = 1;
+        }
+    }
+
+    lsdb_expire(&rt->db, rt->self, now, rt->timers.lsa_timeout);
+    for (i = 0; i < rt->n_nbrs; i++)
+        retransmit(rt, &rt->nbrs[i], now);
+
+    if (now - rt->last_adv >= rt->timers.adv_cycle)
+        originate(rt, 1, now);
+    else if (rt->local_dirty && now >= hold_until(rt))
+        originate(rt, 0, now);
+    rt_flush(rt);
+}
+
+/*
+ * The latest time by which rt_tick() has to be called again.
+ */
+uint64_t rt_next_deadline(const rt_node_t *rt, uint64_t now) {
+    uint64_t next = rt->last_adv + rt->timers.adv_cycle;
+    int i;
+
+    if (rt->local_dirty && hold_until(rt) < next)
+        next = hold_until(rt);
+    for (i = 0; i < rt->n_nbrs; i++) {
+        const rt_neighbor_t *nb = &rt->nbrs[i];
+        if (nb->n_acks > 0)
+            return now;
+        if (nb->rexmit && nb->rexmit->last_tx + rt->timers.retransmit < next)
+            next = nb->rexmit->last_tx + rt->timers.retransmit;
+    }
+    return next < now ? now : next;
+}
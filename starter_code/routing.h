@@ -0,0 +1,172 @@
+#ifndef _ROUTING_H_
+#define _ROUTING_H_
+
+#include "lsdb.h"
+#include "spf.h"
+#include "nickdir.h"
+
+/*
+ * The link state routing protocol.
+ *
+ * This is only the protocol state machine: it never touches a socket or
+ * reads a clock.  The caller feeds it datagrams with rt_recv(), calls
+ * rt_tick() with the current time, and gets packets back through the
+ * send callback.  All times are in milliseconds.
+ *
+ * Every other node listed in the config file is a potential neighbor.
+ * A neighbor is alive once we hear anything from it and dead again
+ * after neighbor_timeout of silence; only live neighbors are listed as
+ * links in our LSA.
+ *
+ * When a neighbor comes up (a new node, or the end of a netsplit) the
+ * two databases are reconciled by walking their hash trees (lsdb.h)
+ * from the root down, only into subtrees that differ, and then
+ * swapping the (sender, seq) lists of the buckets that differ, so each
+ * side sends just the LSAs the other is missing.  After a short split
+ * that costs in proportion to what changed rather than to the size of
+ * the cluster.  full_sync sends the whole database instead, as before.
+ *
+ * Flooding is reliable: every LSA sent to a live neighbor goes on that
+ * neighbor's retransmission list until it is acknowledged, or until the
+ * neighbor is seen to have it anyway (it sent us the same or a newer
+ * copy).  The list is kept in order of last transmission, so its head
+ * is the neighbor's one retransmission timer.  Acknowledgements are
+ * held per neighbor and sent as one ACKS datagram when the caller has
+ * drained a burst of packets (rt_flush(), also done by rt_tick()), so
+ * a flood of updates after a failure costs one ack per neighbor per
+ * burst rather than one per LSA.  ack_each goes back to acking every
+ * LSA on its own.
+ *
+ * The local callback fills in the users and channel summary of each LSA
+ * we originate; periodic is set for the advertisement cycle refreshes
+ * (as opposed to ones triggered by rt_local_changed()).  A triggered
+ * LSA waits until lsa_hold has passed since our previous one, so a run
+ * of joins, parts and link changes inside that time goes out as one.
+ *
+ * Unicast routes come from a next hop table (destination -> neighbors)
+ * that is rebuilt after SPF runs, and only counted as changed
+ * (route_gen) when some next hop actually moved.  Where there are
+ * several equal-cost paths the table keeps all their first hops, and
+ * rt_nexthop() picks one by a flow hash, so one conversation always
+ * takes the same path while different ones spread over all of them.
+ * The nick directory hangs off the same generations.
+ */
+
+/* Defaults, in seconds, match rt_parse_command_line() */
+#define RT_DEFAULT_ADV_CYCLE        30
+#define RT_DEFAULT_NEIGHBOR_TIMEOUT 120
+#define RT_DEFAULT_RETRANSMIT       3
+#define RT_DEFAULT_LSA_TIMEOUT      120
+#define RT_DEFAULT_LSA_HOLD_MS      200     /* not a flag; milliseconds */
+
+typedef struct rt_timers {
+    uint64_t adv_cycle;
+    uint64_t neighbor_timeout;
+    uint64_t retransmit;
+    uint64_t lsa_timeout;
+    uint64_t lsa_hold;      /* least time between our own LSAs */
+} rt_timers_t;
+
+/* An LSA sent to a neighbor that hasn't acknowledged it yet */
+typedef struct rt_pending {
+    u_long sender;
+    uint32_t seq;
+    uint64_t last_tx;
+    struct rt_pending *next, *prev;   /* in order of last_tx */
+    struct rt_pending *hash_next;     /* by sender */
+} rt_pending_t;
+
+/* An acknowledgement held until the end of the receive burst */
+typedef struct rt_ack {
+    u_long sender;
+    uint32_t seq;
+} rt_ack_t;
+
+#define RT_MAX_ACKS 256   /* acks held per neighbor before sending early */
+
+typedef struct rt_neighbor {
+    u_long nodeID;
+    uint64_t last_heard;
+    int alive;
+    int syncing;            /* we sent it our root digest */
+    rt_pending_t *rexmit;   /* unacked LSAs, oldest transmission first */
+    rt_pending_t *rexmit_last;
+    rt_pending_t **rexmit_hash;
+    int rexmit_cap;         /* hash buckets, a power of 2 */
+    int n_rexmit;
+    rt_ack_t acks[RT_MAX_ACKS];
+    int n_acks;
+} rt_neighbor_t;
+
+typedef struct rt_stats {
+    unsigned long lsa_sent;
+    unsigned long lsa_rcvd;
+    unsigned long acks_sent;    /* LSAs acknowledged */
+    unsigned long ack_pkts;     /* ... in this many datagrams */
+    unsigned long acks_rcvd;
+    unsigned long retransmits;
+    unsigned long bytes_sent;
+    unsigned long sync_pkts;    /* DIGEST and LEAVES packets sent */
+    unsigned long sync_bytes;   /* ... and their bytes */
+    unsigned long sync_lsas;    /* LSAs sent to bring a neighbor up to date */
+} rt_stats_t;
+
+#define RT_MAX_PATHS 8   /* equal-cost next hops kept per destination */
+
+/*
+ * One slot of the open addressed next hop table; dest 0 is empty.
+ * via[] holds every neighbor that starts a shortest path to dest, in
+ * ascending order.
+ */
+typedef struct rt_hop {
+    u_long dest;
+    int n_via;
+    u_long via[RT_MAX_PATHS];
+} rt_hop_t;
+
+typedef int (*rt_send_fn)(void *ctx, u_long to, const uint8_t *buf,
+                          size_t len);
+typedef void (*rt_local_fn)(void *ctx, lsa_t *lsa, int periodic);
+
+typedef struct rt_node {
+    u_long self;
+    rt_timers_t timers;
+    lsdb_t db;
+    spf_tree_t spf;         /* rooted at self, see rt_routes() */
+    int spf_valid;
+    rt_hop_t *hops;         /* next hop table, see rt_nexthop() */
+    int hops_cap;
+    int n_hops;
+    unsigned route_gen;     /* bumped when some next hop changes */
+    nickdir_t dir;
+    rt_neighbor_t *nbrs;
+    int n_nbrs;
+    uint32_t seq;
+    uint32_t last_originated; /* seq of our previous LSA, 0 if none yet */
+    uint64_t last_adv;
+    int local_dirty;
+    rt_send_fn send;
+    rt_local_fn local;      /* fills in users and channels of our LSA */
+    void *ctx;
+    int full_sync;          /* dump the database on neighbor up */
+    int ack_each;           /* one ACK datagram per LSA, right away */
+    rt_stats_t stats;
+} rt_node_t;
+
+void rt_timers_default(rt_timers_t *timers);
+int rt_init(rt_node_t *rt, u_long self, const u_long *nbrs, int n_nbrs,
+            const rt_timers_t *timers, rt_send_fn send, rt_local_fn local,
+            void *ctx);
+void rt_destroy(rt_node_t *rt);
+void rt_tick(rt_node_t *rt, uint64_t now);
+void rt_recv(rt_node_t *rt, u_long from, const uint8_t *buf, size_t len,
+             uint64_t now);
+void rt_flush(rt_node_t *rt);
+void rt_local_changed(rt_node_t *rt);
+uint64_t rt_next_deadline(const rt_node_t *rt, uint64_t now);
+const spf_tree_t *rt_routes(rt_node_t *rt);
+rt_neighbor_t *rt_neighbor(rt_node_t *rt, u_long nodeID);
+int rt_nexthop(rt_node_t *rt, u_long dest, uint32_t flow, u_long *hop);
+const nickdir_entry_t *rt_locate_nick(rt_node_t *rt, const char *nick);
+
+#endif /* _ROUTING_H_ */
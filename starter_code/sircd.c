@@ -1,10 +1,19 @@
+#define _GNU_SOURCE          /* accept4() */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <assert.h>
@@ -13,20 +22,110 @@
 // #include "rtgrading.h"
 #include "sircd.h"
 #include "irc_proto.h"
+#include "channel.h"
+#include "fwd.h"
+#include "capture.h"
+#include "msgbuf.h"
+#include "admit.h"
+#include "backlog.h"
+#include "probes.h"
+
+#define MAX_EVENTS 64
+#define NICK_HASH_SIZE 1024
+#define ROUTING_BURST 64     /* datagrams read per wakeup */
+#define MAX_IOV 256          /* send queue pieces per writev() */
+#define READ_SIZE 16384      /* bytes read from a client at a time */
+#define ACCEPT_BURST 64      /* connections accepted per wakeup */
 
 u_long curr_nodeID;
 rt_config_file_t   curr_node_config_file;  /* The config_file  for this node */
 rt_config_entry_t *curr_node_config_entry; /* The config_entry for this node */
+char server_name[MAX_SERVERNAME];
+rt_node_t routing;
+uint64_t line_stamp;
+unsigned long clients_queued;
+unsigned long clients_drained;
+loop_stats_t loop_stats;
+
+static client *clients[MAX_CLIENTS];
+static client *nick_hash[NICK_HASH_SIZE];
+static int epfd = -1;
+static int listen_fd = -1;
+static int routing_fd = -1;
+
+/* epoll tags for the two non-client sockets */
+static char listen_tag, routing_tag;
+
+/* Clients closed while handling an event; freed once it is done */
+static client *closed[MAX_CLIENTS];
+static int n_closed = 0;
+
+/*
+ * Output.  Each client's send queue is a list of pieces of pooled
+ * msgbufs; a line sent to a channel is copied once and every member's
+ * queue refers to that copy.  A client whose queue gets something while
+ * it isn't waiting for EPOLLOUT goes on the dirty list, and once the
+ * loop has handled all of an epoll_wait() worth of events,
+ * flush_pending() writes each of them with one writev().
+ */
+typedef struct seg {
+    msgbuf_t *mb;
+    unsigned off, len;      /* the part of mb->data still to write */
+    struct seg *next;
+} seg_t;
+
+static client *dirty[MAX_CLIENTS];
+static int n_dirty;
+
+static void sendq_free(client *c);
+
+/* Every client read lands here first; see handle_readable() */
+static __thread char scratch[MAX_MSG_LEN + READ_SIZE + 1];
+
+/* Clients whose reads are paused for flooding, and the first to resume */
+static client *paused[MAX_CLIENTS];
+static uint64_t next_resume = UINT64_MAX;
+
+/* Set by SIGTERM or SIGINT: finish the current round and exit */
+static volatile sig_atomic_t stopping;
+
+/* Set by SIGUSR1: write the metrics to stderr */
+static volatile sig_atomic_t dump_stats;
 
 void init_node(char *nodeID, char *config_file);
 void irc_server();
 
 
 void usage() {
-    fprintf(stderr, "sircd [-h] [-D debug_lvl] <nodeID> <config file>\n");
+    fprintf(stderr, "sircd [-h] [-D debug_lvl] [-s exact|bloom[:bits[:k]]] "
+            "[-c capture_file]\n      [-a ip_rate[:ip_burst[:rate[:burst]]]] "
+            "[-f rate[:burst]]\n      [-H lines[:kbytes]] "
+            "[-o oper_name:password] <nodeID> <config file>\n");
     exit(-1);
 }
 
+/*
+ * Parse -s: the channel summary flavour, with optional Bloom filter size
+ * and number of hash functions.
+ */
+static void init_summary(char *arg) {
+    unsigned bits = CHANSUM_DEFAULT_BITS, k = CHANSUM_DEFAULT_K;
+    char *opt = strchr(arg, ':');
+    int mode;
+
+    if (opt) {
+        *opt++ = '\0';
+        bits = strtoul(opt, &opt, 10);
+        if (*opt == ':')
+            k = strtoul(opt + 1, NULL, 10);
+    }
+    if ((mode = chansum_parse_mode(arg)) < 0 ||
+        chansum_init(&channel_summary, mode, bits, k) < 0) {
+        eprintf("sircd: bad channel summary %s\n", arg);
+        usage();
+    }
+}
+
 
 
 int main( int argc, char *argv[] )
@@ -35,13 +134,49 @@ int main( int argc, char *argv[] )
     extern int optind;
     int ch;
 
-    while ((ch = getopt(argc, argv, "hD:")) != -1)
+    chansum_init(&channel_summary, CHANSUM_EXACT, 0, 0);
+
+    while ((ch = getopt(argc, argv, "hD:s:c:a:f:H:o:")) != -1)
         switch (ch) {
         	case 'D':
         	    if (set_debug(optarg)) {
             		exit(0);
         	    }
         	    break;
+            case 's':
+                chansum_destroy(&channel_summary);
+                init_summary(optarg);
+                break;
+            case 'c':
+                if (capture_open(optarg) < 0) {
+                    eprintf("sircd: can't capture to %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'a':
+                if (admit_init(optarg) < 0) {
+                    eprintf("sircd: bad admission limits %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'f':
+                if (irc_flood_init(optarg) < 0) {
+                    eprintf("sircd: bad flood limit %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'H':
+                if (backlog_init(optarg) < 0) {
+                    eprintf("sircd: bad channel history %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'o':
+                if (irc_oper_init(optarg) < 0) {
+                    eprintf("sircd: bad operator name:password\n");
+                    usage();
+                }
+                break;
             case 'h':
             default: /* FALLTHROUGH */
                 usage();
@@ -59,7 +194,9 @@ int main( int argc, char *argv[] )
     printf( "I am node %lu and I listen on port %d for new users\n", curr_nodeID, curr_node_config_entry->irc_port );
 
     /* Start your engines here! */
+    irc_server();
 
+    capture_close();
     return 0;
 }
 
@@ -85,4 +222,1012 @@ void init_node(char *nodeID, char *config_file) {
         printf( "Invalid NodeID\n" );
         exit(1);
     }
-}
\ No newline at end of file
+
+    /* Room in the admission buckets for other nodes' links */
+    for (i = 0; i < curr_node_config_file.size; i++)
+        if (curr_node_config_file.entries[i].nodeID != curr_nodeID)
+            admit_node(htonl(curr_node_config_file.entries[i].ipaddr));
+
+    snprintf(server_name, MAX_SERVERNAME, "node%lu", curr_nodeID);
+}
+
+
+/* Time */
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Wall clock in ns, comparable between nodes on one host */
+uint64_t wall_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* Resident set size, from /proc */
+unsigned long rss_bytes() {
+    unsigned long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (!f)
+        return 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+
+/* Nick table */
+
+/*
+ * The table is keyed on the interned nick, which only stands for its
+ * case-folded form: the spelling shown is the client's own c->nick.
+ */
+client *client_by_nick(const char *nick) {
+    istr_t *is = istr_find(nick);
+    client *c;
+
+    if (!is)
+        return NULL;
+    for (c = nick_hash[is->hash % NICK_HASH_SIZE]; c; c = c->nick_next)
+        if (c->nick_key == is)
+            return c;
+    return NULL;
+}
+
+static void nick_unlink(client *c) {
+    client **pp;
+
+    if (!c->nick_key)
+        return;
+    for (pp = &nick_hash[c->nick_key->hash % NICK_HASH_SIZE]; *pp;
+         pp = &(*pp)->nick_next) {
+        if (*pp == c) {
+            *pp = c->nick_next;
+            break;
+        }
+    }
+    c->nick_next = NULL;
+}
+
+/* Give c the nick; -1 (keeping the old one) if out of memory */
+int client_set_nick(client *c, const char *nick) {
+    istr_t *is = istr_get(nick);
+    unsigned h;
+
+    if (!is)
+        return -1;
+    nick_unlink(c);
+    istr_put(c->nick_key);
+    c->nick_key = is;
+    snprintf(c->nick, MAX_USERNAME, "%s", nick);
+    h = is->hash % NICK_HASH_SIZE;
+    c->nick_next = nick_hash[h];
+    nick_hash[h] = c;
+    return 0;
+}
+
+
+/* Client table */
+
+client *client_get(int slot) {
+    return (slot >= 0 && slot < MAX_CLIENTS) ? clients[slot] : NULL;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Change what epoll reports for c; never EPOLLIN while it is throttled */
+static void set_events(client *c, unsigned events) {
+    struct epoll_event ev;
+
+    if (c->throttled)
+        events &= ~EPOLLIN;
+    if (c->events == events)
+        return;
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev) < 0)
+        DEBUG_PERROR("epoll_ctl");
+    c->events = events;
+}
+
+static client *client_alloc(int sock, struct sockaddr_in *addr,
+                            conn_kind_t kind, unsigned events) {
+    static uint32_t next_id;
+    struct epoll_event ev;
+    client *c;
+    int i;
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (!clients[i])
+            break;
+    if (i == MAX_CLIENTS || !(c = calloc(1, sizeof(client))))
+        return NULL;
+
+    c->id = ++next_id;
+    c->trace = debug_sampled(c->id);
+    c->sock = sock;
+    c->cliaddr = *addr;
+    c->slot = i;
+    c->kind = kind;
+    c->sendq_max = kind == CONN_CLIENT ? MAX_SENDQ : MAX_SERVER_SENDQ;
+    if (!(c->hostname = istr_get(inet_ntoa(addr->sin_addr)))) {
+        free(c);
+        return NULL;
+    }
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        DEBUG_PERROR("epoll_ctl");
+        istr_put(c->hostname);
+        free(c);
+        return NULL;
+    }
+    c->events = events;
+    clients[i] = c;
+    loop_stats.connections++;
+    return c;
+}
+
+static void client_free(client *c) {
+    unsigned long i;
+
+    for (i = 0; c->throttled && i < loop_stats.paused; i++)
+        if (paused[i] == c)
+            paused[i] = paused[--loop_stats.paused];
+    sendq_free(c);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+    close(c->sock);
+    nick_unlink(c);
+    clients[c->slot] = NULL;
+    if (c->inbuf) {
+        pool_free(c->inbuf);
+        loop_stats.inbufs--;
+    }
+    istr_put(c->nick_key);
+    istr_put(c->hostname);
+    istr_put(c->servername);
+    istr_put(c->channel);
+    pool_free(c->realname);
+    loop_stats.connections--;
+    free(c);
+}
+
+/*
+ * Schedule c to be closed.  Nothing is freed until the current event
+ * has been handled, so callers can keep using c (it just stops getting
+ * output).
+ */
+void client_close(client *c, const char *reason) {
+    if (c->closing)
+        return;
+    CDPRINTF(c, DEBUG_CLIENTS, "client %d (%s) closing: %s\n", c->slot,
+             c->nick[0] ? c->nick : "unregistered", reason);
+    client_trace(c, 0);
+    c->closing = 1;
+    if (capture_enabled && c->kind != CONN_SERVER_OUT)
+        capture_record(CAPTURE_CLOSE, c->id, NULL, 0);
+    irc_client_gone(c, reason);
+    closed[n_closed++] = c;
+}
+
+/* Log everything about c, or go back to what sampling says */
+void client_trace(client *c, int on) {
+    if ((c->trace == TRACE_ALL) == !!on)
+        return;
+    debug_traced += on ? 1 : -1;
+    c->trace = on ? TRACE_ALL : debug_sampled(c->id);
+    debug_update();
+}
+
+/* Sample one client in n from now on (0 for none) */
+void client_resample(unsigned n) {
+    int i;
+
+    debug_sample = n;
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i] && clients[i]->trace != TRACE_ALL)
+            clients[i]->trace = debug_sampled(clients[i]->id);
+}
+
+static void reap_closed() {
+    while (n_closed > 0) {
+        client *c = closed[--n_closed];
+        fwd_link_closed(c);
+        client_free(c);
+    }
+}
+
+/*
+ * Connect to the forwarding port of node nodeID.  The connect finishes
+ * in the background; anything sent meanwhile is queued.
+ */
+client *client_connect(u_long nodeID, conn_kind_t kind) {
+    struct sockaddr_in addr;
+    rt_config_entry_t *e = NULL;
+    client *c;
+    int i, sock, one = 1;
+
+    for (i = 0; i < curr_node_config_file.size; i++)
+        if (curr_node_config_file.entries[i].nodeID == nodeID)
+            e = &curr_node_config_file.entries[i];
+    if (!e)
+        return NULL;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(e->ipaddr);
+    addr.sin_port = htons(e->irc_port);
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        DEBUG_PERROR("socket");
+        return NULL;
+    }
+    set_nonblocking(sock);
+    /* Links carry many small lines back to back; don't let Nagle hold
+       them waiting for ACKs */
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+        errno != EINPROGRESS) {
+        DEBUG_PERROR("connect");
+        close(sock);
+        return NULL;
+    }
+
+    c = client_alloc(sock, &addr, kind, EPOLLIN | EPOLLOUT);
+    if (!c) {
+        close(sock);
+        return NULL;
+    }
+    c->nodeID = nodeID;
+    c->connecting = 1;
+    return c;
+}
+
+
+/* Output */
+
+/* Release c's whole send queue, written or not */
+static void sendq_free(client *c) {
+    seg_t *s;
+
+    while ((s = c->sendq)) {
+        c->sendq = s->next;
+        msgbuf_unref(s->mb);
+        pool_free(s);
+    }
+    c->sendq_tail = NULL;
+    if (c->kind == CONN_CLIENT) {
+        clients_queued -= c->sendq_len;
+        clients_drained += c->sendq_len;
+    }
+    c->sendq_len = 0;
+}
+
+/*
+ * Write as much of the send queue as the socket takes, up to MAX_IOV
+ * buffers per writev().  Returns -1 if the connection failed.
+ */
+static int flush_sendq(client *c) {
+    struct iovec iov[MAX_IOV];
+    size_t want;
+    ssize_t n;
+    seg_t *s;
+    int k;
+
+    while (c->sendq) {
+        for (k = 0, want = 0, s = c->sendq; s && k < MAX_IOV;
+             s = s->next, k++) {
+            iov[k].iov_base = s->mb->data + s->off;
+            iov[k].iov_len = s->len;
+            want += s->len;
+        }
+        n = writev(c->sock, iov, k);
+        loop_stats.writes++;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        c->sendq_len -= n;
+        if (c->kind == CONN_CLIENT) {
+            clients_queued -= n;
+            clients_drained += n;
+        }
+        while ((s = c->sendq) && (size_t)n >= s->len) {
+            n -= s->len;
+            c->sendq = s->next;
+            msgbuf_unref(s->mb);
+            pool_free(s);
+        }
+        if (!c->sendq)
+            c->sendq_tail = NULL;
+        else if (n > 0) {
+            s->off += n;
+            s->len -= n;
+        }
+        /* Short: the socket buffer is full, no point asking again */
+        if ((size_t)n < want)
+            break;
+    }
+    return 0;
+}
+
+/*
+ * Can len more bytes go in c's send queue?  Closes c (and says no) if
+ * that would take it over its limit.
+ */
+static int sendq_room(client *c, size_t len) {
+    if (c->closing)
+        return 0;
+    if (c->sendq_len + len > c->sendq_max) {
+        client_close(c, "SendQ exceeded");
+        return 0;
+    }
+    irc_current->bytes_out += len;
+    loop_stats.sends++;
+    return 1;
+}
+
+/* Put len bytes of mb at off on the end of c's send queue */
+static int sendq_add(client *c, msgbuf_t *mb, unsigned off, unsigned len) {
+    seg_t *s;
+
+    if (!(s = pool_alloc(sizeof(seg_t))))
+        return -1;
+    s->mb = msgbuf_ref(mb);
+    s->off = off;
+    s->len = len;
+    s->next = NULL;
+    if (c->sendq_tail)
+        c->sendq_tail->next = s;
+    else
+        c->sendq = s;
+    c->sendq_tail = s;
+    c->sendq_len += len;
+    if (c->kind == CONN_CLIENT)
+        clients_queued += len;
+
+    /* Not waiting for EPOLLOUT: flush_pending() writes it */
+    if (!c->dirty && !(c->events & EPOLLOUT)) {
+        c->dirty = 1;
+        dirty[n_dirty++] = c;
+    }
+    return 0;
+}
+
+/*
+ * Copy buf onto the end of c's send queue: into the last buffer if that
+ * is c's alone and has room, so a run of replies shares one, otherwise
+ * into new ones.
+ */
+static int sendq_append(client *c, const char *buf, size_t len) {
+    seg_t *t = c->sendq_tail;
+    msgbuf_t *mb;
+    size_t n;
+
+    if (t && t->mb->refs == 1 && t->off + t->len == t->mb->len &&
+        t->mb->len < t->mb->size) {
+        n = t->mb->size - t->mb->len;
+        if (n > len)
+            n = len;
+        memcpy(t->mb->data + t->mb->len, buf, n);
+        t->mb->len += n;
+        t->len += n;
+        c->sendq_len += n;
+        if (c->kind == CONN_CLIENT)
+            clients_queued += n;
+        buf += n;
+        len -= n;
+    }
+    while (len > 0) {
+        if (!(mb = msgbuf_new(MSGBUF_LINE)))
+            return -1;
+        n = len < mb->size ? len : mb->size;
+        memcpy(mb->data, buf, n);
+        mb->len = n;
+        if (sendq_add(c, mb, 0, n) < 0) {
+            msgbuf_unref(mb);
+            return -1;
+        }
+        msgbuf_unref(mb);
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Send buf to every client in to[] but except.  They all queue
+ * references to one copy of it.  Returns how many it went to.
+ */
+int client_fanout(client *const *to, int n, client *except,
+                  const char *buf, size_t len) {
+    msgbuf_t *mb = NULL;
+    int i, sent = 0;
+
+    for (i = 0; i < n; i++) {
+        client *c = to[i];
+
+        if (c == except)
+            continue;
+        sent++;
+        if (!mb && !(mb = msgbuf_copy(buf, len))) {
+            client_send(c, buf, len);
+            continue;
+        }
+        if (sendq_room(c, len) && sendq_add(c, mb, 0, len) < 0)
+            client_close(c, "Out of memory");
+    }
+    if (mb)
+        msgbuf_unref(mb);
+    return sent;
+}
+
+/* Queue a reference to mb, a whole line, for c */
+void client_queue(client *c, msgbuf_t *mb) {
+    if (sendq_room(c, mb->len) && sendq_add(c, mb, 0, mb->len) < 0)
+        client_close(c, "Out of memory");
+}
+
+/* client_fanout() of a line that is already in a buffer */
+int client_fanout_buf(client *const *to, int n, client *except,
+                      msgbuf_t *mb) {
+    int i, sent = 0;
+
+    for (i = 0; i < n; i++) {
+        if (to[i] != except) {
+            client_queue(to[i], mb);
+            sent++;
+        }
+    }
+    return sent;
+}
+
+/*
+ * Write out the send queue of every client that got output this round.
+ * A client closed on a write error can send others more (its QUIT), so
+ * this goes on until the dirty list stays empty.
+ */
+static void flush_pending() {
+    static client *batch[MAX_CLIENTS];
+    int i, n;
+
+    while (n_dirty > 0) {
+        n = n_dirty;
+        memcpy(batch, dirty, n * sizeof(client *));
+        n_dirty = 0;
+        for (i = 0; i < n; i++)
+            batch[i]->dirty = 0;
+        for (i = 0; i < n; i++) {
+            client *c = batch[i];
+
+            if (c->closing || (c->events & EPOLLOUT))
+                continue;
+            if (flush_sendq(c) < 0)
+                client_close(c, "Write error");
+            else if (c->sendq)
+                set_events(c, EPOLLIN | EPOLLOUT);
+        }
+    }
+}
+
+void client_send(client *c, const char *buf, size_t len) {
+    if (!sendq_room(c, len))
+        return;
+
+    /* Nothing queued: try to hand it straight to the kernel */
+    if (!c->sendq && !c->connecting) {
+        ssize_t n = write(c->sock, buf, len);
+        loop_stats.writes++;
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                client_close(c, "Write error");
+                return;
+            }
+            n = 0;
+        }
+        buf += n;
+        len -= n;
+        if (len == 0)
+            return;
+        set_events(c, EPOLLIN | EPOLLOUT);
+    }
+
+    if (sendq_append(c, buf, len) < 0)
+        client_close(c, "Out of memory");
+}
+
+void client_printf(client *c, const char *fmt, ...) {
+    char buf[MAX_MSG_LEN + 1];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len > MAX_MSG_LEN)
+        len = MAX_MSG_LEN;
+    client_send(c, buf, len);
+}
+
+static void handle_writable(client *c) {
+    if (c->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            DPRINTF(DEBUG_SOCKETS, "connect to node %lu failed: %s\n",
+                    c->nodeID, strerror(err));
+            client_close(c, "Connect failed");
+            return;
+        }
+        c->connecting = 0;
+    }
+    if (flush_sendq(c) < 0) {
+        client_close(c, "Write error");
+        return;
+    }
+    if (c->sendq_len == 0)
+        set_events(c, EPOLLIN);
+}
+
+
+/* Input */
+
+/* Stop reading from c until it has paid for what it sent */
+static void throttle(client *c, uint64_t now) {
+    c->resume_at = now + irc_flood_wait(c, now);
+    if (c->resume_at < next_resume)
+        next_resume = c->resume_at;
+    if (c->throttled)
+        return;
+    CDPRINTF(c, DEBUG_INPUT, "client %d: flooding, paused\n", c->slot);
+    c->throttled = 1;
+    set_events(c, c->events);
+    paused[loop_stats.paused++] = c;
+    loop_stats.throttled++;
+}
+
+/*
+ * Hand the complete lines in scratch, up to end, to handle_line() while
+ * c's flood bucket allows, and keep the rest in c->inbuf.  Normally
+ * that is a partial line, in a buffer borrowed from the msgbuf pool
+ * while there is one; a line longer than MAX_MSG_LEN is dropped up to
+ * its newline.  If c runs out of tokens, the lines it hasn't paid for
+ * are kept too, at most one read's worth, and it is throttled: nothing
+ * more is read until they have been handled.
+ */
+static void handle_input(client *c, char *end) {
+    char *line = scratch, *nl;
+    uint64_t now = now_ms();
+    int held = 0;
+    size_t left;
+
+    *end = '\0';
+    line_stamp = wall_ns();
+    while (!c->closing && (nl = memchr(line, '\n', end - line)) != NULL) {
+        if (c->kind == CONN_CLIENT && irc_flood_wait(c, now)) {
+            held = 1;
+            break;
+        }
+        PROBE2(line, c->id, nl - line);
+        *nl = '\0';
+        if (nl > line && nl[-1] == '\r')
+            nl[-1] = '\0';
+        if (c->discard) {
+            c->discard = 0;
+        } else if (nl - line >= MAX_MSG_LEN) {
+            CDPRINTF(c, DEBUG_INPUT, "client %d: line too long, dropped\n",
+                     c->slot);
+        } else {
+            if (capture_enabled && c->kind == CONN_CLIENT)
+                capture_record(CAPTURE_LINE, c->id, line, strlen(line));
+            handle_line(c, line);
+        }
+        line = nl + 1;
+    }
+
+    if (c->closing)
+        return;
+    left = end - line;
+    if (held) {
+        throttle(c, now);
+    } else if (left >= MAX_MSG_LEN && !c->discard) {
+        CDPRINTF(c, DEBUG_INPUT, "client %d: line too long, dropped\n",
+                 c->slot);
+        c->discard = 1;
+    }
+    if (c->discard && !held)
+        left = 0;
+    if (left) {
+        /* The buffer has room for MAX_MSG_LEN or what it last held */
+        if (c->inbuf && left > MAX_MSG_LEN && left > c->inbuf_size) {
+            pool_free(c->inbuf);
+            c->inbuf = NULL;
+            loop_stats.inbufs--;
+        }
+        if (!c->inbuf) {
+            c->inbuf = pool_alloc(left > MAX_MSG_LEN ? left : MAX_MSG_LEN);
+            if (!c->inbuf) {
+                client_close(c, "Out of memory");
+                return;
+            }
+            loop_stats.inbufs++;
+        }
+        memcpy(c->inbuf, line, left);
+    } else if (c->inbuf) {
+        pool_free(c->inbuf);
+        c->inbuf = NULL;
+        loop_stats.inbufs--;
+    }
+    c->inbuf_size = left;
+}
+
+/* Read what is available, behind the partial line c had left over */
+static void handle_readable(client *c) {
+    ssize_t n;
+
+    /* Only a hangup or an error is reported while reads are paused */
+    if (c->throttled) {
+        client_close(c, "Connection closed");
+        return;
+    }
+    if (c->inbuf_size)
+        memcpy(scratch, c->inbuf, c->inbuf_size);
+    n = read(c->sock, scratch + c->inbuf_size, READ_SIZE);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        client_close(c, n == 0 ? "Connection closed" : "Read error");
+        return;
+    }
+    PROBE2(read, c->id, n);
+    handle_input(c, scratch + c->inbuf_size + n);
+}
+
+/*
+ * Go on with the throttled clients whose time has come: handle the
+ * lines they were holding and, if that doesn't throttle them again,
+ * start reading from them.
+ */
+static void resume_paused() {
+    uint64_t now = now_ms();
+    unsigned long i = 0;
+    client *c;
+
+    if (now < next_resume)
+        return;
+    next_resume = UINT64_MAX;
+    while (i < loop_stats.paused) {
+        c = paused[i];
+        if (c->closing || now < c->resume_at) {
+            if (!c->closing && c->resume_at < next_resume)
+                next_resume = c->resume_at;
+            i++;
+            continue;
+        }
+        paused[i] = paused[--loop_stats.paused];
+        c->throttled = 0;
+        memcpy(scratch, c->inbuf, c->inbuf_size);
+        handle_input(c, scratch + c->inbuf_size);
+        if (!c->throttled && !c->closing)
+            set_events(c, c->events | EPOLLIN);
+    }
+}
+
+/*
+ * Close a connection we won't take.  With a zero linger the close
+ * resets it, so a flood leaves no TIME_WAIT sockets behind here.
+ */
+static void reject(int sock, struct sockaddr_in *addr, int reason) {
+    struct linger lg = { 1, 0 };
+
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(sock);
+    DPRINTF(DEBUG_CLIENTS, "rejected %s:%d: %s\n", inet_ntoa(addr->sin_addr),
+            ntohs(addr->sin_port), admit_reason[reason]);
+}
+
+/*
+ * Accept up to ACCEPT_BURST waiting connections.  Each one is checked
+ * against the admission limits (admit.h) and the client table before
+ * anything is set up for it.
+ */
+static void handle_accept() {
+    struct sockaddr_in addr;
+    socklen_t len;
+    uint64_t now = now_ms();
+    int burst, sock, reason, one = 1;
+    client *c;
+
+    for (burst = 0; burst < ACCEPT_BURST; burst++) {
+        len = sizeof(addr);
+        sock = accept4(listen_fd, (struct sockaddr *)&addr, &len,
+                       SOCK_NONBLOCK);
+        if (sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                DEBUG_PERROR("accept");
+                admit_count(ADMIT_ERROR);
+            }
+            return;
+        }
+        if ((reason = admit_check(addr.sin_addr.s_addr, now)) != ADMIT_OK) {
+            reject(sock, &addr, reason);
+            continue;
+        }
+        if (loop_stats.connections >= MAX_CLIENTS) {
+            admit_count(ADMIT_FULL);
+            reject(sock, &addr, ADMIT_FULL);
+            continue;
+        }
+        /* Replies and relayed messages go out as separate small writes,
+           and an inbound server link carries our CREDIT grants; Nagle
+           would hold each one until the previous is acked */
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c = client_alloc(sock, &addr, CONN_CLIENT, EPOLLIN);
+        if (!c) {
+            admit_count(ADMIT_ERROR);
+            reject(sock, &addr, ADMIT_ERROR);
+            continue;
+        }
+        admit_count(ADMIT_OK);
+        PROBE2(accept, c->id, sock);
+        if (capture_enabled)
+            capture_record(CAPTURE_OPEN, c->id, NULL, 0);
+        CDPRINTF(c, DEBUG_CLIENTS, "client %d connected from %s:%d\n",
+                 c->slot, c->hostname->s, ntohs(addr.sin_port));
+    }
+}
+
+
+/* Routing glue */
+
+static int routing_send(void *ctx, u_long to, const uint8_t *buf,
+                        size_t len) {
+    struct sockaddr_in addr;
+    int i;
+
+    for (i = 0; i < curr_node_config_file.size; i++) {
+        rt_config_entry_t *e = &curr_node_config_file.entries[i];
+        if (e->nodeID != to)
+            continue;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(e->ipaddr);
+        addr.sin_port = htons(e->routing_port);
+        return sendto(routing_fd, buf, len, 0, (struct sockaddr *)&addr,
+                      sizeof(addr));
+    }
+    return -1;
+}
+
+/* Fill in the users and channel summary of our own LSA */
+static void routing_local(void *ctx, lsa_t *lsa, int periodic) {
+    char *users[MAX_CLIENTS];
+    char **chans = NULL;
+    channel *ch;
+    int i, n_users = 0, n_chans = 0;
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i] && clients[i]->registered && !clients[i]->closing)
+            users[n_users++] = clients[i]->nick;
+
+    if (channel_count > 0)
+        chans = malloc(channel_count * sizeof(char *));
+    for (ch = channel_list; chans && ch; ch = ch->next)
+        chans[n_chans++] = ch->name->s;
+
+    lsa_set_names(lsa, users, n_users, NULL, 0);
+    chansum_fill(&channel_summary, lsa, chans, n_chans,
+                 routing.last_originated, periodic);
+    free(chans);
+}
+
+static void handle_datagram(const uint8_t *buf, ssize_t n,
+                            const struct sockaddr_in *addr) {
+    int i;
+
+    for (i = 0; i < curr_node_config_file.size; i++) {
+        rt_config_entry_t *e = &curr_node_config_file.entries[i];
+        if (e->ipaddr == ntohl(addr->sin_addr.s_addr) &&
+            e->routing_port == ntohs(addr->sin_port)) {
+            rt_recv(&routing, e->nodeID, buf, n, now_ms());
+            return;
+        }
+    }
+    DPRINTF(DEBUG_ROUTING, "routing: datagram from unknown %s:%d\n",
+            inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+}
+
+/*
+ * Drain a burst of routing datagrams, then send the acknowledgements
+ * they earned together.
+ */
+static void handle_routing() {
+    static uint8_t buf[LSA_MAX_PACKET];
+    struct sockaddr_in addr;
+    socklen_t len;
+    ssize_t n;
+    int burst;
+
+    for (burst = 0; burst < ROUTING_BURST; burst++) {
+        len = sizeof(addr);
+        n = recvfrom(routing_fd, buf, sizeof(buf), 0,
+                     (struct sockaddr *)&addr, &len);
+        if (n < 0)
+            break;
+        handle_datagram(buf, n, &addr);
+    }
+    rt_flush(&routing);
+}
+
+static void init_routing() {
+    u_long nbrs[MAX_CONFIG_FILE_LINES];
+    rt_timers_t timers;
+    int i, n = 0;
+
+    for (i = 0; i < curr_node_config_file.size; i++)
+        if (curr_node_config_file.entries[i].nodeID != curr_nodeID)
+            nbrs[n++] = curr_node_config_file.entries[i].nodeID;
+
+    rt_timers_default(&timers);
+    if (rt_init(&routing, curr_nodeID, nbrs, n, &timers, routing_send,
+                routing_local, NULL) < 0) {
+        eprintf("sircd: out of memory\n");
+        exit(1);
+    }
+}
+
+
+/* The event loop */
+
+static int open_socket(int type, unsigned short port) {
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    if ((fd = socket(AF_INET, type, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (type == SOCK_STREAM && listen(fd, 128) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    set_nonblocking(fd);
+    return fd;
+}
+
+static void handle_stop(int sig) {
+    stopping = 1;
+}
+
+static void handle_dump(int sig) {
+    dump_stats = 1;
+}
+
+/* Account for one epoll_wait() return */
+static void loop_account(int n, uint64_t start) {
+    loop_stats_t *l = &loop_stats;
+
+    if (n <= 0) {
+        l->idle++;
+        return;
+    }
+    l->wakeups++;
+    l->events += n;
+    hist_add(&l->batch, n);
+    hist_add(&l->busy, mono_ns() - start);
+    hist_add(&l->queued, clients_queued);
+    if (clients_queued > l->queued_peak)
+        l->queued_peak = clients_queued;
+}
+
+static void watch(int fd, void *tag) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+void irc_server() {
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t now, deadline, start;
+    int i, n, timeout;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, handle_stop);
+    signal(SIGINT, handle_stop);
+    signal(SIGUSR1, handle_dump);
+
+    if ((epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    listen_fd = open_socket(SOCK_STREAM, curr_node_config_entry->irc_port);
+    routing_fd = open_socket(SOCK_DGRAM, curr_node_config_entry->routing_port);
+    watch(listen_fd, &listen_tag);
+    watch(routing_fd, &routing_tag);
+    init_routing();
+    loop_stats.rss_start = rss_bytes();
+
+    DPRINTF(DEBUG_INIT, "sircd: node %lu up, irc port %d, routing port %d\n",
+            curr_nodeID, curr_node_config_entry->irc_port,
+            curr_node_config_entry->routing_port);
+
+    while (!stopping) {
+        if (dump_stats) {
+            dump_stats = 0;
+            irc_stats_dump(stderr);
+        }
+        now = now_ms();
+        rt_tick(&routing, now);
+        fwd_tick(now);
+        deadline = rt_next_deadline(&routing, now);
+        if (next_resume < deadline)
+            deadline = next_resume > now ? next_resume : now;
+        timeout = deadline - now > 1000 ? 1000 : (int)(deadline - now);
+        if (irc_bulk_pending())
+            timeout = 0;
+
+        n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        start = mono_ns();
+        for (i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            client *c = tag;
+
+            if (tag == &listen_tag) {
+                handle_accept();
+            } else if (tag == &routing_tag) {
+                handle_routing();
+            } else if (!c->closing) {
+                if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                    handle_writable(c);
+                if (!c->closing && (events[i].events & (EPOLLIN | EPOLLHUP)))
+                    handle_readable(c);
+            }
+        }
+        resume_paused();
+        irc_bulk_run();
+        flush_pending();
+        reap_closed();
+        loop_account(n, start);
+    }
+}
@@ -3,6 +3,10 @@
 
     #include <sys/types.h>
     #include <netinet/in.h>
+    #include "rtlib.h"
+    #include "routing.h"
+    #include "hist.h"
+    #include "intern.h"
 
     #define MAX_CLIENTS 512
     #define MAX_MSG_TOKENS 10
@@ -13,18 +17,100 @@
     #define MAX_REALNAME 512
     #define MAX_CHANNAME 512
 
-    typedef struct {
+    #define MAX_SENDQ        (64 * 1024)    /* per client */
+    #define MAX_SERVER_SENDQ (1024 * 1024)  /* per server link */
+
+    /* What is on the other end of a connection */
+    typedef enum {
+        CONN_CLIENT = 0,    /* a user, or a server that hasn't said SERVER */
+        CONN_SERVER_IN,     /* a neighbor's forwarding link to us */
+        CONN_SERVER_OUT     /* our forwarding link to a neighbor */
+    } conn_kind_t;
+
+    typedef struct client {
         int sock;
         struct sockaddr_in cliaddr;
-        unsigned inbuf_size;
         int registered;
-        char hostname[MAX_HOSTNAME];
-        char servername[MAX_SERVERNAME];
+        int oper;                 /* has given OPER the -o password */
+        istr_t *hostname;         /* interned; see intern.h */
+        istr_t *servername;
         char user[MAX_USERNAME];
-        char nick[MAX_USERNAME];
-        char realname[MAX_REALNAME];
-        char inbuf[MAX_MSG_LEN+1];
-        char channel[MAX_CHANNAME];
+        char nick[MAX_USERNAME];  /* as the client spelled it */
+        istr_t *nick_key;         /* interned; the nick table's key */
+        char *realname;           /* from the msgbuf pool */
+        istr_t *channel;          /* NULL when in none */
+
+        int slot;                 /* index in the client table */
+        uint32_t id;              /* never reused; names it in captures */
+        conn_kind_t kind;
+        u_long nodeID;            /* the neighbor, for server links */
+        int connecting;           /* outbound connect() in progress */
+        int closing;              /* will be reaped at the end of the event */
+        int discard;              /* skipping the rest of an overlong line */
+        int throttled;            /* reads paused for flooding */
+        int64_t flood_tokens;     /* thousandths; see irc_flood_wait() */
+        uint64_t flood_last;      /* ms the bucket was brought up to date */
+        uint64_t resume_at;       /* ms, while throttled */
+        char *inbuf;              /* a partial line, from the msgbuf pool */
+        unsigned inbuf_size;
+        struct seg *sendq;        /* output not yet written; sircd.c */
+        struct seg *sendq_tail;
+        unsigned sendq_len;       /* bytes in it */
+        unsigned sendq_max;
+        unsigned events;          /* epoll interest set */
+        int dirty;                /* queued output to flush this round */
+        struct bulk *bulk;        /* LIST/WHO/NAMES still to send */
+        int trace;                /* TRACE_*: what CDPRINTF logs for it */
+        struct client *nick_next; /* nick hash chain */
     } client;
 
+    extern u_long curr_nodeID;
+    extern rt_config_file_t curr_node_config_file;
+    extern rt_config_entry_t *curr_node_config_entry;
+    extern char server_name[];
+    extern rt_node_t routing;
+    extern uint64_t line_stamp;   /* wall_ns() when the line was read */
+    extern unsigned long clients_queued;  /* bytes in all client sendqs */
+    extern unsigned long clients_drained; /* ...and ever taken out of them */
+
+    /* Event loop metrics, for STATS e */
+    typedef struct loop_stats {
+        unsigned long wakeups;        /* epoll_wait() returns with events */
+        unsigned long idle;           /* ...and without, on a timeout */
+        unsigned long events;
+        unsigned long queued_peak;    /* most bytes ever in client sendqs */
+        unsigned long sends;          /* lines (or parts) sent to sockets */
+        unsigned long writes;         /* write()/writev() calls for them */
+        unsigned long connections;    /* open now */
+        unsigned long inbufs;         /* of them holding a partial line */
+        unsigned long rss_start;      /* bytes resident before any */
+        unsigned long throttled;      /* times reads were paused */
+        unsigned long paused;         /* clients paused now */
+        hist_t busy;                  /* ns spent on one wakeup's events */
+        hist_t batch;                 /* events per wakeup */
+        hist_t queued;                /* clients_queued after each wakeup */
+    } loop_stats_t;
+
+    extern loop_stats_t loop_stats;
+
+    /* Client table, nick table and output (sircd.c) */
+    client *client_by_nick(const char *nick);
+    int client_set_nick(client *c, const char *nick);
+    client *client_get(int slot);
+    void client_send(client *c, const char *buf, size_t len);
+    int client_fanout(client *const *to, int n, client *except,
+                      const char *buf, size_t len);
+    struct msgbuf;
+    int client_fanout_buf(client *const *to, int n, client *except,
+                          struct msgbuf *mb);
+    void client_queue(client *c, struct msgbuf *mb);
+    void client_printf(client *c, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+    void client_close(client *c, const char *reason);
+    void client_trace(client *c, int on);
+    void client_resample(unsigned n);
+    client *client_connect(u_long nodeID, conn_kind_t kind);
+    uint64_t wall_ns(void);
+    unsigned long rss_bytes(void);
+
 #endif /* _SIRCD_H_ */
@@ -0,0 +1,204 @@
+/*
+ * spf.c
+ *
+ * Shortest path first over the link state database.  See spf.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "spf.h"
+#include "debug.h"
+
+unsigned long spf_runs = 0;
+
+static int cmp_id(const void *a, const void *b) {
+    u_long x = *(const u_long *)a, y = *(const u_long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_index(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+void spf_init(spf_tree_t *t) {
+    memset(t, 0, sizeof(*t));
+}
+
+void spf_free(spf_tree_t *t) {
+    free(t->ids);
+    free(t->dist);
+    free(t->parent);
+    free(t->nexthop);
+    free(t->order);
+    free(t->hopmask);
+    spf_init(t);
+}
+
+int spf_index(const spf_tree_t *t, u_long nodeID) {
+    int lo = 0, hi = t->n - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (t->ids[mid] == nodeID)
+            return mid;
+        if (t->ids[mid] < nodeID)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+/*
+ * Is the link u -> v usable?  Both ends have to list each other.
+ */
+static int link_up(const lsdb_t *db, const lsa_t *u, u_long v) {
+    lsa_t *other;
+
+    if (!lsa_has_link(u, v))
+        return 0;
+    other = lsdb_find(db, v);
+    return other && lsa_has_link(other, u->sender);
+}
+
+/* Tie-break key of parent p for node v in a variant tree */
+static uint32_t variant_key(unsigned variant, u_long p, u_long v) {
+    uint32_t h = variant * 0x9e3779b9u;
+
+    h = (h ^ p) * 0x85ebca6bu;
+    h = (h ^ (h >> 13) ^ v) * 0xc2b2ae35u;
+    return h ^ (h >> 16);
+}
+
+int spf_run(const lsdb_t *db, u_long root, spf_tree_t *t) {
+    return spf_run_variant(db, root, 0, t);
+}
+
+int spf_run_variant(const lsdb_t *db, u_long root, unsigned variant,
+                    spf_tree_t *t) {
+    int i, j, head, tail, r;
+
+    spf_free(t);
+    t->root = root;
+    t->variant = variant;
+    t->topo_gen = db->topo_gen;
+    t->n = db->size;
+    if (t->n == 0)
+        return 0;
+
+    t->ids = malloc(t->n * sizeof(u_long));
+    t->dist = malloc(t->n * sizeof(int));
+    t->parent = malloc(t->n * sizeof(int));
+    t->nexthop = malloc(t->n * sizeof(int));
+    t->order = malloc(t->n * sizeof(int));
+    t->hopmask = calloc(t->n, sizeof(uint64_t));
+    if (!t->ids || !t->dist || !t->parent || !t->nexthop || !t->order ||
+        !t->hopmask) {
+        spf_free(t);
+        return -1;
+    }
+
+    for (i = 0; i < t->n; i++) {
+        t->ids[i] = db->entries[i]->sender;
+        t->dist[i] = -1;
+        t->parent[i] = -1;
+        t->nexthop[i] = -1;
+    }
+    qsort(t->ids, t->n, sizeof(u_long), cmp_id);
+    spf_runs++;
+
+    r = spf_index(t, root);
+    if (r < 0)
+        return 0;
+
+    /*
+     * Breadth first from the root, one level at a time.  Each level is
+     * sorted before it is expanded, so a node's parent is the lowest-ID
+     * node one hop closer to the root.  ids[] is sorted, so comparing
+     * indices compares nodeIDs.  A level's hop masks are complete before
+     * it is expanded, as all their parents are on the level before.
+     */
+    t->dist[r] = 0;
+    t->order[0] = r;
+    head = 0;
+    tail = 1;
+    while (head < tail) {
+        int level_end = tail;
+
+        qsort(t->order + head, level_end - head, sizeof(int), cmp_index);
+        for (; head < level_end; head++) {
+            int u = t->order[head];
+            lsa_t *lsa = lsdb_find(db, t->ids[u]);
+
+            for (j = 0; j < lsa->n_links; j++) {
+                int v = spf_index(t, lsa->links[j]);
+                if (v < 0 || (t->dist[v] >= 0 &&
+                              t->dist[v] != t->dist[u] + 1) ||
+                    !link_up(db, lsa, t->ids[v]))
+                    continue;
+                if (t->dist[v] >= 0) {
+                    /* Another shortest path */
+                    t->hopmask[v] |= t->hopmask[u];
+                    if (variant &&
+                        variant_key(variant, t->ids[u], t->ids[v]) <
+                        variant_key(variant, t->ids[t->parent[v]],
+                                    t->ids[v])) {
+                        t->parent[v] = u;
+                        t->nexthop[v] = t->nexthop[u];
+                    }
+                    continue;
+                }
+                t->dist[v] = t->dist[u] + 1;
+                t->parent[v] = u;
+                if (u == r) {
+                    t->nexthop[v] = v;
+                    if (t->n_first_hops < SPF_MAX_FIRST_HOPS) {
+                        t->hopmask[v] = 1ULL << t->n_first_hops;
+                        t->first_hops[t->n_first_hops++] = v;
+                    }
+                } else {
+                    t->nexthop[v] = t->nexthop[u];
+                    t->hopmask[v] = t->hopmask[u];
+                }
+                t->order[tail++] = v;
+            }
+        }
+    }
+    t->n_reached = tail;
+
+    DPRINTF(DEBUG_ROUTING, "spf: root %lu reaches %d of %d nodes\n",
+            root, t->n_reached, t->n);
+    return 0;
+}
+
+int spf_nexthop(const spf_tree_t *t, u_long dest, u_long *hop) {
+    int i = spf_index(t, dest);
+
+    if (i < 0 || t->nexthop[i] < 0)
+        return -1;
+    *hop = t->ids[t->nexthop[i]];
+    return 0;
+}
+
+/*
+ * Every first hop on a shortest path to dest, in ascending nodeID
+ * order, up to max of them.  Returns how many.
+ */
+int spf_first_hops(const spf_tree_t *t, u_long dest, u_long *hops, int max) {
+    int i = spf_index(t, dest), j, k, n = 0;
+
+    if (i < 0 || t->nexthop[i] < 0)
+        return 0;
+    for (j = 0; j < t->n_first_hops && n < max; j++) {
+        u_long id;
+        if (!(t->hopmask[i] & (1ULL << j)))
+            continue;
+        id = t->ids[t->first_hops[j]];
+        for (k = n++; k > 0 && hops[k - 1] > id; k--)
+            hops[k] = hops[k - 1];
+        hops[k] = id;
+    }
+    if (n == 0)
+        hops[n++] = t->ids[t->nexthop[i]];
+    return n;
+}
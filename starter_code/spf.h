@@ -0,0 +1,57 @@
+#ifndef _SPF_H_
+#define _SPF_H_
+
+#include "lsdb.h"
+
+/*
+ * Shortest path trees over the link state database.
+ *
+ * A link is only used if both ends advertise it.  Every link costs one
+ * hop, so the search is a breadth first walk; ties are broken towards
+ * the parent with the lowest nodeID.  That makes the tree a pure
+ * function of (database, root), so every node computing the tree for
+ * a given root from the same database gets the same answer -- which is
+ * what multicast forwarding relies on.
+ *
+ * Other tie-breaks are available as numbered variants: variant v > 0
+ * picks, among the equal-cost parents of a node, the one with the
+ * lowest hash of (v, parent, node).  Each variant is still a pure
+ * function of the database, so multicast can spread different channels
+ * over different (equally short) trees.
+ *
+ * Whatever the variant, every run also records all the first hops that
+ * start some shortest path to each node (for equal-cost multipath
+ * unicast): bit i of hopmask[x] is set if first_hops[i] does.  Only the
+ * first SPF_MAX_FIRST_HOPS neighbors of the root are tracked.
+ */
+
+#define SPF_MAX_FIRST_HOPS 64
+
+typedef struct spf_tree {
+    u_long root;
+    int n;              /* nodes in the database, ids[] sorted ascending */
+    u_long *ids;
+    int *dist;          /* hops from root, -1 if unreachable */
+    int *parent;        /* index of parent, -1 for root and unreachable */
+    int *nexthop;       /* index of the first hop from root, -1 if none */
+    int *order;         /* reachable indices in BFS order, root first */
+    int n_reached;
+    unsigned variant;
+    unsigned topo_gen;  /* db->topo_gen this tree was computed from */
+    uint64_t *hopmask;  /* first hops starting a shortest path, as bits */
+    int first_hops[SPF_MAX_FIRST_HOPS];  /* indices of root's neighbors */
+    int n_first_hops;
+} spf_tree_t;
+
+void spf_init(spf_tree_t *t);
+void spf_free(spf_tree_t *t);
+int spf_run(const lsdb_t *db, u_long root, spf_tree_t *t);
+int spf_run_variant(const lsdb_t *db, u_long root, unsigned variant,
+                    spf_tree_t *t);
+int spf_first_hops(const spf_tree_t *t, u_long dest, u_long *hops, int max);
+int spf_index(const spf_tree_t *t, u_long nodeID);
+int spf_nexthop(const spf_tree_t *t, u_long dest, u_long *hop);
+
+extern unsigned long spf_runs;
+
+#endif /* _SPF_H_ */